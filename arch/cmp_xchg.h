@@ -192,7 +192,7 @@ struct cmp_xchg_switch<16> {
                       "     setz       %[result]\n\t"
                       : "+a" (pold[0]), "+d" (pold[1]), [result] "=c" (result)
                       : [val] "m" (val), "b" (pnew[0]), "c" (pnew[1])
-                      : "cc");
+                      : "cc", "memory");
         return result;
     }
 
@@ -208,7 +208,7 @@ struct cmp_xchg_switch<16> {
                       "     setz       %[result]\n\t"
                       : "+a" (pold[0]), "+d" (pold[1]), [result] "=c" (result)
                       : [val] "m" (val), "b" (pnew[0]), "c" (pnew[1])
-                      : "cc");
+                      : "cc", "memory");
         return result;
     }
 };
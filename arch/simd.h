@@ -39,6 +39,9 @@ JML_ALWAYS_INLINE bool has_sse3() { return cpu_info().sse3; }
 
 JML_ALWAYS_INLINE bool has_pni() { return cpu_info().pni; }
 
+/** SSSE3 is bit 9 of the ecx features; CPU_Info has it down as pni. */
+JML_ALWAYS_INLINE bool has_ssse3() { return cpu_info().standard2 & (1 << 9); }
+
 
 #endif // __i686__
 
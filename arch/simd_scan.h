@@ -0,0 +1,154 @@
+/* simd_scan.h                                                     -*- C++ -*-
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Functions to scan a block of text for characters, 16 bytes at a time
+   with SSE2 (or 32 at a time with AVX2 when the compiler targets it).
+*/
+
+#ifndef __arch__simd_scan_h__
+#define __arch__simd_scan_h__
+
+#include "jml/compiler/compiler.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace ML {
+
+/** Return a pointer to the first byte in [p, e) that is equal to one of
+    c1 to c4 (which may be repeated), or e if there is none. */
+inline const char *
+scan_for_any(const char * p, const char * e, char c1, char c2, char c3, char c4)
+{
+#if defined(__AVX2__)
+    {
+        __m256i v1 = _mm256_set1_epi8(c1), v2 = _mm256_set1_epi8(c2);
+        __m256i v3 = _mm256_set1_epi8(c3), v4 = _mm256_set1_epi8(c4);
+        for (; p + 32 <= e;  p += 32) {
+            __m256i block = _mm256_loadu_si256((const __m256i *)p);
+            __m256i match
+                = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, v1),
+                                                  _mm256_cmpeq_epi8(block, v2)),
+                                  _mm256_or_si256(_mm256_cmpeq_epi8(block, v3),
+                                                  _mm256_cmpeq_epi8(block, v4)));
+            uint32_t mask = _mm256_movemask_epi8(match);
+            if (mask) return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        __m128i v1 = _mm_set1_epi8(c1), v2 = _mm_set1_epi8(c2);
+        __m128i v3 = _mm_set1_epi8(c3), v4 = _mm_set1_epi8(c4);
+        for (; p + 16 <= e;  p += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i *)p);
+            __m128i match
+                = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, v1),
+                                            _mm_cmpeq_epi8(block, v2)),
+                               _mm_or_si128(_mm_cmpeq_epi8(block, v3),
+                                            _mm_cmpeq_epi8(block, v4)));
+            unsigned mask = _mm_movemask_epi8(match);
+            if (mask) return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; p < e;  ++p) {
+        char c = *p;
+        if (c == c1 || c == c2 || c == c3 || c == c4) return p;
+    }
+    return e;
+}
+
+/** Return a pointer to the first byte in [p, e) that isn't a space or a
+    tab (ie, for which isblank() in the C locale is false), or e if there
+    is none. */
+inline const char *
+scan_past_blanks(const char * p, const char * e)
+{
+#if defined(__AVX2__)
+    {
+        __m256i spaces = _mm256_set1_epi8(' '), tabs = _mm256_set1_epi8('\t');
+        for (; p + 32 <= e;  p += 32) {
+            __m256i block = _mm256_loadu_si256((const __m256i *)p);
+            __m256i blank = _mm256_or_si256(_mm256_cmpeq_epi8(block, spaces),
+                                            _mm256_cmpeq_epi8(block, tabs));
+            uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(blank);
+            if (mask) return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        __m128i spaces = _mm_set1_epi8(' '), tabs = _mm_set1_epi8('\t');
+        for (; p + 16 <= e;  p += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i *)p);
+            __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(block, spaces),
+                                         _mm_cmpeq_epi8(block, tabs));
+            unsigned mask = ~_mm_movemask_epi8(blank) & 0xffff;
+            if (mask) return p + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (p < e && (*p == ' ' || *p == '\t'))
+        ++p;
+    return p;
+}
+
+/** Count the number of occurrences of c in [p, e).  The vector versions
+    subtract the compare results (0 or -1 per byte) into byte counters,
+    which are summed with psadbw before they can overflow; this is
+    equivalent to a popcount of the match masks but doesn't need the
+    popcnt instruction. */
+inline size_t
+count_char(const char * p, const char * e, char c)
+{
+    size_t result = 0;
+
+#if defined(__AVX2__)
+    {
+        __m256i vc = _mm256_set1_epi8(c), zero = _mm256_setzero_si256();
+        while (p + 32 <= e) {
+            __m256i counts = zero;
+            for (int i = 0;  i < 255 && p + 32 <= e;  ++i, p += 32) {
+                __m256i block = _mm256_loadu_si256((const __m256i *)p);
+                counts = _mm256_sub_epi8(counts,
+                                         _mm256_cmpeq_epi8(block, vc));
+            }
+            __m256i sums = _mm256_sad_epu8(counts, zero);
+            result += _mm256_extract_epi64(sums, 0)
+                + _mm256_extract_epi64(sums, 1)
+                + _mm256_extract_epi64(sums, 2)
+                + _mm256_extract_epi64(sums, 3);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        __m128i vc = _mm_set1_epi8(c), zero = _mm_setzero_si128();
+        while (p + 16 <= e) {
+            __m128i counts = zero;
+            for (int i = 0;  i < 255 && p + 16 <= e;  ++i, p += 16) {
+                __m128i block = _mm_loadu_si128((const __m128i *)p);
+                counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(block, vc));
+            }
+            __m128i sums = _mm_sad_epu8(counts, zero);
+            result += _mm_cvtsi128_si32(sums)
+                + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+        }
+    }
+#endif
+    for (; p < e;  ++p)
+        result += (*p == c);
+    return result;
+}
+
+} // namespace ML
+
+#endif /* __arch__simd_scan_h__ */
@@ -0,0 +1,297 @@
+/* archive_views.h                                                 -*- C++ -*-
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Read-only views of strings and arrays that are reconstituted in place,
+   pointing into the archive's memory rather than copying out of it.
+*/
+
+#ifndef __jml__db__archive_views_h__
+#define __jml__db__archive_views_h__
+
+#include "persistent.h"
+#include "serialization_order.h"
+#include <memory>
+#include <algorithm>
+#include <vector>
+#include <string>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+namespace ML {
+namespace DB {
+
+
+/*****************************************************************************/
+/* STRING_VIEW                                                               */
+/*****************************************************************************/
+
+/** A read-only string, serialized exactly as a std::string is, so that any
+    string in an existing archive can be reconstituted as one.
+
+    When the archive is read from a mapped file (or a File_Read_Buffer), the
+    view points straight into the mapping and holds on to it, so the mapping
+    stays alive for as long as the view (or a copy of it) does, even after
+    the Store_Reader is gone.  Nothing is read from the file until the view
+    is looked at.  For memory that was given to the Store_Reader directly,
+    the view points into it and it's up to the caller to keep it alive.
+    Otherwise (streams, the asynchronous reader) the bytes are copied into
+    memory that the view owns.
+
+    Views into a mapped file must not be looked at after the pages they are
+    in have been dropped with Binary_Input::drop_consumed().
+*/
+
+struct String_View {
+    String_View()
+        : data_(0), size_(0)
+    {
+    }
+
+    /** Point to memory that's kept alive by owner, or by the caller if it
+        is null. */
+    String_View(const char * data, size_t size,
+                std::shared_ptr<const void> owner
+                    = std::shared_ptr<const void>())
+        : data_(data), size_(size), owner_(std::move(owner))
+    {
+    }
+
+    /** Take a copy of the string. */
+    explicit String_View(const std::string & str)
+    {
+        auto copy = std::make_shared<std::string>(str);
+        data_ = copy->data();
+        size_ = copy->size();
+        owner_ = copy;
+    }
+
+    typedef const char * const_iterator;
+    typedef const char * iterator;
+
+    const char * data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const char * begin() const { return data_; }
+    const char * end() const { return data_ + size_; }
+
+    char operator [] (size_t index) const { return data_[index]; }
+
+    std::string toString() const { return std::string(data_, size_); }
+
+    /** What keeps the memory alive; null if it's up to the caller. */
+    const std::shared_ptr<const void> & owner() const { return owner_; }
+
+    bool operator == (const String_View & other) const
+    {
+        return size_ == other.size_
+            && (size_ == 0 || memcmp(data_, other.data_, size_) == 0);
+    }
+
+    bool operator != (const String_View & other) const
+    {
+        return !operator == (other);
+    }
+
+    void serialize(Store_Writer & store) const
+    {
+        compact_size_t size(size_);
+        size.serialize(store);
+        store.save_binary(data_, size_);
+    }
+
+    void reconstitute(Store_Reader & store)
+    {
+        size_t size = compact_size_t(store);
+
+        std::shared_ptr<const void> owner;
+        if (store.in_place(size, owner)) {
+            data_ = store.pos();
+            size_ = size;
+            owner_ = std::move(owner);
+            store.skip(size);
+            return;
+        }
+
+        auto copy = std::make_shared<std::string>(size, '\0');
+        store.load_binary(&(*copy)[0], size);
+        data_ = copy->data();
+        size_ = copy->size();
+        owner_ = copy;
+    }
+
+private:
+    const char * data_;
+    size_t size_;
+    std::shared_ptr<const void> owner_;
+};
+
+inline std::ostream &
+operator << (std::ostream & stream, const String_View & view)
+{
+    return stream.write(view.data(), view.size());
+}
+
+
+/*****************************************************************************/
+/* ARRAY_VIEW                                                                */
+/*****************************************************************************/
+
+/** A read-only array of numbers that, like String_View, points into the
+    archive's memory when it can and holds on to it, and copies the
+    elements out otherwise.  Its data() is always aligned to Alignment.
+
+    So that the elements can be pointed to where they are, they are
+    written aligned to Alignment from the start of the archive: the size,
+    then a byte with the amount of padding, the padding and the elements.
+    Arrays written by one Alignment can be read with any other.  As a
+    mapping is aligned to a page, elements read from a mapped file are
+    pointed to unless the archive didn't start at the start of the file;
+    in that case, or with memory given to the Store_Reader that is
+    misaligned, they are copied.
+
+    This is not the same format as a std::vector, which can't be pointed
+    into as its elements have no alignment.
+*/
+
+template<typename T, size_t Alignment = alignof(T)>
+struct Array_View {
+    static_assert(Serialized_As_Bytes<T>::value,
+                  "Array_View is only for types serialized as their bytes");
+    static_assert(Alignment % alignof(T) == 0
+                  && (Alignment & (Alignment - 1)) == 0
+                  && Alignment <= 256,
+                  "Array_View alignment must be a power of two multiple of "
+                  "the type's, up to 256");
+
+    Array_View()
+        : data_(0), size_(0)
+    {
+    }
+
+    /** Point to memory that's kept alive by owner, or by the caller if it
+        is null.  It's up to the caller to align it. */
+    Array_View(const T * data, size_t size,
+               std::shared_ptr<const void> owner
+                   = std::shared_ptr<const void>())
+        : data_(data), size_(size), owner_(std::move(owner))
+    {
+    }
+
+    /** Take a copy of the elements. */
+    explicit Array_View(const std::vector<T> & vec)
+        : data_(0), size_(0)
+    {
+        copy(vec.data(), vec.size());
+    }
+
+    typedef T value_type;
+    typedef const T * const_iterator;
+    typedef const T * iterator;
+
+    const T * data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const T * begin() const { return data_; }
+    const T * end() const { return data_ + size_; }
+
+    const T & operator [] (size_t index) const { return data_[index]; }
+    const T & front() const { return data_[0]; }
+    const T & back() const { return data_[size_ - 1]; }
+
+    std::vector<T> toVector() const { return std::vector<T>(begin(), end()); }
+
+    /** What keeps the memory alive; null if it's up to the caller. */
+    const std::shared_ptr<const void> & owner() const { return owner_; }
+
+    void serialize(Store_Writer & store) const
+    {
+        compact_size_t size(size_);
+        size.serialize(store);
+
+        // Pad so that the elements start aligned, counting the byte that
+        // says how much padding there is
+        unsigned char padding = (Alignment - (store.offset() + 1) % Alignment)
+                                % Alignment;
+        store.save(padding);
+        char zeros[Alignment] = { 0 };
+        store.save_binary(zeros, padding);
+
+        store.save_binary(data_, size_ * sizeof(T));
+    }
+
+    void reconstitute(Store_Reader & store)
+    {
+        size_t size = compact_size_t(store);
+        unsigned char padding;
+        store.load(padding);
+        store.skip(padding);
+
+        size_t bytes = size * sizeof(T);
+        if (size != 0 && bytes / size != sizeof(T))
+            throw Exception("Array_View: size is too large");
+
+        std::shared_ptr<const void> owner;
+        if (store.in_place(bytes, owner)
+            && (uintptr_t)store.pos() % Alignment == 0) {
+            data_ = reinterpret_cast<const T *>(store.pos());
+            size_ = size;
+            owner_ = std::move(owner);
+            store.skip(bytes);
+            return;
+        }
+
+        T * mem = allocate(size);
+        store.load_binary(mem, bytes);
+        data_ = mem;
+        size_ = size;
+    }
+
+private:
+    const T * data_;
+    size_t size_;
+    std::shared_ptr<const void> owner_;
+
+    /** Make aligned memory for size elements, owned by the view. */
+    T * allocate(size_t size)
+    {
+        void * mem = 0;
+        size_t alignment = std::max(Alignment, sizeof(void *));
+        if (posix_memalign(&mem, alignment,
+                           std::max<size_t>(size * sizeof(T), 1)))
+            throw Exception("Array_View: couldn't allocate memory");
+        owner_.reset(mem, free);
+        return reinterpret_cast<T *>(mem);
+    }
+
+    void copy(const T * data, size_t size)
+    {
+        T * mem = allocate(size);
+        std::copy(data, data + size, mem);
+        data_ = mem;
+        size_ = size;
+    }
+};
+
+template<typename T, size_t A1, size_t A2>
+bool operator == (const Array_View<T, A1> & view1,
+                  const Array_View<T, A2> & view2)
+{
+    return view1.size() == view2.size()
+        && std::equal(view1.begin(), view1.end(), view2.begin());
+}
+
+template<typename T, size_t A1, size_t A2>
+bool operator != (const Array_View<T, A1> & view1,
+                  const Array_View<T, A2> & view2)
+{
+    return !(view1 == view2);
+}
+
+} // namespace DB
+} // namespace ML
+
+#endif /* __jml__db__archive_views_h__ */
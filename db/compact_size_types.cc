@@ -23,6 +23,7 @@
 #include "compact_size_types.h"
 #include "jml/compiler/compiler.h"
 #include "jml/arch/bitops.h"
+#include "jml/arch/simd.h"
 #include "jml/utils/exc_assert.h"
 #include "persistent.h"
 #include <stdint.h>
@@ -245,6 +246,7 @@ void compact_size_t::serialize(std::ostream & stream) const
 {
     Store_Writer writer(stream);
     serialize(writer);
+    writer.close();
 }
 
 std::ostream & operator << (std::ostream & stream, const compact_size_t & s)
@@ -336,6 +338,7 @@ void compact_int_t::serialize(std::ostream & stream) const
 {
     Store_Writer writer(stream);
     serialize(writer);
+    writer.close();
 }
 
 std::ostream & operator << (std::ostream & stream, const compact_int_t & s)
@@ -345,6 +348,175 @@ std::ostream & operator << (std::ostream & stream, const compact_int_t & s)
 }
 
 
+/*****************************************************************************/
+/* COMPACT ARRAYS                                                            */
+/*****************************************************************************/
+
+#ifdef JML_INTEL_ISA
+/* Decode as many of the groups of four values as possible with 16 byte
+   loads that don't go past end, moving data along.  Returns the number of
+   groups decoded.  It's in compact_size_types_ssse3.cc, which is compiled
+   with SSSE3 enabled; only call it if the CPU has it.
+*/
+size_t decode_compact_array_ssse3(const uint8_t * control,
+                                  const uint8_t * & data,
+                                  const uint8_t * end,
+                                  uint32_t * values, size_t groups,
+                                  int transform, uint32_t & previous);
+#endif
+
+inline uint32_t zigzag(uint32_t val)
+{
+    return (val << 1) ^ (uint32_t)((int32_t)val >> 31);
+}
+
+inline uint32_t unzigzag(uint32_t val)
+{
+    return (val >> 1) ^ -(val & 1);
+}
+
+/* Number of bytes for value i, less one, from the control bytes. */
+inline int compact_array_code(const uint8_t * control, size_t i)
+{
+    return (control[i / 4] >> (2 * (i % 4))) & 3;
+}
+
+size_t compact_array_max_length(size_t n)
+{
+    return (n + 3) / 4 + 4 * n;
+}
+
+size_t encode_compact_array(const uint32_t * values, size_t n, char * out,
+                            Compact_Array_Transform transform)
+{
+    uint8_t * control = (uint8_t *)out;
+    uint8_t * data = control + (n + 3) / 4;
+    uint32_t previous = 0;
+
+    for (size_t i = 0;  i < n;  ++i) {
+        uint32_t val = values[i];
+        if (transform & COMPACT_DELTA) {
+            uint32_t current = val;
+            val -= previous;
+            previous = current;
+        }
+        if (transform & COMPACT_ZIGZAG)
+            val = zigzag(val);
+
+        int code = (val > 0xff) + (val > 0xffff) + (val > 0xffffff);
+        if (i % 4 == 0) control[i / 4] = 0;
+        control[i / 4] |= code << (2 * (i % 4));
+
+        for (int j = 0;  j <= code;  ++j)
+            data[j] = val >> (8 * j);
+        data += code + 1;
+    }
+
+    return (char *)data - out;
+}
+
+size_t decode_compact_array(const char * first, const char * last,
+                            uint32_t * values, size_t n,
+                            Compact_Array_Transform transform,
+                            bool simd)
+{
+    size_t controlLength = (n + 3) / 4;
+    if (controlLength > size_t(last - first))
+        throw Exception("not enough bytes to decode compact array");
+
+    const uint8_t * control = (const uint8_t *)first;
+    const uint8_t * data = control + controlLength;
+    const uint8_t * end = (const uint8_t *)last;
+
+    /* Make sure all of the data is there before we start, so that the
+       decoding doesn't need to check as it goes. */
+    size_t length = n;
+    for (size_t i = 0;  i < n / 4;  ++i) {
+        uint8_t c = control[i];
+        length += (c & 3) + ((c >> 2) & 3) + ((c >> 4) & 3) + (c >> 6);
+    }
+    for (size_t i = n / 4 * 4;  i < n;  ++i)
+        length += compact_array_code(control, i);
+
+    if (length > size_t(end - data))
+        throw Exception("not enough bytes to decode compact array");
+
+    uint32_t previous = 0;
+    size_t done = 0;
+
+#ifdef JML_INTEL_ISA
+    if (simd && has_ssse3())
+        done = 4 * decode_compact_array_ssse3(control, data, end, values,
+                                              n / 4, transform, previous);
+#endif
+
+    /* Whatever's left is done one at a time. */
+    for (size_t i = done;  i < n;  ++i) {
+        int code = compact_array_code(control, i);
+        uint32_t val = data[0];
+        for (int j = 1;  j <= code;  ++j)
+            val |= uint32_t(data[j]) << (8 * j);
+        data += code + 1;
+
+        if (transform & COMPACT_ZIGZAG)
+            val = unzigzag(val);
+        if (transform & COMPACT_DELTA)
+            val = previous = previous + val;
+        values[i] = val;
+    }
+
+    return (const char *)data - first;
+}
+
+
+/*****************************************************************************/
+/* COMPACT_ARRAY_T                                                           */
+/*****************************************************************************/
+
+compact_array_t::compact_array_t(Store_Reader & store)
+{
+    reconstitute(store);
+}
+
+void compact_array_t::serialize(Store_Writer & store) const
+{
+    std::vector<char> buf(compact_array_max_length(values.size()));
+    size_t length = encode_compact_array(values.data(), values.size(),
+                                         buf.data(), transform);
+
+    store << compact_size_t(values.size()) << (unsigned char)transform
+          << compact_size_t(length);
+    store.save_binary(buf.data(), length);
+}
+
+void compact_array_t::reconstitute(Store_Reader & store)
+{
+    size_t n = compact_size_t(store);
+    unsigned char t;
+    store >> t;
+    if (t > COMPACT_DELTA_ZIGZAG)
+        throw Exception("unknown compact array transform");
+    size_t length = compact_size_t(store);
+
+    // Every value takes at least a byte
+    if (n > length)
+        throw Exception("compact array is too short");
+
+    store.must_have(length);
+
+    std::vector<uint32_t> v(n);
+    size_t used = decode_compact_array(store.pos(), store.pos() + length,
+                                       v.data(), n,
+                                       (Compact_Array_Transform)t);
+    if (used != length)
+        throw Exception("compact array has the wrong length");
+    store.skip(length);
+
+    values.swap(v);
+    transform = (Compact_Array_Transform)t;
+}
+
+
 
 } // namespace DB
 } // namespace ML
@@ -26,6 +26,7 @@
 
 #include "persistent_fwd.h"
 #include <iostream>
+#include <vector>
 #include <stdint.h>
 
 namespace ML {
@@ -102,6 +103,88 @@ std::ostream & operator << (std::ostream & stream, const compact_int_t & s);
 IMPL_SERIALIZE_RECONSTITUTE(compact_int_t);
 
 
+/*****************************************************************************/
+/* COMPACT ARRAYS                                                            */
+/*****************************************************************************/
+
+/* Arrays of 32 bit integers are encoded in the "stream vbyte" layout: first
+   a control byte for each group of four values, with two bits per value
+   (starting at the bottom) saying how many bytes from 1 to 4 it takes, then
+   the bytes of all of the values one after the other, little endian.  As
+   a single control byte gives the layout of four values, they can be
+   decoded four at a time with a shuffle rather than one at a time as for
+   compact_size_t.
+
+   The values can be transformed before they are encoded:
+   - with DELTA, each is stored as the difference from the one before
+     (modulo 2^32), so that a sorted list of ids is mostly single bytes;
+   - with ZIGZAG, the sign bit is moved to the bottom so that small
+     negative numbers are small too, as are the differences between the
+     values of a list that isn't quite sorted with DELTA_ZIGZAG.
+*/
+
+enum Compact_Array_Transform {
+    COMPACT_PLAIN = 0,
+    COMPACT_DELTA = 1,
+    COMPACT_ZIGZAG = 2,
+    COMPACT_DELTA_ZIGZAG = 3
+};
+
+/** Return the most bytes that encoding n values can take. */
+size_t compact_array_max_length(size_t n);
+
+/** Encode the n values into out, which must have room for
+    compact_array_max_length(n) bytes.  Returns the number of bytes used.
+*/
+size_t encode_compact_array(const uint32_t * values, size_t n, char * out,
+                            Compact_Array_Transform transform
+                                = COMPACT_PLAIN);
+
+/** Decode n values that were encoded at first.  Returns the number of
+    bytes that they took, and throws if that would be past last.  The
+    encoded bytes don't need any alignment or padding.  Unless simd is
+    false, groups of four are decoded with SSSE3 when the CPU has it.
+*/
+size_t decode_compact_array(const char * first, const char * last,
+                            uint32_t * values, size_t n,
+                            Compact_Array_Transform transform
+                                = COMPACT_PLAIN,
+                            bool simd = true);
+
+
+/*****************************************************************************/
+/* COMPACT_ARRAY_T                                                           */
+/*****************************************************************************/
+
+/** A vector of 32 bit integers that's serialized as a compact array: the
+    number of values, the transform, the number of bytes and then the
+    bytes.
+*/
+
+struct compact_array_t {
+    compact_array_t(Compact_Array_Transform transform = COMPACT_PLAIN)
+        : transform(transform)
+    {
+    }
+
+    compact_array_t(const std::vector<uint32_t> & values,
+                    Compact_Array_Transform transform = COMPACT_PLAIN)
+        : values(values), transform(transform)
+    {
+    }
+
+    compact_array_t(Store_Reader & archive);
+
+    void serialize(Store_Writer & store) const;
+    void reconstitute(Store_Reader & store);
+
+    std::vector<uint32_t> values;
+    Compact_Array_Transform transform;
+};
+
+IMPL_SERIALIZE_RECONSTITUTE(compact_array_t);
+
+
 } // namespace DB
 } // namespace ML
 
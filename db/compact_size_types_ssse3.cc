@@ -0,0 +1,111 @@
+/* compact_size_types_ssse3.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Decoding of compact arrays four values at a time with SSSE3.  This file
+   is compiled with -mssse3, so it must only be called when the CPU has it.
+*/
+
+#include "compact_size_types.h"
+#include <tmmintrin.h>
+#include <algorithm>
+
+
+namespace ML {
+namespace DB {
+
+namespace {
+
+/** For each control byte, the shuffle that moves the bytes of its four
+    values into place, and how many bytes they take. */
+struct Shuffle_Tables {
+    Shuffle_Tables()
+    {
+        for (unsigned c = 0;  c < 256;  ++c) {
+            int pos = 0;
+            for (int i = 0;  i < 4;  ++i) {
+                int len = ((c >> (2 * i)) & 3) + 1;
+                for (int j = 0;  j < 4;  ++j)
+                    shuffles[c][i * 4 + j] = (j < len ? pos + j : 0x80);
+                pos += len;
+            }
+            lengths[c] = pos;
+        }
+    }
+
+    uint8_t shuffles[256][16] __attribute__((__aligned__(16)));
+    uint8_t lengths[256];
+};
+
+template<int Transform>
+size_t decode_groups(const uint8_t * control, const uint8_t * & data,
+                     const uint8_t * end, uint32_t * values, size_t groups,
+                     uint32_t & previous, const Shuffle_Tables & tables)
+{
+    __m128i prev = _mm_set1_epi32(previous);
+    const __m128i one = _mm_set1_epi32(1);
+
+    size_t i = 0;
+    while (i < groups) {
+        // A group takes at most 16 bytes, so this many can be loaded
+        // without looking at where the end is
+        size_t safe = std::min<size_t>(groups - i, (end - data) / 16);
+        if (safe == 0) break;
+
+        for (size_t last = i + safe;  i < last;  ++i) {
+            uint8_t c = control[i];
+            __m128i v = _mm_loadu_si128((const __m128i *)data);
+            v = _mm_shuffle_epi8(v, _mm_load_si128((const __m128i *)
+                                                   tables.shuffles[c]));
+            data += tables.lengths[c];
+
+            if (Transform & COMPACT_ZIGZAG)
+                v = _mm_xor_si128(_mm_srli_epi32(v, 1),
+                                  _mm_sub_epi32(_mm_setzero_si128(),
+                                                _mm_and_si128(v, one)));
+
+            if (Transform & COMPACT_DELTA) {
+                // Prefix sum of the four, plus the last one before them
+                v = _mm_add_epi32(v, _mm_slli_si128(v, 4));
+                v = _mm_add_epi32(v, _mm_slli_si128(v, 8));
+                v = _mm_add_epi32(v, prev);
+                prev = _mm_shuffle_epi32(v, 0xff);
+            }
+
+            _mm_storeu_si128((__m128i *)(values + i * 4), v);
+        }
+    }
+
+    previous = _mm_cvtsi128_si32(prev);
+    return i;
+}
+
+} // file scope
+
+size_t decode_compact_array_ssse3(const uint8_t * control,
+                                  const uint8_t * & data,
+                                  const uint8_t * end,
+                                  uint32_t * values, size_t groups,
+                                  int transform, uint32_t & previous)
+{
+    static const Shuffle_Tables tables;
+
+    switch (transform) {
+    case COMPACT_PLAIN:
+        return decode_groups<COMPACT_PLAIN>
+            (control, data, end, values, groups, previous, tables);
+    case COMPACT_DELTA:
+        return decode_groups<COMPACT_DELTA>
+            (control, data, end, values, groups, previous, tables);
+    case COMPACT_ZIGZAG:
+        return decode_groups<COMPACT_ZIGZAG>
+            (control, data, end, values, groups, previous, tables);
+    case COMPACT_DELTA_ZIGZAG:
+        return decode_groups<COMPACT_DELTA_ZIGZAG>
+            (control, data, end, values, groups, previous, tables);
+    default:
+        return 0;
+    }
+}
+
+} // namespace DB
+} // namespace ML
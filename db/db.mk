@@ -1,9 +1,12 @@
 LIBDB_SOURCES := \
         compact_size_types.cc \
+        compact_size_types_ssse3.cc \
         nested_archive.cc \
         portable_iarchive.cc \
         portable_oarchive.cc
 
+$(eval $(call set_single_compile_option,compact_size_types_ssse3.cc,-mssse3))
+
 $(eval $(call add_sources,$(LIBDB_SOURCES)))
 
 LIBDB_LINK := utils
@@ -33,7 +33,47 @@ namespace DB {
 
 Nested_Reader::Nested_Reader()
 {
-    open(stream);
+    open((const char *)0, 0);
+}
+
+Nested_Reader::Nested_Reader(Store_Reader & parent)
+{
+    size_t length = compact_size_t(parent);
+    open(parent, length);
+}
+
+Nested_Reader::Nested_Reader(Nested_Reader & parent)
+{
+    size_t length = compact_size_t(parent);
+    open(parent, length);
+}
+
+Nested_Reader::~Nested_Reader()
+{
+    // Leave the parent after the nested archive
+    try {
+        finish();
+    } catch (...) {
+    }
+}
+
+void
+Nested_Reader::
+reconstitute(Store_Reader & parent)
+{
+    finish();
+    size_t length = compact_size_t(parent);
+
+    std::shared_ptr<const void> owner;
+    if (parent.in_place(length, owner)) {
+        data.clear();
+        open(parent, length);
+        return;
+    }
+
+    data.resize(length);
+    parent.load_binary(&data[0], length);
+    open(data.c_str(), length);
 }
 
 
@@ -42,8 +82,30 @@ Nested_Reader::Nested_Reader()
 /*****************************************************************************/
 
 Nested_Writer::Nested_Writer()
+    : inPlace(false)
+{
+    open(&data);
+}
+
+Nested_Writer::Nested_Writer(Store_Writer & parent)
+    : inPlace(true)
+{
+    open(parent);
+}
+
+Nested_Writer::Nested_Writer(Nested_Writer & parent)
+    : inPlace(true)
+{
+    open(parent);
+}
+
+Nested_Writer::~Nested_Writer()
 {
-    open(stream);
+    // Flush into data (or the parent) while it's still there
+    try {
+        close();
+    } catch (...) {
+    }
 }
 
 } // namespace DB
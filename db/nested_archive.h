@@ -21,10 +21,10 @@
 */
 
 #ifndef __db__nested_archive_h__
-#define __db__nested_arhcive_h__
+#define __db__nested_archive_h__
 
 #include "persistent.h"
-#include <sstream>
+#include <string>
 
 namespace ML {
 namespace DB {
@@ -35,24 +35,41 @@ namespace DB {
 /*****************************************************************************/
 
 /** A store reader that can be used to read an archive nested within another
-    archive.
+    archive, where it's stored as a string.  When the parent is a mapped
+    file or memory, the nested archive is read where it is, without a copy,
+    and the parent carries on straight away.
+
+    Otherwise, reading it with >> (or reconstitute()) copies it out of the
+    parent, so that the parent can carry on straight away and the nested
+    reader doesn't depend on it.  The explicit constructor instead reads
+    from the parent as it goes: the parent can only carry on after the
+    nested reader has been finished (see Binary_Input::finish()) or
+    destroyed, and must outlive it.
 */
 
 class Nested_Reader : public Store_Reader {
 public:
     Nested_Reader();
 
+    /** Read the nested archive that comes next in the parent, from the
+        parent itself if it can't be read in place. */
+    explicit Nested_Reader(Store_Reader & parent);
+    explicit Nested_Reader(Nested_Reader & parent);
+
+    ~Nested_Reader();
+
+    /** Read the nested archive that comes next in the parent, copying it
+        if it can't be read in place. */
+    void reconstitute(Store_Reader & parent);
+
     template<class Archive>
     void serialize(Archive & archive)
     {
-        // reconstitute
-        std::string data;
-        archive >> data;
-        stream.str(data);
+        reconstitute(archive);
     }
 
 private:
-    std::istringstream stream;
+    std::string data;   ///< Copy of the nested archive, if there is one
 };
 
 
@@ -61,21 +78,42 @@ private:
 /*****************************************************************************/
 
 /** A store writer that can be used to write an archive and nest it within
-    another archive.
+    another archive, as a string holding it.
+
+    By default, what's written is kept in memory until the nested writer is
+    written to the parent with <<.  Given the parent, it's instead written
+    into the parent as it goes, with the string's size filled in when the
+    nested writer is closed or destroyed; nothing else can be written to the
+    parent in between.  That needs the parent's output to be able to seek
+    back to the size (see portable_bin_oarchive::patch()): a string, a file
+    descriptor of a file or a seekable stream, but not a filename, which
+    is written through a filter_ostream.
 */
 
 class Nested_Writer : public Store_Writer {
 public:
     Nested_Writer();
 
+    /** Write in place into the parent. */
+    explicit Nested_Writer(Store_Writer & parent);
+    explicit Nested_Writer(Nested_Writer & parent);
+
+    ~Nested_Writer();
+
     template<class Archive>
     void serialize(Archive & archive) const
     {
-        archive << stream.str();
+        if (inPlace)
+            throw Exception("Nested_Writer was already written in place");
+
+        // What's been written is buffered until it's flushed
+        const_cast<Nested_Writer *>(this)->flush();
+        archive << data;
     }
     
 private:
-    std::ostringstream stream;
+    std::string data;
+    bool inPlace;
 };
 
 } // namespace DB
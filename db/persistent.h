@@ -53,10 +53,11 @@ template<typename T,
 std::string
 serializeToString(const T & t, X * = 0)
 {
-    std::ostringstream stream;
-    ML::DB::Store_Writer writer(stream);
+    std::string result;
+    ML::DB::Store_Writer writer(&result);
     t.serialize(writer);
-    return stream.str();
+    writer.close();
+    return result;
 }
 
 
@@ -23,9 +23,11 @@
 #include "portable_iarchive.h"
 #include "jml/utils/file_functions.h"
 #include "jml/utils/filter_streams.h"
+#include "jml/utils/async_file_reader.h"
 #include <boost/scoped_ptr.hpp>
 #include <iostream>
 #include <algorithm>
+#include <unistd.h>
 
 
 using namespace std;
@@ -45,18 +47,33 @@ struct Binary_Input::Source {
     }
 
     virtual size_t more(Binary_Input & input, size_t amount) = 0;
+
+    virtual void drop_consumed(const Binary_Input & input)
+    {
+    }
+
+    virtual bool in_place(std::shared_ptr<const void> & owner) const
+    {
+        return false;
+    }
+
+    virtual void finish(Binary_Input & input)
+    {
+    }
 };
 
 struct Binary_Input::Buffer_Source
     : public Binary_Input::Source {
     Buffer_Source(const File_Read_Buffer & buf)
-        : region(buf.region)
+        : region(buf.region), dropped(0)
     {
     }
 
-    Buffer_Source(const std::string & filename)
+    Buffer_Source(const std::string & filename,
+                  const File_Read_Buffer::Options & options)
+        : dropped(0)
     {
-        File_Read_Buffer buf(filename);
+        File_Read_Buffer buf(filename, options);
         region = buf.region;
     }
     
@@ -76,7 +93,26 @@ struct Binary_Input::Buffer_Source
         return input.avail();  // we can never get more after this
     }
 
+    virtual void drop_consumed(const Binary_Input & input)
+    {
+        size_t pos = input.pos_ - region->start;
+        if (pos <= dropped) return;
+
+        // Everything before dropped was consumed too, so its page can go
+        size_t page = getpagesize();
+        size_t first = dropped / page * page;
+        region->done_with(first, pos - first);
+        dropped = pos;
+    }
+
+    virtual bool in_place(std::shared_ptr<const void> & owner) const
+    {
+        owner = region;
+        return true;
+    }
+
     std::shared_ptr<File_Read_Buffer::Region> region;
+    size_t dropped;   ///< Offset before which the region was dropped
 };
 
 struct Binary_Input::Stream_Source
@@ -189,12 +225,168 @@ struct Binary_Input::Stream_Source
     boost::scoped_ptr<std::istream> owned_stream;
 };
 
+struct Binary_Input::Async_Source
+    : public Binary_Input::Source {
+
+    Async_Source(const std::shared_ptr<Async_File_Reader> & reader)
+        : reader(reader), haveBlock(false), inStaging(false),
+          resume(0), blockEnd(0)
+    {
+    }
+
+    virtual ~Async_Source()
+    {
+        if (haveBlock) reader->release(block.index);
+    }
+
+    /** Give back the block we're holding and wait for the next one. */
+    bool next_block()
+    {
+        if (haveBlock) reader->release(block.index);
+        haveBlock = reader->next(block);
+        if (!haveBlock) return false;
+        blockEnd = block.data + block.size;
+        return true;
+    }
+
+    virtual size_t more(Binary_Input & input, size_t amount)
+    {
+        /* Most of the time the input points straight into the current
+           block.  When what's wanted runs over the end of it, what's left
+           plus just enough of the following block(s) are copied into
+           staging, and the input goes back to pointing into the block once
+           that's been used up. */
+
+        const char * p = (inStaging ? resume : blockEnd);
+
+        if (inStaging && input.avail() == 0
+            && size_t(blockEnd - p) >= amount) {
+            inStaging = false;
+            input.pos_ = p;
+            input.end_ = blockEnd;
+            return input.avail();
+        }
+
+        // The leftover may be in the block, so copy it before releasing
+        spare.assign(input.pos_, input.end_);
+
+        while (spare.size() < amount) {
+            if (p == blockEnd) {
+                if (!next_block()) break;
+                p = block.data;
+                if (spare.empty() && block.size >= amount) {
+                    inStaging = false;
+                    input.pos_ = p;
+                    input.end_ = blockEnd;
+                    return input.avail();
+                }
+                continue;
+            }
+
+            size_t n = std::min<size_t>(amount - spare.size(), blockEnd - p);
+            spare.insert(spare.end(), p, p + n);
+            p += n;
+        }
+
+        staging.swap(spare);
+        inStaging = true;
+        resume = p;
+        input.pos_ = staging.data();
+        input.end_ = input.pos_ + staging.size();
+        return input.avail();
+    }
+
+    std::shared_ptr<Async_File_Reader> reader;
+    Async_File_Reader::Block block;
+    bool haveBlock;
+    bool inStaging;         ///< Is the input pointing to staging?
+    const char * resume;    ///< Where in block to carry on after staging
+    const char * blockEnd;
+    std::vector<char> staging, spare;
+};
+
 struct Binary_Input::No_Source
     : public Binary_Input::Source {
+
+    /** The memory is kept alive by owner, or by the caller if it's null. */
+    No_Source(std::shared_ptr<const void> owner
+                  = std::shared_ptr<const void>())
+        : owner(std::move(owner))
+    {
+    }
+
     virtual size_t more(Binary_Input & input, size_t amount)
     {
         return 0;
     }
+
+    virtual bool in_place(std::shared_ptr<const void> & owner) const
+    {
+        owner = this->owner;
+        return true;
+    }
+
+    std::shared_ptr<const void> owner;
+};
+
+/** Reads part of a parent input that can't be pointed to in place.  The
+    input points into the parent's own memory, and the parent is moved
+    along by what's been read whenever more is needed.
+*/
+struct Binary_Input::Part_Source
+    : public Binary_Input::Source {
+
+    enum { SKIP_CHUNK = 65536 };
+
+    Part_Source(Binary_Input & parent, size_t length)
+        : parent(parent), remaining(length), window(0)
+    {
+    }
+
+    /** Move the parent past what's been read since it was last looked
+        at. */
+    void catch_up(const Binary_Input & input)
+    {
+        if (!window) return;
+        size_t consumed = input.pos_ - window;
+        parent.skip(consumed);
+        remaining -= consumed;
+        window = 0;
+    }
+
+    virtual size_t more(Binary_Input & input, size_t amount)
+    {
+        catch_up(input);
+
+        if (remaining)
+            parent.try_to_have(std::min(amount, remaining));
+
+        input.pos_ = window = parent.pos();
+        input.end_ = input.pos_ + std::min(parent.avail(), remaining);
+        return input.avail();
+    }
+
+    virtual void finish(Binary_Input & input)
+    {
+        catch_up(input);
+
+        // A bit at a time, so that a parent reading from a stream doesn't
+        // have to buffer all of what's left to skip it
+        while (remaining) {
+            size_t avail
+                = parent.try_to_have(std::min<size_t>(remaining, SKIP_CHUNK));
+            if (avail == 0) parent.skip(remaining);  // throws past the end
+            size_t done = std::min(avail, remaining);
+            parent.skip(done);
+            remaining -= done;
+        }
+
+        input.pos_ = input.end_ = 0;
+    }
+
+    Binary_Input & parent;
+    size_t remaining;         ///< What's left of the part from window on
+    const char * window;      ///< Where the input was pointed to in parent
 };
 
 Binary_Input::Binary_Input()
@@ -208,10 +400,11 @@ Binary_Input::Binary_Input(const File_Read_Buffer & buf)
     open(buf);
 }
 
-Binary_Input::Binary_Input(const std::string & filename)
+Binary_Input::Binary_Input(const std::string & filename,
+                           const File_Read_Buffer::Options & options)
     : offset_(0), pos_(0), end_(0)
 {
-    open(filename);
+    open(filename, options);
 }
 
 Binary_Input::Binary_Input(std::istream & stream)
@@ -220,6 +413,13 @@ Binary_Input::Binary_Input(std::istream & stream)
     open(stream);
 }
 
+Binary_Input::
+Binary_Input(const std::shared_ptr<Async_File_Reader> & reader)
+    : offset_(0), pos_(0), end_(0)
+{
+    open(reader);
+}
+
 Binary_Input::Binary_Input(const char * c, size_t sz)
     : offset_(0), pos_(0), end_(0)
 {
@@ -240,7 +440,8 @@ bool endsWith(const std::string & str, const std::string & val)
         && str.rfind(val) == str.size() - val.size();
 }
 
-void Binary_Input::open(const std::string & filename)
+void Binary_Input::open(const std::string & filename,
+                        const File_Read_Buffer::Options & options)
 {
     if (endsWith(filename, ".gz")
         || endsWith(filename, ".bz2")
@@ -254,7 +455,7 @@ void Binary_Input::open(const std::string & filename)
 
     offset_ = 0;
     pos_ = end_ = 0;
-    source.reset(new Buffer_Source(filename));
+    source.reset(new Buffer_Source(filename, options));
     source->more(*this, 0);
 }
 
@@ -266,6 +467,39 @@ void Binary_Input::open(std::istream & stream)
     source->more(*this, 0);
 }
 
+void
+Binary_Input::
+open(Binary_Input & parent, size_t length)
+{
+    if (&parent == this)
+        throw Exception("Binary_Input can't be opened on itself");
+
+    offset_ = 0;
+
+    std::shared_ptr<const void> owner;
+    if (parent.in_place(length, owner)) {
+        pos_ = parent.pos();
+        end_ = pos_ + length;
+        source.reset(new No_Source(owner));
+        parent.skip(length);
+        return;
+    }
+
+    pos_ = end_ = 0;
+    source.reset(new Part_Source(parent, length));
+    source->more(*this, 0);
+}
+
+void
+Binary_Input::
+open(const std::shared_ptr<Async_File_Reader> & reader)
+{
+    offset_ = 0;
+    pos_ = end_ = 0;
+    source.reset(new Async_Source(reader));
+    source->more(*this, 0);
+}
+
 void Binary_Input::open(const char * c, size_t sz)
 {
     offset_ = 0;
@@ -292,6 +526,31 @@ try_make_avail(size_t min_avail)
     return source->more(*this, min_avail);
 }
 
+void
+Binary_Input::
+drop_consumed()
+{
+    if (source) source->drop_consumed(*this);
+}
+
+void
+Binary_Input::
+finish()
+{
+    if (source) source->finish(*this);
+}
+
+bool
+Binary_Input::
+in_place(size_t size, std::shared_ptr<const void> & owner)
+{
+    if (!source || !source->in_place(owner))
+        return false;
+    if (avail() < size)
+        throw Exception("Binary_Input: read past end of data");
+    return true;
+}
+
 
 /*****************************************************************************/
 /* PORTABLE_BIN_IARCHIVE                                                     */
@@ -306,8 +565,10 @@ portable_bin_iarchive::portable_bin_iarchive(const File_Read_Buffer & buf)
 {
 }
 
-portable_bin_iarchive::portable_bin_iarchive(const std::string & filename)
-    : Binary_Input(filename)
+portable_bin_iarchive::
+portable_bin_iarchive(const std::string & filename,
+                      const File_Read_Buffer::Options & options)
+    : Binary_Input(filename, options)
 {
 }
 
@@ -316,10 +577,39 @@ portable_bin_iarchive::portable_bin_iarchive(std::istream & stream)
 {
 }
 
+portable_bin_iarchive::
+portable_bin_iarchive(const std::shared_ptr<Async_File_Reader> & reader)
+    : Binary_Input(reader)
+{
+}
+
 portable_bin_iarchive::portable_bin_iarchive(const char * c, size_t sz)
     : Binary_Input(c, sz)
 {
 }
 
+void
+portable_bin_iarchive::
+load_binary_slow(void * address, size_t size)
+{
+    char * p = reinterpret_cast<char *>(address);
+
+    while (size) {
+        if (avail() == 0) {
+            // Ask for just one byte, so that the source can give whatever
+            // it has in place, rather than copying to make more available
+            try_to_have(1);
+            if (avail() == 0)
+                throw Exception("Binary_Input: read past end of data");
+        }
+
+        size_t n = std::min(size, avail());
+        memcpy(p, pos(), n);
+        skip(n);
+        p += n;
+        size -= n;
+    }
+}
+
 } // namespace DB
 } // namespace ML
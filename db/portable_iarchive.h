@@ -28,13 +28,16 @@
 #include "serialization_order.h"
 #include "jml/utils/floating_point.h"
 #include "jml/arch/exception.h"
+#include "jml/compiler/compiler.h"
 #include "compact_size_types.h"
 #include <vector>
 #include <map>
 #include <unordered_map>
 #include <set>
 #include <boost/array.hpp>
+#include <string.h>
 #include "jml/utils/string_functions.h"
+#include "jml/utils/file_functions.h"
 
 namespace boost {
 
@@ -45,7 +48,7 @@ class multi_array;
 
 namespace ML {
 
-class File_Read_Buffer;
+struct Async_File_Reader;
 
 namespace DB {
 
@@ -59,14 +62,38 @@ struct Binary_Input {
 public:
     Binary_Input();
     Binary_Input(const File_Read_Buffer & buf);
-    Binary_Input(const std::string & filename);
+    Binary_Input(const std::string & filename,
+                 const File_Read_Buffer::Options & options
+                     = File_Read_Buffer::Options());
     Binary_Input(std::istream & stream);
+    Binary_Input(const std::shared_ptr<Async_File_Reader> & reader);
     Binary_Input(const char * c, size_t len);
 
     void open(const File_Read_Buffer & buf);
-    void open(const std::string & filename);
+    /** Open the file, mapping it with the given options unless it's
+        compressed. */
+    void open(const std::string & filename,
+              const File_Read_Buffer::Options & options
+                  = File_Read_Buffer::Options());
     void open(std::istream & stream);
+    /** Read from the blocks of the reader in place; only the values that
+        straddle two blocks are copied. */
+    void open(const std::shared_ptr<Async_File_Reader> & reader);
     void open(const char * c, size_t len);
+    /** Read the next length bytes of the parent as an input of their own.
+        If they can be pointed to where they are (see in_place()), the
+        parent is moved past them straight away.  Otherwise the parent is
+        read from as this input is, and must not be used until finish()
+        has been called to move it to the end of them.
+    */
+    void open(Binary_Input & parent, size_t length);
+
+    /** For an input opened on part of a parent input, move the parent to
+        the end of the part, skipping whatever hasn't been read of it.
+        After that, nothing more can be read from this input.  Does
+        nothing for other inputs.
+    */
+    void finish();
 
     size_t avail() const { return end_ - pos_; }
 
@@ -106,6 +133,24 @@ public:
 
     size_t offset() const { return offset_; }
 
+    /** For input from a mapped file, tell the file that nothing before the
+        current position will be looked at again, so that those pages can be
+        dropped (see File_Read_Buffer::done_with).  Nothing loaded before
+        the current position may still point into the file.  Does nothing
+        for other inputs.
+    */
+    void drop_consumed();
+
+    /** Can the next size bytes be pointed to where they are, rather than
+        copied out?  They can for a mapped file (or File_Read_Buffer), where
+        owner is set to something that keeps the mapping alive, and for
+        memory given to open(), where owner is set to null and it's up to
+        the caller to keep the memory around.  They can't for streams or
+        the asynchronous reader, whose buffers are reused.  Throws if there
+        are fewer than size bytes left.
+    */
+    bool in_place(size_t size, std::shared_ptr<const void> & owner);
+
 private:
     size_t offset_;       ///< Offset of start from archive start
     const char * pos_;    ///< Position in memory region
@@ -117,7 +162,9 @@ private:
     struct Source;
     struct Buffer_Source;
     struct Stream_Source;
+    struct Async_Source;
     struct No_Source;
+    struct Part_Source;
     std::shared_ptr<Source> source;
 };
 
@@ -131,8 +178,11 @@ class portable_bin_iarchive
 public:
     portable_bin_iarchive();
     portable_bin_iarchive(const File_Read_Buffer & buf);
-    portable_bin_iarchive(const std::string & filename);
+    portable_bin_iarchive(const std::string & filename,
+                          const File_Read_Buffer::Options & options
+                              = File_Read_Buffer::Options());
     portable_bin_iarchive(std::istream & stream);
+    portable_bin_iarchive(const std::shared_ptr<Async_File_Reader> & reader);
     portable_bin_iarchive(const char * c, size_t sz);
 
     void load(unsigned char & x)
@@ -253,12 +303,7 @@ public:
         compact_size_t sz(*this);
 
         std::vector<T, A> v;
-        v.reserve(sz);
-        for (unsigned i = 0;  i < sz;  ++i) {
-            T t;
-            *this >> t;
-            v.push_back(t);
-        }
+        load_elements(v, sz, Serialized_As_Bytes<T>());
         vec.swap(v);
     }
 
@@ -337,18 +382,17 @@ public:
 
         arr.resize(sizes);
 
-        size_t ne = arr.num_elements();
-        T * el = arr.data();
-        for (unsigned i = 0;  i < ne;  ++i, ++el)
-            *this >> *el;
+        load_elements(arr.data(), arr.num_elements(),
+                      Serialized_As_Bytes<T>());
     }
 
     void load_binary(void * address, size_t size)
     {
-        must_have(size);
-        std::copy(pos(), pos() + size,
-                  reinterpret_cast<char *>(address));
-        skip(size);
+        if (JML_LIKELY(avail() >= size)) {
+            memcpy(address, pos(), size);
+            skip(size);
+        }
+        else load_binary_slow(address, size);
     }
 
     // Anything with a serialize() method gets to be serialized
@@ -366,6 +410,44 @@ public:
         obj.reconstitute(*this);
     }
 #endif
+
+private:
+    /** Elements that are serialized as their bytes are read as one
+        block. */
+    template<class T, class A>
+    void load_elements(std::vector<T, A> & v, size_t sz, std::true_type)
+    {
+        v.resize(sz);
+        load_elements(v.data(), sz, std::true_type());
+    }
+
+    template<class T, class A>
+    void load_elements(std::vector<T, A> & v, size_t sz, std::false_type)
+    {
+        v.reserve(sz);
+        for (size_t i = 0;  i < sz;  ++i) {
+            T t;
+            *this >> t;
+            v.push_back(t);
+        }
+    }
+
+    template<typename T>
+    void load_elements(T * el, size_t n, std::true_type)
+    {
+        load_binary(el, n * sizeof(T));
+    }
+
+    template<typename T>
+    void load_elements(T * el, size_t n, std::false_type)
+    {
+        for (size_t i = 0;  i < n;  ++i, ++el)
+            *this >> *el;
+    }
+
+    /** Read a block that's not all available yet, a piece at a time so
+        that the input never needs to hold all of it at once. */
+    void load_binary_slow(void * address, size_t size);
 };
 
 } // namespace DB
@@ -24,6 +24,9 @@
 #include "portable_oarchive.h"
 #include "nested_archive.h"
 #include "jml/utils/filter_streams.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 
 using namespace std;
 
@@ -36,36 +39,503 @@ namespace DB {
 /* PORTABLE_BIN_OARCHIVE                                                     */
 /*****************************************************************************/
 
+namespace {
+
+/** Size of the buffer that writes go into.  It's allocated on the first
+    write at MIN_BUFFER_SIZE and grows up to BUFFER_SIZE, so that an archive
+    used for a single small value doesn't allocate the whole thing. */
+enum { MIN_BUFFER_SIZE = 256, BUFFER_SIZE = 65536 };
+
+} // file scope
+
+struct portable_bin_oarchive::Sink {
+    virtual ~Sink()
+    {
+    }
+
+    virtual void write(const char * data, size_t size) = 0;
+
+    /** Overwrite size bytes at offset from where the archive started. */
+    virtual void patch(size_t offset, const char * data, size_t size)
+    {
+        throw Exception("portable_bin_oarchive: can't go back to patch "
+                        "this output");
+    }
+
+    /** Can patch() go back to anything that's been written? */
+    virtual bool can_patch() const
+    {
+        return false;
+    }
+
+    /** Called after the last write. */
+    virtual void close()
+    {
+    }
+};
+
+struct portable_bin_oarchive::Stream_Sink
+    : public portable_bin_oarchive::Sink {
+
+    Stream_Sink(std::ostream & stream)
+        : stream(&stream), written(0), located(false)
+    {
+    }
+
+    Stream_Sink(std::ostream * stream)
+        : stream(stream), written(0), located(false), owned_stream(stream)
+    {
+    }
+
+    /** Find out where the archive started, the first time it's needed.
+        It's not done up front, as most archives never patch. */
+    void locate() const
+    {
+        if (located) return;
+        start = position(*stream);
+        if (start != std::streampos(-1))
+            start -= std::streamoff(written);
+        located = true;
+    }
+
+    /** Where the stream is, or -1 if it can't seek.  This goes straight to
+        the streambuf, as streams that can't seek may throw, which would
+        leave the stream itself in a bad state. */
+    static std::streampos position(std::ostream & stream)
+    {
+        try {
+            return stream.rdbuf()->pubseekoff(0, std::ios::cur,
+                                              std::ios::out);
+        } catch (const std::exception & exc) {
+            return std::streampos(-1);
+        }
+    }
+
+    virtual void write(const char * data, size_t size)
+    {
+        stream->write(data, size);
+        if (!*stream)
+            throw Exception("Error writing to stream");
+        written += size;
+    }
+
+    virtual void patch(size_t offset, const char * data, size_t size)
+    {
+        locate();
+        if (start == std::streampos(-1))
+            return Sink::patch(offset, data, size);
+
+        stream->flush();
+        std::streambuf * buf = stream->rdbuf();
+        std::streampos end = position(*stream);
+        if (end == std::streampos(-1)
+            || buf->pubseekpos(start + std::streamoff(offset), std::ios::out)
+               == std::streampos(-1)
+            || buf->sputn(data, size) != std::streamsize(size)
+            || buf->pubseekpos(end, std::ios::out) == std::streampos(-1))
+            throw Exception("Error patching stream");
+    }
+
+    virtual bool can_patch() const
+    {
+        locate();
+        return start != std::streampos(-1);
+    }
+
+    std::ostream * stream;
+    uint64_t written;                ///< Bytes written to the stream so far
+    mutable bool located;            ///< Has start been found yet?
+    mutable std::streampos start;    ///< Where the archive started, or -1
+    std::unique_ptr<std::ostream> owned_stream;
+};
+
+struct portable_bin_oarchive::Fd_Sink
+    : public portable_bin_oarchive::Sink {
+
+    Fd_Sink(int fd)
+        : fd(fd), written(0), located(false), start(-1)
+    {
+    }
+
+    /** Find out where the archive started, the first time it's needed.
+        An fd opened with O_APPEND can seek, but pwrite() on it ignores the
+        offset and appends, so it's treated as though it can't.
+    */
+    void locate() const
+    {
+        if (located) return;
+        int flags = fcntl(fd, F_GETFL);
+        if (flags == -1 || (flags & O_APPEND))
+            start = -1;
+        else start = lseek(fd, 0, SEEK_CUR);
+        if (start != -1)
+            start -= written;
+        located = true;
+    }
+
+    virtual void write(const char * data, size_t size)
+    {
+        while (size) {
+            ssize_t res = ::write(fd, data, size);
+            if (res == -1 && errno == EINTR)
+                continue;
+            if (res == -1)
+                throw Exception(errno, "portable_bin_oarchive write()");
+            data += res;
+            size -= res;
+            written += res;
+        }
+    }
+
+    virtual void patch(size_t offset, const char * data, size_t size)
+    {
+        locate();
+        if (start == -1)
+            return Sink::patch(offset, data, size);
+
+        offset += start;
+        while (size) {
+            ssize_t res = ::pwrite(fd, data, size, offset);
+            if (res == -1 && errno == EINTR)
+                continue;
+            if (res == -1)
+                throw Exception(errno, "portable_bin_oarchive pwrite()");
+            data += res;
+            offset += res;
+            size -= res;
+        }
+    }
+
+    virtual bool can_patch() const
+    {
+        locate();
+        return start != -1;
+    }
+
+    int fd;
+    off_t written;  ///< Bytes written to the fd so far
+    mutable bool located;   ///< Has start been found yet?
+    mutable off_t start;    ///< Where the archive started; -1 if can't patch
+};
+
+struct portable_bin_oarchive::String_Sink
+    : public portable_bin_oarchive::Sink {
+
+    String_Sink(std::string * output)
+        : output(output), start(output->size())
+    {
+    }
+
+    virtual void write(const char * data, size_t size)
+    {
+        output->append(data, size);
+    }
+
+    virtual void patch(size_t offset, const char * data, size_t size)
+    {
+        std::copy(data, data + size, output->begin() + start + offset);
+    }
+
+    virtual bool can_patch() const
+    {
+        return true;
+    }
+
+    std::string * output;
+    size_t start;
+};
+
+/** Writes into another archive as a string: a compact size, which is
+    filled in at the end, and then the bytes.  The size always takes the
+    full nine bytes so that it doesn't need to know in advance how big it
+    will be.
+*/
+struct portable_bin_oarchive::Parent_Sink
+    : public portable_bin_oarchive::Sink {
+
+    enum { SIZE_LENGTH = 9 };
+
+    Parent_Sink(portable_bin_oarchive & parent)
+        : parent(parent), start(parent.offset()), written(0)
+    {
+        if (!parent.sink)
+            throw Exception("Nesting in unopened portable_bin_oarchive");
+
+        // Otherwise, we'd find out that the size can't be filled in only
+        // once it's too late
+        if (!parent.sink->can_patch())
+            throw Exception("portable_bin_oarchive: can't nest in place in "
+                            "an output that can't be patched");
+
+        char size[SIZE_LENGTH] = { 0 };
+        parent.save_binary(size, SIZE_LENGTH);
+        parent.set_nested(true);
+    }
+
+    ~Parent_Sink()
+    {
+        // If close() wasn't reached, the parent can at least be used again
+        parent.set_nested(false);
+    }
+
+    virtual void write(const char * data, size_t size)
+    {
+        parent.write_nested(data, size);
+        written += size;
+    }
+
+    virtual void patch(size_t offset, const char * data, size_t size)
+    {
+        parent.patch(start + SIZE_LENGTH + offset, data, size);
+    }
+
+    virtual bool can_patch() const
+    {
+        return parent.sink && parent.sink->can_patch();
+    }
+
+    virtual void close()
+    {
+        // A first byte of all ones, then the size in eight bytes
+        char size[SIZE_LENGTH];
+        size[0] = (char)0xff;
+        for (unsigned i = 1;  i < SIZE_LENGTH;  ++i)
+            size[i] = written >> (8 * (SIZE_LENGTH - 1 - i));
+        parent.patch(start, size, SIZE_LENGTH);
+        parent.set_nested(false);
+    }
+
+    portable_bin_oarchive & parent;
+    size_t start;       ///< Offset of the size in the parent
+    uint64_t written;
+};
+
 portable_bin_oarchive::portable_bin_oarchive()
-    : stream(0), offset_(0)
+    : pos_(0), end_(0), offset_(0), capacity_(0), nested_(false)
 {
 }
 
 portable_bin_oarchive::portable_bin_oarchive(const std::string & filename)
-    : stream(new filter_ostream(filename)), owned_stream(stream),
-      offset_(0)
+    : pos_(0), end_(0), offset_(0), capacity_(0), nested_(false)
 {
+    open(filename);
 }
 
 portable_bin_oarchive::portable_bin_oarchive(std::ostream & stream)
-    : stream(&stream), offset_(0)
+    : pos_(0), end_(0), offset_(0), capacity_(0), nested_(false)
 {
+    open(stream);
+}
+
+portable_bin_oarchive::portable_bin_oarchive(int fd)
+    : pos_(0), end_(0), offset_(0), capacity_(0), nested_(false)
+{
+    open(fd);
+}
+
+portable_bin_oarchive::portable_bin_oarchive(std::string * output)
+    : pos_(0), end_(0), offset_(0), capacity_(0), nested_(false)
+{
+    open(output);
+}
+
+portable_bin_oarchive::~portable_bin_oarchive()
+{
+    // Nothing can be thrown from here; call close() to find out about
+    // errors writing the end of the archive
+    try {
+        close();
+    } catch (...) {
+    }
 }
 
 void portable_bin_oarchive::open(const std::string & filename)
 {
-    stream = new filter_ostream(filename.c_str());
-    owned_stream.reset(stream);
-    offset_ = 0;
+    open_sink(new Stream_Sink(new filter_ostream(filename.c_str())));
 }
 
 void portable_bin_oarchive::open(std::ostream & stream)
 {
-    this->stream = &stream;
-    owned_stream.reset();
+    open_sink(new Stream_Sink(stream));
+}
+
+void portable_bin_oarchive::open(int fd)
+{
+    open_sink(new Fd_Sink(fd));
+}
+
+void portable_bin_oarchive::open(std::string * output)
+{
+    open_sink(new String_Sink(output));
+}
+
+void portable_bin_oarchive::open(portable_bin_oarchive & parent)
+{
+    if (&parent == this)
+        throw Exception("portable_bin_oarchive can't be nested in itself");
+    open_sink(new Parent_Sink(parent));
+}
+
+void
+portable_bin_oarchive::
+open_sink(Sink * newSink)
+{
+    std::shared_ptr<Sink> holder(newSink);
+    if (nested_)
+        throw Exception("portable_bin_oarchive: can't open an archive while "
+                        "a nested archive is open in it");
+    close();
+    sink = holder;
+    buffer_.reset();
+    capacity_ = 0;
+    pos_ = end_ = 0;
     offset_ = 0;
 }
 
+void
+portable_bin_oarchive::
+flush()
+{
+    if (sink) flush_buffer();
+}
+
+void
+portable_bin_oarchive::
+close()
+{
+    if (!sink) return;
+
+    // Stop writing even if the flush fails
+    std::shared_ptr<Sink> oldSink = sink;
+    size_t oldOffset = offset();
+    char * oldPos = pos_;
+    char * oldStart = buffer_.get();
+
+    sink.reset();
+    pos_ = end_ = 0;
+    capacity_ = 0;
+    offset_ = oldOffset;
+
+    std::unique_ptr<char[]> oldBuffer(std::move(buffer_));
+    oldSink->write(oldStart, oldPos - oldStart);
+    oldSink->close();
+}
+
+void
+portable_bin_oarchive::
+flush_buffer()
+{
+    size_t size = pos_ - buffer_.get();
+    if (!size) return;
+    pos_ = buffer_.get();
+    if (nested_) end_ = pos_;
+    offset_ += size;
+    sink->write(buffer_.get(), size);
+}
+
+void
+portable_bin_oarchive::
+patch(size_t offset, const void * data, size_t size)
+{
+    if (!sink)
+        throw Exception("Patching unopened portable_bin_oarchive");
+    if (offset + size > this->offset())
+        throw Exception("portable_bin_oarchive: patching past the end");
+
+    const char * p = (const char *)data;
+
+    // The part that's already gone to the sink
+    if (offset < offset_) {
+        size_t n = std::min(size, offset_ - offset);
+        sink->patch(offset, p, n);
+        offset += n;
+        p += n;
+        size -= n;
+    }
+
+    // The part that's still in the buffer
+    memcpy(buffer_.get() + (offset - offset_), p, size);
+}
+
+void
+portable_bin_oarchive::
+save_binary_slow(const void * address, size_t size)
+{
+    if (!sink)
+        throw Exception("Writing to unopened portable_bin_oarchive");
+    if (nested_)
+        throw Exception("portable_bin_oarchive: can't write to an archive "
+                        "while a nested archive is open in it");
+
+    write_buffered((const char *)address, size);
+}
+
+bool
+portable_bin_oarchive::
+grow_buffer(size_t size)
+{
+    size_t used = pos_ - buffer_.get();
+    if (used + size <= capacity_) return true;
+    if (capacity_ >= BUFFER_SIZE) return false;
+
+    size_t newCapacity = std::max<size_t>(MIN_BUFFER_SIZE, capacity_ * 2);
+    newCapacity = std::max(newCapacity, used + size);
+    newCapacity = std::min<size_t>(newCapacity, BUFFER_SIZE);
+
+    std::unique_ptr<char[]> newBuffer(new char[newCapacity]);
+    if (used) memcpy(newBuffer.get(), buffer_.get(), used);
+    buffer_ = std::move(newBuffer);
+    capacity_ = newCapacity;
+    pos_ = buffer_.get() + used;
+    end_ = nested_ ? pos_ : buffer_.get() + capacity_;
+
+    return used + size <= capacity_;
+}
+
+void
+portable_bin_oarchive::
+write_buffered(const char * data, size_t size)
+{
+    if (size < BUFFER_SIZE && grow_buffer(size)) {
+        memcpy(pos_, data, size);
+        pos_ += size;
+        return;
+    }
+
+    flush_buffer();
+
+    // Big writes go straight through
+    if (size >= BUFFER_SIZE) {
+        offset_ += size;
+        sink->write(data, size);
+        return;
+    }
+
+    // The buffer is full size, as growing it didn't make room
+    memcpy(pos_, data, size);
+    pos_ += size;
+}
+
+void
+portable_bin_oarchive::
+set_nested(bool nested)
+{
+    nested_ = nested;
+    if (!buffer_) return;
+    end_ = nested ? pos_ : buffer_.get() + capacity_;
+}
+
+void
+portable_bin_oarchive::
+write_nested(const char * data, size_t size)
+{
+    if (!sink)
+        throw Exception("Writing to unopened portable_bin_oarchive");
+
+    write_buffered(data, size);
+    end_ = pos_;
+}
+
 void
 portable_bin_oarchive::
 save(const Nested_Writer & writer)
@@ -26,10 +26,12 @@
 
 #include <algorithm>
 #include "jml/arch/exception.h"
+#include "jml/compiler/compiler.h"
 #include "serialization_order.h"
 #include "jml/utils/floating_point.h"
 #include "compact_size_types.h"
 #include <boost/shared_ptr.hpp>
+#include <memory>
 #include <boost/type_traits.hpp>
 #include <boost/utility.hpp>
 #include <vector>
@@ -56,14 +58,48 @@ class Nested_Writer;
 /* PORTABLE_BIN_OARCHIVE                                                     */
 /*****************************************************************************/
 
+/** Writes go into a buffer within the archive, which is only passed on to
+    where the archive is going (a stream, a file descriptor or a string)
+    when it's full, on flush() and on close().  The buffer is allocated on
+    the first write, small at first.  So the bytes written don't
+    show up there until then; the destructor closes the archive.
+
+    Errors writing to the output are thrown by whichever call passes the
+    buffer on.  What's been written since the buffer was last full is only
+    passed on by flush() or close(), so errors writing it are only reported
+    if one of them is called: the destructor can't throw.
+*/
+
 class portable_bin_oarchive : boost::noncopyable {
 public:
     portable_bin_oarchive();
     portable_bin_oarchive(const std::string & filename);
     portable_bin_oarchive(std::ostream & stream);
+    /** Write to the file descriptor directly, with no stream in between.
+        It's not closed by the archive. */
+    explicit portable_bin_oarchive(int fd);
+    /** Append to the given string. */
+    explicit portable_bin_oarchive(std::string * output);
+
+    ~portable_bin_oarchive();
 
     void open(const std::string & filename);
     void open(std::ostream & stream);
+    void open(int fd);
+    void open(std::string * output);
+
+    /** Write into the parent archive, in place of a string holding what's
+        written to this one.  The string's size is filled in when this is
+        closed (see patch()); until then, writing to the parent or opening
+        it again throws.  Throws if the parent's output can't seek. */
+    void open(portable_bin_oarchive & parent);
+
+    /** Pass everything that's been written on to where it's going. */
+    void flush();
+
+    /** Flush, and stop writing there.  Unlike the destructor, errors are
+        thrown. */
+    void close();
 
     void save(unsigned char x)
     {
@@ -114,32 +150,24 @@ public:
     
     void save(unsigned long x)
     {
-        if (!stream)
-            throw Exception("Writing to unopened portable_bin_oarchive");
         compact_size_t sz(x);
         sz.serialize(*this);
     }
 
     void save(signed long x)
     {
-        if (!stream)
-            throw Exception("Writing to unopened portable_bin_oarchive");
         compact_int_t sz(x);
         sz.serialize(*this);
     }
 
     void save(unsigned long long x)
     {
-        if (!stream)
-            throw Exception("Writing to unopened portable_bin_oarchive");
         compact_size_t sz(x);
         sz.serialize(*this);
     }
 
     void save(signed long long x)
     {
-        if (!stream)
-            throw Exception("Writing to unopened portable_bin_oarchive");
         compact_int_t sz(x);
         sz.serialize(*this);
     }
@@ -173,8 +201,6 @@ public:
 
     void save(const std::string & str)
     {
-        if (!stream)
-            throw Exception("Writing to unopened portable_bin_oarchive");
         compact_size_t size(str.length());
         size.serialize(*this);
         save_binary(&str[0], size);
@@ -182,8 +208,6 @@ public:
 
     void save(const char * str)
     {
-        if (!stream)
-            throw Exception("Writing to unopened portable_bin_oarchive");
         compact_size_t size(strlen(str));
         size.serialize(*this);
         save_binary(str, size);
@@ -194,8 +218,7 @@ public:
     {
         compact_size_t size(vec.size());
         size.serialize(*this);
-        for (unsigned i = 0;  i < vec.size();  ++i)
-            *this << vec[i];
+        save_elements(vec, Serialized_As_Bytes<T>());
     }
 
     template<class K, class V, class L, class A>
@@ -243,10 +266,8 @@ public:
             dim.serialize(*this);
         }
 
-        size_t ne = arr.num_elements();
-        const T * el = arr.data();
-        for (unsigned i = 0;  i < ne;  ++i, ++el)
-            *this << *el;
+        save_elements(arr.data(), arr.num_elements(),
+                      Serialized_As_Bytes<T>());
     }
 
     template<typename T1, typename T2>
@@ -260,12 +281,11 @@ public:
 
     void save_binary(const void * address, size_t size)
     {
-        if (!stream)
-            throw Exception("Writing to unopened portable_bin_oarchive");
-        stream->write((char *)address, size);
-        offset_ += size;
-        if (!stream)
-            throw Exception("Error writing to stream");
+        if (JML_LIKELY(size <= size_t(end_ - pos_))) {
+            memcpy(pos_, address, size);
+            pos_ += size;
+        }
+        else save_binary_slow(address, size);
     }
 
     /** Warning: doesn't do byte order conversions or anything like that. */
@@ -291,12 +311,78 @@ public:
     }
 #endif
 
-    size_t offset() const { return offset_; }
+    size_t offset() const { return offset_ + (pos_ - buffer_.get()); }
+
+    /** Overwrite bytes that have already been written at the given offset.
+        That can always be done while they're still in the buffer.  After
+        that, the output needs to be a string, a file descriptor that can
+        seek or a stream that can seek; it throws otherwise.
+    */
+    void patch(size_t offset, const void * data, size_t size);
 
 private:
-    std::ostream * stream;
-    std::shared_ptr<std::ostream> owned_stream;
-    size_t offset_;
+    /** Elements that are serialized as their bytes go in one block. */
+    template<class T, class A>
+    void save_elements(const std::vector<T, A> & vec, std::true_type)
+    {
+        save_elements(vec.data(), vec.size(), std::true_type());
+    }
+
+    template<class T, class A>
+    void save_elements(const std::vector<T, A> & vec, std::false_type)
+    {
+        for (size_t i = 0;  i < vec.size();  ++i)
+            *this << vec[i];
+    }
+
+    template<typename T>
+    void save_elements(const T * el, size_t n, std::true_type)
+    {
+        save_binary(el, n * sizeof(T));
+    }
+
+    template<typename T>
+    void save_elements(const T * el, size_t n, std::false_type)
+    {
+        for (size_t i = 0;  i < n;  ++i, ++el)
+            *this << *el;
+    }
+
+    /** Make room for the write by flushing the buffer. */
+    void save_binary_slow(const void * address, size_t size);
+
+    /** Write out the buffer and make it empty again. */
+    void flush_buffer();
+
+    /** Grow the buffer, if it's not yet full size, until there is room for
+        size more bytes.  Returns whether there's room. */
+    bool grow_buffer(size_t size);
+
+    /** Put the bytes in the buffer, making room for them if needed. */
+    void write_buffered(const char * data, size_t size);
+
+    struct Sink;
+    struct Stream_Sink;
+    struct Fd_Sink;
+    struct String_Sink;
+    struct Parent_Sink;
+
+    /** Start writing to the sink with an empty buffer. */
+    void open_sink(Sink * sink);
+
+    /** While a nested archive is open in this one, end_ is kept at pos_
+        so that every save_binary() goes to save_binary_slow(), which
+        throws.  The nested archive writes with write_nested() instead. */
+    void set_nested(bool nested);
+    void write_nested(const char * data, size_t size);
+
+    std::shared_ptr<Sink> sink;
+    std::unique_ptr<char[]> buffer_;
+    char * pos_;          ///< Where the next write goes in the buffer
+    char * end_;          ///< End of the buffer
+    size_t offset_;       ///< Offset of the buffer from the archive start
+    size_t capacity_;     ///< Size of the buffer; 0 until the first write
+    bool nested_;         ///< Is a nested archive open in this one?
 };
 
 
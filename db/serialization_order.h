@@ -26,6 +26,7 @@
 #define __db__serialization_order_h__
 
 #include <stdint.h>
+#include <type_traits>
 #include "jml/compiler/compiler.h"
 
 namespace ML {
@@ -113,6 +114,36 @@ JML_ALWAYS_INLINE int64_t serialization_order(int64_t val)
     return val;
 }
 
+/** Is a T serialized as exactly its bytes in serialization order?  If
+    so, an array of them can be written and read as a single block of
+    bytes rather than one at a time.  As serialization_order() above
+    doesn't swap anything, that's the same as their bytes in memory; if
+    that changes, the block writes and reads will need to swap them too.
+
+    Not for long types, which are serialized as compact sizes, or for bool,
+    which needs to be checked when it's read.
+*/
+template<typename T>
+struct Serialized_As_Bytes : public std::false_type {
+};
+
+#define JML_SERIALIZED_AS_BYTES(type) \
+template<> \
+struct Serialized_As_Bytes<type> : public std::true_type { \
+}
+
+JML_SERIALIZED_AS_BYTES(char);
+JML_SERIALIZED_AS_BYTES(signed char);
+JML_SERIALIZED_AS_BYTES(unsigned char);
+JML_SERIALIZED_AS_BYTES(short);
+JML_SERIALIZED_AS_BYTES(unsigned short);
+JML_SERIALIZED_AS_BYTES(int);
+JML_SERIALIZED_AS_BYTES(unsigned int);
+JML_SERIALIZED_AS_BYTES(float);
+JML_SERIALIZED_AS_BYTES(double);
+
+#undef JML_SERIALIZED_AS_BYTES
+
 } // namespace DB
 } // namespace ML
 
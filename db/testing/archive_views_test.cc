@@ -0,0 +1,177 @@
+/* archive_views_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Tests for views that are reconstituted in place.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <sstream>
+
+#include "jml/db/archive_views.h"
+#include "jml/utils/file_functions.h"
+#include "jml/utils/guard.h"
+
+using namespace ML;
+using namespace ML::DB;
+using namespace std;
+
+bool points_into(const void * p, const File_Read_Buffer & buf)
+{
+    return p >= (const void *)buf.start() && p < (const void *)buf.end();
+}
+
+BOOST_AUTO_TEST_CASE( test_string_view )
+{
+    string filename = "archive_views_test_strings";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+
+    string big(100000, 'x');
+    {
+        // Written as plain strings
+        Store_Writer writer(filename);
+        writer << string("hello") << big << string();
+    }
+
+    File_Read_Buffer buf(filename);
+
+    String_View hello, view, empty;
+    {
+        Store_Reader reader(buf);
+        reader >> hello >> view >> empty;
+    }
+
+    // Points into the mapping, and keeps it alive after the reader's gone
+    BOOST_CHECK(points_into(view.data(), buf));
+    BOOST_CHECK(view.owner());
+    BOOST_CHECK_EQUAL(hello.toString(), "hello");
+    BOOST_CHECK(view.toString() == big);
+    BOOST_CHECK(empty.empty());
+
+    buf.close();
+    BOOST_CHECK(view.toString() == big);
+
+    // From a stream, it's a copy
+    string contents;
+    {
+        File_Read_Buffer buf2(filename);
+        contents.assign(buf2.start(), buf2.end());
+    }
+    istringstream stream(contents);
+    Store_Reader streamReader(stream);
+    String_View copied;
+    streamReader >> copied;
+    BOOST_CHECK_EQUAL(copied.toString(), "hello");
+    BOOST_CHECK(copied.owner());
+
+    // From memory, it points into it with nothing to keep it alive
+    Store_Reader memReader(contents.data(), contents.size());
+    String_View inMemory;
+    memReader >> inMemory;
+    BOOST_CHECK(inMemory.data() == contents.data() + 1);
+    BOOST_CHECK(!inMemory.owner());
+
+    // And it can be written back out as a string
+    string str;
+    {
+        Store_Writer writer(&str);
+        writer << view;
+    }
+    Store_Reader strReader(str.data(), str.size());
+    string s;
+    strReader >> s;
+    BOOST_CHECK(s == big);
+
+    Store_Reader truncated(contents.data(), 10);
+    truncated >> hello;
+    BOOST_CHECK_THROW(truncated >> view, std::exception);
+}
+
+template<typename View>
+void check_view(const View & view, const vector<float> & expected)
+{
+    BOOST_CHECK_EQUAL((uintptr_t)view.data() % alignof(float), 0);
+    BOOST_CHECK_EQUAL(view.size(), expected.size());
+    BOOST_CHECK(view.toVector() == expected);
+}
+
+BOOST_AUTO_TEST_CASE( test_array_view )
+{
+    string filename = "archive_views_test_arrays";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+
+    vector<float> floats(12345);
+    for (unsigned i = 0;  i < floats.size();  ++i)
+        floats[i] = i * 0.25;
+    vector<double> doubles(1000, 3.5);
+
+    {
+        // Odd length strings in between, so that they need padding
+        Store_Writer writer(filename);
+        writer << string("a") << Array_View<float>(floats)
+               << string("bcd") << Array_View<double, 64>(doubles)
+               << string("e") << Array_View<float>()
+               << string("END");
+    }
+
+    {
+        File_Read_Buffer buf(filename);
+        Store_Reader reader(buf);
+        string s;
+        Array_View<float> view, empty;
+        Array_View<double, 64> view64;
+        reader >> s >> view >> s >> view64 >> s >> empty >> s;
+        BOOST_CHECK_EQUAL(s, "END");
+
+        check_view(view, floats);
+        BOOST_CHECK(points_into(view.data(), buf));
+        BOOST_CHECK(points_into(view64.data(), buf));
+        BOOST_CHECK_EQUAL((uintptr_t)view64.data() % 64, 0);
+        BOOST_CHECK(view64.toVector() == doubles);
+        BOOST_CHECK(empty.empty());
+    }
+
+    string contents;
+    {
+        File_Read_Buffer buf(filename);
+        contents.assign(buf.start(), buf.end());
+    }
+
+    // From a stream they're copied, but still aligned
+    {
+        istringstream stream(contents);
+        Store_Reader reader(stream);
+        string s;
+        Array_View<float> view;
+        Array_View<double, 64> view64;
+        reader >> s >> view >> s >> view64;
+        check_view(view, floats);
+        BOOST_CHECK_EQUAL((uintptr_t)view64.data() % 64, 0);
+        BOOST_CHECK(view64.toVector() == doubles);
+    }
+
+    // From memory that's misaligned, they're copied too
+    {
+        vector<double> mem(contents.size() / sizeof(double) + 2);
+        char * start = (char *)mem.data() + 1;
+        std::copy(contents.begin(), contents.end(), start);
+        Store_Reader reader(start, contents.size());
+        string s;
+        Array_View<float> view;
+        Array_View<double> view8;   // written with 64
+        reader >> s >> view >> s >> view8;
+        check_view(view, floats);
+        BOOST_CHECK(view.owner());
+        BOOST_CHECK(view8.toVector() == doubles);
+    }
+
+    // Too short
+    Store_Reader truncated(contents.data(), 1000);
+    string s;
+    Array_View<float> view;
+    truncated >> s;
+    BOOST_CHECK_THROW(truncated >> view, std::exception);
+}
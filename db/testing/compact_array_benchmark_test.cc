@@ -0,0 +1,107 @@
+/* compact_array_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Decoding speed of a sorted list of ids as compact sizes one at a time,
+   against compact arrays decoded four at a time.  The number of millions
+   of ids comes from COMPACT_ARRAY_BENCHMARK_M.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+
+#include "jml/db/compact_size_types.h"
+#include "jml/utils/environment.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace ML::DB;
+using namespace std;
+
+enum { REPEATS = 10 };
+
+void report(const string & what, size_t values, size_t bytes,
+            double elapsed)
+{
+    cerr << format("  %-32s %8.1f M values/s  %5.2f bytes/value",
+                   what.c_str(), values * REPEATS / elapsed / 1e6,
+                   1.0 * bytes / values)
+         << endl;
+}
+
+/** What we do now: a compact size for each value, or its delta. */
+void run_per_value(const vector<uint32_t> & ids, bool delta)
+{
+    vector<char> buf(ids.size() * 9);
+    char * p = buf.data();
+    uint32_t previous = 0;
+    for (uint32_t id: ids) {
+        encode_compact(p, buf.data() + buf.size(),
+                       delta ? id - previous : id);
+        previous = id;
+    }
+    size_t bytes = p - buf.data();
+
+    vector<uint32_t> decoded(ids.size());
+    Timer timer;
+    for (unsigned r = 0;  r < REPEATS;  ++r) {
+        const char * p = buf.data();
+        const char * e = p + bytes;
+        uint32_t previous = 0;
+        for (size_t i = 0;  i < ids.size();  ++i) {
+            uint32_t val = decode_compact(p, e);
+            decoded[i] = previous = (delta ? previous + val : val);
+        }
+    }
+    report(delta ? "decode_compact of deltas" : "decode_compact",
+           ids.size(), bytes, timer.elapsed_wall());
+    BOOST_CHECK(decoded == ids);
+}
+
+void run_array(const vector<uint32_t> & ids,
+               Compact_Array_Transform transform, bool simd)
+{
+    vector<char> buf(compact_array_max_length(ids.size()));
+    size_t bytes = encode_compact_array(ids.data(), ids.size(), buf.data(),
+                                        transform);
+
+    vector<uint32_t> decoded(ids.size());
+    Timer timer;
+    for (unsigned r = 0;  r < REPEATS;  ++r)
+        decode_compact_array(buf.data(), buf.data() + bytes,
+                             decoded.data(), ids.size(), transform, simd);
+    report(format("array %s %s",
+                  transform == COMPACT_DELTA ? "delta" : "plain",
+                  simd ? "simd" : "scalar"),
+           ids.size(), bytes, timer.elapsed_wall());
+    BOOST_CHECK(decoded == ids);
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_compact_arrays )
+{
+    Env_Option<size_t> millions("COMPACT_ARRAY_BENCHMARK_M", 10);
+
+    // Sorted ids with gaps of up to 600, so the deltas are one or two
+    // bytes and the ids themselves three or four
+    vector<uint32_t> ids(millions * 1000000);
+    uint32_t id = 1000, seed = 17;
+    for (size_t i = 0;  i < ids.size();  ++i) {
+        seed = seed * 1103515245 + 12345;
+        id += (seed >> 8) % 600;
+        ids[i] = id;
+    }
+
+    cerr << "decoding " << ids.size() << " sorted ids " << REPEATS
+         << " times" << endl;
+
+    run_per_value(ids, false);
+    run_per_value(ids, true);
+
+    for (bool simd: { false, true }) {
+        run_array(ids, COMPACT_PLAIN, simd);
+        run_array(ids, COMPACT_DELTA, simd);
+    }
+}
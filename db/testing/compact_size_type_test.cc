@@ -138,3 +138,130 @@ BOOST_AUTO_TEST_CASE( test2 )
     test_compact_int_type(0xffffffffffffffffULL);
 }
 
+
+// Writing straight to a stream reports errors, even though the archive
+// underneath only writes to it once it's closed
+BOOST_AUTO_TEST_CASE( test_serialize_to_bad_stream )
+{
+    ostringstream stream;
+    stream.setstate(ios::badbit);
+    BOOST_CHECK_THROW(compact_size_t(12345).serialize(stream),
+                      std::exception);
+    BOOST_CHECK_THROW(compact_int_t(-12345).serialize(stream),
+                      std::exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_compact_array_layout )
+{
+    uint32_t values[5] = { 1, 256, 65536, 1 << 24, 7 };
+    char buf[32];
+    size_t length = encode_compact_array(values, 5, buf);
+
+    // Two control bytes, then the values' bytes, little endian
+    string expected("\xe4\x00"
+                    "\x01" "\x00\x01" "\x00\x00\x01" "\x00\x00\x00\x01"
+                    "\x07", 13);
+    BOOST_CHECK_EQUAL(length, expected.size());
+    BOOST_CHECK(string(buf, length) == expected);
+}
+
+void test_compact_array(const vector<uint32_t> & values)
+{
+    for (auto transform: { COMPACT_PLAIN, COMPACT_DELTA, COMPACT_ZIGZAG,
+                           COMPACT_DELTA_ZIGZAG }) {
+        BOOST_TEST_CHECKPOINT(values.size() << " values with transform "
+                              << transform);
+
+        vector<char> buf(compact_array_max_length(values.size()));
+        size_t length = encode_compact_array(values.data(), values.size(),
+                                             buf.data(), transform);
+        BOOST_REQUIRE_LE(length, buf.size());
+
+        // Exactly the right size, so that the end is done without loads
+        // that run over
+        string encoded(buf.data(), length);
+
+        for (bool simd: { false, true }) {
+            vector<uint32_t> decoded(values.size() + 1, 12345);
+            size_t used
+                = decode_compact_array(encoded.data(),
+                                       encoded.data() + encoded.size(),
+                                       decoded.data(), values.size(),
+                                       transform, simd);
+            BOOST_CHECK_EQUAL(used, length);
+            BOOST_CHECK_EQUAL(decoded.back(), 12345);
+            decoded.pop_back();
+            BOOST_CHECK(decoded == values);
+
+            if (length > 0) {
+                vector<uint32_t> out(values.size());
+                BOOST_CHECK_THROW(decode_compact_array
+                                      (encoded.data(),
+                                       encoded.data() + length - 1,
+                                       out.data(), values.size(),
+                                       transform, simd),
+                                  std::exception);
+            }
+        }
+
+        compact_array_t array(values, transform);
+        string serialized;
+        {
+            Store_Writer writer(&serialized);
+            writer << array << string("END");
+        }
+        istringstream stream(serialized);
+        Store_Reader reader(stream);
+        compact_array_t array2;
+        string s;
+        reader >> array2 >> s;
+        BOOST_CHECK(array2.values == values);
+        BOOST_CHECK_EQUAL(array2.transform, transform);
+        BOOST_CHECK_EQUAL(s, "END");
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_compact_arrays )
+{
+    // Serialized arrays that are cut short or have a transform that
+    // doesn't exist aren't accepted
+    {
+        vector<uint32_t> values(100, 300);
+        string str = serializeToString(compact_array_t(values,
+                                                       COMPACT_DELTA));
+        compact_array_t array;
+        DB::Store_Reader reader(str.data(), str.size());
+        array.reconstitute(reader);
+        BOOST_CHECK(array.values == values);
+        BOOST_CHECK_EQUAL(array.transform, COMPACT_DELTA);
+
+        DB::Store_Reader truncated(str.data(), str.size() - 1);
+        BOOST_CHECK_THROW(array.reconstitute(truncated), std::exception);
+
+        // The transform comes just after the one byte count
+        string badTransform = str;
+        badTransform[1] = 0x7f;
+        DB::Store_Reader badReader(badTransform.data(), badTransform.size());
+        BOOST_CHECK_THROW(array.reconstitute(badReader), std::exception);
+    }
+
+    for (size_t n: { 0, 1, 2, 3, 4, 5, 7, 8, 9, 31, 100, 1001, 100000 }) {
+        vector<uint32_t> sorted(n), random(n), small(n), all(n);
+        uint32_t id = 1000;
+        uint32_t seed = 17;
+        for (size_t i = 0;  i < n;  ++i) {
+            seed = seed * 1103515245 + 12345;
+            id += seed % 300;
+            sorted[i] = id;
+            random[i] = seed;
+            small[i] = seed % 3;
+            // Every length, and the extremes
+            all[i] = (i % 5 == 4 ? 0xffffffff : 0xffu << (8 * (i % 5)));
+        }
+
+        test_compact_array(sorted);
+        test_compact_array(random);
+        test_compact_array(small);
+        test_compact_array(all);
+    }
+}
@@ -1,2 +1,5 @@
 $(eval $(call test,compact_size_type_test,utils arch db,boost))
 $(eval $(call test,serialize_reconstitute_test,utils arch db,boost))
+$(eval $(call test,serialize_benchmark_test,utils arch db,boost manual))
+$(eval $(call test,archive_views_test,utils arch db,boost))
+$(eval $(call test,compact_array_benchmark_test,utils arch db,boost manual))
@@ -0,0 +1,174 @@
+/* serialize_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Throughput of portable_bin_oarchive writing to each kind of sink, for a
+   big vector of floats (like a model) and for small mixed records, and of
+   reading the floats back.  The number of MB of floats comes from
+   SERIALIZE_BENCHMARK_MB.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "jml/db/persistent.h"
+#include "jml/utils/file_functions.h"
+#include "jml/utils/filter_streams.h"
+#include "jml/utils/environment.h"
+#include "jml/utils/guard.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace ML::DB;
+using namespace std;
+
+void report(const string & what, size_t bytes, double elapsed)
+{
+    cerr << format("  %-36s %8.1f MB/s", what.c_str(),
+                   bytes / elapsed / 1e6)
+         << endl;
+}
+
+/** Writes the archive with the given function, to each of the sinks. */
+template<typename Write>
+void run_sinks(const string & name, const Write & write)
+{
+    string filename = "serialize_benchmark_test.out";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+
+    {
+        ostringstream stream;
+        Timer timer;
+        Store_Writer writer(stream);
+        write(writer);
+        writer.close();
+        report(name + " ostringstream", writer.offset(),
+               timer.elapsed_wall());
+    }
+
+    {
+        string output;
+        Timer timer;
+        Store_Writer writer(&output);
+        write(writer);
+        writer.close();
+        report(name + " string", writer.offset(), timer.elapsed_wall());
+    }
+
+    {
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1)
+            throw Exception(errno, "open");
+        Timer timer;
+        Store_Writer writer(fd);
+        write(writer);
+        writer.close();
+        report(name + " fd", writer.offset(), timer.elapsed_wall());
+        close(fd);
+    }
+
+    {
+        Timer timer;
+        Store_Writer writer(filename);
+        write(writer);
+        writer.close();
+        report(name + " file", writer.offset(), timer.elapsed_wall());
+    }
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_serialize )
+{
+    Env_Option<size_t> mb("SERIALIZE_BENCHMARK_MB", 64);
+
+    vector<float> floats(mb * 1000000 / sizeof(float));
+    for (unsigned i = 0;  i < floats.size();  ++i)
+        floats[i] = i * 0.001f;
+
+    cerr << "writing " << floats.size() << " floats" << endl;
+
+    // What every value used to cost: a write to the ostream for each one,
+    // checking the stream as it goes
+    {
+        ostringstream stream;
+        Timer timer;
+        for (float f: floats) {
+            uint32_t val = serialization_order(reinterpret_as_int(f));
+            if (!stream) throw Exception("bad stream");
+            stream.write((const char *)&val, sizeof(val));
+            if (!stream) throw Exception("bad stream");
+        }
+        report("floats ostream::write per value", stream.str().size(),
+               timer.elapsed_wall());
+    }
+
+    run_sinks("floats", [&] (Store_Writer & writer) { writer << floats; });
+
+    size_t numRecords = floats.size() / 8;
+    run_sinks("records", [&] (Store_Writer & writer)
+              {
+                  for (unsigned i = 0;  i < numRecords;  ++i)
+                      writer << i << (unsigned long)(i * 7919)
+                             << string("record", i % 7) << (float)i;
+              });
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_reconstitute )
+{
+    Env_Option<size_t> mb("SERIALIZE_BENCHMARK_MB", 64);
+
+    vector<float> floats(mb * 1000000 / sizeof(float));
+    for (unsigned i = 0;  i < floats.size();  ++i)
+        floats[i] = i * 0.001f;
+
+    string filename = "serialize_benchmark_test.in";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    {
+        Store_Writer writer(filename);
+        writer << floats;
+    }
+    size_t bytes = floats.size() * sizeof(float);
+
+    cerr << "reading " << floats.size() << " floats" << endl;
+
+    // What every value used to cost: a load of each one
+    {
+        Timer timer;
+        Store_Reader reader(filename);
+        compact_size_t sz(reader);
+        vector<float> v;
+        v.reserve(sz);
+        for (unsigned i = 0;  i < sz;  ++i) {
+            float f;
+            reader >> f;
+            v.push_back(f);
+        }
+        report("floats load per value, mapped", bytes, timer.elapsed_wall());
+        BOOST_CHECK(v == floats);
+    }
+
+    {
+        Timer timer;
+        Store_Reader reader(filename);
+        vector<float> v;
+        reader >> v;
+        report("floats mapped", bytes, timer.elapsed_wall());
+        BOOST_CHECK(v == floats);
+    }
+
+    {
+        Timer timer;
+        filter_istream stream(filename);
+        Store_Reader reader(stream);
+        vector<float> v;
+        reader >> v;
+        report("floats istream", bytes, timer.elapsed_wall());
+        BOOST_CHECK(v == floats);
+    }
+}
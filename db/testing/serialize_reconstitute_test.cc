@@ -10,12 +10,16 @@
 
 #include "jml/utils/parse_context.h"
 #include "jml/utils/file_functions.h"
+#include "jml/utils/async_file_reader.h"
 #include "jml/utils/guard.h"
 #include "jml/db/persistent.h"
 #include "jml/db/compact_size_types.h"
+#include "jml/db/nested_archive.h"
 #include <boost/test/unit_test.hpp>
 #include <boost/bind.hpp>
 #include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
 #include <boost/multi_array.hpp>
 #include "jml/stats/distribution.h"
 
@@ -102,17 +106,42 @@ BOOST_AUTO_TEST_CASE( test_char )
     test_serialize_reconstitute('a');
 }
 
-#if 0
 BOOST_AUTO_TEST_CASE( test_multi_array )
 {
-    boost::multi_array<float, 2> A(boost::extents[3][3]);
+    boost::multi_array<float, 2> A(boost::extents[3][5]);
     for (unsigned i = 0;  i < 3;  ++i)
-        for (unsigned j = 0;  j < 3;  ++j)
+        for (unsigned j = 0;  j < 5;  ++j)
             A[i][j] = j * j - i;
 
-    test_serialize_reconstitute(A);
+    string str;
+    {
+        DB::Store_Writer writer(&str);
+        writer << A << std::string("END");
+    }
+
+    // Version, dimensions, sizes then the elements
+    BOOST_CHECK_EQUAL(str.size(), 4 + 15 * 4 + 4);
+
+    DB::Store_Reader reader(str.data(), str.size());
+    boost::multi_array<float, 2> B;
+    string s;
+    reader >> B >> s;
+    BOOST_CHECK(A == B);
+    BOOST_CHECK_EQUAL(s, "END");
+
+    // Elements that aren't written as their bytes still work
+    boost::multi_array<unsigned long, 1> C(boost::extents[300]), D;
+    for (unsigned i = 0;  i < 300;  ++i)
+        C[i] = i * i;
+    str.clear();
+    {
+        DB::Store_Writer writer(&str);
+        writer << C;
+    }
+    DB::Store_Reader reader2(str.data(), str.size());
+    reader2 >> D;
+    BOOST_CHECK(C == D);
 }
-#endif
 
 BOOST_AUTO_TEST_CASE( test_bool )
 {
@@ -141,3 +170,498 @@ BOOST_AUTO_TEST_CASE( test_distribution )
     dist.push_back(2.0);
     test_serialize_reconstitute(dist);
 }
+
+// Reading through small blocks makes the values straddle them, including
+// strings longer than a whole block
+BOOST_AUTO_TEST_CASE( test_async_file_reader )
+{
+    string filename = "serialize_reconstitute_test_async";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+
+    {
+        DB::Store_Writer writer(filename);
+        for (unsigned i = 0;  i < 2000;  ++i)
+            writer << i << string(i * 7 % 10007, 'a' + i % 26)
+                   << vector<float>(i % 13, i);
+        writer << std::string("END");
+    }
+
+    for (auto backend: { Async_File_Reader::IO_URING,
+                         Async_File_Reader::THREAD }) {
+        Async_File_Reader::Options options;
+        options.blockSize = 4096;
+        options.numBlocks = 3;
+        options.backend = backend;
+
+        std::shared_ptr<Async_File_Reader> asyncReader;
+        try {
+            asyncReader.reset(new Async_File_Reader(filename, options));
+        } catch (const std::exception & exc) {
+            // Not every kernel has io_uring
+            BOOST_REQUIRE_EQUAL(backend, Async_File_Reader::IO_URING);
+            cerr << "no io_uring: " << exc.what() << endl;
+            continue;
+        }
+
+        DB::Store_Reader reader(asyncReader);
+        for (unsigned i = 0;  i < 2000;  ++i) {
+            unsigned j;
+            string s;
+            vector<float> v;
+            reader >> j >> s >> v;
+            BOOST_REQUIRE_EQUAL(j, i);
+            BOOST_REQUIRE(s == string(i * 7 % 10007, 'a' + i % 26));
+            BOOST_REQUIRE(v == vector<float>(i % 13, i));
+        }
+
+        string s;
+        reader >> s;
+        BOOST_CHECK_EQUAL(s, "END");
+        BOOST_CHECK_THROW(reader >> s, std::exception);
+    }
+}
+
+void write_test_archive(DB::Store_Writer & writer)
+{
+    for (unsigned i = 0;  i < 2000;  ++i)
+        writer << i << string(i * 7 % 100007, 'a' + i % 26)
+               << vector<float>(i % 13, i) << (double)i / 3;
+    writer << std::string("END");
+}
+
+// All of the sinks write the same bytes, only when flushed
+BOOST_AUTO_TEST_CASE( test_output_sinks )
+{
+    ostringstream stream_out;
+    size_t offset;
+    {
+        DB::Store_Writer writer(stream_out);
+        write_test_archive(writer);
+        offset = writer.offset();
+    }
+    string expected = stream_out.str();
+    BOOST_CHECK_EQUAL(offset, expected.size());
+
+    string str = "prefix";
+    {
+        DB::Store_Writer writer(&str);
+        writer << 1 << 2;
+        BOOST_CHECK_EQUAL(writer.offset(), 8);
+        BOOST_CHECK_EQUAL(str, "prefix");
+        writer.flush();
+        BOOST_CHECK_EQUAL(str.size(), 14);
+        write_test_archive(writer);
+    }
+    BOOST_CHECK(str.substr(14) == expected);
+
+    string filename = "serialize_reconstitute_test_fd";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    BOOST_REQUIRE(fd != -1);
+    {
+        DB::Store_Writer writer(fd);
+        write_test_archive(writer);
+        writer.close();
+        BOOST_CHECK_EQUAL(writer.offset(), expected.size());
+        BOOST_CHECK_THROW(writer << 1, std::exception);
+    }
+    ::close(fd);
+
+    File_Read_Buffer buf(filename);
+    BOOST_CHECK(string(buf.start(), buf.end()) == expected);
+
+    DB::Store_Writer unopened;
+    BOOST_CHECK_THROW(unopened << 1, std::exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_nested_writer )
+{
+    Nested_Writer nested;
+    nested << string("inner") << 42;
+
+    string str;
+    {
+        DB::Store_Writer writer(&str);
+        writer << nested << string("outer");
+    }
+
+    // It's written as a string holding the inner archive
+    DB::Store_Reader reader(str.data(), str.size());
+    string data, s;
+    int i;
+    reader >> data >> s;
+    BOOST_CHECK_EQUAL(s, "outer");
+
+    DB::Store_Reader inner(data.data(), data.size());
+    inner >> s >> i;
+    BOOST_CHECK_EQUAL(s, "inner");
+    BOOST_CHECK_EQUAL(i, 42);
+
+    // Or read in place as a nested archive
+    DB::Store_Reader reader2(str.data(), str.size());
+    {
+        Nested_Reader nestedReader(reader2);
+        BOOST_CHECK(nestedReader.pos() == str.data() + 1);
+        nestedReader >> s >> i;
+        BOOST_CHECK_EQUAL(s, "inner");
+        BOOST_CHECK_EQUAL(i, 42);
+        BOOST_CHECK_THROW(nestedReader >> i, std::exception);
+    }
+    reader2 >> s;
+    BOOST_CHECK_EQUAL(s, "outer");
+}
+
+/** Write an archive with two nested archives in it, the first of the given
+    number of strings, written in place. */
+void write_nested(DB::Store_Writer & writer, unsigned n)
+{
+    writer << string("before");
+    {
+        Nested_Writer nested(writer);
+        for (unsigned i = 0;  i < n;  ++i)
+            nested << string(i % 100, 'a' + i % 26) << i;
+        {
+            // Nested within the nested one
+            Nested_Writer nested2(nested);
+            nested2 << string("deeper");
+        }
+        nested << string("last");
+    }
+    writer << string("between");
+    Nested_Writer nested;
+    nested << string("second");
+    writer << nested << string("after");
+}
+
+void check_nested(DB::Store_Reader & reader, unsigned n, unsigned toRead)
+{
+    string s;
+    unsigned j;
+    reader >> s;
+    BOOST_CHECK_EQUAL(s, "before");
+    {
+        Nested_Reader nested(reader);
+        for (unsigned i = 0;  i < toRead;  ++i) {
+            nested >> s >> j;
+            BOOST_REQUIRE_EQUAL(j, i);
+            BOOST_REQUIRE(s == string(i % 100, 'a' + i % 26));
+        }
+        if (toRead == n) {
+            Nested_Reader nested2(nested);
+            nested2 >> s;
+            BOOST_CHECK_EQUAL(s, "deeper");
+            nested2.finish();
+            nested >> s;
+            BOOST_CHECK_EQUAL(s, "last");
+            BOOST_CHECK_THROW(nested >> s, std::exception);
+        }
+        // The rest is skipped when it's destroyed
+    }
+    reader >> s;
+    BOOST_CHECK_EQUAL(s, "between");
+    Nested_Reader nested(reader);
+    nested.finish();
+    reader >> s;
+    BOOST_CHECK_EQUAL(s, "after");
+}
+
+void check_nested(const string & contents, unsigned n)
+{
+    for (unsigned toRead: { n, n / 2 }) {
+        DB::Store_Reader reader(contents.data(), contents.size());
+        check_nested(reader, n, toRead);
+
+        // A stream isn't read in place
+        istringstream stream(contents);
+        DB::Store_Reader streamReader(stream);
+        check_nested(streamReader, n, toRead);
+    }
+
+    // It's the same as a string holding the nested archive
+    DB::Store_Reader reader(contents.data(), contents.size());
+    string s, data;
+    reader >> s >> data;
+    DB::Store_Reader inner(data.data(), data.size());
+    unsigned j;
+    inner >> s >> j;
+    BOOST_CHECK_EQUAL(j, 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_nested_in_place )
+{
+    // Small enough to be patched in the buffer, and too big for that
+    for (unsigned n: { 10, 20000 }) {
+        BOOST_TEST_CHECKPOINT("string " << n);
+        string str;
+        {
+            DB::Store_Writer writer(&str);
+            write_nested(writer, n);
+        }
+        check_nested(str, n);
+
+        BOOST_TEST_CHECKPOINT("ostringstream " << n);
+        ostringstream stream;
+        stream << "prefix";
+        {
+            DB::Store_Writer writer(stream);
+            write_nested(writer, n);
+        }
+        BOOST_CHECK(stream.str() == "prefix" + str);
+
+        BOOST_TEST_CHECKPOINT("fd " << n);
+        string filename = "serialize_reconstitute_test_nested";
+        Call_Guard guard(boost::bind(&delete_file, filename));
+        int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        BOOST_REQUIRE(fd != -1);
+        BOOST_REQUIRE_EQUAL(write(fd, "prefix", 6), 6);
+        {
+            DB::Store_Writer writer(fd);
+            write_nested(writer, n);
+        }
+        ::close(fd);
+
+        File_Read_Buffer buf(filename);
+        BOOST_CHECK(string(buf.start(), buf.end()) == "prefix" + str);
+    }
+
+    // A filename is written through a filter_ostream, which can't go back
+    // to fill in the size
+    string filename = "serialize_reconstitute_test_nested_filename";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    DB::Store_Writer writer(filename);
+    BOOST_CHECK_THROW(Nested_Writer nested(writer), std::exception);
+    writer << string("still ok");
+}
+
+/* An fd opened with O_APPEND can seek, but writes to it always go to the
+   end, so the nested archive's size can't be filled in. */
+BOOST_AUTO_TEST_CASE( test_nested_writer_append_fd )
+{
+    string filename = "serialize_reconstitute_test_nested_append";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                  0666);
+    BOOST_REQUIRE(fd != -1);
+    {
+        DB::Store_Writer writer(fd);
+        writer << string("before");
+        BOOST_CHECK_THROW(Nested_Writer nested(writer), std::exception);
+        writer << string("after");
+    }
+    ::close(fd);
+
+    File_Read_Buffer buf(filename);
+    DB::Store_Reader reader(buf.start(), buf.end() - buf.start());
+    string s;
+    reader >> s;
+    BOOST_CHECK_EQUAL(s, "before");
+    reader >> s;
+    BOOST_CHECK_EQUAL(s, "after");
+}
+
+/* Nothing can be written to a parent while an archive is nested in it,
+   as the nested archive's size would be filled in over the wrong bytes. */
+BOOST_AUTO_TEST_CASE( test_nested_writer_locks_parent )
+{
+    string str;
+    {
+        DB::Store_Writer writer(&str);
+        writer << string("before");
+        {
+            Nested_Writer nested(writer);
+            nested << string("inner");
+            BOOST_CHECK_THROW(writer << string("interleaved"),
+                              std::exception);
+            BOOST_CHECK_THROW(Nested_Writer nested2(writer), std::exception);
+            BOOST_CHECK_THROW(writer.open(&str), std::exception);
+            writer.flush();
+            nested << string(100000, 'x');
+        }
+        writer << string("after");
+    }
+
+    DB::Store_Reader reader(str.data(), str.size());
+    string s;
+    reader >> s;
+    BOOST_CHECK_EQUAL(s, "before");
+    {
+        Nested_Reader nested(reader);
+        nested >> s;
+        BOOST_CHECK_EQUAL(s, "inner");
+        nested >> s;
+        BOOST_CHECK_EQUAL(s.size(), 100000);
+    }
+    reader >> s;
+    BOOST_CHECK_EQUAL(s, "after");
+}
+
+/** A stringbuf that records the biggest read that's asked of it. */
+struct Read_Size_Buf : public std::stringbuf {
+    Read_Size_Buf(const string & str)
+        : std::stringbuf(str), biggest(0)
+    {
+    }
+
+    virtual std::streamsize xsgetn(char * s, std::streamsize n)
+    {
+        biggest = std::max(biggest, n);
+        return std::stringbuf::xsgetn(s, n);
+    }
+
+    std::streamsize biggest;
+};
+
+/* Skipping what's left of a nested archive read from a stream doesn't
+   read all of it into the parent's buffer at once. */
+BOOST_AUTO_TEST_CASE( test_nested_reader_skip_stream )
+{
+    string str;
+    {
+        DB::Store_Writer writer(&str);
+        {
+            Nested_Writer nested(writer);
+            nested << string("inner") << string(10000000, 'x');
+        }
+        writer << string("after");
+    }
+
+    Read_Size_Buf buf(str);
+    istream stream(&buf);
+    DB::Store_Reader reader(stream);
+    {
+        Nested_Reader nested(reader);
+        string s;
+        nested >> s;
+        BOOST_CHECK_EQUAL(s, "inner");
+    }
+    BOOST_CHECK_LT(buf.biggest, 1000000);
+
+    string s;
+    reader >> s;
+    BOOST_CHECK_EQUAL(s, "after");
+}
+
+/* Reading a nested archive with >> copies it out of a parent that can't be
+   read in place, so that the parent can carry on straight away and the
+   nested reader can outlive it. */
+BOOST_AUTO_TEST_CASE( test_nested_reader_reconstitute )
+{
+    string str;
+    {
+        DB::Store_Writer writer(&str);
+        write_nested(writer, 1000);
+    }
+
+    for (bool useStream: { false, true }) {
+        BOOST_TEST_CHECKPOINT("stream " << useStream);
+
+        std::unique_ptr<Nested_Reader> nested;
+        {
+            istringstream stream(str);
+            std::unique_ptr<DB::Store_Reader> reader
+                (useStream
+                 ? new DB::Store_Reader(stream)
+                 : new DB::Store_Reader(str.data(), str.size()));
+            string s;
+            *reader >> s;
+            BOOST_CHECK_EQUAL(s, "before");
+            nested.reset(new Nested_Reader());
+            *reader >> *nested >> s;
+            BOOST_CHECK_EQUAL(s, "between");
+        }
+
+        // The parent has gone, but the nested archive is still there
+        string s;
+        unsigned j;
+        *nested >> s >> j;
+        BOOST_CHECK_EQUAL(s, "");
+        BOOST_CHECK_EQUAL(j, 0);
+    }
+}
+
+/** Write the elements one at a time, as vectors used to be written. */
+template<typename T>
+string write_one_by_one(const vector<T> & vec)
+{
+    string result;
+    DB::Store_Writer writer(&result);
+    writer << compact_size_t(vec.size());
+    for (const T & val: vec)
+        writer << val;
+    writer.close();
+    return result;
+}
+
+template<typename T>
+void test_vector(const vector<T> & vec)
+{
+    BOOST_TEST_CHECKPOINT("vector of " << vec.size() << " "
+                          << sizeof(T) << " byte elements");
+
+    string str;
+    {
+        DB::Store_Writer writer(&str);
+        writer << vec << std::string("END");
+    }
+
+    // Exactly the same bytes as before
+    string expected = write_one_by_one(vec);
+    BOOST_CHECK(str.substr(0, expected.size()) == expected);
+
+    auto check = [&] (DB::Store_Reader & reader)
+        {
+            vector<T> v;
+            string s;
+            reader >> v >> s;
+            BOOST_CHECK(v == vec);
+            BOOST_CHECK_EQUAL(s, "END");
+        };
+
+    DB::Store_Reader reader(str.data(), str.size());
+    check(reader);
+
+    // From a stream, so that it's not all available at once
+    istringstream stream(str);
+    DB::Store_Reader streamReader(stream);
+    check(streamReader);
+
+    // Cut off before the end
+    DB::Store_Reader truncated(str.data(), expected.size() - 1);
+    vector<T> v;
+    BOOST_CHECK_THROW(truncated >> v, std::exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_vectors )
+{
+    for (size_t n: { 0, 1, 1000, 100000 }) {
+        vector<float> floats(n);
+        vector<double> doubles(n);
+        vector<int> ints(n);
+        vector<unsigned short> shorts(n);
+        vector<signed char> chars(n);
+        vector<bool> bools(n);
+        vector<unsigned long> longs(n);
+        vector<string> strings(n / 100);
+
+        for (size_t i = 0;  i < n;  ++i) {
+            floats[i] = i * 0.1f;
+            doubles[i] = i / 7.0;
+            ints[i] = i * -12345;
+            shorts[i] = i * 31;
+            chars[i] = i;
+            bools[i] = i % 3;
+            longs[i] = i * i * i;
+        }
+        for (size_t i = 0;  i < strings.size();  ++i)
+            strings[i] = string(i, 'x');
+
+        test_vector(floats);
+        test_vector(doubles);
+        test_vector(ints);
+        test_vector(shorts);
+        test_vector(chars);
+        test_vector(bools);
+        test_vector(longs);
+        test_vector(strings);
+    }
+}
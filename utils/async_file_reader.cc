@@ -0,0 +1,669 @@
+/* async_file_reader.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Sequential reader of a file that keeps several reads in flight.
+*/
+
+#include "async_file_reader.h"
+#include "jml/arch/exception.h"
+#include "jml/arch/format.h"
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#  define JML_HAS_IO_URING 1
+#  include <linux/io_uring.h>
+#else
+#  define JML_HAS_IO_URING 0
+#endif
+
+using namespace std;
+
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* ASYNC FILE READER                                                         */
+/*****************************************************************************/
+
+/** What's common to the backends: the buffers (one per block in flight)
+    and keeping track of which block of the file goes where.  Block seq is
+    always read into slot seq % slots.size(). */
+
+struct Async_File_Reader::Itl {
+
+    enum State {
+        FREE,       ///< Can be read into
+        READING,    ///< Being read into
+        READY,      ///< Read, waiting for next()
+        HELD        ///< Returned by next() and not yet released
+    };
+
+    struct Slot {
+        char * data;
+        size_t size;       ///< Number of bytes read so far
+        size_t wanted;     ///< Number of bytes to read
+        uint64_t offset;   ///< Offset in the file of data
+        int error;         ///< errno of a failed read, or 0
+        State state;
+    };
+
+    Itl(int fd, const Options & options)
+        : fd(dup(fd)), regular(false), startOffset(0), fileSize(0),
+          nextToRead(0), nextToDeliver(0), ended(false)
+    {
+        if (this->fd == -1)
+            throw Exception(errno, "dup", "Async_File_Reader");
+
+        struct stat st;
+        if (fstat(this->fd, &st) == -1) {
+            ::close(this->fd);
+            throw Exception(errno, "fstat", "Async_File_Reader");
+        }
+
+        regular = S_ISREG(st.st_mode);
+        if (regular) {
+            off_t pos = lseek(this->fd, 0, SEEK_CUR);
+            startOffset = (pos == -1 ? 0 : pos);
+            fileSize = st.st_size;
+        }
+
+        size_t page = getpagesize();
+        blockSize = std::max<size_t>((options.blockSize + page - 1)
+                                     / page * page, page);
+
+        slots.resize(std::max(options.numBlocks, 2));
+        for (unsigned i = 0;  i < slots.size();  ++i) {
+            void * mem;
+            if (posix_memalign(&mem, page, blockSize) != 0) {
+                slots.resize(i);
+                freeAll();
+                throw Exception("Async_File_Reader: couldn't allocate buffer");
+            }
+            Slot & slot = slots[i];
+            slot.data = (char *)mem;
+            slot.size = slot.wanted = slot.offset = 0;
+            slot.error = 0;
+            slot.state = FREE;
+        }
+    }
+
+    virtual ~Itl()
+    {
+        freeAll();
+    }
+
+    void freeAll()
+    {
+        for (unsigned i = 0;  i < slots.size();  ++i)
+            free(slots[i].data);
+        slots.clear();
+        if (fd != -1) ::close(fd);
+        fd = -1;
+    }
+
+    virtual Backend backend() const = 0;
+    virtual bool next(Block & block) = 0;
+    virtual void release(int index) = 0;
+
+    bool finished() const
+    {
+        return ended
+            || (regular && startOffset + nextToDeliver * blockSize >= fileSize);
+    }
+
+    /** Is there another block (that we know of) to be read? */
+    bool moreToRead() const
+    {
+        return regular
+            ? startOffset + nextToRead * blockSize < fileSize
+            : true;
+    }
+
+    /** Set up the slot for the next block to be read. */
+    Slot & startBlock()
+    {
+        Slot & slot = slots[nextToRead % slots.size()];
+        slot.offset = startOffset + nextToRead * blockSize;
+        slot.size = 0;
+        slot.wanted = regular
+            ? std::min<uint64_t>(blockSize, fileSize - slot.offset)
+            : blockSize;
+        slot.error = 0;
+        slot.state = READING;
+        ++nextToRead;
+        return slot;
+    }
+
+    /** Hand over a slot that's READY as the next block. */
+    bool deliver(Slot & slot, Block & block)
+    {
+        if (slot.error)
+            throw Exception(slot.error, "read", "Async_File_Reader::next()");
+
+        if (slot.size == 0) {
+            // End of file (sooner than expected for a regular file if it
+            // was truncated)
+            ended = true;
+            slot.state = FREE;
+            return false;
+        }
+
+        slot.state = HELD;
+        block.data = slot.data;
+        block.size = slot.size;
+        block.index = &slot - &slots[0];
+        ++nextToDeliver;
+        return true;
+    }
+
+    void checkNotHeld(const Slot & slot) const
+    {
+        if (slot.state == HELD)
+            throw Exception("Async_File_Reader: all buffers are held; "
+                            "release blocks before asking for more");
+    }
+
+    int fd;
+    bool regular;           ///< Can we read at an offset?
+    uint64_t startOffset;   ///< Where the reading started
+    uint64_t fileSize;      ///< For a regular file
+    size_t blockSize;
+    std::vector<Slot> slots;
+    uint64_t nextToRead;    ///< Number of the next block to start reading
+    uint64_t nextToDeliver; ///< Number of the next block for next()
+    bool ended;             ///< Has next() got to the end of the file?
+};
+
+
+/*****************************************************************************/
+/* THREAD BACKEND                                                            */
+/*****************************************************************************/
+
+/** A thread reads the blocks in order, into each buffer as it becomes
+    free.  The slot states are only changed with the lock held.  A pipe may
+    not have anything to read for as long as its writer likes, so the
+    thread polls it together with an eventfd that the destructor uses to
+    wake it up. */
+
+struct Async_File_Reader::Thread_Itl : public Async_File_Reader::Itl {
+
+    Thread_Itl(int fd, const Options & options)
+        : Itl(fd, options), shutdown(false), wakeFd(-1)
+    {
+        if (!regular) {
+            wakeFd = eventfd(0, EFD_CLOEXEC);
+            if (wakeFd == -1)
+                throw Exception(errno, "eventfd", "Async_File_Reader");
+        }
+
+        try {
+            thread = std::thread(&Thread_Itl::run, this);
+        } catch (...) {
+            if (wakeFd != -1) ::close(wakeFd);
+            throw;
+        }
+    }
+
+    ~Thread_Itl()
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            shutdown = true;
+        }
+        cond.notify_all();
+        if (wakeFd != -1) {
+            uint64_t one = 1;
+            while (write(wakeFd, &one, sizeof(one)) == -1 && errno == EINTR)
+                ;
+        }
+        thread.join();
+        if (wakeFd != -1) ::close(wakeFd);
+    }
+
+    /** Wait until fd can be read from without blocking.  Returns false if
+        we were woken up to shut down instead. */
+    bool waitReadable()
+    {
+        pollfd fds[2] = { { fd, POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
+        for (;;) {
+            int res = poll(fds, 2, -1);
+            if (res == -1 && errno == EINTR) continue;
+            // On an error, the read will report it
+            return res == -1 || !fds[1].revents;
+        }
+    }
+
+    virtual Backend backend() const
+    {
+        return THREAD;
+    }
+
+    void run()
+    {
+        for (;;) {
+            Slot * slot;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                if (!moreToRead()) return;
+                Slot & next = slots[nextToRead % slots.size()];
+                cond.wait(guard, [&] ()
+                          {
+                              return shutdown || next.state == FREE;
+                          });
+                if (shutdown) return;
+                slot = &startBlock();
+            }
+
+            size_t done = 0;
+            int error = 0;
+            while (done < slot->wanted) {
+                if (!regular && !waitReadable()) return;
+                ssize_t res = regular
+                    ? pread(fd, slot->data + done, slot->wanted - done,
+                            slot->offset + done)
+                    : read(fd, slot->data + done, slot->wanted - done);
+                if (res == -1) {
+                    if (errno == EINTR) continue;
+                    error = errno;
+                    break;
+                }
+                if (res == 0) break;
+                done += res;
+
+                // Pass on what a pipe has as soon as it has it
+                if (!regular) break;
+            }
+
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                slot->size = done;
+                slot->error = error;
+                slot->state = READY;
+            }
+            cond.notify_all();
+
+            // next() will see the error or the end of the file when it gets
+            // to this block
+            if (error || done == 0) return;
+        }
+    }
+
+    virtual bool next(Block & block)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if (finished()) return false;
+
+        Slot & slot = slots[nextToDeliver % slots.size()];
+        checkNotHeld(slot);
+        cond.wait(guard, [&] () { return slot.state == READY; });
+
+        return deliver(slot, block);
+    }
+
+    virtual void release(int index)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            slots.at(index).state = FREE;
+        }
+        cond.notify_all();
+    }
+
+    std::mutex lock;
+    std::condition_variable cond;
+    bool shutdown;
+    int wakeFd;             ///< Wakes the thread from poll(); -1 if unused
+    std::thread thread;
+};
+
+
+#if JML_HAS_IO_URING
+
+/*****************************************************************************/
+/* IO_URING BACKEND                                                          */
+/*****************************************************************************/
+
+/** All of the free buffers have a read queued with the kernel through an
+    io_uring.  Everything happens on the caller's thread: completions are
+    collected when next() needs a block that isn't there yet. */
+
+struct Async_File_Reader::Uring_Itl : public Async_File_Reader::Itl {
+
+    Uring_Itl(int fd, const Options & options)
+        : Itl(fd, options), ringFd(-1), sqRing(MAP_FAILED),
+          cqRing(MAP_FAILED), sqes((io_uring_sqe *)MAP_FAILED), inFlight(0),
+          iovecs(slots.size())
+    {
+        if (!regular)
+            throw Exception("Async_File_Reader: io_uring needs a "
+                            "regular file");
+
+        try {
+            setup();
+            startReads();
+        } catch (...) {
+            teardown();
+            throw;
+        }
+    }
+
+    ~Uring_Itl()
+    {
+        // The kernel may still be writing into the buffers
+        try {
+            while (inFlight)
+                reap(true);
+        } catch (...) {
+        }
+
+        teardown();
+    }
+
+    virtual Backend backend() const
+    {
+        return IO_URING;
+    }
+
+    void setup()
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        ringFd = syscall(__NR_io_uring_setup, slots.size(), &params);
+        if (ringFd == -1)
+            throw Exception(errno, "io_uring_setup", "Async_File_Reader");
+
+        sqRingSize = params.sq_off.array
+            + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes
+            + params.cq_entries * sizeof(io_uring_cqe);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+        bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+        sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            throw Exception(errno, "mmap", "Async_File_Reader");
+
+        if (single) cqRing = sqRing;
+        else {
+            cqRing = mmap(0, cqRingSize, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ringFd,
+                          IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED)
+                throw Exception(errno, "mmap", "Async_File_Reader");
+        }
+
+        sqes = (io_uring_sqe *)
+            mmap(0, sqesSize, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            throw Exception(errno, "mmap", "Async_File_Reader");
+
+        char * sq = (char *)sqRing;
+        sqTail = (unsigned *)(sq + params.sq_off.tail);
+        sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+        sqArray = (unsigned *)(sq + params.sq_off.array);
+
+        char * cq = (char *)cqRing;
+        cqHead = (unsigned *)(cq + params.cq_off.head);
+        cqTail = (unsigned *)(cq + params.cq_off.tail);
+        cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+    }
+
+    void teardown()
+    {
+        if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+        if (ringFd != -1) ::close(ringFd);
+        ringFd = -1;
+        sqRing = cqRing = MAP_FAILED;
+        sqes = (io_uring_sqe *)MAP_FAILED;
+    }
+
+    int enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+    {
+        for (;;) {
+            int res = syscall(__NR_io_uring_enter, ringFd, toSubmit,
+                              minComplete, flags, 0, 0);
+            if (res >= 0) return res;
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            throw Exception(errno, "io_uring_enter", "Async_File_Reader");
+        }
+    }
+
+    /** Queue a read of the rest of the slot.  It's submitted to the kernel
+        by the next enter(). */
+    void queue(Slot & slot)
+    {
+        int index = &slot - &slots[0];
+        iovec & iov = iovecs[index];
+        iov.iov_base = slot.data + slot.size;
+        iov.iov_len = slot.wanted - slot.size;
+
+        unsigned tail = *sqTail;
+        unsigned entry = tail & sqMask;
+        io_uring_sqe & sqe = sqes[entry];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READV;
+        sqe.fd = fd;
+        sqe.addr = (uint64_t)&iov;
+        sqe.len = 1;
+        sqe.off = slot.offset + slot.size;
+        sqe.user_data = index;
+        sqArray[entry] = entry;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+
+        ++inFlight;
+    }
+
+    /** Start reading into as many of the free slots as we can. */
+    void startReads()
+    {
+        unsigned queued = 0;
+        while (moreToRead()
+               && slots[nextToRead % slots.size()].state == FREE) {
+            queue(startBlock());
+            ++queued;
+        }
+        if (queued) enter(queued, 0, 0);
+    }
+
+    /** Collect the completed reads, waiting for at least one if wait is
+        set.  Short reads are queued again for the rest. */
+    void reap(bool wait)
+    {
+        if (wait) enter(0, 1, IORING_ENTER_GETEVENTS);
+
+        unsigned requeued = 0;
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+        for (;  head != tail;  ++head) {
+            const io_uring_cqe & cqe = cqes[head & cqMask];
+            Slot & slot = slots[cqe.user_data];
+            --inFlight;
+
+            if (cqe.res < 0) {
+                slot.error = -cqe.res;
+                slot.state = READY;
+            }
+            else if (cqe.res == 0) {
+                // Truncated under us; give what we have
+                slot.state = READY;
+            }
+            else {
+                slot.size += cqe.res;
+                if (slot.size < slot.wanted) {
+                    queue(slot);
+                    ++requeued;
+                }
+                else slot.state = READY;
+            }
+        }
+
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+        if (requeued) enter(requeued, 0, 0);
+    }
+
+    virtual bool next(Block & block)
+    {
+        if (finished()) return false;
+
+        Slot & slot = slots[nextToDeliver % slots.size()];
+        checkNotHeld(slot);
+
+        reap(false);
+        while (slot.state == READING)
+            reap(true);
+
+        return deliver(slot, block);
+    }
+
+    virtual void release(int index)
+    {
+        slots.at(index).state = FREE;
+        startReads();
+    }
+
+    int ringFd;
+    void * sqRing;
+    void * cqRing;
+    io_uring_sqe * sqes;
+    size_t sqRingSize, cqRingSize, sqesSize;
+
+    unsigned * sqTail;
+    unsigned sqMask;
+    unsigned * sqArray;
+
+    unsigned * cqHead;
+    unsigned * cqTail;
+    unsigned cqMask;
+    io_uring_cqe * cqes;
+
+    unsigned inFlight;
+    std::vector<iovec> iovecs;   ///< One per slot, for its read
+};
+
+#endif // JML_HAS_IO_URING
+
+
+/*****************************************************************************/
+/* ASYNC FILE READER                                                         */
+/*****************************************************************************/
+
+Async_File_Reader::
+Async_File_Reader(const std::string & filename, const Options & options)
+    : filename_(filename)
+{
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw Exception(errno, filename, "Async_File_Reader");
+
+    try {
+        init(fd, options);
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+}
+
+Async_File_Reader::
+Async_File_Reader(int fd, const Options & options)
+    : filename_(format("fd %d", fd))
+{
+    init(fd, options);
+}
+
+Async_File_Reader::
+~Async_File_Reader()
+{
+}
+
+void
+Async_File_Reader::
+init(int fd, const Options & options)
+{
+    if (options.backend != THREAD) {
+#if JML_HAS_IO_URING
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            try {
+                itl.reset(new Uring_Itl(fd, options));
+                return;
+            } catch (...) {
+                // Fall back to a thread unless we were asked for io_uring
+                if (options.backend == IO_URING) throw;
+            }
+        }
+#endif
+        if (options.backend == IO_URING)
+            throw Exception("Async_File_Reader: io_uring is not available "
+                            "for " + filename_);
+    }
+
+    itl.reset(new Thread_Itl(fd, options));
+}
+
+bool
+Async_File_Reader::
+next(Block & block)
+{
+    return itl->next(block);
+}
+
+void
+Async_File_Reader::
+release(int index)
+{
+    itl->release(index);
+}
+
+bool
+Async_File_Reader::
+finished() const
+{
+    return itl->finished();
+}
+
+Async_File_Reader::Backend
+Async_File_Reader::
+backend() const
+{
+    return itl->backend();
+}
+
+int
+Async_File_Reader::
+numBlocks() const
+{
+    return itl->slots.size();
+}
+
+} // namespace ML
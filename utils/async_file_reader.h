@@ -0,0 +1,111 @@
+/* async_file_reader.h                                             -*- C++ -*-
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Sequential reader of a file that keeps several reads in flight.
+*/
+
+#ifndef __jml__utils__async_file_reader_h__
+#define __jml__utils__async_file_reader_h__
+
+#include <string>
+#include <memory>
+#include <stdint.h>
+
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* ASYNC FILE READER                                                         */
+/*****************************************************************************/
+
+/** Reads a file from start to end in big page aligned blocks, keeping
+    several of the reads in flight at once so that the I/O overlaps with
+    whatever is consuming the blocks.  There is no copy: the consumer gets
+    a pointer to the buffer that the data was read into, and gives it back
+    with release() when it's done, which lets the buffer be used to read
+    the next block.
+
+    There are two ways of doing the reads.  On Linux, regular files are
+    read with io_uring, which has all of the buffers' reads queued with the
+    kernel at once without needing any threads.  Otherwise (or if io_uring
+    isn't available, or for pipes and other files that can't be read at an
+    offset) a thread reads the blocks one after the other with pread or
+    read, keeping ahead of the consumer by as many buffers as are free.
+
+    It's used through Parse_Context and Binary_Input, and is only used by
+    one thread.
+*/
+
+struct Async_File_Reader {
+
+    enum Backend {
+        AUTO,       ///< io_uring if possible, otherwise THREAD
+        IO_URING,   ///< io_uring; only for regular files
+        THREAD      ///< A thread that does blocking reads
+    };
+
+    struct Options {
+        Options()
+            : blockSize(1 << 20), numBlocks(8), backend(AUTO)
+        {
+        }
+
+        size_t blockSize;   ///< Size of each read; rounded up to a page
+        int numBlocks;      ///< Number of buffers, and so of reads in flight
+        Backend backend;
+    };
+
+    /** Open the given file and start reading it. */
+    explicit Async_File_Reader(const std::string & filename,
+                               const Options & options = Options());
+
+    /** Start reading from the given file descriptor (which may be a pipe),
+        from its current position.  The reader uses its own copy of the fd.
+    */
+    explicit Async_File_Reader(int fd, const Options & options = Options());
+
+    ~Async_File_Reader();
+
+    struct Block {
+        const char * data;
+        size_t size;
+        int index;   ///< Pass to release()
+    };
+
+    /** Wait for the next block of the file and return it.  Returns false
+        once the whole file has been returned.  The block is valid until it
+        is passed to release().  No more than numBlocks can be held at once
+        (and nothing is being read while they all are); they should be
+        released in the order they were returned.
+    */
+    bool next(Block & block);
+
+    /** Give back a block so that its buffer can be read into again. */
+    void release(int index);
+
+    /** Has every block been returned by next()?  (For files that aren't
+        regular files, this only becomes true when next() returns false.) */
+    bool finished() const;
+
+    /** Which backend is actually being used. */
+    Backend backend() const;
+
+    /** Number of buffers, and so the most blocks that can be held. */
+    int numBlocks() const;
+
+    const std::string & filename() const { return filename_; }
+
+private:
+    struct Itl;
+    struct Thread_Itl;
+    struct Uring_Itl;
+    std::unique_ptr<Itl> itl;
+    std::string filename_;
+
+    void init(int fd, const Options & options);
+};
+
+} // namespace ML
+
+#endif /* __jml__utils__async_file_reader_h__ */
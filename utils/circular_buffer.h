@@ -11,6 +11,8 @@
 #define __jml__utils__circular_buffer_h__
 
 #include <vector>
+#include <algorithm>
+#include <utility>
 #include "jml/arch/exception.h"
 #include <boost/iterator/iterator_facade.hpp>
 #include <iostream> // debug
@@ -230,7 +232,7 @@ struct Circular_Buffer {
         unsigned i;
         try {
             for (i = 0;  i < nfirst_half;  ++i)
-                new (new_vals + i) T(vals_[start_ + i]);
+                new (new_vals + i) T(std::move_if_noexcept(vals_[start_ + i]));
         } catch (...) {
             for (i -= 1; i >= 0;  --i) {
                 try {
@@ -245,7 +247,8 @@ struct Circular_Buffer {
 
         try {
             for (unsigned i = 0;  i < nsecond_half;  ++i)
-                new (new_vals + nfirst_half + i) T(vals_[i]);
+                new (new_vals + nfirst_half + i)
+                    T(std::move_if_noexcept(vals_[i]));
         } catch (...) {
             for (i -= 1; i >= 0;  --i) {
                 try {
@@ -379,6 +382,13 @@ struct Circular_Buffer {
         new (element_at(size_ - 1)) T(val);
     }
 
+    void push_back(T && val)
+    {
+        if (size_ == capacity_) reserve(std::max(1, capacity_ * 2));
+        ++size_;
+        new (element_at(size_ - 1)) T(std::move(val));
+    }
+
     void push_front(const T & val)
     {
         if (size_ == capacity_) reserve(std::max(1, capacity_ * 2));
@@ -387,6 +397,14 @@ struct Circular_Buffer {
         else --start_;
     }
 
+    void push_front(T && val)
+    {
+        if (size_ == capacity_) reserve(std::max(1, capacity_ * 2));
+        new (element_at(-1)) T(std::move(val));
+        if (start_ == 0) start_ = capacity_ - 1;
+        else --start_;
+    }
+
     void pop_back()
     {
         if (empty())
@@ -579,7 +597,7 @@ private:
             // slide everything
             int last_element = start_ + size_;
             last_element -= capacity_ * (last_element >= capacity_);
-            std::copy(vals_ + offset + 1, vals_ + last_element,
+            std::move(vals_ + offset + 1, vals_ + last_element,
                       vals_ + offset);
             pop_back();
         }
@@ -589,7 +607,7 @@ private:
                 //cerr << "setting element " << i << " old value "
                 //     << vals_[i] << " from element " << i - 1
                 //     << " old value " << vals_[i - 1] << endl;
-                vals_[i] = vals_[i - 1];
+                vals_[i] = std::move(vals_[i - 1]);
             }
             pop_front();
         }
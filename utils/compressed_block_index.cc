@@ -0,0 +1,402 @@
+/* compressed_block_index.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Reading the block indexes of xz and zstd files.
+*/
+
+#include "compressed_block_index.h"
+#include "jml/arch/exception.h"
+#include <algorithm>
+#include <string.h>
+#include <lzma.h>
+#include <zstd.h>
+
+
+using namespace std;
+
+
+namespace ML {
+
+namespace {
+
+/** Magic number at the very end of a zstd seek table. */
+enum { ZSTD_SEEKABLE_MAGIC = 0x8F92EAB1 };
+
+/** Size of the footer of a zstd seek table. */
+enum { ZSTD_SEEK_TABLE_FOOTER_SIZE = 9 };
+
+uint64_t fileSize(std::streambuf & buf)
+{
+    std::streamoff res = buf.pubseekoff(0, ios::end, ios::in);
+    if (res == std::streamoff(-1))
+        throw Exception("Compressed_Block_Index: file can't seek");
+    return res;
+}
+
+std::string readAt(std::streambuf & buf, uint64_t offset, size_t length)
+{
+    if (buf.pubseekpos(offset, ios::in) == std::streampos(-1))
+        throw Exception("Compressed_Block_Index: couldn't seek to %lld",
+                        (long long)offset);
+
+    std::string result(length, 0);
+    if (length && buf.sgetn(&result[0], length) != std::streamsize(length))
+        throw Exception("Compressed_Block_Index: short read at %lld",
+                        (long long)offset);
+    return result;
+}
+
+uint32_t get32(const std::string & data, size_t pos)
+{
+    const unsigned char * p = (const unsigned char *)data.data() + pos;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24);
+}
+
+/** Read the streams of an xz file backwards from the end.  Returns false
+    if the file doesn't end with an xz stream footer. */
+bool readXzIndex(std::streambuf & buf, uint64_t size,
+                 Compressed_Block_Index & result)
+{
+    std::vector<std::vector<Compressed_Block_Index::Block> > streams;
+    std::vector<int> checks;
+
+    uint64_t pos = size;
+    while (pos > 0) {
+        if (pos % 4 != 0 || pos < 2 * LZMA_STREAM_HEADER_SIZE) {
+            if (streams.empty()) return false;
+            throw Exception("Compressed_Block_Index: bad xz file");
+        }
+
+        std::string footer = readAt(buf, pos - LZMA_STREAM_HEADER_SIZE,
+                                    LZMA_STREAM_HEADER_SIZE);
+
+        // Stream padding, which comes in multiples of four zero bytes
+        if (!streams.empty() && get32(footer, 8) == 0) {
+            pos -= 4;
+            continue;
+        }
+
+        lzma_stream_flags footerFlags;
+        if (lzma_stream_footer_decode(&footerFlags,
+                                      (const uint8_t *)footer.data())
+            != LZMA_OK) {
+            if (streams.empty()) return false;
+            throw Exception("Compressed_Block_Index: bad xz stream footer");
+        }
+
+        uint64_t indexSize = footerFlags.backward_size;
+        if (indexSize + LZMA_STREAM_HEADER_SIZE > pos)
+            throw Exception("Compressed_Block_Index: bad xz index size");
+
+        std::string indexData
+            = readAt(buf, pos - LZMA_STREAM_HEADER_SIZE - indexSize,
+                     indexSize);
+
+        lzma_index * index = 0;
+        uint64_t memlimit = UINT64_MAX;
+        size_t inPos = 0;
+        if (lzma_index_buffer_decode(&index, &memlimit, 0,
+                                     (const uint8_t *)indexData.data(),
+                                     &inPos, indexData.size())
+            != LZMA_OK)
+            throw Exception("Compressed_Block_Index: bad xz index");
+
+        uint64_t streamSize = lzma_index_stream_size(index);
+        if (streamSize > pos) {
+            lzma_index_end(index, 0);
+            throw Exception("Compressed_Block_Index: bad xz stream size");
+        }
+        uint64_t streamStart = pos - streamSize;
+
+        std::vector<Compressed_Block_Index::Block> blocks;
+        lzma_index_iter iter;
+        lzma_index_iter_init(&iter, index);
+        while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+            Compressed_Block_Index::Block block;
+            block.compressedOffset
+                = streamStart + iter.block.compressed_stream_offset;
+            block.compressedSize = iter.block.total_size;
+            block.uncompressedOffset = 0;  // filled in below
+            block.uncompressedSize = iter.block.uncompressed_size;
+            block.unpaddedSize = iter.block.unpadded_size;
+            block.stream = 0;
+            blocks.push_back(block);
+        }
+        lzma_index_end(index, 0);
+
+        std::string header = readAt(buf, streamStart,
+                                    LZMA_STREAM_HEADER_SIZE);
+        lzma_stream_flags headerFlags;
+        if (lzma_stream_header_decode(&headerFlags,
+                                      (const uint8_t *)header.data())
+                != LZMA_OK
+            || lzma_stream_flags_compare(&headerFlags, &footerFlags)
+                != LZMA_OK)
+            throw Exception("Compressed_Block_Index: bad xz stream header");
+
+        streams.push_back(blocks);
+        checks.push_back(footerFlags.check);
+        pos = streamStart;
+    }
+
+    if (streams.empty()) return false;
+
+    // We went from the end, so put it back in order
+    std::reverse(streams.begin(), streams.end());
+    std::reverse(checks.begin(), checks.end());
+
+    result.format = Compressed_Block_Index::XZ;
+    result.streamChecks = checks;
+    uint64_t uncompressed = 0;
+    for (unsigned i = 0;  i < streams.size();  ++i) {
+        for (auto block: streams[i]) {
+            block.uncompressedOffset = uncompressed;
+            block.stream = i;
+            uncompressed += block.uncompressedSize;
+            result.blocks.push_back(block);
+        }
+    }
+    result.uncompressedSize = uncompressed;
+    return true;
+}
+
+/** Read the seek table at the end of a zstd file.  Returns false if there
+    isn't one. */
+bool readZstdSeekTable(std::streambuf & buf, uint64_t size,
+                       Compressed_Block_Index & result)
+{
+    if (size < ZSTD_SEEK_TABLE_FOOTER_SIZE + 8)
+        return false;
+
+    std::string footer = readAt(buf, size - ZSTD_SEEK_TABLE_FOOTER_SIZE,
+                                ZSTD_SEEK_TABLE_FOOTER_SIZE);
+    if (get32(footer, 5) != ZSTD_SEEKABLE_MAGIC)
+        return false;
+
+    uint64_t numFrames = get32(footer, 0);
+    int descriptor = (unsigned char)footer[4];
+    uint64_t entrySize = (descriptor & 0x80 ? 12 : 8);
+
+    uint64_t tableSize = numFrames * entrySize + ZSTD_SEEK_TABLE_FOOTER_SIZE;
+    if (tableSize + 8 > size)
+        throw Exception("Compressed_Block_Index: bad zstd seek table size");
+
+    uint64_t tableStart = size - tableSize - 8;
+    std::string table = readAt(buf, tableStart, tableSize + 8);
+    if (get32(table, 0) != (ZSTD_MAGIC_SKIPPABLE_START | 0xE)
+        || get32(table, 4) != tableSize)
+        throw Exception("Compressed_Block_Index: bad zstd seek table");
+
+    result.format = Compressed_Block_Index::ZSTD;
+    uint64_t compressed = 0, uncompressed = 0;
+    for (uint64_t i = 0;  i < numFrames;  ++i) {
+        Compressed_Block_Index::Block block;
+        block.compressedOffset = compressed;
+        block.compressedSize = get32(table, 8 + i * entrySize);
+        block.uncompressedOffset = uncompressed;
+        block.uncompressedSize = get32(table, 12 + i * entrySize);
+        block.unpaddedSize = block.compressedSize;
+        block.stream = 0;
+        result.blocks.push_back(block);
+
+        compressed += block.compressedSize;
+        uncompressed += block.uncompressedSize;
+    }
+
+    if (compressed != tableStart)
+        throw Exception("Compressed_Block_Index: zstd seek table doesn't "
+                        "match the file");
+
+    result.uncompressedSize = uncompressed;
+    return true;
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* COMPRESSED BLOCK INDEX                                                    */
+/*****************************************************************************/
+
+std::shared_ptr<Compressed_Block_Index>
+Compressed_Block_Index::
+read(std::streambuf & buf)
+{
+    std::shared_ptr<Compressed_Block_Index> result
+        (new Compressed_Block_Index());
+
+    uint64_t size = fileSize(buf);
+    if (readXzIndex(buf, size, *result)
+        || readZstdSeekTable(buf, size, *result))
+        return result;
+    return std::shared_ptr<Compressed_Block_Index>();
+}
+
+size_t
+Compressed_Block_Index::
+findBlock(uint64_t offset) const
+{
+    // First block that ends after the offset.  Empty blocks are skipped.
+    auto it = std::upper_bound(blocks.begin(), blocks.end(), offset,
+                               [] (uint64_t offset, const Block & block)
+                               {
+                                   return offset < block.uncompressedOffset
+                                       + block.uncompressedSize;
+                               });
+    return it - blocks.begin();
+}
+
+std::vector<Compressed_Block_Index::Segment>
+Compressed_Block_Index::
+segments(size_t begin, size_t end) const
+{
+    std::vector<Segment> result;
+
+    if (format == ZSTD) {
+        if (begin < end) {
+            const Block & last = blocks.at(end - 1);
+            result.push_back(Segment(blocks.at(begin).compressedOffset,
+                                     last.compressedOffset
+                                     + last.compressedSize
+                                     - blocks[begin].compressedOffset));
+        }
+        return result;
+    }
+
+    if (begin == end)
+        return result;
+
+    // xz: the blocks go into a stream of their own.  The blocks don't know
+    // which stream they were in, but they do depend on its check type.
+    int check = streamChecks.at(blocks.at(begin).stream);
+    for (size_t i = begin;  i < end;  ++i)
+        if (streamChecks.at(blocks.at(i).stream) != check)
+            throw Exception("Compressed_Block_Index: range covers xz "
+                            "streams with different check types");
+
+    lzma_stream_flags flags;
+    memset(&flags, 0, sizeof(flags));
+    flags.version = 0;
+    flags.check = lzma_check(check);
+
+    std::string header(LZMA_STREAM_HEADER_SIZE, 0);
+    if (lzma_stream_header_encode(&flags, (uint8_t *)&header[0]) != LZMA_OK)
+        throw Exception("Compressed_Block_Index: couldn't encode xz header");
+    result.push_back(Segment(header));
+
+    // The blocks of each stream of the file are together
+    for (size_t i = begin;  i < end;) {
+        size_t runEnd = i;
+        while (runEnd < end && blocks[runEnd].stream == blocks[i].stream)
+            ++runEnd;
+        const Block & last = blocks[runEnd - 1];
+        result.push_back(Segment(blocks[i].compressedOffset,
+                                 last.compressedOffset + last.compressedSize
+                                 - blocks[i].compressedOffset));
+        i = runEnd;
+    }
+
+    lzma_index * index = lzma_index_init(0);
+    if (!index)
+        throw Exception("Compressed_Block_Index: lzma_index_init failed");
+
+    std::string indexData;
+    try {
+        for (size_t i = begin;  i < end;  ++i) {
+            if (lzma_index_append(index, 0, blocks[i].unpaddedSize,
+                                  blocks[i].uncompressedSize)
+                != LZMA_OK)
+                throw Exception("Compressed_Block_Index: "
+                                "lzma_index_append failed");
+        }
+
+        indexData.resize(lzma_index_size(index));
+        size_t pos = 0;
+        if (lzma_index_buffer_encode(index, (uint8_t *)&indexData[0],
+                                     &pos, indexData.size())
+            != LZMA_OK)
+            throw Exception("Compressed_Block_Index: couldn't encode xz "
+                            "index");
+    } catch (...) {
+        lzma_index_end(index, 0);
+        throw;
+    }
+    lzma_index_end(index, 0);
+    result.push_back(Segment(indexData));
+
+    std::string footer(LZMA_STREAM_HEADER_SIZE, 0);
+    flags.backward_size = indexData.size();
+    if (lzma_stream_footer_encode(&flags, (uint8_t *)&footer[0]) != LZMA_OK)
+        throw Exception("Compressed_Block_Index: couldn't encode xz footer");
+    result.push_back(Segment(footer));
+
+    return result;
+}
+
+
+/*****************************************************************************/
+/* SEGMENT SOURCE                                                            */
+/*****************************************************************************/
+
+struct Segment_Source::Itl {
+    Itl(std::streambuf * buf,
+        const std::vector<Compressed_Block_Index::Segment> & segments)
+        : buf(buf), segments(segments), current(0), done(0)
+    {
+    }
+
+    std::streamsize read(char * s, std::streamsize n)
+    {
+        while (current < segments.size()
+               && done == segments[current].length) {
+            ++current;
+            done = 0;
+        }
+
+        if (current == segments.size())
+            return -1;
+
+        const Compressed_Block_Index::Segment & segment = segments[current];
+        size_t todo = std::min<uint64_t>(n, segment.length - done);
+
+        if (!segment.literal.empty()) {
+            std::copy(segment.literal.data() + done,
+                      segment.literal.data() + done + todo, s);
+        }
+        else {
+            if (done == 0
+                && buf->pubseekpos(segment.offset, ios::in)
+                   == std::streampos(-1))
+                throw Exception("Segment_Source: couldn't seek");
+            std::streamsize res = buf->sgetn(s, todo);
+            if (res <= 0)
+                throw Exception("Segment_Source: file is shorter than its "
+                                "index says");
+            todo = res;
+        }
+
+        done += todo;
+        return todo;
+    }
+
+    std::streambuf * buf;
+    std::vector<Compressed_Block_Index::Segment> segments;
+    size_t current;   ///< Segment being read
+    uint64_t done;    ///< How much of it has been read
+};
+
+Segment_Source::
+Segment_Source(std::streambuf * buf,
+               const std::vector<Compressed_Block_Index::Segment> & segments)
+    : itl(new Itl(buf, segments))
+{
+}
+
+std::streamsize
+Segment_Source::
+read(char * s, std::streamsize n)
+{
+    return itl->read(s, n);
+}
+
+} // namespace ML
@@ -0,0 +1,127 @@
+/* compressed_block_index.h                                        -*- C++ -*-
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Random access to compressed files that are made of independent blocks.
+*/
+
+#ifndef __jml__utils__compressed_block_index_h__
+#define __jml__utils__compressed_block_index_h__
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <iostream>
+#include <stdint.h>
+#include <boost/iostreams/categories.hpp>
+
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* COMPRESSED BLOCK INDEX                                                    */
+/*****************************************************************************/
+
+/** Where each of the independently compressed blocks of a file is, both in
+    the file and in what it decompresses to.  This is read from the end of
+    the file, where there is one for:
+    - xz files, which always end with an index of their blocks.  Those
+      written by parallel_compressor (so by filter_ostream with
+      compressionThreads other than 1) or by xz -T have many blocks; others
+      have a single one, which can still be read but not seeked in.
+      Several xz streams one after the other are handled too.
+    - zstd files with a seek table at the end, as written by
+      parallel_compressor or by the seekable format of zstd's contrib.
+
+    Any xz or zstd tool can read these files from the start as usual.  With
+    the index, a range of what they decompress to can be read by
+    decompressing only the blocks that it overlaps.
+*/
+
+struct Compressed_Block_Index {
+
+    enum Format {
+        XZ,
+        ZSTD
+    };
+
+    struct Block {
+        uint64_t compressedOffset;     ///< Where the block starts in the file
+        uint64_t compressedSize;       ///< Including any padding
+        uint64_t uncompressedOffset;
+        uint64_t uncompressedSize;
+        uint64_t unpaddedSize;         ///< xz only: as in the index
+        int stream;                    ///< xz only: index in streamChecks
+    };
+
+    Format format;
+    std::vector<Block> blocks;
+    std::vector<int> streamChecks;    ///< xz only: check type of each stream
+    uint64_t uncompressedSize;
+
+    /** Read the index from the end of the given streambuf, which needs to
+        be able to seek.  Returns a null pointer if the file isn't an xz or
+        zstd file that has one.
+    */
+    static std::shared_ptr<Compressed_Block_Index> read(std::streambuf & buf);
+
+    /** Which block holds the given uncompressed offset.  Returns
+        blocks.size() if it's past the end.
+    */
+    size_t findBlock(uint64_t offset) const;
+
+    /** A piece of what the decompressor needs to be given: either part of
+        the file, or some bytes that have been made up.
+    */
+    struct Segment {
+        Segment(uint64_t offset = 0, uint64_t length = 0)
+            : offset(offset), length(length)
+        {
+        }
+
+        Segment(const std::string & literal)
+            : offset(0), length(literal.size()), literal(literal)
+        {
+        }
+
+        uint64_t offset;
+        uint64_t length;
+        std::string literal;   ///< If not empty, these bytes and not the file
+    };
+
+    /** What to give to a decompressor for the format so that it outputs
+        blocks begin up to end.  For zstd, that's just the frames.  For xz,
+        the blocks are put into a stream of their own, with a made up
+        header, index and footer around them; that needs them to all have
+        the same check type.
+    */
+    std::vector<Segment> segments(size_t begin, size_t end) const;
+};
+
+
+/*****************************************************************************/
+/* SEGMENT SOURCE                                                            */
+/*****************************************************************************/
+
+/** Boost iostreams source that reads the segments given by
+    Compressed_Block_Index::segments() from a streambuf, one after the
+    other, seeking as needed.
+*/
+
+struct Segment_Source {
+    typedef char char_type;
+    typedef boost::iostreams::source_tag category;
+
+    Segment_Source(std::streambuf * buf,
+                   const std::vector<Compressed_Block_Index::Segment>
+                       & segments);
+
+    std::streamsize read(char * s, std::streamsize n);
+
+    struct Itl;
+    std::shared_ptr<Itl> itl;
+};
+
+} // namespace ML
+
+#endif /* __jml__utils__compressed_block_index_h__ */
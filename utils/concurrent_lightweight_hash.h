@@ -0,0 +1,318 @@
+/* concurrent_lightweight_hash.h                                   -*- C++ -*-
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   A lightweight hash map that can be read without taking any locks while
+   it's being inserted into and resized.
+*/
+
+#ifndef __jml__utils__concurrent_lightweight_hash_h__
+#define __jml__utils__concurrent_lightweight_hash_h__
+
+#include "jml/arch/cmp_xchg.h"
+#include "jml/arch/exception.h"
+#include "jml/arch/bitops.h"
+#include "jml/compiler/compiler.h"
+#include <functional>
+#include <type_traits>
+#include <cstring>
+#include <stdint.h>
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* CONCURRENT LIGHTWEIGHT HASH                                               */
+/*****************************************************************************/
+
+/** Open addressed hash map from one word sized value to another, for the
+    case where lots of threads read a map that's being added to (in which
+    case a Lightweight_Hash needs to be wrapped in an RWLock, and all of
+    the readers fight over the lock's cache line).
+
+    - find() and count() never lock or write to shared memory.  They can
+      run at any time, including while the table is being resized.
+    - insert() adds a key if it's not already there, using a 16 byte
+      compare and exchange to publish the key and value together.  Any
+      number of threads can insert at the same time.  There is no erase,
+      and a value can't be changed once it's been inserted.
+    - When a table gets 3/4 full, a bigger one is chained on after it and
+      the entries are copied across by the inserting thread that noticed.
+      Empty buckets of the old table are marked as moved as they are
+      passed, so that inserts and lookups that find one carry on in the
+      next table.  Nobody waits for the copy to finish.
+
+    As readers may still be looking at an old table at any time, old tables
+    are only freed when the map is destroyed.  Since each one is half the
+    size of the next, they never take up more memory than the current one.
+
+    Both the key and the value must be trivially copyable and at most 8
+    bytes; a key with all bits zero can't be inserted, in the same way as
+    the guard value of a Lightweight_Hash.
+*/
+
+template<typename Key, typename Value, class Hash = std::hash<Key> >
+struct Concurrent_Lightweight_Hash {
+
+    static_assert(sizeof(Key) <= 8 && sizeof(Value) <= 8,
+                  "keys and values must fit in a word");
+
+    Concurrent_Lightweight_Hash(size_t capacity = 16)
+        : size_(0)
+    {
+        if (capacity < 16) capacity = 16;
+        current_ = oldest_ = new Table(ML::highest_bit(capacity - 1, -1) + 1);
+    }
+
+    ~Concurrent_Lightweight_Hash()
+    {
+        for (Table * t = oldest_;  t;) {
+            Table * next = t->next;
+            delete t;
+            t = next;
+        }
+    }
+
+    /** Number of entries that have been inserted. */
+    size_t size() const
+    {
+        return __atomic_load_n(&size_, __ATOMIC_RELAXED);
+    }
+
+    bool empty() const { return size() == 0; }
+
+    /** Capacity of the newest table that readers are using. */
+    size_t capacity() const
+    {
+        return __atomic_load_n(&current_, __ATOMIC_ACQUIRE)->capacity;
+    }
+
+    /** Look up the key.  Returns true and sets value if it was found. */
+    bool find(const Key & key, Value & value) const
+    {
+        uint64_t k = encode(key);
+        if (k == 0)
+            throw Exception("searching for or inserting guard value");
+        size_t hash = Hash()(key);
+
+        const Table * t = __atomic_load_n(&current_, __ATOMIC_ACQUIRE);
+        while (t) {
+            bool moved = false;
+            const Entry * entry = t->find(k, hash, moved);
+            if (entry) {
+                value = decode<Value>(__atomic_load_n(&entry->value,
+                                                      __ATOMIC_RELAXED));
+                return true;
+            }
+            if (!moved) return false;
+            t = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+        }
+        return false;
+    }
+
+    bool count(const Key & key) const
+    {
+        Value value;
+        return find(key, value);
+    }
+
+    /** Insert the key with the given value if it's not already there.
+        Returns true if it was inserted, or false if the key was already
+        there (in which case the value that's there is kept). */
+    bool insert(const Key & key, const Value & value)
+    {
+        uint64_t k = encode(key);
+        if (k == 0)
+            throw Exception("searching for or inserting guard value");
+
+        Table * t = __atomic_load_n(&current_, __ATOMIC_ACQUIRE);
+        bool result = insert(t, k, encode(value), Hash()(key));
+        if (result) __sync_fetch_and_add(&size_, 1);
+        return result;
+    }
+
+private:
+    struct Entry {
+        uint64_t key;
+        uint64_t value;
+    } JML_ALIGNED(16);
+
+    /** Value of an empty entry (which has a key of zero) that's been
+        passed by the copy into the next table. */
+    static const uint64_t MOVED = ~0ULL;
+
+    enum Insert_Result {
+        INSERTED,   ///< Inserted into this table
+        FOUND,      ///< Key was already there
+        MOVED_ON,   ///< Hit a moved entry; carry on in the next table
+        FULL        ///< No empty entry in the table
+    };
+
+    struct Table {
+        Table(int bits)
+            : bits(bits), capacity(1ULL << bits), num_full(0), next(0),
+              copied(false)
+        {
+            entries = new Entry[capacity]();
+        }
+
+        ~Table()
+        {
+            delete[] entries;
+        }
+
+        int bits;
+        size_t capacity;
+        Entry * entries;
+        size_t num_full;      ///< Includes entries copied in from before
+        Table * next;         ///< Table that we're being copied into
+        bool copied;          ///< Has everything been copied into next?
+
+        size_t bucket(size_t hash) const
+        {
+            return (hash * 0x9e3779b97f4a7c15ULL) >> (64 - bits);
+        }
+
+        bool needs_expansion() const
+        {
+            return __atomic_load_n(&num_full, __ATOMIC_RELAXED)
+                >= 3 * capacity / 4;
+        }
+
+        /** Probe for the key.  Returns the entry that holds it, or zero if
+            it's not in this table, in which case moved says whether it may
+            be in the next one. */
+        const Entry * find(uint64_t key, size_t hash, bool & moved) const
+        {
+            size_t mask = capacity - 1;
+            size_t i = bucket(hash);
+            for (size_t probed = 0;  probed < capacity;
+                 ++probed, i = (i + 1) & mask) {
+                const Entry & entry = entries[i];
+                uint64_t k = __atomic_load_n(&entry.key, __ATOMIC_ACQUIRE);
+                if (k == key) return &entry;
+                if (k == 0) {
+                    moved = __atomic_load_n(&entry.value, __ATOMIC_RELAXED)
+                        == MOVED;
+                    return 0;
+                }
+            }
+            moved = true;
+            return 0;
+        }
+
+        Insert_Result insert(uint64_t key, uint64_t value, size_t hash)
+        {
+            size_t mask = capacity - 1;
+            size_t i = bucket(hash);
+            for (size_t probed = 0;  probed < capacity;
+                 ++probed, i = (i + 1) & mask) {
+                Entry & entry = entries[i];
+                uint64_t k = __atomic_load_n(&entry.key, __ATOMIC_ACQUIRE);
+                if (k == key) return FOUND;
+                if (k != 0) continue;
+
+                Entry old = { 0, 0 };
+                Entry inserted = { key, value };
+                if (cmp_xchg(entry, old, inserted)) {
+                    __sync_fetch_and_add(&num_full, 1);
+                    return INSERTED;
+                }
+
+                // Lost the race for this entry
+                if (old.key == key) return FOUND;
+                if (old.key == 0) return MOVED_ON;
+            }
+            return FULL;
+        }
+    };
+
+    /** Insert into the given table or, if it's being copied, the tables
+        after it. */
+    bool insert(Table * t, uint64_t key, uint64_t value, size_t hash)
+    {
+        for (;;) {
+            Insert_Result res = t->insert(key, value, hash);
+            if (res == FOUND) return false;
+            if (res == INSERTED) {
+                if (t->needs_expansion()
+                    && !__atomic_load_n(&t->next, __ATOMIC_ACQUIRE))
+                    expand(t);
+                return true;
+            }
+
+            // The next table is always set before any entry is moved, but
+            // a table can fill up before it's been expanded
+            if (res == FULL && !__atomic_load_n(&t->next, __ATOMIC_ACQUIRE))
+                expand(t);
+            t = __atomic_load_n(&t->next, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    /** Chain a table of double the size after t, and copy everything in t
+        into it.  If another thread got in first, it does the copying. */
+    void expand(Table * t)
+    {
+        Table * next = new Table(t->bits + 1);
+        Table * none = 0;
+        if (!cmp_xchg(t->next, none, next)) {
+            delete next;
+            return;
+        }
+
+        for (size_t i = 0;  i < t->capacity;  ++i) {
+            Entry & entry = t->entries[i];
+            Entry old = { 0, 0 };
+            Entry moved = { 0, MOVED };
+            if (cmp_xchg(entry, old, moved)) continue;
+
+            // It's full; keys never change once set so it's safe to copy
+            insert(next, old.key, old.value,
+                   Hash()(decode<Key>(old.key)));
+        }
+
+        __atomic_store_n(&t->copied, true, __ATOMIC_RELEASE);
+
+        // Move readers onto the new table.  Tables can finish being copied
+        // out of order if a table expands while it's still being filled,
+        // so we advance as far as we can.
+        for (;;) {
+            Table * current = __atomic_load_n(&current_, __ATOMIC_ACQUIRE);
+            if (!__atomic_load_n(&current->copied, __ATOMIC_ACQUIRE))
+                break;
+            cmp_xchg(current_, current, current->next);
+        }
+    }
+
+    template<typename T>
+    static uint64_t encode(const T & val)
+    {
+        static_assert(std::is_trivially_copyable<T>::value,
+                      "keys and values must be trivially copyable");
+        uint64_t result = 0;
+        std::memcpy(&result, &val, sizeof(T));
+        return result;
+    }
+
+    template<typename T>
+    static T decode(uint64_t val)
+    {
+        T result;
+        std::memcpy(&result, &val, sizeof(T));
+        return result;
+    }
+
+    Table * current_;        ///< Newest table that's fully populated
+    Table * oldest_;         ///< First of the chain of tables
+    size_t size_;
+
+    Concurrent_Lightweight_Hash(const Concurrent_Lightweight_Hash &);
+    void operator = (const Concurrent_Lightweight_Hash &);
+};
+
+template<typename Key, typename Value, class Hash>
+const uint64_t
+Concurrent_Lightweight_Hash<Key, Value, Hash>::MOVED;
+
+} // namespace ML
+
+#endif /* __jml__utils__concurrent_lightweight_hash_h__ */
@@ -67,7 +67,14 @@ std::string expect_csv_field(Parse_Context & context, bool & another,
                 return result;
             
         }
-        result += *context++;
+
+        // Take everything up to the next character that means something
+        // in one go
+        if (quoted)
+            context.append_text(result, Parse_Context::Matches_Char('\"'));
+        else context.append_text(result,
+                                 Parse_Context::Matches_Any_Char
+                                     (separator, '\"', '\n', '\r'));
     }
 
     if (quoted)
@@ -0,0 +1,185 @@
+/* csv_columns.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Schema driven CSV reader.
+*/
+
+#include "csv_columns.h"
+#include "csv.h"
+#include "parse_context.h"
+#include "fast_int_parsing.h"
+#include "fast_float_parsing.h"
+#include "jml/arch/simd_scan.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+#include <limits>
+
+using namespace std;
+
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* CSV COLUMN                                                                */
+/*****************************************************************************/
+
+Csv_Column::
+Csv_Column(const std::string & name, Type type)
+    : name(name), type(type)
+{
+}
+
+size_t
+Csv_Column::
+size() const
+{
+    switch (type) {
+    case INT64:  return ints.size();
+    case DOUBLE: return doubles.size();
+    case STRING: return codes.size();
+    }
+    throw Exception("Csv_Column: unknown type");
+}
+
+void
+Csv_Column::
+clear()
+{
+    ints.clear();
+    doubles.clear();
+    codes.clear();
+}
+
+void
+Csv_Column::
+add(const char * first, const char * last, const Parse_Context & context)
+{
+    switch (type) {
+    case INT64: {
+        const char * p = first;
+        bool negative = p != last && *p == '-';
+        if (p != last && (*p == '-' || *p == '+')) ++p;
+
+        unsigned long long val;
+        unsigned long long limit = (1ULL << 63) - !negative;
+        if (parse_unsigned_long_long(p, last, val) != last || val > limit)
+            context.exception("expected integer for CSV column " + name
+                              + ", got '" + string(first, last) + "'");
+        ints.push_back(negative ? -(int64_t)(val - 1) - 1 : (int64_t)val);
+        return;
+    }
+
+    case DOUBLE: {
+        double val = std::numeric_limits<double>::quiet_NaN();
+        if (first != last && parse_double(first, last, val) != last)
+            context.exception("expected number for CSV column " + name
+                              + ", got '" + string(first, last) + "'");
+        doubles.push_back(val);
+        return;
+    }
+
+    case STRING: {
+        key.assign(first, last);
+        auto it = codeOf.find(key);
+        if (it == codeOf.end()) {
+            it = codeOf.insert(make_pair(key, dictionary.size())).first;
+            dictionary.push_back(key);
+        }
+        codes.push_back(it->second);
+        return;
+    }
+    }
+
+    throw Exception("Csv_Column: unknown type");
+}
+
+
+/*****************************************************************************/
+/* CSV COLUMN READER                                                         */
+/*****************************************************************************/
+
+Csv_Column_Reader::
+Csv_Column_Reader(const Schema & schema, char separator)
+    : separator(separator), rows_(0)
+{
+    if (schema.empty())
+        throw Exception("Csv_Column_Reader: empty schema");
+
+    for (auto & c: schema)
+        columns_.push_back(Csv_Column(c.first, c.second));
+}
+
+void
+Csv_Column_Reader::
+expect_header(Parse_Context & context)
+{
+    vector<string> header = expect_csv_row(context, columns_.size(),
+                                           separator);
+    for (unsigned i = 0;  i < header.size();  ++i)
+        if (header[i] != columns_[i].name)
+            context.exception("CSV header has column " + header[i]
+                              + " where " + columns_[i].name
+                              + " was expected");
+}
+
+size_t
+Csv_Column_Reader::
+read_batch(Parse_Context & context, size_t maxRows)
+{
+    double start = wall_time();
+    size_t startOffset = context.get_offset();
+
+    for (auto & c: columns_)
+        c.clear();
+    rows_ = 0;
+
+    while (rows_ < maxRows && context) {
+        if (context.match_eol()) continue;
+        read_row(context);
+        ++rows_;
+    }
+
+    stats_.rows += rows_;
+    stats_.bytes += context.get_offset() - startOffset;
+    stats_.seconds += wall_time() - start;
+
+    return rows_;
+}
+
+void
+Csv_Column_Reader::
+read_row(Parse_Context & context)
+{
+    // Set when the separator after a field has already been eaten
+    bool another = false;
+
+    for (unsigned i = 0;  i < columns_.size();  ++i) {
+        if (i > 0 && !another && !context.match_literal(separator))
+            context.exception(format("Wrong CSV length: expected %zd, got %d",
+                                     columns_.size(), i));
+        another = false;
+
+        // A field that's not quoted and ends within the buffer can be
+        // parsed where it is
+        const char * p = context.buffer_pos();
+        const char * e = context.buffer_end();
+        const char * q = scan_for_any(p, e, separator, '"', '\n', '\r');
+
+        if (q != e ? *q != '"' : context.last_buffer()) {
+            columns_[i].add(p, q, context);
+            context.skip_buffered(q);
+        }
+        else {
+            string field = expect_csv_field(context, another, separator);
+            columns_[i].add(field.data(), field.data() + field.size(),
+                            context);
+        }
+    }
+
+    if (another || !context.match_eol())
+        context.exception(format("Wrong CSV length: expected %zd, got more",
+                                 columns_.size()));
+}
+
+} // namespace ML
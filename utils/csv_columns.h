@@ -0,0 +1,133 @@
+/* csv_columns.h                                                   -*- C++ -*-
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Schema driven CSV reader that parses straight into typed columns.
+*/
+
+#ifndef __jml__utils__csv_columns_h__
+#define __jml__utils__csv_columns_h__
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <stdint.h>
+
+
+namespace ML {
+
+struct Parse_Context;
+
+
+/*****************************************************************************/
+/* CSV COLUMN                                                                */
+/*****************************************************************************/
+
+/** One column of a batch of CSV rows.  Only the vector that matches the
+    type is used.  Strings are dictionary encoded: each row holds the code
+    of its value in the dictionary, which keeps growing from one batch to
+    the next so that the codes stay the same for the whole file.
+*/
+
+struct Csv_Column {
+    enum Type {
+        INT64,     ///< Signed 64 bit integers, in ints
+        DOUBLE,    ///< Doubles in doubles; an empty field is NaN
+        STRING     ///< Codes into dictionary, in codes
+    };
+
+    Csv_Column(const std::string & name, Type type);
+
+    std::string name;
+    Type type;
+
+    std::vector<int64_t> ints;
+    std::vector<double> doubles;
+    std::vector<uint32_t> codes;
+    std::vector<std::string> dictionary;
+
+    /** Number of rows in the column. */
+    size_t size() const;
+
+    /** Value of row i of a STRING column. */
+    const std::string & string_at(size_t i) const
+    {
+        return dictionary[codes[i]];
+    }
+
+    /** Remove the rows, keeping the memory and the dictionary. */
+    void clear();
+
+    /** Parse the field in [first, last) and add it to the column.  Errors
+        are reported through the context. */
+    void add(const char * first, const char * last,
+             const Parse_Context & context);
+
+private:
+    std::unordered_map<std::string, uint32_t> codeOf;
+    std::string key;  ///< Scratch space to look up codeOf without allocating
+};
+
+
+/*****************************************************************************/
+/* CSV COLUMN READER                                                         */
+/*****************************************************************************/
+
+/** Reads a CSV file with a known schema in batches of rows, parsing each
+    field straight into the typed column it belongs to.  Unlike
+    expect_csv_row, there is no std::string made per field; fields that
+    aren't quoted are parsed directly in the Parse_Context's buffer, and
+    only quoted ones (or those that straddle two buffers of a stream) go
+    through expect_csv_field.  The column buffers are reused from one batch
+    to the next.
+*/
+
+struct Csv_Column_Reader {
+
+    typedef std::vector<std::pair<std::string, Csv_Column::Type> > Schema;
+
+    Csv_Column_Reader(const Schema & schema, char separator = ',');
+
+    /** Read a header row, and check that it matches the schema. */
+    void expect_header(Parse_Context & context);
+
+    /** Read up to maxRows rows into the columns, replacing what was there
+        before.  Empty lines are skipped.  Returns the number of rows read,
+        which is zero only at the end of the file.
+    */
+    size_t read_batch(Parse_Context & context, size_t maxRows = 65536);
+
+    size_t num_columns() const { return columns_.size(); }
+
+    /** Number of rows in the current batch. */
+    size_t num_rows() const { return rows_; }
+
+    const Csv_Column & column(size_t i) const { return columns_.at(i); }
+
+    const std::vector<Csv_Column> & columns() const { return columns_; }
+
+    /** Totals over all of the batches read so far. */
+    struct Stats {
+        Stats() : rows(0), bytes(0), seconds(0.0) {}
+
+        size_t rows;
+        size_t bytes;
+        double seconds;
+
+        double rows_per_second() const { return rows / seconds; }
+        double bytes_per_second() const { return bytes / seconds; }
+    };
+
+    const Stats & stats() const { return stats_; }
+
+private:
+    std::vector<Csv_Column> columns_;
+    char separator;
+    size_t rows_;
+    Stats stats_;
+
+    void read_row(Parse_Context & context);
+};
+
+} // namespace ML
+
+#endif /* __jml__utils__csv_columns_h__ */
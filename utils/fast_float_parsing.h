@@ -26,11 +26,15 @@
 
 #include "jml/utils/parse_context.h"
 #include <limits>
+#include <string>
 #include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 namespace ML {
 
-double binary_exp10 [10] = {
+static const double binary_exp10 [10] = {
     10,
     100,
     1e4,
@@ -43,7 +47,7 @@ double binary_exp10 [10] = {
     INFINITY
 };
 
-double binary_exp10_neg [10] = {
+static const double binary_exp10_neg [10] = {
     0.1,
     0.01,
     1e-4,
@@ -56,7 +60,7 @@ double binary_exp10_neg [10] = {
     0.0
 };
 
-double
+inline double
 exp10_int(int val)
 {
     double result = 1.0;
@@ -166,7 +170,14 @@ inline bool match_float(Float & result, Parse_Context & c)
         size_t ofs0 = c.get_offset();
         size_t nchars = ofs - ofs0;
         
-        char buf[nchars + 1];
+        // Numbers are almost always short enough for the stack
+        char local[128];
+        std::string longer;
+        char * buf = local;
+        if (nchars >= sizeof(local)) {
+            longer.resize(nchars + 1);
+            buf = &longer[0];
+        }
 
         for (unsigned i = 0;  i < nchars;  ++i)
             buf[i] = *c++;
@@ -201,6 +212,116 @@ inline Float expect_float(Parse_Context & c,
     return result;
 }
 
+/** Parse a number of the form [-]digits[.digits][(e|E)[+-]digits] from
+    [p, e) into result, directly from memory.  At least one digit is
+    required in the mantissa.
+
+    The result is correctly rounded.  When the mantissa fits exactly in
+    a double and the power of ten is exact (up to 1e22), a single multiply
+    or divide gives the correctly rounded answer.  Anything else is passed
+    to strtod from a copy, which is on the stack unless the number is more
+    than 127 characters long.
+
+    Returns a pointer past the number, or 0 if it is malformed or out of
+    range.
+*/
+inline const char *
+parse_double(const char * p, const char * e, double & result)
+{
+    static const double exact_exp10[23] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10,
+        1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21,
+        1e22
+    };
+
+    const char * start = p;
+
+    bool negative = p < e && *p == '-';
+    if (negative) ++p;
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    bool exact = true;  // mantissa holds all of the digits
+
+    for (;  p < e;  ++p) {
+        unsigned digit = (unsigned char)*p - '0';
+        if (digit > 9) break;
+        ++digits;
+        if (mantissa < 100000000000000000ULL)
+            mantissa = mantissa * 10 + digit;
+        else {
+            exact = false;
+            ++exponent;
+        }
+    }
+
+    if (p < e && *p == '.') {
+        for (++p;  p < e;  ++p) {
+            unsigned digit = (unsigned char)*p - '0';
+            if (digit > 9) break;
+            ++digits;
+            if (mantissa < 100000000000000000ULL) {
+                mantissa = mantissa * 10 + digit;
+                --exponent;
+            }
+            else exact = false;
+        }
+    }
+
+    if (!digits) return 0;
+
+    if (p < e && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool negative_exp = false;
+        if (p < e && (*p == '+' || *p == '-')) {
+            negative_exp = *p == '-';
+            ++p;
+        }
+
+        const char * exp_start = p;
+        int exp = 0;
+        for (;  p < e;  ++p) {
+            unsigned digit = (unsigned char)*p - '0';
+            if (digit > 9) break;
+            if (exp < 100000) exp = exp * 10 + digit;
+        }
+        if (p == exp_start) return 0;
+
+        exponent += negative_exp ? -exp : exp;
+    }
+
+    if (exact && mantissa <= (1ULL << 53)
+        && exponent >= -22 && exponent <= 22) {
+        double m = mantissa;
+        result = exponent < 0
+            ? m / exact_exp10[-exponent]
+            : m * exact_exp10[exponent];
+        if (negative) result = -result;
+        return p;
+    }
+
+    size_t nchars = p - start;
+
+    char local[128];
+    std::string longer;
+    char * buf = local;
+    if (nchars >= sizeof(local)) {
+        longer.resize(nchars + 1);
+        buf = &longer[0];
+    }
+    memcpy(buf, start, nchars);
+    buf[nchars] = 0;
+
+    char * endptr;
+    errno = 0;
+    double parsed = strtod(buf, &endptr);
+    if (errno || endptr != buf + nchars)
+        return 0;
+
+    result = parsed;
+    return p;
+}
 
 } // namespace ML
 
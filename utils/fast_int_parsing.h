@@ -162,6 +162,34 @@ inline bool match_long_long(long long int & result, Parse_Context & c)
     return true;
 }
 
+/** Parse the decimal digits at the start of [p, e) into val directly
+    from memory, without going through a Parse_Context.  Returns a
+    pointer past the last digit, or 0 if there were no digits or the
+    value doesn't fit.
+*/
+inline const char *
+parse_unsigned_long_long(const char * p, const char * e,
+                         unsigned long long & val)
+{
+    const char * start = p;
+    unsigned long long result = 0;
+
+    for (;  p < e;  ++p) {
+        unsigned digit = (unsigned char)*p - '0';
+        if (digit > 9) break;
+        // Only the twentieth and later digits can overflow
+        if (JML_UNLIKELY(p - start >= 19)
+            && result > (ULLONG_MAX - digit) / 10)
+            return 0;
+        result = result * 10 + digit;
+    }
+
+    if (p == start) return 0;
+
+    val = result;
+    return p;
+}
+
 } // namespace ML
 
 #endif /* __utils__fast_int_parsing_h__ */
@@ -34,6 +34,7 @@
 #include <iostream>
 #include <boost/weak_ptr.hpp>
 #include <map>
+#include <algorithm>
 #include <grp.h>
 #include <exception>
 #include "guard.h"
@@ -294,21 +295,48 @@ class File_Read_Buffer::MMap_Region
     : public File_Read_Buffer::Region {
 
     inode_type inode;
+    bool cached;
+    int fd;   ///< Our own copy of the fd for dropBehind, or -1
 
-    MMap_Region(int fd, inode_type inode)
-        : inode(inode)
+    MMap_Region(int fd, inode_type inode, const Options & options,
+                bool cached)
+        : inode(inode), cached(cached), fd(-1)
     {
         size = get_file_size(fd);
 
         if (size == 0) {
             start = 0;
+            return;
         }
-        else {
-            start = (const char *)mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
-            if (start == MAP_FAILED)
-                throw Exception(errno, "mmap", "MMap_Region()");
+
+        int flags = MAP_SHARED;
+        if (options.populate) flags |= MAP_POPULATE;
+
+        start = (const char *)mmap(0, size, PROT_READ, flags, fd, 0);
+        if (start == MAP_FAILED)
+            throw Exception(errno, "mmap", "MMap_Region()");
+
+        int advice = MADV_NORMAL;
+        if (options.access == SEQUENTIAL) advice = MADV_SEQUENTIAL;
+        else if (options.access == RANDOM) advice = MADV_RANDOM;
+
+        if (advice != MADV_NORMAL
+            && madvise((void *)start, size, advice) == -1) {
+            munmap((void *)start, size);
+            throw Exception(errno, "madvise", "MMap_Region()");
         }
 
+        // The kernel may not do huge pages for files; that's not an error
+        if (options.hugePages)
+            madvise((void *)start, size, MADV_HUGEPAGE);
+
+        if (options.dropBehind) {
+            this->fd = dup(fd);
+            if (this->fd == -1) {
+                munmap((void *)start, size);
+                throw Exception(errno, "dup", "MMap_Region()");
+            }
+        }
     }
 
     MMap_Region(const MMap_Region & other);
@@ -330,18 +358,25 @@ class File_Read_Buffer::MMap_Region
     }
 
 public:
-    static std::shared_ptr<MMap_Region> get(int fd)
+    static std::shared_ptr<MMap_Region> get(int fd, const Options & options)
     {
+        inode_type inode = get_inode(fd);
+
+        // Hints are per mapping, so only the default one is shared
+        if (!options.isDefault()) {
+            return std::shared_ptr<MMap_Region>
+                (new MMap_Region(fd, inode, options, false));
+        }
+
         std::lock_guard<ML::Spinlock> guard(lock());
 
-        inode_type inode = get_inode(fd);
         std::weak_ptr<MMap_Region> & ptr = cache()[inode];
 
         std::shared_ptr<MMap_Region> result;
         result = ptr.lock();
         
         if (!result) {
-            result.reset(new MMap_Region(fd, inode));
+            result.reset(new MMap_Region(fd, inode, options, true));
             ptr = result;
         }
 
@@ -351,11 +386,51 @@ public:
     virtual ~MMap_Region()
     {
         if  (size) munmap((void *)start, size);
+        if (fd != -1) ::close(fd);
+
+        if (!cached) return;
 
         std::lock_guard<ML::Spinlock> guard(lock());
         if (cache()[inode].expired())
             cache().erase(inode);
     }
+
+    virtual void will_need(size_t offset, size_t length)
+    {
+        offset = std::min(offset, size);
+        length = std::min(length, size - offset);
+
+        // Round outwards to whole pages
+        size_t page = getpagesize();
+        size_t first = offset / page * page;
+        size_t last = offset + length;
+        if (last <= first) return;
+
+        if (madvise((void *)(start + first), last - first, MADV_WILLNEED)
+            == -1)
+            throw Exception(errno, "madvise", "MMap_Region::will_need()");
+    }
+
+    virtual void done_with(size_t offset, size_t length)
+    {
+        offset = std::min(offset, size);
+        length = std::min(length, size - offset);
+
+        // Round inwards to whole pages, except for the partial page at the
+        // end of the file
+        size_t page = getpagesize();
+        size_t first = (offset + page - 1) / page * page;
+        size_t last = offset + length;
+        if (last != size) last = last / page * page;
+        if (last <= first) return;
+
+        if (madvise((void *)(start + first), last - first, MADV_DONTNEED)
+            == -1)
+            throw Exception(errno, "madvise", "MMap_Region::done_with()");
+
+        if (fd != -1)
+            posix_fadvise(fd, first, last - first, POSIX_FADV_DONTNEED);
+    }
 };
 
 /** Region that comes from a memory block. */
@@ -382,6 +457,18 @@ File_Read_Buffer::Region::~Region()
 {
 }
 
+void
+File_Read_Buffer::Region::
+will_need(size_t offset, size_t length)
+{
+}
+
+void
+File_Read_Buffer::Region::
+done_with(size_t offset, size_t length)
+{
+}
+
 
 /*****************************************************************************/
 /* FILE_READ_BUFFER                                                          */
@@ -391,14 +478,15 @@ File_Read_Buffer::File_Read_Buffer()
 {
 }
 
-File_Read_Buffer::File_Read_Buffer(const std::string & filename)
+File_Read_Buffer::File_Read_Buffer(const std::string & filename,
+                                   const Options & options)
 {
-    open(filename);
+    open(filename, options);
 }
 
-File_Read_Buffer::File_Read_Buffer(int fd)
+File_Read_Buffer::File_Read_Buffer(int fd, const Options & options)
 {
-    open(fd);
+    open(fd, options);
 }
 
 File_Read_Buffer::File_Read_Buffer(const char * start, size_t length,
@@ -413,7 +501,8 @@ File_Read_Buffer::File_Read_Buffer(const File_Read_Buffer & other)
 {
 }
 
-void File_Read_Buffer::open(const std::string & filename)
+void File_Read_Buffer::open(const std::string & filename,
+                            const Options & options)
 {
     int fd = ::open(filename.c_str(), O_RDONLY);
 
@@ -421,7 +510,7 @@ void File_Read_Buffer::open(const std::string & filename)
         throw Exception(errno, filename, "File_Read_Buffer::open()");
 
     try {
-        region = MMap_Region::get(fd);
+        region = MMap_Region::get(fd, options);
         filename_ = filename;
     }
     catch (...) {
@@ -431,9 +520,9 @@ void File_Read_Buffer::open(const std::string & filename)
     ::close(fd);
 }
 
-void File_Read_Buffer::open(int fd)
+void File_Read_Buffer::open(int fd, const Options & options)
 {
-    region = MMap_Region::get(fd);
+    region = MMap_Region::get(fd, options);
     filename_ = get_name_from_fd(fd);
 }
 
@@ -104,16 +104,58 @@ void scanFiles(const std::string & path,
 
 class File_Read_Buffer {
 public:
+    /** How the mapping will be accessed, which is passed on to the kernel
+        so that it can choose how much to read ahead. */
+    enum Access {
+        NORMAL,       ///< Default readahead
+        SEQUENTIAL,   ///< Read ahead aggressively (MADV_SEQUENTIAL)
+        RANDOM        ///< Don't read ahead at all (MADV_RANDOM)
+    };
+
+    /** Options for mapping a file.  A file that's opened with anything but
+        the default options gets its own mapping, rather than sharing that of
+        other File_Read_Buffers open on the same file, so that the hints of
+        one reader don't change the behaviour of another.
+    */
+    struct Options {
+        Options(Access access = NORMAL)
+            : access(access), populate(false), hugePages(false),
+              dropBehind(false)
+        {
+        }
+
+        Access access;
+
+        /** Read the whole file in when it's mapped (MAP_POPULATE), rather
+            than on first touch. */
+        bool populate;
+
+        /** Ask for transparent huge pages (MADV_HUGEPAGE).  This only has
+            an effect on kernels that support them for the page cache. */
+        bool hugePages;
+
+        /** Keep the file open so that done_with() can drop the pages from
+            the page cache as well as from the mapping. */
+        bool dropBehind;
+
+        bool isDefault() const
+        {
+            return access == NORMAL && !populate && !hugePages && !dropBehind;
+        }
+    };
+
     File_Read_Buffer();
-    File_Read_Buffer(const std::string & filename);
-    File_Read_Buffer(int fd);
+    File_Read_Buffer(const std::string & filename,
+                     const Options & options = Options());
+    File_Read_Buffer(int fd, const Options & options = Options());
     File_Read_Buffer(const File_Read_Buffer & other);
     File_Read_Buffer(const char * start, size_t length,
                      const std::string & fileName = "anonymous memory",
                      boost::function<void ()> onDone = boost::function<void ()>());
 
-    void open(const std::string & filename);
-    void open(int fd);
+    void open(const std::string & filename,
+              const Options & options = Options());
+    void open(int fd, const Options & options = Options());
 
     void open(const char * start, size_t length,
               const std::string & filename = "anonymous memory",
@@ -127,12 +169,35 @@ public:
 
     std::string filename() const { return filename_; }
 
+    /** Start reading [offset, offset + length) into memory in the
+        background (MADV_WILLNEED), so that it's there by the time it's
+        needed.  Does nothing for a buffer that isn't a mapped file. */
+    void will_need(size_t offset, size_t length) const
+    {
+        region->will_need(offset, length);
+    }
+
+    /** Say that [offset, offset + length) won't be looked at again, so that
+        the pages that are wholly within it can be dropped from the mapping,
+        and from the page cache too if the file was opened with dropBehind.
+        This stops a scan through a big file from pushing everything else
+        out of the page cache.  The range must not be accessed afterwards.
+        Does nothing for a buffer that isn't a mapped file.
+    */
+    void done_with(size_t offset, size_t length) const
+    {
+        region->done_with(offset, length);
+    }
+
     /* Only access this if you know what you are doing... */
     class Region {
     public:
         virtual ~Region();
         const char * start;
         size_t size;
+
+        virtual void will_need(size_t offset, size_t length);
+        virtual void done_with(size_t offset, size_t length);
     };
 
     std::string filename_;
@@ -36,6 +36,10 @@
 #include <thread>
 #include <unordered_map>
 #include "lzma.h"
+#include "parallel_compressor.h"
+#include "zstd_filter.h"
+#include "lz4_filter.h"
+#include "compressed_block_index.h"
 
 
 using namespace std;
@@ -79,18 +83,18 @@ filter_ostream(filter_ostream && other) noexcept
 
 filter_ostream::
 filter_ostream(const std::string & file, std::ios_base::openmode mode,
-               const std::string & compression, int level)
+               const std::string & compression, int level, int threads)
     : ostream(std::cout.rdbuf())
 {
-    open(file, mode, compression, level);
+    open(file, mode, compression, level, threads);
 }
 
 filter_ostream::
 filter_ostream(int fd, std::ios_base::openmode mode,
-               const std::string & compression, int level)
+               const std::string & compression, int level, int threads)
     : ostream(std::cout.rdbuf())
 {
-    open(fd, mode);
+    open(fd, mode, compression, level, threads);
 }
 
 filter_ostream::
@@ -127,13 +131,25 @@ void addCompression(streambuf & buf,
                     boost::iostreams::filtering_ostream & stream,
                     const std::string & resource,
                     const std::string & compression,
-                    int compressionLevel)
+                    int compressionLevel,
+                    int compressionThreads)
 {
     using namespace boost::iostreams;
 
+    auto pushParallel = [&] (parallel_compressor::Format format)
+        {
+            parallel_compressor::Options options(format, compressionLevel);
+            options.maxBlocks = compressionThreads;
+            stream.push(parallel_compressor(options));
+        };
+
     if (compression == "gz" || compression == "gzip"
         || (compression == ""
             && (ends_with(resource, ".gz") || ends_with(resource, ".gz~")))) {
+        if (compressionThreads != 1) {
+            pushParallel(parallel_compressor::GZIP);
+            return;
+        }
         gzip_compressor compressor;
         if (compressionLevel != -1) {
             compressor = gzip_compressor(compressionLevel);
@@ -151,10 +167,26 @@ void addCompression(streambuf & buf,
     else if (compression == "lzma" || compression == "xz"
         || (compression == ""
             && (ends_with(resource, ".xz") || ends_with(resource, ".xz~")))) {
-        if (compressionLevel == -1)
+        if (compressionThreads != 1)
+            pushParallel(parallel_compressor::XZ);
+        else if (compressionLevel == -1)
             stream.push(lzma_compressor());
         else stream.push(lzma_compressor(compressionLevel));
     }
+    else if (compression == "zst" || compression == "zstd"
+        || (compression == ""
+            && (ends_with(resource, ".zst") || ends_with(resource, ".zst~")))) {
+        if (compressionThreads != 1)
+            pushParallel(parallel_compressor::ZSTD);
+        else stream.push(zstd_compressor(compressionLevel));
+    }
+    else if (compression == "lz4"
+        || (compression == ""
+            && (ends_with(resource, ".lz4") || ends_with(resource, ".lz4~")))) {
+        if (compressionThreads != 1)
+            pushParallel(parallel_compressor::LZ4);
+        else stream.push(lz4_compressor(compressionLevel));
+    }
     else if (compression != "" && compression != "none")
         throw ML::Exception("unknown filter compression " + compression);
     
@@ -165,7 +197,8 @@ void addCompression(streambuf & buf,
 void
 filter_ostream::
 open(const std::string & uri, std::ios_base::openmode mode,
-     const std::string & compression, int compressionLevel)
+     const std::string & compression, int compressionLevel,
+     int compressionThreads)
 {
     using namespace boost::iostreams;
 
@@ -181,7 +214,7 @@ open(const std::string & uri, std::ios_base::openmode mode,
     std::tie(buf, weOwnBuf) = handler(scheme, resource, mode);
 
     return openFromStreambuf(buf, weOwnBuf, resource, compression,
-                             compressionLevel);
+                             compressionLevel, compressionThreads);
 }
 
 void
@@ -190,7 +223,8 @@ openFromStreambuf(std::streambuf * buf,
                   bool weOwnBuf,
                   const std::string & resource,
                   const std::string & compression,
-                  int compressionLevel)
+                  int compressionLevel,
+                  int compressionThreads)
 {
     // TODO: exception safety for buf
 
@@ -206,7 +240,8 @@ openFromStreambuf(std::streambuf * buf,
     unique_ptr<filtering_ostream> new_stream
         (new filtering_ostream());
 
-    addCompression(*buf, *new_stream, resource, compression, compressionLevel);
+    addCompression(*buf, *new_stream, resource, compression, compressionLevel,
+                   compressionThreads);
 
     new_stream->push(*buf);
 
@@ -219,7 +254,8 @@ openFromStreambuf(std::streambuf * buf,
 
 void filter_ostream::
 open(int fd, std::ios_base::openmode mode,
-     const std::string & compression, int compressionLevel)
+     const std::string & compression, int compressionLevel,
+     int compressionThreads)
 {
     using namespace boost::iostreams;
     
@@ -229,7 +265,7 @@ open(int fd, std::ios_base::openmode mode,
     if (compression.size() > 0) {
         stringbuf headerbuf;
         addCompression(headerbuf, *new_stream, "", compression,
-                       compressionLevel);
+                       compressionLevel, compressionThreads);
         string header = headerbuf.str();
         ssize_t rc = ::write(fd, header.c_str(), header.size());
         if (rc < 0) {
@@ -288,10 +324,10 @@ filter_istream::filter_istream()
 
 filter_istream::
 filter_istream(const std::string & file, std::ios_base::openmode mode,
-               const std::string & compression)
+               const std::string & compression, int decompressionThreads)
     : istream(std::cin.rdbuf())
 {
-    open(file, mode, compression);
+    open(file, mode, compression, decompressionThreads);
 }
 
 filter_istream::
@@ -323,11 +359,176 @@ operator = (filter_istream && other)
     return *this;
 }
 
+namespace {
+
+/** The compression of a file, going by the first few bytes of it.  Returns
+    the empty string if it's not recognized.
+*/
+std::string detectCompression(const std::string & start)
+{
+    auto startsWith = [&] (const char * magic, size_t len)
+        {
+            return start.size() >= len
+                && start.compare(0, len, magic, len) == 0;
+        };
+
+    if (startsWith("\x1f\x8b", 2))
+        return "gz";
+    if (startsWith("BZh", 3) && start.size() >= 4
+        && start[3] >= '1' && start[3] <= '9')
+        return "bz2";
+    if (startsWith("\xfd" "7zXZ\0", 6))
+        return "xz";
+    if (startsWith("\x28\xb5\x2f\xfd", 4))
+        return "zst";
+    if (startsWith("\x04\x22\x4d\x18", 4))
+        return "lz4";
+    return "";
+}
+
+/** Source that gives back the bytes that were read from the streambuf to
+    detect its compression, followed by the rest of the streambuf. */
+struct Prefixed_Source {
+    typedef char char_type;
+    typedef boost::iostreams::source_tag category;
+
+    Prefixed_Source(const std::string & prefix, std::streambuf * buf)
+        : prefix(new std::string(prefix)), done(new size_t(0)), buf(buf)
+    {
+    }
+
+    std::streamsize read(char * s, std::streamsize n)
+    {
+        if (*done < prefix->size()) {
+            size_t todo = std::min<size_t>(n, prefix->size() - *done);
+            std::copy(prefix->data() + *done, prefix->data() + *done + todo,
+                      s);
+            *done += todo;
+            return todo;
+        }
+
+        std::streamsize res = buf->sgetn(s, n);
+        return res == 0 ? -1 : res;
+    }
+
+    // Boost copies the device, so the position is shared
+    std::shared_ptr<std::string> prefix;
+    std::shared_ptr<size_t> done;
+    std::streambuf * buf;
+};
+
+/** Push what's needed to read the compressed streambuf onto the stream. */
+void addDecompression(boost::iostreams::filtering_istream & stream,
+                      std::streambuf * buf,
+                      const std::string & resource,
+                      const std::string & compression,
+                      int decompressionThreads)
+{
+    using namespace boost::iostreams;
+
+    // "auto" goes by the extension too, and only looks inside if there
+    // isn't one
+    bool byName = (compression == "" || compression == "auto");
+
+    bool gzip = (compression == "gz" || compression == "gzip"
+                 || (byName
+                     && (ends_with(resource, ".gz")
+                         || ends_with(resource, ".gz~"))));
+    bool bzip2 = (compression == "bz2" || compression == "bzip2"
+                 || (byName
+                     && (ends_with(resource, ".bz2")
+                         || ends_with(resource, ".bz2~"))));
+    bool lzma = (compression == "xz" || compression == "lzma"
+                 || (byName
+                     && (ends_with(resource, ".xz")
+                         || ends_with(resource, ".xz~"))));
+    bool zstd = (compression == "zst" || compression == "zstd"
+                 || (byName
+                     && (ends_with(resource, ".zst")
+                         || ends_with(resource, ".zst~"))));
+    bool lz4 = (compression == "lz4"
+                || (byName
+                    && (ends_with(resource, ".lz4")
+                        || ends_with(resource, ".lz4~"))));
+
+    // Nothing to go on from the name, so look at what's in the file.  If
+    // the streambuf can seek, we go back to where we were; otherwise what
+    // was read to find out is put back in front of the rest of it.
+    bool detect = (compression == "auto"
+                   && !gzip && !bzip2 && !lzma && !zstd && !lz4);
+    bool prefixed = false;
+    std::string start;
+    if (detect) {
+        std::streampos pos = buf->pubseekoff(0, ios::cur, ios::in);
+        start.resize(6);
+        start.resize(buf->sgetn(&start[0], start.size()));
+        prefixed = (pos == std::streampos(std::streamoff(-1))
+                    || buf->pubseekpos(pos, ios::in) != pos);
+        std::string detected = detectCompression(start);
+        gzip = (detected == "gz");
+        bzip2 = (detected == "bz2");
+        lzma = (detected == "xz");
+        zstd = (detected == "zst");
+        lz4 = (detected == "lz4");
+    }
+
+    if (gzip) stream.push(gzip_decompressor());
+    if (bzip2) stream.push(bzip2_decompressor());
+    if (lzma) stream.push(lzma_decompressor());
+    if (zstd)
+        stream.push(zstd_decompressor(decompressionThreads));
+    if (lz4) stream.push(lz4_decompressor());
+
+    if (prefixed) stream.push(Prefixed_Source(start, buf));
+    else stream.push(*buf);
+}
+
+/** Input filter that skips the given number of bytes, and then ends after
+    the given number more. */
+struct Range_Filter {
+    typedef char char_type;
+    struct category
+        : boost::iostreams::multichar_input_filter_tag {
+    };
+
+    Range_Filter(uint64_t skip, uint64_t limit)
+        : skip(skip), limit(limit)
+    {
+    }
+
+    template<typename Source>
+    std::streamsize read(Source & src, char * s, std::streamsize n)
+    {
+        while (skip) {
+            char buf[65536];
+            std::streamsize res
+                = boost::iostreams::read(src, buf,
+                                         std::min<uint64_t>(skip,
+                                                            sizeof(buf)));
+            if (res <= 0) return -1;
+            skip -= res;
+        }
+
+        if (limit == 0) return -1;
+
+        std::streamsize res
+            = boost::iostreams::read(src, s, std::min<uint64_t>(n, limit));
+        if (res > 0) limit -= res;
+        return res;
+    }
+
+    uint64_t skip;
+    uint64_t limit;
+};
+
+} // file scope
+
 void
 filter_istream::
 open(const std::string & uri,
      std::ios_base::openmode mode,
-     const std::string & compression)
+     const std::string & compression,
+     int decompressionThreads)
 {
     exceptions(ios::badbit);
 
@@ -339,7 +540,8 @@ open(const std::string & uri,
     bool weOwnBuf;
     std::tie(buf, weOwnBuf) = handler(scheme, resource, mode);
 
-    openFromStreambuf(buf, weOwnBuf, resource, compression);
+    openFromStreambuf(buf, weOwnBuf, resource, compression,
+                      decompressionThreads);
 }
 
 void
@@ -347,7 +549,8 @@ filter_istream::
 openFromStreambuf(std::streambuf * buf,
                   bool weOwnBuf,
                   const std::string & resource,
-                  const std::string & compression)
+                  const std::string & compression,
+                  int decompressionThreads)
 {
     // TODO: exception safety for buf
 
@@ -360,30 +563,106 @@ openFromStreambuf(std::streambuf * buf,
     unique_ptr<filtering_istream> new_stream
         (new filtering_istream());
 
-    bool gzip = (compression == "gz" || compression == "gzip"
-                 || (compression == ""
-                     && (ends_with(resource, ".gz")
-                         || ends_with(resource, ".gz~"))));
-    bool bzip2 = (compression == "bz2" || compression == "bzip2"
-                 || (compression == ""
-                     && (ends_with(resource, ".bz2")
-                         || ends_with(resource, ".bz2~"))));
-    bool lzma = (compression == "xz" || compression == "lzma"
-                 || (compression == ""
-                     && (ends_with(resource, ".xz")
-                         || ends_with(resource, ".xz~"))));
+    addDecompression(*new_stream, buf, resource, compression,
+                     decompressionThreads);
 
-    if (gzip) new_stream->push(gzip_decompressor());
-    if (bzip2) new_stream->push(bzip2_decompressor());
-    if (lzma) new_stream->push(lzma_decompressor());
+    this->stream = std::move(new_stream);
+    this->sink = std::move(sink);
+    rdbuf(this->stream->rdbuf());
+}
 
-    new_stream->push(*buf);
+void
+filter_istream::
+openRange(const std::string & uri,
+          uint64_t start,
+          uint64_t end,
+          const std::string & compression,
+          int decompressionThreads)
+{
+    using namespace boost::iostreams;
+
+    exceptions(ios::badbit);
+
+    string scheme, resource;
+    std::tie(scheme, resource) = getScheme(uri);
+
+    const auto & handler = getUriHandler(scheme);
+    std::streambuf * buf;
+    bool weOwnBuf;
+    std::tie(buf, weOwnBuf) = handler(scheme, resource, ios::in);
+
+    std::unique_ptr<std::streambuf> sink;
+    if (weOwnBuf)
+        sink.reset(buf);
+
+    unique_ptr<filtering_istream> new_stream
+        (new filtering_istream());
+
+    uint64_t length = (end > start ? end - start : 0);
+
+    // Only xz and zstd files can have an index, and we can only read it if
+    // the file can seek
+    std::shared_ptr<Compressed_Block_Index> index;
+    bool seekable
+        = buf->pubseekoff(0, ios::cur, ios::in) != std::streamoff(-1);
+    if (seekable
+        && (compression == "" || compression == "auto"
+            || compression == "xz" || compression == "lzma"
+            || compression == "zst" || compression == "zstd")) {
+        index = Compressed_Block_Index::read(*buf);
+        if (!index) buf->pubseekpos(0, ios::in);
+    }
+
+    if (index) {
+        // Only the blocks that overlap the range are read
+        size_t first = index->findBlock(start);
+        size_t last = index->blocks.size();
+        if (length == 0)
+            last = first;
+        else if (end < index->uncompressedSize)
+            last = index->findBlock(end - 1) + 1;
+
+        uint64_t skip = 0;
+        if (first < last)
+            skip = start - index->blocks[first].uncompressedOffset;
+
+        new_stream->push(Range_Filter(skip, length));
+        if (first < last && index->format == Compressed_Block_Index::XZ)
+            new_stream->push(lzma_decompressor());
+        if (first < last && index->format == Compressed_Block_Index::ZSTD)
+            new_stream->push(zstd_decompressor(decompressionThreads));
+        new_stream->push(Segment_Source(buf, index->segments(first, last)));
+    }
+    else {
+        // Read it from the start, throwing away what comes before
+        new_stream->push(Range_Filter(start, length));
+        addDecompression(*new_stream, buf, resource, compression,
+                         decompressionThreads);
+    }
 
     this->stream = std::move(new_stream);
     this->sink = std::move(sink);
     rdbuf(this->stream->rdbuf());
 }
 
+std::shared_ptr<const Compressed_Block_Index>
+getCompressedBlockIndex(const std::string & uri)
+{
+    string scheme, resource;
+    std::tie(scheme, resource) = getScheme(uri);
+
+    const auto & handler = getUriHandler(scheme);
+    std::streambuf * buf;
+    bool weOwnBuf;
+    std::tie(buf, weOwnBuf) = handler(scheme, resource, ios::in);
+
+    std::unique_ptr<std::streambuf> sink;
+    if (weOwnBuf)
+        sink.reset(buf);
+
+    return Compressed_Block_Index::read(*buf);
+}
+
 void
 filter_istream::
 close()
@@ -26,9 +26,12 @@
 #include <iostream>
 #include <fstream>
 #include <memory>
+#include <stdint.h>
 
 namespace ML {
 
+struct Compressed_Block_Index;
+
 
 /*****************************************************************************/
 /* FILTER OSTREAM                                                            */
@@ -41,17 +44,31 @@ namespace ML {
       extensible API.
 */
 
+/** The compression is taken from the compression argument ("gz", "bz2",
+    "xz", "zst" or "lz4", or "none") or failing that from the extension of
+    the file.
+
+    compressionThreads says how gzip, xz, zstd and lz4 compression is done:
+    - 1 (the default) compresses the stream in the writing thread;
+    - 0 compresses blocks of it on all of the threads of the default
+      Worker_Task, with the writing thread helping (see parallel_compressor);
+    - more than 1 does the same, but with no more than that many blocks
+      being compressed at once.
+*/
+
 class filter_ostream : public std::ostream {
 public:
     filter_ostream();
     filter_ostream(const std::string & uri,
                    std::ios_base::openmode mode = std::ios_base::out,
                    const std::string & compression = "",
-                   int compressionLevel = -1);
+                   int compressionLevel = -1,
+                   int compressionThreads = 1);
     filter_ostream(int fd,
                    std::ios_base::openmode mode = std::ios_base::out,
                    const std::string & compression = "",
-                   int compressionLevel = -1);
+                   int compressionLevel = -1,
+                   int compressionThreads = 1);
 
     filter_ostream(filter_ostream && other) noexcept;
 
@@ -62,17 +79,20 @@ public:
     void open(const std::string & uri,
               std::ios_base::openmode mode = std::ios_base::out,
               const std::string & compression = "",
-              int level = -1);
+              int level = -1,
+              int compressionThreads = 1);
     void open(int fd,
               std::ios_base::openmode mode = std::ios_base::out,
               const std::string & compression = "",
-              int level = -1);
+              int level = -1,
+              int compressionThreads = 1);
 
     void openFromStreambuf(std::streambuf * buf,
                            bool weOwnBuf,
                            const std::string & resource = "",
                            const std::string & compression = "",
-                           int compressionLevel = -1);
+                           int compressionLevel = -1,
+                           int compressionThreads = 1);
 
     void close();
 
@@ -88,12 +108,25 @@ private:
 /* FILTER ISTREAM                                                            */
 /*****************************************************************************/
 
+/** As for filter_ostream, the compression comes from the compression
+    argument or the extension of the file.  With "auto", a file whose
+    extension doesn't give it has its first few bytes looked at to
+    recognize gzip, bzip2, xz, zstd and lz4 files; anything else is read as
+    it is.  Use "none" to never decompress.
+
+    decompressionThreads is the number of zstd frames that are decompressed
+    at once (see zstd_decompressor); 0 means one per worker thread.  Only
+    files made of many frames, such as those written by filter_ostream with
+    several compressionThreads, benefit.
+*/
+
 class filter_istream : public std::istream {
 public:
     filter_istream();
     filter_istream(const std::string & uri,
                    std::ios_base::openmode mode = std::ios_base::in,
-                   const std::string & compression = "");
+                   const std::string & compression = "",
+                   int decompressionThreads = 1);
 
     filter_istream(filter_istream && other) noexcept;
 
@@ -103,12 +136,29 @@ public:
 
     void open(const std::string & uri,
               std::ios_base::openmode mode = std::ios_base::in,
-              const std::string & comparession = "");
+              const std::string & comparession = "",
+              int decompressionThreads = 1);
 
     void openFromStreambuf(std::streambuf * buf,
                            bool weOwnBuf,
                            const std::string & resource = "",
-                           const std::string & compression = "");
+                           const std::string & compression = "",
+                           int decompressionThreads = 1);
+
+    /** Open the part of what the file decompresses to that starts at start
+        and ends before end (or at the end of the file).
+
+        For xz and zstd files that have an index of their blocks (see
+        Compressed_Block_Index), only the blocks that overlap the range
+        are read, so it doesn't matter how far into the file it is.  For
+        anything else, the file is decompressed from the start and what
+        comes before the range is thrown away.
+    */
+    void openRange(const std::string & uri,
+                   uint64_t start,
+                   uint64_t end = (uint64_t)-1,
+                   const std::string & compression = "",
+                   int decompressionThreads = 1);
 
     void close();
 
@@ -118,6 +168,16 @@ private:
 };
 
 
+/** Open the given URI and read the index of its blocks, as for
+    Compressed_Block_Index::read().  This is what's needed to split a big
+    compressed file into ranges for filter_istream::openRange(), so that
+    each block is only decompressed once.  Returns a null pointer if the
+    file doesn't have one.
+*/
+std::shared_ptr<const Compressed_Block_Index>
+getCompressedBlockIndex(const std::string & uri);
+
+
 /*****************************************************************************/
 /* REGISTRY                                                                  */
 /*****************************************************************************/
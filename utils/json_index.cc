@@ -0,0 +1,574 @@
+/* json_index.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Structural index of a JSON document.
+*/
+
+#include "json_index.h"
+#include "jml/arch/format.h"
+#include "jml/arch/exception.h"
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+
+using namespace std;
+
+
+namespace ML {
+
+namespace {
+
+/** Find the structural characters ({}[]:,), the brackets amongst them,
+    the quotes and the backslashes in the 64 bytes at p, as one bit per
+    byte.  The brackets are found with two comparisons: or-ing in 0x20
+    maps [ onto { and ] onto }, and nothing else onto either. */
+void classify64(const char * p, uint64_t & structural, uint64_t & brackets,
+                uint64_t & quote, uint64_t & backslash)
+{
+#if defined(__AVX2__)
+    structural = brackets = quote = backslash = 0;
+    for (unsigned i = 0;  i < 64;  i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i folded = _mm256_or_si256(block, _mm256_set1_epi8(0x20));
+        __m256i br
+            = _mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')),
+                              _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}')));
+        __m256i s
+            = _mm256_or_si256
+            (br,
+             _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(':')),
+                             _mm256_cmpeq_epi8(block, _mm256_set1_epi8(','))));
+        __m256i q = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('"'));
+        __m256i b = _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\\'));
+        structural |= (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << i;
+        brackets |= (uint64_t)(uint32_t)_mm256_movemask_epi8(br) << i;
+        quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(q) << i;
+        backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(b) << i;
+    }
+#elif defined(__SSE2__)
+    structural = brackets = quote = backslash = 0;
+    for (unsigned i = 0;  i < 64;  i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i folded = _mm_or_si128(block, _mm_set1_epi8(0x20));
+        __m128i br
+            = _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')),
+                           _mm_cmpeq_epi8(folded, _mm_set1_epi8('}')));
+        __m128i s
+            = _mm_or_si128(br,
+                           _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(':')),
+                                        _mm_cmpeq_epi8(block, _mm_set1_epi8(','))));
+        __m128i q = _mm_cmpeq_epi8(block, _mm_set1_epi8('"'));
+        __m128i b = _mm_cmpeq_epi8(block, _mm_set1_epi8('\\'));
+        structural |= (uint64_t)_mm_movemask_epi8(s) << i;
+        brackets |= (uint64_t)_mm_movemask_epi8(br) << i;
+        quote |= (uint64_t)_mm_movemask_epi8(q) << i;
+        backslash |= (uint64_t)_mm_movemask_epi8(b) << i;
+    }
+#else
+    structural = brackets = quote = backslash = 0;
+    for (unsigned i = 0;  i < 64;  ++i) {
+        char c = p[i];
+        uint64_t bit = 1ULL << i;
+        if ((c | 0x20) == '{' || (c | 0x20) == '}')
+            structural |= bit, brackets |= bit;
+        else if (c == ':' || c == ',')
+            structural |= bit;
+        else if (c == '"') quote |= bit;
+        else if (c == '\\') backslash |= bit;
+    }
+#endif
+}
+
+/** Return the mask of characters that are escaped by a backslash.
+    Backslashes are rare, so they are walked one at a time.  carry is
+    set if the first character of the next block is escaped. */
+uint64_t find_escaped(uint64_t backslash, uint64_t & carry)
+{
+    uint64_t escaped = carry;
+    backslash &= ~carry;
+    carry = 0;
+
+    while (backslash) {
+        int i = __builtin_ctzll(backslash);
+        if (i == 63) {
+            carry = 1;
+            break;
+        }
+        escaped |= 2ULL << i;
+        backslash &= ~(3ULL << i);
+    }
+
+    return escaped;
+}
+
+/** Each bit of the result is the xor of that bit and all lower bits, which
+    turns a mask of quotes into a mask of what's inside the strings. */
+uint64_t prefix_xor(uint64_t x)
+{
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+bool isJsonSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+} // file scope
+
+
+/*****************************************************************************/
+/* JSON INDEX                                                                */
+/*****************************************************************************/
+
+JsonIndex::
+JsonIndex()
+    : start(0), end(0), size_(0), capacity_(0)
+{
+}
+
+JsonIndex::
+JsonIndex(const char * start, const char * end)
+    : size_(0), capacity_(0)
+{
+    init(start, end);
+}
+
+void
+JsonIndex::
+reserve(size_t newCapacity)
+{
+    if (newCapacity <= capacity_) return;
+
+    std::unique_ptr<uint32_t[]> newPositions(new uint32_t[newCapacity]);
+    std::unique_ptr<uint32_t[]> newMatching(new uint32_t[newCapacity]);
+    std::copy(positions.get(), positions.get() + size_, newPositions.get());
+    std::copy(matching.get(), matching.get() + size_, newMatching.get());
+
+    positions.swap(newPositions);
+    matching.swap(newMatching);
+    capacity_ = newCapacity;
+}
+
+void
+JsonIndex::
+init(const char * start, const char * end)
+{
+    this->start = start;
+    this->end = end;
+
+    size_t length = end - start;
+    if (length >= (1ULL << 32))
+        throw Exception("JsonIndex: document is longer than 4GB");
+
+    // There is always room for a whole block of entries, so that they can
+    // be written without checking
+    size_ = 0;
+    reserve(length / 4 + 64);
+
+    uint64_t escapeCarry = 0, inString = 0;
+    vector<uint32_t> open;  // entry numbers of the unclosed brackets
+
+    for (size_t ofs = 0;  ofs < length;  ofs += 64) {
+        const char * p = start + ofs;
+
+        char padded[64];
+        if (length - ofs < 64) {
+            memset(padded, ' ', 64);
+            memcpy(padded, p, length - ofs);
+            p = padded;
+        }
+
+        uint64_t structural, brackets, quote, backslash;
+        classify64(p, structural, brackets, quote, backslash);
+
+        quote &= ~find_escaped(backslash, escapeCarry);
+        uint64_t strings = prefix_xor(quote) ^ inString;
+        inString = (uint64_t)((int64_t)strings >> 63);
+
+        uint64_t entries = (structural & ~strings) | quote;
+        brackets &= ~strings;
+
+        if (JML_UNLIKELY(size_ + 64 > capacity_))
+            reserve(capacity_ * 2);
+
+        // Write the entries eight at a time, so that there is only a
+        // branch per eight instead of one per entry.  Extra entries
+        // beyond the real ones are written but then overwritten.
+        uint32_t * out = positions.get() + size_;
+        uint64_t toWrite = entries;
+        int count = __builtin_popcountll(entries);
+        for (int i = 0;  i < count;  i += 8) {
+            for (int j = 0;  j < 8;  ++j) {
+                out[i + j] = ofs + __builtin_ctzll(toWrite | (1ULL << 63));
+                toWrite &= toWrite - 1;
+            }
+        }
+
+        // Match up the brackets.  There are far fewer of them than entries,
+        // so they are found from their own mask.
+        for (uint64_t b = brackets;  b;  b &= b - 1) {
+            int bit = __builtin_ctzll(b);
+            uint32_t i = size_
+                + __builtin_popcountll(entries & ((1ULL << bit) - 1));
+            char c = p[bit];
+            if (c == '{' || c == '[') {
+                open.push_back(i);
+                continue;
+            }
+            if (open.empty()
+                || start[positions[open.back()]] != (c == '}' ? '{' : '['))
+                throw Exception(format("JsonIndex: unmatched '%c' at "
+                                       "offset %d", c, (int)(ofs + bit)));
+            matching[open.back()] = i;
+            open.pop_back();
+        }
+
+        size_ += count;
+    }
+
+    if (inString)
+        throw Exception("JsonIndex: unterminated string");
+
+    if (!open.empty())
+        throw Exception(format("JsonIndex: unclosed '%c' at offset %d",
+                               start[positions[open.back()]],
+                               (int)positions[open.back()]));
+}
+
+JsonIndexValue
+JsonIndex::
+root() const
+{
+    uint32_t begin = 0;
+    while (start + begin < end && isJsonSpace(start[begin]))
+        ++begin;
+    return JsonIndexValue(this, 0, begin);
+}
+
+
+/*****************************************************************************/
+/* JSON INDEX VALUE                                                          */
+/*****************************************************************************/
+
+char
+JsonIndexValue::
+firstChar() const
+{
+    if (!index || index->start + begin >= index->end)
+        return 0;
+    return index->start[begin];
+}
+
+bool
+JsonIndexValue::
+textIs(const char * str) const
+{
+    if (!index) return false;
+    const char * first, * last;
+    range(first, last);
+    size_t len = strlen(str);
+    return (size_t)(last - first) == len && memcmp(first, str, len) == 0;
+}
+
+bool
+JsonIndexValue::
+isNull() const
+{
+    return textIs("null");
+}
+
+bool
+JsonIndexValue::
+isBool() const
+{
+    return textIs("true") || textIs("false");
+}
+
+bool
+JsonIndexValue::
+isNumber() const
+{
+    char c = firstChar();
+    return c == '-' || (c >= '0' && c <= '9');
+}
+
+uint32_t
+JsonIndexValue::
+skip() const
+{
+    switch (firstChar()) {
+    case '{':
+    case '[':
+        return index->matching[entry] + 1;
+    case '"':
+        return entry + 2;
+    default:
+        return entry;
+    }
+}
+
+JsonIndexValue
+JsonIndexValue::
+valueAfter(uint32_t i) const
+{
+    uint32_t b = index->positionOrEnd(i) + 1;
+    uint32_t length = index->end - index->start;
+    while (b < length && isJsonSpace(index->start[b]))
+        ++b;
+
+    JsonIndexValue result(index, i + 1, b);
+
+    char c = index->entryChar(i + 1);
+    if (b == length
+        || (b == index->positionOrEnd(i + 1) && c != '{' && c != '['
+            && c != '"'))
+        result.exception("expected JSON value");
+
+    return result;
+}
+
+uint32_t
+JsonIndexValue::
+firstMember() const
+{
+    if (!isObject())
+        exception("expected JSON object");
+    if (index->entryChar(entry + 1) == '}')
+        return NONE;
+    return entry + 1;
+}
+
+JsonIndexValue
+JsonIndexValue::
+memberValue(uint32_t i, std::string & scratch,
+            const char * & key, size_t & len) const
+{
+    if (index->entryChar(i) != '"')
+        JsonIndexValue(index, i, index->positionOrEnd(i))
+            .exception("expected JSON object key");
+
+    const char * first = index->start + index->positionOrEnd(i) + 1;
+    const char * last = index->start + index->positionOrEnd(i + 1);
+
+    if (memchr(first, '\\', last - first)) {
+        // Has escapes, so it's always unescaped into scratch
+        Parse_Context context("JSON key", first - 1, last + 1);
+        expectJsonStringView(context, scratch, key, len);
+    }
+    else {
+        key = first;
+        len = last - first;
+    }
+
+    if (index->entryChar(i + 2) != ':')
+        JsonIndexValue(index, i + 2, index->positionOrEnd(i + 2))
+            .exception("expected ':' after JSON object key");
+
+    return valueAfter(i + 2);
+}
+
+uint32_t
+JsonIndexValue::
+nextMember(const JsonIndexValue & value) const
+{
+    uint32_t i = value.skip();
+    char c = index->entryChar(i);
+    if (c == ',')
+        return i + 1;
+    if (c == '}')
+        return NONE;
+    JsonIndexValue(index, i, index->positionOrEnd(i))
+        .exception("expected ',' or '}' in JSON object");
+}
+
+JsonIndexValue
+JsonIndexValue::
+firstElement() const
+{
+    if (!isArray())
+        exception("expected JSON array");
+
+    uint32_t b = begin + 1;
+    uint32_t length = index->end - index->start;
+    while (b < length && isJsonSpace(index->start[b]))
+        ++b;
+
+    if (b == index->positionOrEnd(entry + 1) && index->entryChar(entry + 1) == ']')
+        return JsonIndexValue();
+
+    return valueAfter(entry);
+}
+
+JsonIndexValue
+JsonIndexValue::
+nextElement(const JsonIndexValue & value) const
+{
+    uint32_t i = value.skip();
+    char c = index->entryChar(i);
+    if (c == ',')
+        return valueAfter(i);
+    if (c == ']')
+        return JsonIndexValue();
+    JsonIndexValue(index, i, index->positionOrEnd(i))
+        .exception("expected ',' or ']' in JSON array");
+}
+
+JsonIndexValue
+JsonIndexValue::
+find(const char * key, size_t len) const
+{
+    string scratch;
+    uint32_t i = firstMember();
+    while (i != NONE) {
+        const char * k;
+        size_t l;
+        JsonIndexValue value = memberValue(i, scratch, k, l);
+        if (l == len && memcmp(k, key, len) == 0)
+            return value;
+        i = nextMember(value);
+    }
+
+    return JsonIndexValue();
+}
+
+JsonIndexValue
+JsonIndexValue::
+operator [] (const std::string & key) const
+{
+    JsonIndexValue result = find(key);
+    if (!result.valid())
+        exception(("JSON object has no key " + key).c_str());
+    return result;
+}
+
+JsonIndexValue
+JsonIndexValue::
+at(size_t i) const
+{
+    JsonIndexValue value = firstElement();
+    for (;  value.valid() && i > 0;  --i)
+        value = nextElement(value);
+    if (!value.valid())
+        exception("JSON array index out of range");
+    return value;
+}
+
+size_t
+JsonIndexValue::
+size() const
+{
+    size_t result = 0;
+    if (isObject()) {
+        string scratch;
+        for (uint32_t i = firstMember();  i != NONE;  ++result) {
+            const char * key;
+            size_t len;
+            i = nextMember(memberValue(i, scratch, key, len));
+        }
+    }
+    else {
+        for (JsonIndexValue value = firstElement();  value.valid();
+             ++result)
+            value = nextElement(value);
+    }
+    return result;
+}
+
+void
+JsonIndexValue::
+range(const char * & first, const char * & last) const
+{
+    if (!index)
+        throw Exception("JsonIndexValue: no value");
+
+    first = index->start + begin;
+
+    switch (firstChar()) {
+    case '{':
+    case '[':
+        last = index->start + index->positionOrEnd(index->matching[entry]) + 1;
+        break;
+    case '"':
+        last = index->start + index->positionOrEnd(entry + 1) + 1;
+        break;
+    default:
+        last = index->start + index->positionOrEnd(entry);
+        while (last > first && isJsonSpace(last[-1]))
+            --last;
+    }
+}
+
+std::string
+JsonIndexValue::
+text() const
+{
+    const char * first, * last;
+    range(first, last);
+    return string(first, last);
+}
+
+std::string
+JsonIndexValue::
+getString() const
+{
+    if (!isString())
+        exception("expected JSON string");
+
+    const char * first, * last;
+    range(first, last);
+
+    if (!memchr(first, '\\', last - first))
+        return string(first + 1, last - 1);
+
+    Parse_Context context("JSON string", first, last);
+    string scratch;
+    const char * str;
+    size_t len;
+    expectJsonStringView(context, scratch, str, len);
+    return string(str, len);
+}
+
+JsonNumber
+JsonIndexValue::
+getNumber() const
+{
+    const char * first, * last;
+    range(first, last);
+
+    Parse_Context context("JSON number", first, last);
+    JsonNumber result = expectJsonNumber(context);
+    if (!context.eof())
+        exception("expected JSON number");
+    return result;
+}
+
+bool
+JsonIndexValue::
+getBool() const
+{
+    if (textIs("true")) return true;
+    if (textIs("false")) return false;
+    exception("expected JSON boolean");
+}
+
+void
+JsonIndexValue::
+exception(const char * message) const
+{
+    throw Exception(format("JsonIndex: %s at offset %d", message,
+                           (int)begin));
+}
+
+} // namespace ML
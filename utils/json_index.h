@@ -0,0 +1,216 @@
+/* json_index.h                                                    -*- C++ -*-
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Structural index of a JSON document, for pulling a few fields out of
+   large documents without tokenizing all of them.
+*/
+
+#ifndef __jml__utils__json_index_h__
+#define __jml__utils__json_index_h__
+
+#include "json_parsing.h"
+#include <memory>
+#include <string>
+#include <stdint.h>
+
+
+namespace ML {
+
+struct JsonIndexValue;
+
+
+/*****************************************************************************/
+/* JSON INDEX                                                                */
+/*****************************************************************************/
+
+/** Index of the structure of a JSON document in memory.
+
+    Building it is a single vectorized pass over the document, 64 bytes at
+    a time, that finds the quotes, backslashes and structural characters
+    ({}[]:,) as bitmasks.  The escaped quotes are removed from the quotes,
+    the quotes are turned into a mask of the bytes inside strings, and the
+    offsets of the structural characters that aren't in a string plus all
+    of the unescaped quotes are written to a list.  The brackets are
+    matched up in the same pass, so that a whole object or array can be
+    skipped over in constant time when navigating.
+
+    Only the bracket and quote structure is checked when the index is
+    built; everything else is checked lazily by JsonIndexValue when it is
+    accessed.  The document must outlive the index, and may be at most
+    4GB long.
+*/
+struct JsonIndex {
+    JsonIndex();
+
+    /** Index the JSON document in [start, end). */
+    JsonIndex(const char * start, const char * end);
+
+    /** Index the JSON document in [start, end). */
+    void init(const char * start, const char * end);
+
+    /** Return the top level value of the document. */
+    JsonIndexValue root() const;
+
+    /** Number of entries in the index. */
+    size_t size() const { return size_; }
+
+    /** Offset of entry i. */
+    uint32_t position(uint32_t i) const { return positions[i]; }
+
+    const char * start;    ///< Start of the document
+    const char * end;      ///< End of the document
+
+private:
+    friend struct JsonIndexValue;
+
+    /** Make room for at least newCapacity entries. */
+    void reserve(size_t newCapacity);
+
+    /** Offset of each structural character or quote. */
+    std::unique_ptr<uint32_t[]> positions;
+
+    /** For each opening bracket, the entry number of the closing bracket
+        that matches it.  Undefined for other entries. */
+    std::unique_ptr<uint32_t[]> matching;
+
+    size_t size_;
+    size_t capacity_;
+
+    /** Offset of entry i, or the document length for one past the end. */
+    uint32_t positionOrEnd(uint32_t i) const
+    {
+        return i < size_ ? positions[i] : end - start;
+    }
+
+    /** Character at entry i, or zero for one past the end. */
+    char entryChar(uint32_t i) const
+    {
+        return i < size_ ? start[positions[i]] : 0;
+    }
+};
+
+
+/*****************************************************************************/
+/* JSON INDEX VALUE                                                          */
+/*****************************************************************************/
+
+/** A value within an indexed JSON document.  It's a lightweight cursor
+    that can be copied freely, and navigating from one value to another
+    only touches the index and the characters that are needed.
+*/
+struct JsonIndexValue {
+    JsonIndexValue()
+        : index(0), entry(0), begin(0)
+    {
+    }
+
+    /** Does this refer to a value?  False for a value that was not found. */
+    bool valid() const { return index; }
+
+    bool isObject() const { return firstChar() == '{'; }
+    bool isArray() const { return firstChar() == '['; }
+    bool isString() const { return firstChar() == '"'; }
+    bool isNull() const;
+    bool isBool() const;
+    bool isNumber() const;
+
+    /** Look up the given key in an object.  Returns an invalid value if it
+        is not there.  Every member before it is skipped in constant time.
+    */
+    JsonIndexValue find(const char * key, size_t len) const;
+
+    JsonIndexValue find(const std::string & key) const
+    {
+        return find(key.c_str(), key.length());
+    }
+
+    /** As find, but throws if the key is missing. */
+    JsonIndexValue operator [] (const std::string & key) const;
+
+    /** Return the ith element of an array, or throw if out of range. */
+    JsonIndexValue at(size_t i) const;
+
+    /** Return the number of elements in an array or members in an
+        object. */
+    size_t size() const;
+
+    /** Call onMember(key, len, value) for each member of an object. */
+    template<typename Fn>
+    void forEachMember(const Fn & onMember) const
+    {
+        std::string scratch;
+        uint32_t i = firstMember();
+        while (i != NONE) {
+            const char * key;
+            size_t len;
+            JsonIndexValue value = memberValue(i, scratch, key, len);
+            onMember(key, len, value);
+            i = nextMember(value);
+        }
+    }
+
+    /** Call onElement(i, value) for each element of an array. */
+    template<typename Fn>
+    void forEachElement(const Fn & onElement) const
+    {
+        JsonIndexValue value = firstElement();
+        for (size_t i = 0;  value.valid();  ++i) {
+            onElement(i, value);
+            value = nextElement(value);
+        }
+    }
+
+    /** Return the (unescaped) contents of a string. */
+    std::string getString() const;
+
+    /** Return the value of a number. */
+    JsonNumber getNumber() const;
+
+    /** Return the value of a boolean. */
+    bool getBool() const;
+
+    /** Return the JSON text of the value, including any children. */
+    std::string text() const;
+
+    /** Text of the value as [first, last). */
+    void range(const char * & first, const char * & last) const;
+
+private:
+    friend struct JsonIndex;
+
+    JsonIndexValue(const JsonIndex * index, uint32_t entry, uint32_t begin)
+        : index(index), entry(entry), begin(begin)
+    {
+    }
+
+    static const uint32_t NONE = uint32_t(-1);
+
+    char firstChar() const;
+
+    /** Is the text of the value equal to str? */
+    bool textIs(const char * str) const;
+
+    /** Entry number just after the end of this value. */
+    uint32_t skip() const;
+
+    /** Value that starts just after entry i. */
+    JsonIndexValue valueAfter(uint32_t i) const;
+
+    uint32_t firstMember() const;
+    JsonIndexValue memberValue(uint32_t i, std::string & scratch,
+                               const char * & key, size_t & len) const;
+    uint32_t nextMember(const JsonIndexValue & value) const;
+
+    JsonIndexValue firstElement() const;
+    JsonIndexValue nextElement(const JsonIndexValue & value) const;
+
+    void exception(const char * message) const JML_NORETURN;
+
+    const JsonIndex * index;
+    uint32_t entry;   ///< First index entry at or after the value
+    uint32_t begin;   ///< Offset of the first character of the value
+};
+
+} // namespace ML
+
+#endif /* __jml__utils__json_index_h__ */
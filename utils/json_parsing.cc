@@ -6,6 +6,8 @@
 */
 
 #include "json_parsing.h"
+#include "fast_int_parsing.h"
+#include "fast_float_parsing.h"
 #include "jml/arch/format.h"
 
 
@@ -446,10 +448,68 @@ matchJsonObject(Parse_Context & context,
     return true;
 }
 
+namespace {
+
+/** Parse a number that lies entirely within the current buffer of the
+    context in place, without copying it or allocating.  Returns false
+    without moving if it can't, in which case the caller falls back to
+    the character at a time parser (which also produces the errors).
+*/
+bool matchJsonNumberInBuffer(Parse_Context & context, JsonNumber & result)
+{
+    const char * start = context.buffer_pos();
+    const char * end = context.buffer_end();
+
+    const char * p = start;
+    bool negative = p < end && *p == '-';
+    if (negative) ++p;
+
+    const char * digitsEnd = p;
+    while (digitsEnd < end && (unsigned)(*digitsEnd - '0') <= 9)
+        ++digitsEnd;
+
+    bool isFloat = digitsEnd < end
+        && (*digitsEnd == '.' || *digitsEnd == 'e' || *digitsEnd == 'E');
+
+    const char * numEnd;
+    if (isFloat) {
+        numEnd = parse_double(start, end, result.fp);
+        if (!numEnd) return false;
+        result.type = JsonNumber::FLOATING_POINT;
+    }
+    else {
+        unsigned long long val;
+        numEnd = parse_unsigned_long_long(p, end, val);
+        if (!numEnd) return false;
+        if (negative) {
+            if (val > (unsigned long long)LLONG_MAX + 1)
+                return false;
+            result.uns = -val;
+            result.type = JsonNumber::SIGNED_INT;
+        }
+        else {
+            result.uns = val;
+            result.type = JsonNumber::UNSIGNED_INT;
+        }
+    }
+
+    // The number may carry on into the next buffer
+    if (numEnd == end && !context.last_buffer())
+        return false;
+
+    context.skip_buffered(numEnd);
+    return true;
+}
+
+} // file scope
+
 JsonNumber expectJsonNumber(Parse_Context & context)
 {
     JsonNumber result;
 
+    if (JML_LIKELY(matchJsonNumberInBuffer(context, result)))
+        return result;
+
     std::string number;
     number.reserve(32);
 
@@ -546,4 +606,115 @@ JsonNumber expectJsonNumber(Parse_Context & context)
     return result;
 }
 
+
+/*****************************************************************************/
+/* JSON EVENT READER                                                         */
+/*****************************************************************************/
+
+namespace {
+
+/** Read the four hex digits of a \u escape. */
+unsigned expectJsonHex4(Parse_Context & context)
+{
+    unsigned result = 0;
+    for (unsigned i = 0;  i < 4;  ++i) {
+        char c = *context++;
+        unsigned digit;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        else context.exception("invalid hex digit in \\u escape");
+        result = result * 16 + digit;
+    }
+    return result;
+}
+
+void appendUtf8(std::string & str, unsigned code)
+{
+    if (code < 0x80)
+        str.push_back(code);
+    else if (code < 0x800) {
+        str.push_back(0xc0 | (code >> 6));
+        str.push_back(0x80 | (code & 0x3f));
+    }
+    else if (code < 0x10000) {
+        str.push_back(0xe0 | (code >> 12));
+        str.push_back(0x80 | ((code >> 6) & 0x3f));
+        str.push_back(0x80 | (code & 0x3f));
+    }
+    else {
+        str.push_back(0xf0 | (code >> 18));
+        str.push_back(0x80 | ((code >> 12) & 0x3f));
+        str.push_back(0x80 | ((code >> 6) & 0x3f));
+        str.push_back(0x80 | (code & 0x3f));
+    }
+}
+
+} // file scope
+
+const char *
+expectJsonStringView(Parse_Context & context, std::string & scratch,
+                     const char * & str, size_t & len)
+{
+    if (context.eof() || *context != '"')
+        context.exception("expected string");
+
+    const char * start = context.buffer_pos() + 1;
+    const char * end = context.buffer_end();
+
+    // Fast path: no escapes and the closing quote is in this buffer
+    const char * p = scan_for_any(start, end, '"', '\\', '"', '"');
+    if (p != end && *p == '"') {
+        str = start;
+        len = p - start;
+        return p + 1;
+    }
+
+    scratch.clear();
+    ++context;
+
+    for (;;) {
+        context.append_text(scratch,
+                            Parse_Context::Matches_Any_Char('"', '\\'));
+        if (context.eof())
+            context.exception("unterminated JSON string");
+        if (context.match_literal('"'))
+            break;
+
+        ++context;  // backslash
+        char c = *context++;
+        switch (c) {
+        case 't': scratch.push_back('\t');  break;
+        case 'n': scratch.push_back('\n');  break;
+        case 'r': scratch.push_back('\r');  break;
+        case 'f': scratch.push_back('\f');  break;
+        case 'b': scratch.push_back('\b');  break;
+        case '/': scratch.push_back('/');   break;
+        case '\\':scratch.push_back('\\');  break;
+        case '"': scratch.push_back('"');   break;
+        case 'u': {
+            unsigned code = expectJsonHex4(context);
+            if (code >= 0xdc00 && code < 0xe000)
+                context.exception("unpaired low surrogate in JSON string");
+            if (code >= 0xd800 && code < 0xdc00) {
+                context.expect_literal("\\u",
+                                       "expected low surrogate in JSON string");
+                unsigned low = expectJsonHex4(context);
+                if (low < 0xdc00 || low >= 0xe000)
+                    context.exception("invalid low surrogate in JSON string");
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+            }
+            appendUtf8(scratch, code);
+            break;
+        }
+        default:
+            context.exception("invalid escaped char");
+        }
+    }
+
+    str = scratch.data();
+    len = scratch.size();
+    return 0;
+}
+
 } // namespace ML
@@ -107,6 +107,156 @@ JsonNumber expectJsonNumber(Parse_Context & context);
 /** Match a JSON number. */
 bool matchJsonNumber(Parse_Context & context, JsonNumber & num);
 
+
+/*****************************************************************************/
+/* JSON EVENT READER                                                         */
+/*****************************************************************************/
+
+/** Expect a JSON string at the current position, without copying it if
+    possible.  On return, str and len give the contents of the string.
+
+    If the string is entirely within the current buffer and has no escapes,
+    str points into the buffer, the position is NOT moved and the return
+    value is the position just past the closing quote; the caller should
+    pass it to context.skip_buffered() once it has finished with str.
+
+    Otherwise the string is unescaped (with \u escapes converted to UTF-8)
+    into scratch, the position is moved past the string and the return
+    value is zero.
+*/
+const char *
+expectJsonStringView(Parse_Context & context, std::string & scratch,
+                     const char * & str, size_t & len);
+
+/** Handler for the events produced by JsonEventReader.  Handlers don't
+    need to derive from it, but doing so means that only the events that
+    are of interest need to be redefined.  String and key contents are
+    only valid for the duration of the call.
+*/
+struct JsonEventHandler {
+    void onBeginObject() {}
+    void onKey(const char * key, size_t len) {}
+    void onEndObject() {}
+    void onBeginArray() {}
+    void onEndArray() {}
+    void onString(const char * str, size_t len) {}
+    void onNumber(const JsonNumber & number) {}
+    void onBool(bool value) {}
+    void onNull() {}
+};
+
+/** Streaming JSON reader that turns a JSON value into a series of calls
+    on a handler.  The handler is a template parameter, so the calls are
+    resolved (and usually inlined) at compile time.  Keys and strings are
+    passed as pointers into the input where possible; the others are
+    unescaped into a buffer that is reused, so that once it has grown
+    nothing is allocated per token.
+*/
+struct JsonEventReader {
+
+    /** Read a single JSON value, calling the handler for each event. */
+    template<class Handler>
+    void expectValue(Parse_Context & context, Handler & handler)
+    {
+        skipJsonWhitespace(context);
+
+        switch (*context) {
+        case '{':
+            expectObject(context, handler);
+            break;
+        case '[':
+            expectArray(context, handler);
+            break;
+        case '"':
+            expectString(context, handler, false);
+            break;
+        case 't':
+        case 'f':
+            handler.onBool(expectJsonBool(context));
+            break;
+        case 'n':
+            if (context.match_literal("null")) {
+                handler.onNull();
+                break;
+            }
+            // fall through; could be the nan extension
+        default:
+            handler.onNumber(expectJsonNumber(context));
+        }
+    }
+
+private:
+    template<class Handler>
+    void expectObject(Parse_Context & context, Handler & handler)
+    {
+        context.expect_literal('{');
+        handler.onBeginObject();
+
+        skipJsonWhitespace(context);
+
+        if (!context.match_literal('}')) {
+            for (;;) {
+                skipJsonWhitespace(context);
+                expectString(context, handler, true);
+                skipJsonWhitespace(context);
+                context.expect_literal(':');
+                expectValue(context, handler);
+                skipJsonWhitespace(context);
+                if (!context.match_literal(',')) break;
+            }
+
+            context.expect_literal('}');
+        }
+
+        handler.onEndObject();
+    }
+
+    template<class Handler>
+    void expectArray(Parse_Context & context, Handler & handler)
+    {
+        context.expect_literal('[');
+        handler.onBeginArray();
+
+        skipJsonWhitespace(context);
+
+        if (!context.match_literal(']')) {
+            for (;;) {
+                expectValue(context, handler);
+                skipJsonWhitespace(context);
+                if (!context.match_literal(',')) break;
+            }
+
+            context.expect_literal(']');
+        }
+
+        handler.onEndArray();
+    }
+
+    template<class Handler>
+    void expectString(Parse_Context & context, Handler & handler, bool isKey)
+    {
+        const char * str;
+        size_t len;
+        const char * end = expectJsonStringView(context, scratch, str, len);
+
+        if (isKey) handler.onKey(str, len);
+        else handler.onString(str, len);
+
+        if (end) context.skip_buffered(end);
+    }
+
+    std::string scratch;   ///< Unescaped strings go here
+};
+
+/** Read a single JSON value from the context, calling the handler for each
+    event. */
+template<class Handler>
+void readJsonEvents(Parse_Context & context, Handler & handler)
+{
+    JsonEventReader reader;
+    reader.expectValue(context, handler);
+}
+
 #ifdef CPPTL_JSON_H_INCLUDED
 
 inline Json::Value
@@ -20,6 +20,11 @@
 #include <string>
 #include <cassert>
 #include <functional>
+#include <algorithm>
+#include <memory>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace ML {
 
@@ -319,6 +324,194 @@ Allocator LogMemStorage<Bucket, Allocator>::
 allocator;
 
 
+/*****************************************************************************/
+/* SIMD PROBE STORAGE                                                        */
+/*****************************************************************************/
+
+/** Storage that keeps a parallel array of control bytes alongside the
+    buckets, one per bucket.  An empty bucket has a control byte of
+    EMPTY_CONTROL; a full one holds a 7 bit fragment of its key's hash.
+
+    Lightweight_Hash_Base recognises this storage and probes it 16 control
+    bytes at a time with SSE2, only looking at the buckets whose fragment
+    matches the key's.  Most of the buckets that a linear probe would have
+    to walk over are never touched, so that long probe sequences at high
+    load factors cost a few instructions per 16 buckets.
+
+    The capacity is always a power of two and at least PROBE_WIDTH.  The
+    first PROBE_WIDTH - 1 control bytes are mirrored after the end so that
+    a 16 byte load starting at any bucket never has to wrap around.
+*/
+
+template<typename Bucket, typename Allocator = std::allocator<Bucket> >
+struct SimdProbeStorage {
+    enum {
+        PROBE_WIDTH = 16,
+        EMPTY_CONTROL = 0x80
+    };
+
+    SimdProbeStorage()
+        : vals_(0), ctrl_(0), bits_(0)
+    {
+    }
+
+    SimdProbeStorage(size_t capacity)
+        : vals_(0), ctrl_(0), bits_(0)
+    {
+        reserve(capacity);
+    }
+
+    SimdProbeStorage(SimdProbeStorage && other)
+        : vals_(other.vals_), ctrl_(other.ctrl_), bits_(other.bits_)
+    {
+        other.vals_ = 0;
+        other.ctrl_ = 0;
+        other.bits_ = 0;
+    }
+
+    SimdProbeStorage & operator = (SimdProbeStorage && other)
+    {
+        destroy();
+        swap(other);
+        return *this;
+    }
+
+    ~SimdProbeStorage()
+    {
+        destroy();
+    }
+
+    Bucket * vals_;
+    uint8_t * ctrl_;
+    uint8_t bits_;
+
+    void swap(SimdProbeStorage & other)
+    {
+        std::swap(bits_, other.bits_);
+        std::swap(vals_, other.vals_);
+        std::swap(ctrl_, other.ctrl_);
+    }
+
+    size_t capacity() const JML_PURE_FN
+    {
+        return size_t(bits_ != 0) * (1ULL << (bits_ - 1));
+    }
+
+    void reserve(size_t newCapacity)
+    {
+        if (vals_)
+            throw ML::Exception("can't double initialize storage");
+
+        if (newCapacity == 0) return;
+        if (newCapacity < PROBE_WIDTH) newCapacity = PROBE_WIDTH;
+
+        bits_ = ML::highest_bit((newCapacity - 1), -1) + 2;
+        vals_ = allocator.allocate(capacity());
+        try {
+            ctrl_ = ctrl_allocator.allocate(num_control_bytes());
+        } catch (...) {
+            allocator.deallocate(vals_, capacity());
+            vals_ = 0;
+            bits_ = 0;
+            throw;
+        }
+        clearControl();
+
+        ExcAssertGreaterEqual(capacity(), newCapacity);
+    }
+
+    void destroy()
+    {
+        if (!vals_) return;
+        try {
+            allocator.deallocate(vals_, capacity());
+            ctrl_allocator.deallocate(ctrl_, num_control_bytes());
+        } catch (...) {}
+        vals_ = 0;
+        ctrl_ = 0;
+        bits_ = 0;
+    }
+
+    /** Bucket at which the probe for a key with the given full hash value
+        starts.  The hash is scrambled first, as the std::hash of integers
+        and pointers is the identity and would leave the fragments empty. */
+    size_t bucketForHash(size_t hash) const JML_PURE_FN
+    {
+        return mix(hash) >> (64 - (bits_ - 1));
+    }
+
+    /** Control byte fragment for a key with the given full hash value.  It
+        comes from the bits just below the ones that select the bucket, so
+        that keys colliding on a bucket mostly don't collide on it. */
+    uint8_t fragmentForHash(size_t hash) const JML_PURE_FN
+    {
+        return (mix(hash) >> (64 - (bits_ - 1) - 7)) & 0x7f;
+    }
+
+    void setControl(size_t index, uint8_t control)
+    {
+        ctrl_[index] = control;
+        if (index < PROBE_WIDTH - 1)
+            ctrl_[index + capacity()] = control;
+    }
+
+    void clearControl()
+    {
+        std::fill(ctrl_, ctrl_ + num_control_bytes(), uint8_t(EMPTY_CONTROL));
+    }
+
+    void copyControl(const SimdProbeStorage & other)
+    {
+        ExcAssertEqual(capacity(), other.capacity());
+        std::copy(other.ctrl_, other.ctrl_ + num_control_bytes(), ctrl_);
+    }
+
+    Bucket * operator + (size_t index)
+    {
+        return vals_ + index;
+    }
+
+    Bucket & operator [] (size_t index)
+    {
+        return vals_[index];
+    }
+
+    const Bucket & operator [] (size_t index) const
+    {
+        return vals_[index];
+    }
+
+private:
+    void operator = (const SimdProbeStorage & other);
+    SimdProbeStorage(const SimdProbeStorage & other);
+
+    size_t num_control_bytes() const
+    {
+        return capacity() + PROBE_WIDTH - 1;
+    }
+
+    static uint64_t mix(uint64_t hash) JML_CONST_FN
+    {
+        return hash * 0x9e3779b97f4a7c15ULL;
+    }
+
+    typedef typename std::allocator_traits<Allocator>
+        ::template rebind_alloc<uint8_t> Ctrl_Allocator;
+
+    static Allocator allocator;
+    static Ctrl_Allocator ctrl_allocator;
+};
+
+template<typename Bucket, typename Allocator>
+Allocator SimdProbeStorage<Bucket, Allocator>::
+allocator;
+
+template<typename Bucket, typename Allocator>
+typename SimdProbeStorage<Bucket, Allocator>::Ctrl_Allocator
+SimdProbeStorage<Bucket, Allocator>::
+ctrl_allocator;
+
+
 /*****************************************************************************/
 /* LIGHTWEIGHT HASH BASE                                                     */
 /*****************************************************************************/
@@ -375,6 +568,8 @@ struct Lightweight_Hash_Base {
                 Ops::initBucket(storage_ + i, other.storage_[i]);
             else Ops::initEmptyBucket(storage_ + i);
         }
+
+        copy_metadata(storage_, other.storage_);
     }
 
     Lightweight_Hash_Base(Lightweight_Hash_Base && other)
@@ -383,6 +578,14 @@ struct Lightweight_Hash_Base {
         other.size_ = 0;
     }
 
+    /** Take over storage whose buckets have already been filled in with
+        size entries, for example by mapping a file that was written from
+        a hash with the same Ops and Storage. */
+    Lightweight_Hash_Base(Storage && storage, size_t size)
+        : storage_(std::move(storage)), size_(size)
+    {
+    }
+
     ~Lightweight_Hash_Base()
     {
         destroy();
@@ -412,6 +615,8 @@ struct Lightweight_Hash_Base {
     bool empty() const { return size_ == 0; }
     size_t capacity() const { return storage_.capacity(); }
 
+    const Storage & storage() const { return storage_; }
+
     void clear()
     {
         size_t cp = capacity();
@@ -425,6 +630,7 @@ struct Lightweight_Hash_Base {
             }
         }
 
+        clear_metadata(storage_);
         size_ = 0;
     }
 
@@ -505,8 +711,15 @@ public:
     //static uint64_t numCalls, numHops;
 
 protected:
-    //__attribute__((__noinline__))
     int find_bucket(const Key & key) const
+    {
+        return find_bucket(key, storage_);
+    }
+
+    /** Linear probe, one bucket at a time. */
+    //__attribute__((__noinline__))
+    template<class AnyStorage>
+    int find_bucket(const Key & key, const AnyStorage & storage) const
     {
         if (Ops::isGuardValue(key))
             throw Exception("searching for or inserting guard value");
@@ -550,6 +763,109 @@ protected:
         return -1;
     }
 
+    /** Probe of the control bytes, 16 buckets at a time.  The probe
+        sequence is the same as for the linear probe (it's just done in
+        blocks), so the first empty bucket seen is where the key would be
+        inserted. */
+    template<class B, class A>
+    int find_bucket(const Key & key,
+                    const SimdProbeStorage<B, A> & storage) const
+    {
+        if (Ops::isGuardValue(key))
+            throw Exception("searching for or inserting guard value");
+
+        size_t cap = capacity();
+        if (cap == 0) return -1;
+
+        size_t hash = Ops::hashKeyFull(key);
+        size_t mask = cap - 1;
+        size_t pos = storage.bucketForHash(hash);
+        uint8_t fragment = storage.fragmentForHash(hash);
+
+#if defined(__SSE2__)
+        __m128i fragments = _mm_set1_epi8(fragment);
+        __m128i empties = _mm_set1_epi8(char(Storage::EMPTY_CONTROL));
+#endif
+
+        for (size_t probed = 0;  probed < cap;
+             probed += Storage::PROBE_WIDTH) {
+            unsigned matches = 0, empty = 0;
+#if defined(__SSE2__)
+            __m128i control
+                = _mm_loadu_si128((const __m128i *)(storage.ctrl_ + pos));
+            matches = _mm_movemask_epi8(_mm_cmpeq_epi8(control, fragments));
+            empty = _mm_movemask_epi8(_mm_cmpeq_epi8(control, empties));
+#else
+            for (unsigned i = 0;  i < Storage::PROBE_WIDTH;  ++i) {
+                uint8_t c = storage.ctrl_[pos + i];
+                matches |= unsigned(c == fragment) << i;
+                empty |= unsigned(c == Storage::EMPTY_CONTROL) << i;
+            }
+#endif
+
+            // Only the matches before the first empty bucket can be ours
+            if (empty) matches &= (empty ^ (empty - 1));
+
+            while (matches) {
+                int i = (pos + ML::lowest_bit(matches)) & mask;
+                if (Ops::bucketHasKey(storage_[i], key))
+                    return i;
+                matches &= matches - 1;
+            }
+
+            if (empty)
+                return (pos + ML::lowest_bit(empty)) & mask;
+
+            pos = (pos + Storage::PROBE_WIDTH) & mask;
+        }
+
+        // No bucket found; will need to be expanded
+        if (size_t(size_) != cap) {
+            dump(std::cerr);
+            throw Exception("find_bucket: inconsistency");
+        }
+        return -1;
+    }
+
+    /* Hooks that keep the metadata of storages that have some in sync with
+       the buckets.  They do nothing for the others. */
+
+    template<class AnyStorage>
+    static void mark_full(AnyStorage & storage, int bucket, const Key & key)
+    {
+    }
+
+    template<class B, class A>
+    static void mark_full(SimdProbeStorage<B, A> & storage, int bucket,
+                          const Key & key)
+    {
+        storage.setControl(bucket,
+                           storage.fragmentForHash(Ops::hashKeyFull(key)));
+    }
+
+    template<class AnyStorage>
+    static void clear_metadata(AnyStorage & storage)
+    {
+    }
+
+    template<class B, class A>
+    static void clear_metadata(SimdProbeStorage<B, A> & storage)
+    {
+        if (storage.capacity()) storage.clearControl();
+    }
+
+    template<class AnyStorage>
+    static void copy_metadata(AnyStorage & storage, const AnyStorage & other)
+    {
+    }
+
+    template<class B, class A>
+    static void copy_metadata(SimdProbeStorage<B, A> & storage,
+                              const SimdProbeStorage<B, A> & other)
+    {
+        if (storage.capacity()) storage.copyControl(other);
+    }
+
     int find_full_bucket(const Key & key) const
     {
         int bucket = find_bucket(key);
@@ -569,6 +885,49 @@ protected:
         return bucket;
     }
 
+    /** How many keys ahead of the one being probed find_full_buckets()
+        prefetches.  It needs to be enough to cover memory latency without
+        evicting the prefetched lines before they're used. */
+    enum { BATCH_PREFETCH_DISTANCE = 16 };
+
+    /** Does find_full_bucket() for each of n keys, calling
+        onBucket(index, bucket) with the result for each.  The home bucket
+        of each key is prefetched a few keys before it's probed, so that
+        the cache misses of different keys overlap rather than being taken
+        one after the other. */
+    template<class OnBucket>
+    void find_full_buckets(const Key * keys, size_t n,
+                           OnBucket onBucket) const
+    {
+        size_t cap = capacity();
+        size_t ahead = BATCH_PREFETCH_DISTANCE;
+
+        if (cap != 0)
+            for (size_t i = 0;  i < n && i < ahead;  ++i)
+                prefetch_home(storage_, keys[i]);
+
+        for (size_t i = 0;  i < n;  ++i) {
+            if (cap != 0 && i + ahead < n)
+                prefetch_home(storage_, keys[i + ahead]);
+            onBucket(i, find_full_bucket(keys[i]));
+        }
+    }
+
+    template<class AnyStorage>
+    void prefetch_home(const AnyStorage & storage, const Key & key) const
+    {
+        __builtin_prefetch(&storage[Ops::hashKey(key, capacity(), storage)]);
+    }
+
+    template<class B, class A>
+    void prefetch_home(const SimdProbeStorage<B, A> & storage,
+                       const Key & key) const
+    {
+        size_t bucket = storage.bucketForHash(Ops::hashKeyFull(key));
+        __builtin_prefetch(storage.ctrl_ + bucket);
+        __builtin_prefetch(&storage[bucket]);
+    }
+
     //__attribute__((__noinline__))
     int insert_new(int bucket, const Bucket & toInsert) 
     {
@@ -585,6 +944,7 @@ protected:
         }
 
         Ops::fillBucket(storage_ + bucket, toInsert);
+        mark_full(storage_, bucket, key);
         ++size_;
 
         return bucket;
@@ -720,6 +1080,18 @@ struct PairOps {
         uint64_t mask = (1ULL << ((storage.bits_ - 1))) - 1;
         return Hash()(key) & mask;
     }
+
+    template<class Allocator>
+    static size_t hashKey(Key key, int capacity,
+                          const SimdProbeStorage<Bucket, Allocator> & storage)
+    {
+        return storage.bucketForHash(hashKeyFull(key));
+    }
+
+    static size_t hashKeyFull(Key key)
+    {
+        return Hash()(key);
+    }
  };
 
 template<typename Key,
@@ -759,6 +1131,11 @@ struct Lightweight_Hash
     {
     }
 
+    Lightweight_Hash(Storage && storage, size_t size)
+        : Base(std::move(storage), size)
+    {
+    }
+
     Lightweight_Hash & operator = (const Lightweight_Hash & other)
     {
         Lightweight_Hash new_me(other);
@@ -819,6 +1196,25 @@ struct Lightweight_Hash
         return const_iterator(this, bucket);
     }
 
+    /** Look up n keys at once, putting what find() would return for each
+        one into out.  This is much faster than calling find() in a loop
+        when the hash doesn't fit in cache, as it prefetches ahead. */
+    void find_batch(const Key * keys, size_t n, iterator * out)
+    {
+        this->find_full_buckets(keys, n, [&] (size_t i, int bucket)
+            {
+                out[i] = bucket == -1 ? end() : iterator(this, bucket);
+            });
+    }
+
+    void find_batch(const Key * keys, size_t n, const_iterator * out) const
+    {
+        this->find_full_buckets(keys, n, [&] (size_t i, int bucket)
+            {
+                out[i] = bucket == -1 ? end() : const_iterator(this, bucket);
+            });
+    }
+
     Value & operator [] (const Key & key)
     {
         int bucket = this->find_or_insert(Bucket(key, Value())).first;
@@ -956,6 +1352,18 @@ struct ScalarOps {
         uint64_t mask = (1ULL << ((storage.bits_ - 1))) - 1;
         return Hash()(key) & mask;
     }
+
+    template<class Allocator>
+    static size_t hashKey(Key key, int capacity,
+                          const SimdProbeStorage<Bucket, Allocator> & storage)
+    {
+        return storage.bucketForHash(hashKeyFull(key));
+    }
+
+    static size_t hashKeyFull(Key key)
+    {
+        return Hash()(key);
+    }
 };
 
 template<typename Key, typename Hash>
@@ -1001,6 +1409,11 @@ struct Lightweight_Hash_Set
     {
     }
 
+    Lightweight_Hash_Set(Storage && storage, size_t size)
+        : Base(std::move(storage), size)
+    {
+    }
+
     Lightweight_Hash_Set & operator = (const Lightweight_Hash_Set & other)
     {
         Lightweight_Hash_Set new_me(other);
@@ -1043,6 +1456,17 @@ struct Lightweight_Hash_Set
         return const_iterator(this, bucket);
     }
 
+    /** Look up n keys at once, putting what find() would return for each
+        one into out.  This is much faster than calling find() in a loop
+        when the hash doesn't fit in cache, as it prefetches ahead. */
+    void find_batch(const Key * keys, size_t n, const_iterator * out) const
+    {
+        this->find_full_buckets(keys, n, [&] (size_t i, int bucket)
+            {
+                out[i] = bucket == -1 ? end() : const_iterator(this, bucket);
+            });
+    }
+
     std::pair<const_iterator, bool>
     insert(const Key & val)
     {
@@ -0,0 +1,213 @@
+/* lz4_filter.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Implementation of the lz4 filters.
+*/
+
+#include "lz4_filter.h"
+#include "jml/arch/exception.h"
+#include <string>
+#include <string.h>
+#include <lz4frame.h>
+
+
+using namespace std;
+
+
+namespace ML {
+
+namespace {
+
+size_t check(size_t res, const char * what)
+{
+    if (LZ4F_isError(res))
+        throw Exception("lz4: %s: %s", what, LZ4F_getErrorName(res));
+    return res;
+}
+
+/** Input is given to the compressor in pieces of at most this size, so
+    that the output buffer can be a fixed size. */
+enum { CHUNK_SIZE = 64 * 1024 };
+
+} // file scope
+
+
+/*****************************************************************************/
+/* LZ4 COMPRESSOR                                                            */
+/*****************************************************************************/
+
+struct lz4_compressor::Itl {
+    Itl(const Options & options)
+        : cctx(0), started(false)
+    {
+        if (options.level < -1 || options.level > LZ4F_compressionLevel_max())
+            throw Exception("lz4_compressor: level %d out of range",
+                            options.level);
+
+        memset(&prefs, 0, sizeof(prefs));
+        prefs.compressionLevel = std::max(options.level, 0);
+        prefs.frameInfo.blockSizeID = LZ4F_max4MB;
+        prefs.frameInfo.contentChecksumFlag
+            = (options.checksum ? LZ4F_contentChecksumEnabled
+               : LZ4F_noContentChecksum);
+
+        check(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION),
+              "creating context");
+        buffer.resize(std::max<size_t>(LZ4F_compressBound(CHUNK_SIZE, &prefs),
+                                       LZ4F_HEADER_SIZE_MAX));
+    }
+
+    ~Itl()
+    {
+        LZ4F_freeCompressionContext(cctx);
+    }
+
+    void start(const Output & output)
+    {
+        if (started) return;
+        size_t n = check(LZ4F_compressBegin(cctx, &buffer[0], buffer.size(),
+                                            &prefs),
+                         "starting frame");
+        output(buffer.data(), n);
+        started = true;
+    }
+
+    void write(const char * s, size_t n, const Output & output)
+    {
+        start(output);
+        while (n) {
+            size_t todo = std::min<size_t>(n, CHUNK_SIZE);
+            size_t res = check(LZ4F_compressUpdate(cctx, &buffer[0],
+                                                   buffer.size(), s, todo,
+                                                   0),
+                               "compressing");
+            if (res) output(buffer.data(), res);
+            s += todo;
+            n -= todo;
+        }
+    }
+
+    void close(const Output & output)
+    {
+        start(output);
+        size_t res = check(LZ4F_compressEnd(cctx, &buffer[0], buffer.size(),
+                                            0),
+                           "ending frame");
+        output(buffer.data(), res);
+        started = false;
+    }
+
+    LZ4F_preferences_t prefs;
+    LZ4F_cctx * cctx;
+    std::string buffer;
+    bool started;
+};
+
+lz4_compressor::
+lz4_compressor(const Options & options)
+    : itl(new Itl(options))
+{
+}
+
+void
+lz4_compressor::
+add_input(const char * s, size_t n, const Output & output)
+{
+    itl->write(s, n, output);
+}
+
+void
+lz4_compressor::
+finish(const Output & output)
+{
+    itl->close(output);
+}
+
+
+/*****************************************************************************/
+/* LZ4 DECOMPRESSOR                                                          */
+/*****************************************************************************/
+
+struct lz4_decompressor::Itl {
+    Itl()
+        : dctx(0), inBuf(CHUNK_SIZE, 0)
+    {
+        check(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION),
+              "creating context");
+        init();
+    }
+
+    ~Itl()
+    {
+        LZ4F_freeDecompressionContext(dctx);
+    }
+
+    void init()
+    {
+        inPos = inEnd = 0;
+        inputEnded = false;
+        atFrameStart = true;
+        LZ4F_resetDecompressionContext(dctx);
+    }
+
+    std::streamsize read(char * s, size_t n, const Input & input)
+    {
+        size_t produced = 0;
+
+        while (produced == 0) {
+            if (inPos == inEnd && !inputEnded) {
+                std::streamsize res = input(&inBuf[0], inBuf.size());
+                inPos = 0;
+                inEnd = std::max<std::streamsize>(res, 0);
+                if (res <= 0) inputEnded = true;
+            }
+
+            if (inPos == inEnd && inputEnded && atFrameStart)
+                return -1;
+
+            size_t outSize = n;
+            size_t inSize = inEnd - inPos;
+            size_t hint = check(LZ4F_decompress(dctx, s, &outSize,
+                                                &inBuf[inPos], &inSize, 0),
+                                "decompressing");
+            inPos += inSize;
+            produced = outSize;
+
+            // A hint of zero means that the frame is finished
+            atFrameStart = (hint == 0);
+
+            if (produced == 0 && inSize == 0 && !atFrameStart && inputEnded)
+                throw Exception("lz4_decompressor: truncated input");
+        }
+
+        return produced;
+    }
+
+    LZ4F_dctx * dctx;
+    std::string inBuf;
+    size_t inPos, inEnd;     ///< Unused part of inBuf
+    bool inputEnded;
+    bool atFrameStart;       ///< Is the decompressor between frames?
+};
+
+lz4_decompressor::
+lz4_decompressor()
+    : itl(new Itl())
+{
+}
+
+std::streamsize
+lz4_decompressor::
+get_output(char * s, std::streamsize n, const Input & input)
+{
+    return itl->read(s, n, input);
+}
+
+void
+lz4_decompressor::
+reset()
+{
+    itl->init();
+}
+
+} // namespace ML
@@ -0,0 +1,120 @@
+/* lz4_filter.h                                                    -*- C++ -*-
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Boost iostreams filters for the lz4 frame format.
+*/
+
+#ifndef __jml__utils__lz4_filter_h__
+#define __jml__utils__lz4_filter_h__
+
+#include <memory>
+#include <functional>
+#include <boost/iostreams/categories.hpp>
+#include <boost/iostreams/operations.hpp>
+
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* LZ4 COMPRESSOR                                                            */
+/*****************************************************************************/
+
+/** Output filter that compresses into a single lz4 frame, as written by
+    the lz4 tool. */
+
+struct lz4_compressor {
+
+    struct Options {
+        Options(int level = -1)
+            : level(level), checksum(true)
+        {
+        }
+
+        int level;        ///< -1 or 0 for fast; 3 to 12 for lz4 -3 to -12
+        bool checksum;    ///< Add a checksum of the content
+    };
+
+    typedef char char_type;
+    struct category
+        : boost::iostreams::multichar_output_filter_tag,
+          boost::iostreams::closable_tag {
+    };
+
+    lz4_compressor(const Options & options = Options());
+
+    typedef std::function<void (const char *, size_t)> Output;
+
+    template<typename Sink>
+    std::streamsize write(Sink & sink, const char * s, std::streamsize n)
+    {
+        add_input(s, n, [&] (const char * data, size_t len)
+                  {
+                      boost::iostreams::write(sink, data, len);
+                  });
+        return n;
+    }
+
+    template<typename Sink>
+    void close(Sink & sink)
+    {
+        finish([&] (const char * data, size_t len)
+               {
+                   boost::iostreams::write(sink, data, len);
+               });
+    }
+
+    void add_input(const char * s, size_t n, const Output & output);
+    void finish(const Output & output);
+
+    struct Itl;
+    std::shared_ptr<Itl> itl;
+};
+
+
+/*****************************************************************************/
+/* LZ4 DECOMPRESSOR                                                          */
+/*****************************************************************************/
+
+/** Input filter that decompresses any number of lz4 frames, one after the
+    other. */
+
+struct lz4_decompressor {
+
+    typedef char char_type;
+    struct category
+        : boost::iostreams::multichar_input_filter_tag,
+          boost::iostreams::closable_tag {
+    };
+
+    lz4_decompressor();
+
+    /** Reads up to the given number of bytes, returning -1 at the end. */
+    typedef std::function<std::streamsize (char *, std::streamsize)> Input;
+
+    template<typename Source>
+    std::streamsize read(Source & src, char * s, std::streamsize n)
+    {
+        return get_output(s, n, [&] (char * data, std::streamsize len)
+                          {
+                              return boost::iostreams::read(src, data, len);
+                          });
+    }
+
+    template<typename Source>
+    void close(Source & src)
+    {
+        reset();
+    }
+
+    std::streamsize get_output(char * s, std::streamsize n,
+                               const Input & input);
+    void reset();
+
+    struct Itl;
+    std::shared_ptr<Itl> itl;
+};
+
+} // namespace ML
+
+#endif /* __jml__utils__lz4_filter_h__ */
@@ -10,44 +10,137 @@
 #define __utils__map_reduce_h__
 
 #include <utility>
+#include <vector>
 #include "worker_task.h"
+#include "jml/arch/cmp_xchg.h"
 
 namespace ML {
 
+/** Map each element of the range in parallel, and reduce the results
+    strictly in order.
+
+    The mapped results wait to be reduced in a fixed size window of
+    maxOutstanding slots (by default 64 per thread), indexed by position
+    modulo the window size, so the memory used is bounded no matter how
+    slow an early element is.  Elements are claimed in order, and a thread
+    won't claim an element that doesn't yet have a free slot; instead it
+    helps to reduce what is ready, or waits.  Since the earliest unreduced
+    element has always been claimed, this can't deadlock.
+
+    Reducing doesn't need a lock either: whichever thread gets the drain
+    flag reduces all of the ready results at the head of the window, so
+    reduce is never called concurrently and always sees elements in order.
+
+    If map or reduce throws, no more elements are claimed and the exception
+    is rethrown (as with do_group) once the running ones have finished.
+*/
 template<typename MapFn, typename ReduceFn, typename It, typename It2>
 void
-parallelMapInOrderReduce(It first, It2 last, MapFn map, ReduceFn reduce)
+parallelMapInOrderReduce(It first, It2 last, MapFn map, ReduceFn reduce,
+                         size_t maxOutstanding = 0,
+                         Worker_Task & worker
+                             = Worker_Task::instance(num_threads() - 1))
 {
     // Result type of map function (to be passed to reduce)
     typedef decltype(map(first)) MapResult;
 
-    It next = first;
-    std::map<It, MapResult> writeQueue;
-    boost::mutex lock;
-
-    auto drainWriteQueue = [&] ()
+    size_t n = last - first;
+    if (n == 0) return;
+
+    size_t numRunners = std::min<size_t>(worker.threads() + 1, n);
+    if (maxOutstanding == 0) maxOutstanding = 64 * numRunners;
+    size_t window = std::min(maxOutstanding, n);
+
+    // ready is written with release and read with acquire semantics, so
+    // that whoever sees it set also sees the value.
+    struct Slot {
+        Slot() : ready(false) {}
+        MapResult value;
+        bool ready;
+    };
+
+    std::vector<Slot> slots(window);
+
+    size_t nextToClaim = 0;           // next element to map
+    size_t nextToReduce = 0;          // head of the window
+    int draining = 0;                 // 1 if a thread is reducing
+    volatile bool stop = false;
+
+    // Reduce everything that's ready at the head of the window.  Returns
+    // true if anything was reduced.
+    auto drain = [&] () -> bool
         {
-            while (!writeQueue.empty()
-                   && writeQueue.begin()->first == next) {
-                reduce(writeQueue.begin()->first,
-                       writeQueue.begin()->second);
-                writeQueue.erase(writeQueue.begin());
-                ++next;
+            bool result = false;
+            for (;;) {
+                if (!__sync_bool_compare_and_swap(&draining, 0, 1))
+                    return result;  // someone else is on it
+
+                try {
+                    for (size_t i = nextToReduce;  i < n;  ++i) {
+                        Slot & slot = slots[i % window];
+                        if (!__atomic_load_n(&slot.ready, __ATOMIC_ACQUIRE))
+                            break;
+                        reduce(first + i, slot.value);
+                        slot.value = MapResult();
+                        slot.ready = false;
+                        __atomic_store_n(&nextToReduce, i + 1,
+                                         __ATOMIC_RELEASE);
+                        result = true;
+                    }
+                } catch (...) {
+                    stop = true;
+                    __sync_lock_release(&draining);
+                    throw;
+                }
+
+                __sync_lock_release(&draining);
+
+                // Something may have become ready after we looked but
+                // before we let go of the flag; go round again if so.
+                size_t i = nextToReduce;
+                if (i >= n
+                    || !__atomic_load_n(&slots[i % window].ready,
+                                        __ATOMIC_ACQUIRE))
+                    return result;
             }
         };
 
-    auto doMap = [&] (It it)
+    auto doRunner = [&] (size_t)
         {
-            auto res = map(it);
-
-            boost::unique_lock<boost::mutex> guard(lock);
-            writeQueue[it] = std::move(res);
-            drainWriteQueue();
+            for (;;) {
+                // Claim the next element, once it has a free slot
+                size_t i = nextToClaim;
+                for (;;) {
+                    if (stop || i >= n) return;
+                    if (i >= __atomic_load_n(&nextToReduce, __ATOMIC_ACQUIRE)
+                             + window) {
+                        // Too far ahead; help or wait
+                        if (!drain()) sched_yield();
+                        i = nextToClaim;
+                        continue;
+                    }
+                    if (cmp_xchg(nextToClaim, i, i + 1)) break;
+                }
+
+                Slot & slot = slots[i % window];
+                try {
+                    slot.value = map(first + i);
+                } catch (...) {
+                    stop = true;
+                    throw;
+                }
+                __atomic_store_n(&slot.ready, true, __ATOMIC_RELEASE);
+
+                drain();
+            }
         };
 
-    ML::run_in_parallel_blocked(first, last, doMap);
+    worker.do_group<size_t>(0, numRunners, doRunner);
 
-    drainWriteQueue();
+    drain();
+
+    if (nextToReduce != n)
+        throw Exception("parallelMapInOrderReduce(): not all reduced");
 }
 
 template<typename MapFn, typename ReduceFn>
@@ -187,6 +280,154 @@ parallelMapInOrderReduceInEqualWorkChunks
 }
 
 
+/*****************************************************************************/
+/* PARALLEL REDUCE AND SCAN                                                  */
+/*****************************************************************************/
+
+/** Split [0, n) into blocks for a parallel reduce or scan.  We aim for
+    roughly 16 blocks per thread (as run_in_parallel_blocked does) so that
+    the load balances, but never go under minBlockSize elements per block.
+*/
+inline size_t parallelReduceNumBlocks(size_t n, int nthreads,
+                                      size_t minBlockSize = 1024)
+{
+    if (n == 0) return 0;
+    size_t numBlocks = 16 * (size_t)std::max(nthreads, 1);
+    size_t maxBlocks = (n + minBlockSize - 1) / minBlockSize;
+    return std::max<size_t>(1, std::min(numBlocks, maxBlocks));
+}
+
+/** Tree-structured parallel reduction.
+
+    The range is split into contiguous blocks.  Each block is reduced in
+    parallel into its own partial result, starting from identity, by
+    calling accumulate(T & partial, It it) on each element.  The partials
+    are then combined pairwise up a tree, each level in parallel, by
+    calling combine(T & left, T & right), which must fold right into left.
+
+    There is no lock anywhere.  combine() must be associative, but needn't
+    be commutative: the left argument always covers the earlier part of
+    the range.  Both functions mutate their first argument so that big
+    results (like histograms) aren't copied for each element.
+
+    Returns the reduction of the whole range (identity if it's empty).
+*/
+template<typename T, typename AccumulateFn, typename CombineFn,
+         typename It, typename It2>
+T parallelReduce(It first, It2 last, const T & identity,
+                 AccumulateFn accumulate, CombineFn combine,
+                 Worker_Task & worker
+                     = Worker_Task::instance(num_threads() - 1))
+{
+    size_t n = last - first;
+    size_t numBlocks = parallelReduceNumBlocks(n, worker.threads() + 1);
+    if (numBlocks == 0) return identity;
+
+    size_t blockSize = (n + numBlocks - 1) / numBlocks;
+    numBlocks = (n + blockSize - 1) / blockSize;
+
+    std::vector<T> partials(numBlocks, identity);
+
+    auto doBlock = [&] (size_t b)
+        {
+            T & partial = partials[b];
+            It it = first + b * blockSize;
+            It end = first + std::min(n, (b + 1) * blockSize);
+            for (;  it != end;  ++it)
+                accumulate(partial, it);
+        };
+
+    worker.do_group<size_t>(0, numBlocks, doBlock);
+
+    // Combine pairs at distance stride, doubling it at each level
+    for (size_t stride = 1;  stride < numBlocks;  stride *= 2) {
+        size_t numPairs = (numBlocks - stride + 2 * stride - 1) / (2 * stride);
+
+        auto doPair = [&] (size_t p)
+            {
+                size_t left = p * 2 * stride;
+                combine(partials[left], partials[left + stride]);
+            };
+
+        if (numPairs == 1) doPair(0);
+        else worker.do_group<size_t>(0, numPairs, doPair);
+    }
+
+    return std::move(partials[0]);
+}
+
+/** Parallel prefix scan.
+
+    Calls output(It it, const T & prefix) for every element in the range,
+    where prefix is the reduction (as in parallelReduce) of all of the
+    elements before it, or up to and including it if inclusive is true.
+    The calls for different blocks happen in parallel, but within a block
+    they are in order.
+
+    This makes two passes over the range: the first reduces each block to
+    its total, the totals are scanned serially (there are only a few of
+    them) to get each block's starting prefix, and the second pass walks
+    each block again from its starting prefix, calling output.  So
+    accumulate is called twice on each element.
+
+    Returns the reduction of the whole range.
+*/
+template<typename T, typename AccumulateFn, typename CombineFn,
+         typename OutputFn, typename It, typename It2>
+T parallelScan(It first, It2 last, const T & identity,
+               AccumulateFn accumulate, CombineFn combine, OutputFn output,
+               bool inclusive = false,
+               Worker_Task & worker
+                   = Worker_Task::instance(num_threads() - 1))
+{
+    size_t n = last - first;
+    size_t numBlocks = parallelReduceNumBlocks(n, worker.threads() + 1);
+    if (numBlocks == 0) return identity;
+
+    size_t blockSize = (n + numBlocks - 1) / numBlocks;
+    numBlocks = (n + blockSize - 1) / blockSize;
+
+    // Pass 1: total of each block
+    std::vector<T> prefixes(numBlocks + 1, identity);
+
+    auto totalBlock = [&] (size_t b)
+        {
+            T & total = prefixes[b + 1];
+            It it = first + b * blockSize;
+            It end = first + std::min(n, (b + 1) * blockSize);
+            for (;  it != end;  ++it)
+                accumulate(total, it);
+        };
+
+    worker.do_group<size_t>(0, numBlocks, totalBlock);
+
+    // Exclusive scan of the block totals, so prefixes[b] is everything
+    // before block b
+    for (size_t b = 1;  b <= numBlocks;  ++b) {
+        T prefix = prefixes[b - 1];
+        combine(prefix, prefixes[b]);
+        prefixes[b] = std::move(prefix);
+    }
+
+    // Pass 2: walk each block from its prefix
+    auto scanBlock = [&] (size_t b)
+        {
+            T current = prefixes[b];
+            It it = first + b * blockSize;
+            It end = first + std::min(n, (b + 1) * blockSize);
+            for (;  it != end;  ++it) {
+                if (!inclusive) output(it, current);
+                accumulate(current, it);
+                if (inclusive) output(it, current);
+            }
+        };
+
+    worker.do_group<size_t>(0, numBlocks, scanBlock);
+
+    return std::move(prefixes[numBlocks]);
+}
+
+
 } // namespace ML
 
 #endif
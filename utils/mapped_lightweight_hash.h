@@ -0,0 +1,374 @@
+/* mapped_lightweight_hash.h                                       -*- C++ -*-
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Storage for a lightweight hash that lives in a memory mapped file, so
+   that a hash can be built once offline and then opened without being
+   deserialized by any number of processes, which share the page cache.
+*/
+
+#ifndef __jml__utils__mapped_lightweight_hash_h__
+#define __jml__utils__mapped_lightweight_hash_h__
+
+#include "jml/utils/lightweight_hash.h"
+#include "jml/utils/guard.h"
+#include "jml/arch/exception.h"
+#include <typeinfo>
+#include <type_traits>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* MAPPED HASH HEADER                                                        */
+/*****************************************************************************/
+
+/** Header at the start of a mapped hash file.  The buckets follow at
+    data_offset, which is page aligned, exactly as they are laid out in
+    memory; everything in the header is there to make sure that the
+    program opening the file lays them out and hashes them in the same
+    way as the one that wrote it.
+*/
+
+struct Mapped_Hash_Header {
+    enum {
+        VERSION = 1,
+        DATA_ALIGNMENT = 4096
+    };
+
+    static const uint64_t BYTE_ORDER_MARK = 0x0102030405060708ULL;
+
+    char magic[8];            ///< "JMLHASH" plus a null
+    uint32_t version;         ///< VERSION
+    uint32_t header_size;     ///< sizeof(Mapped_Hash_Header)
+    uint64_t byte_order;      ///< BYTE_ORDER_MARK in the writer's order
+    uint64_t fingerprint;     ///< Identifies the key, bucket and ops types
+    uint64_t bucket_size;     ///< sizeof(Bucket)
+    uint64_t capacity;        ///< Number of buckets
+    uint64_t size;            ///< Number of full buckets
+    uint64_t data_offset;     ///< Offset of the first bucket in the file
+
+    static const char * expected_magic() { return "JMLHASH"; }
+
+    /** Throw if the header isn't one that we can use, for a file of the
+        given length holding buckets with the given fingerprint. */
+    void validate(const std::string & filename, size_t file_length,
+                  uint64_t expected_fingerprint,
+                  size_t expected_bucket_size) const
+    {
+        if (file_length < sizeof(*this)
+            || std::memcmp(magic, expected_magic(), sizeof(magic)) != 0)
+            throw Exception("mapped hash " + filename
+                            + ": not a mapped hash file");
+        if (byte_order != BYTE_ORDER_MARK)
+            throw Exception("mapped hash " + filename
+                            + ": written on a machine of different byte order");
+        if (version != VERSION || header_size != sizeof(*this))
+            throw Exception(format("mapped hash %s: unknown version %d",
+                                   filename.c_str(), (int)version));
+        if (fingerprint != expected_fingerprint
+            || bucket_size != expected_bucket_size)
+            throw Exception("mapped hash " + filename
+                            + ": written for a different type of hash");
+        if (data_offset % DATA_ALIGNMENT != 0
+            || data_offset > file_length
+            || capacity > (file_length - data_offset) / bucket_size
+            || size > capacity
+            || data_offset + capacity * bucket_size != file_length)
+            throw Exception("mapped hash " + filename
+                            + ": truncated or corrupt");
+    }
+};
+
+/** Fingerprint of the types that determine the on-disk layout of a hash.
+    It uses the mangled type names (which are part of the ABI) and a fixed
+    hash function, so that it's the same in every program. */
+template<class Key, class Bucket, class Ops>
+uint64_t mapped_hash_fingerprint()
+{
+    uint64_t result = 14695981039346656037ULL;  // FNV-1a
+    auto add = [&] (const char * str)
+        {
+            for (; *str;  ++str) {
+                result ^= (unsigned char)*str;
+                result *= 1099511628211ULL;
+            }
+            result ^= 0xff;
+            result *= 1099511628211ULL;
+        };
+
+    add(typeid(Key).name());
+    add(typeid(Bucket).name());
+    add(typeid(Ops).name());
+    return result;
+}
+
+
+/*****************************************************************************/
+/* MAPPED STORAGE                                                            */
+/*****************************************************************************/
+
+/** Storage for a Lightweight_Hash whose buckets live in a memory mapping.
+
+    Built normally (through reserve()), the buckets are in anonymous memory
+    and the hash behaves like any other; save_mapped() then writes it out.
+    load_mapped() maps such a file privately: nothing is read until it's
+    looked up, and the pages are shared between all of the processes that
+    map the file until one of them writes to them (copy on write), so that
+    inserting into a loaded hash works but doesn't change the file.
+
+    The buckets are used in place, so they must have no pointers into the
+    heap and must be trivially destructible.
+*/
+
+template<typename Bucket>
+struct MappedStorage {
+    static_assert(std::is_trivially_destructible<Bucket>::value,
+                  "mapped buckets must be trivially destructible");
+
+    MappedStorage()
+        : vals_(0), capacity_(0), mapping_(0), mapping_length_(0)
+    {
+    }
+
+    MappedStorage(size_t capacity)
+        : vals_(0), capacity_(0), mapping_(0), mapping_length_(0)
+    {
+        reserve(capacity);
+    }
+
+    MappedStorage(MappedStorage && other)
+        : vals_(other.vals_), capacity_(other.capacity_),
+          mapping_(other.mapping_), mapping_length_(other.mapping_length_)
+    {
+        other.vals_ = 0;
+        other.capacity_ = 0;
+        other.mapping_ = 0;
+        other.mapping_length_ = 0;
+    }
+
+    MappedStorage & operator = (MappedStorage && other)
+    {
+        destroy();
+        swap(other);
+        return *this;
+    }
+
+    ~MappedStorage()
+    {
+        destroy();
+    }
+
+    Bucket * vals_;
+    size_t capacity_;
+    void * mapping_;
+    size_t mapping_length_;
+
+    void swap(MappedStorage & other)
+    {
+        std::swap(vals_, other.vals_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(mapping_, other.mapping_);
+        std::swap(mapping_length_, other.mapping_length_);
+    }
+
+    size_t capacity() const JML_PURE_FN { return capacity_; }
+
+    void reserve(size_t newCapacity)
+    {
+        if (vals_)
+            throw ML::Exception("can't double initialize storage");
+
+        if (newCapacity == 0) return;
+
+        size_t length = newCapacity * sizeof(Bucket);
+        void * mem = mmap(0, length, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            throw ML::Exception(errno, "mmap", "MappedStorage::reserve()");
+
+        mapping_ = mem;
+        mapping_length_ = length;
+        vals_ = reinterpret_cast<Bucket *>(mem);
+        capacity_ = newCapacity;
+    }
+
+    void destroy()
+    {
+        if (!mapping_) return;
+        munmap(mapping_, mapping_length_);
+        vals_ = 0;
+        capacity_ = 0;
+        mapping_ = 0;
+        mapping_length_ = 0;
+    }
+
+    /** Map the given file, which must have been written by save() with
+        buckets of the same fingerprint.  Returns the number of full
+        buckets in size. */
+    static MappedStorage map(const std::string & filename,
+                             uint64_t fingerprint,
+                             size_t & size)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1)
+            throw ML::Exception(errno, filename, "MappedStorage::map()");
+        Call_Guard closeGuard([&] () { close(fd); });
+
+        struct stat stats;
+        if (fstat(fd, &stats) == -1)
+            throw ML::Exception(errno, filename, "MappedStorage::map()");
+
+        size_t length = stats.st_size;
+        if (length < sizeof(Mapped_Hash_Header))
+            throw Exception("mapped hash " + filename
+                            + ": not a mapped hash file");
+
+        void * mem = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                          fd, 0);
+        if (mem == MAP_FAILED)
+            throw ML::Exception(errno, filename, "MappedStorage::map()");
+
+        MappedStorage result;
+        result.mapping_ = mem;
+        result.mapping_length_ = length;
+
+        const Mapped_Hash_Header & header
+            = *reinterpret_cast<const Mapped_Hash_Header *>(mem);
+        header.validate(filename, length, fingerprint, sizeof(Bucket));
+
+        result.vals_ = reinterpret_cast<Bucket *>
+            (reinterpret_cast<char *>(mem) + header.data_offset);
+        result.capacity_ = header.capacity;
+        size = header.size;
+
+        return result;
+    }
+
+    /** Write the buckets to the given file, behind a header recording
+        the fingerprint and number of full buckets.  The file is written
+        under a temporary name and renamed into place, so that processes
+        opening it never see a partial file. */
+    void save(const std::string & filename, uint64_t fingerprint,
+              size_t size) const
+    {
+        Mapped_Hash_Header header;
+        std::memset(&header, 0, sizeof(header));
+        std::strncpy(header.magic, Mapped_Hash_Header::expected_magic(),
+                     sizeof(header.magic));
+        header.version = Mapped_Hash_Header::VERSION;
+        header.header_size = sizeof(header);
+        header.byte_order = Mapped_Hash_Header::BYTE_ORDER_MARK;
+        header.fingerprint = fingerprint;
+        header.bucket_size = sizeof(Bucket);
+        header.capacity = capacity_;
+        header.size = size;
+        header.data_offset = Mapped_Hash_Header::DATA_ALIGNMENT;
+
+        std::string tmpFilename = filename + ".tmp";
+        int fd = open(tmpFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                      0644);
+        if (fd == -1)
+            throw ML::Exception(errno, tmpFilename, "MappedStorage::save()");
+        Call_Guard cleanupGuard([&] ()
+                                {
+                                    if (fd != -1) close(fd);
+                                    unlink(tmpFilename.c_str());
+                                });
+
+        auto writeAll = [&] (const void * data, size_t length)
+            {
+                const char * p = reinterpret_cast<const char *>(data);
+                while (length) {
+                    ssize_t res = write(fd, p, length);
+                    if (res == -1 && errno == EINTR) continue;
+                    if (res == -1)
+                        throw ML::Exception(errno, tmpFilename,
+                                            "MappedStorage::save()");
+                    p += res;
+                    length -= res;
+                }
+            };
+
+        char padding[Mapped_Hash_Header::DATA_ALIGNMENT - sizeof(header)];
+        std::memset(padding, 0, sizeof(padding));
+        writeAll(&header, sizeof(header));
+        writeAll(padding, sizeof(padding));
+        writeAll(vals_, capacity_ * sizeof(Bucket));
+
+        int res = close(fd);
+        fd = -1;
+        if (res == -1)
+            throw ML::Exception(errno, tmpFilename, "MappedStorage::save()");
+
+        if (rename(tmpFilename.c_str(), filename.c_str()) == -1)
+            throw ML::Exception(errno, filename, "MappedStorage::save()");
+        cleanupGuard.clear();
+    }
+
+    Bucket * operator + (size_t index)
+    {
+        return vals_ + index;
+    }
+
+    Bucket & operator [] (size_t index)
+    {
+        return vals_[index];
+    }
+
+    const Bucket & operator [] (size_t index) const
+    {
+        return vals_[index];
+    }
+
+private:
+    void operator = (const MappedStorage & other);
+    MappedStorage(const MappedStorage & other);
+};
+
+
+/*****************************************************************************/
+/* SAVING AND LOADING                                                        */
+/*****************************************************************************/
+
+/** Write out a hash that uses MappedStorage so that it can be opened with
+    load_mapped(). */
+template<class Key, class Bucket, class Ops>
+void save_mapped(const Lightweight_Hash_Base<Key, Bucket, Ops,
+                                             MappedStorage<Bucket> > & hash,
+                 const std::string & filename)
+{
+    hash.storage().save(filename,
+                        mapped_hash_fingerprint<Key, Bucket, Ops>(),
+                        hash.size());
+}
+
+/** Replace the contents of the hash with those mapped from the given
+    file, which was written by save_mapped() for a hash of the same type.
+    This doesn't touch the buckets, so it takes the same time whatever the
+    size of the hash. */
+template<class Key, class Bucket, class Ops>
+void load_mapped(Lightweight_Hash_Base<Key, Bucket, Ops,
+                                       MappedStorage<Bucket> > & hash,
+                 const std::string & filename)
+{
+    typedef Lightweight_Hash_Base<Key, Bucket, Ops, MappedStorage<Bucket> >
+        Base;
+
+    size_t size = 0;
+    MappedStorage<Bucket> storage
+        = MappedStorage<Bucket>::map(filename,
+                                     mapped_hash_fingerprint<Key, Bucket, Ops>(),
+                                     size);
+    Base loaded(std::move(storage), size);
+    hash.swap(loaded);
+}
+
+} // namespace ML
+
+#endif /* __jml__utils__mapped_lightweight_hash_h__ */
@@ -0,0 +1,414 @@
+/* parallel_compressor.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Implementation of the parallel block compressor.
+*/
+
+#include "parallel_compressor.h"
+#include "worker_task.h"
+#include "jml/arch/exception.h"
+#include <deque>
+#include <vector>
+#include <string.h>
+#include <zlib.h>
+#include <lzma.h>
+#include <zstd.h>
+#include <lz4frame.h>
+
+
+using namespace std;
+
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* PARALLEL COMPRESSOR                                                       */
+/*****************************************************************************/
+
+namespace {
+
+/** A block of input, and what it compresses to. */
+struct Block {
+    std::string input;
+    std::string output;
+    uint64_t uncompressedSize;
+    uint64_t unpaddedSize;   ///< For the xz index
+};
+
+void compressGzip(Block & block, int level)
+{
+    z_stream stream;
+    stream.zalloc = 0;
+    stream.zfree = 0;
+    stream.opaque = 0;
+
+    // 16 added to the window bits asks for a gzip header and trailer
+    int res = deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8,
+                           Z_DEFAULT_STRATEGY);
+    if (res != Z_OK)
+        throw Exception("parallel_compressor: deflateInit2 failed: %d", res);
+
+    block.output.resize(deflateBound(&stream, block.input.size()));
+
+    stream.next_in = (Bytef *)block.input.data();
+    stream.avail_in = block.input.size();
+    stream.next_out = (Bytef *)&block.output[0];
+    stream.avail_out = block.output.size();
+
+    res = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    if (res != Z_STREAM_END)
+        throw Exception("parallel_compressor: deflate failed: %d", res);
+
+    block.output.resize(block.output.size() - stream.avail_out);
+}
+
+void compressXz(Block & block, const lzma_options_lzma & lzmaOptions)
+{
+    lzma_options_lzma options = lzmaOptions;
+    lzma_filter filters[2] = {
+        { LZMA_FILTER_LZMA2, &options },
+        { LZMA_VLI_UNKNOWN, 0 }
+    };
+
+    lzma_block header;
+    memset(&header, 0, sizeof(header));
+    header.version = 0;
+    header.check = LZMA_CHECK_CRC64;
+    header.filters = filters;
+
+    block.output.resize(lzma_block_buffer_bound(block.input.size()));
+    size_t outPos = 0;
+
+    lzma_ret res
+        = lzma_block_buffer_encode(&header, 0,
+                                   (const uint8_t *)block.input.data(),
+                                   block.input.size(),
+                                   (uint8_t *)&block.output[0], &outPos,
+                                   block.output.size());
+    if (res != LZMA_OK)
+        throw Exception("parallel_compressor: lzma_block_buffer_encode "
+                        "failed: %d", res);
+
+    block.output.resize(outPos);
+    block.unpaddedSize = lzma_block_unpadded_size(&header);
+}
+
+void compressZstd(Block & block, int level)
+{
+    ZSTD_CCtx * cctx = ZSTD_createCCtx();
+    if (!cctx)
+        throw Exception("parallel_compressor: couldn't create zstd context");
+
+    block.output.resize(ZSTD_compressBound(block.input.size()));
+
+    size_t res = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+    if (!ZSTD_isError(res))
+        res = ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+    if (!ZSTD_isError(res))
+        res = ZSTD_compress2(cctx, &block.output[0], block.output.size(),
+                             block.input.data(), block.input.size());
+    ZSTD_freeCCtx(cctx);
+
+    if (ZSTD_isError(res))
+        throw Exception("parallel_compressor: zstd failed: %s",
+                        ZSTD_getErrorName(res));
+
+    block.output.resize(res);
+}
+
+void compressLz4(Block & block, int level)
+{
+    LZ4F_preferences_t prefs;
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.compressionLevel = level;
+    prefs.frameInfo.blockSizeID = LZ4F_max4MB;
+    prefs.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+    prefs.frameInfo.contentSize = block.input.size();
+
+    block.output.resize(LZ4F_compressFrameBound(block.input.size(), &prefs));
+
+    size_t res = LZ4F_compressFrame(&block.output[0], block.output.size(),
+                                    block.input.data(), block.input.size(),
+                                    &prefs);
+    if (LZ4F_isError(res))
+        throw Exception("parallel_compressor: lz4 failed: %s",
+                        LZ4F_getErrorName(res));
+
+    block.output.resize(res);
+}
+
+} // file scope
+
+struct parallel_compressor::Itl {
+    Itl(const Options & options)
+        : options(options), index(0), started(false)
+    {
+        switch (options.format) {
+        case GZIP:
+        case XZ:
+            if (options.level < -1 || options.level > 9)
+                throw Exception("parallel_compressor: level must be -1 to 9");
+            break;
+        case ZSTD:
+            // The seek table has 32 bit sizes
+            if (options.blockSize > (1 << 30))
+                throw Exception("parallel_compressor: zstd blocks can't be "
+                                "more than 1GB");
+            if (options.level == -1)
+                this->options.level = ZSTD_CLEVEL_DEFAULT;
+            else if (options.level < ZSTD_minCLevel()
+                     || options.level > ZSTD_maxCLevel())
+                throw Exception("parallel_compressor: zstd level %d out of "
+                                "range", options.level);
+            break;
+        case LZ4:
+            if (options.level < -1
+                || options.level > LZ4F_compressionLevel_max())
+                throw Exception("parallel_compressor: lz4 level %d out of "
+                                "range", options.level);
+            this->options.level = std::max(options.level, 0);
+            break;
+        default:
+            throw Exception("parallel_compressor: unknown format");
+        }
+
+        if (!this->options.worker)
+            this->options.worker
+                = &Worker_Task::instance(num_threads() - 1);
+        if (this->options.maxBlocks <= 0)
+            this->options.maxBlocks = this->options.worker->threads() + 1;
+
+        if (options.format == XZ) {
+            uint32_t preset = (options.level == -1 ? LZMA_PRESET_DEFAULT
+                               : options.level);
+            if (lzma_lzma_preset(&lzmaOptions, preset))
+                throw Exception("parallel_compressor: bad xz preset");
+            if (options.blockSize == 0)
+                this->options.blockSize = 3 * size_t(lzmaOptions.dict_size);
+        }
+        else if (options.blockSize == 0)
+            this->options.blockSize = (options.format == GZIP ? 1 : 4) << 20;
+
+        current.reset(new Block());
+        current->input.reserve(this->options.blockSize);
+    }
+
+    ~Itl()
+    {
+        // The jobs refer to the blocks, so they need to finish first
+        for (auto & p: pending) {
+            try {
+                options.worker->run_until_finished(p.first, true);
+            } catch (...) {
+            }
+        }
+
+        if (index) lzma_index_end(index, 0);
+    }
+
+    void write(const char * s, size_t n, const Output & output)
+    {
+        while (n) {
+            size_t todo
+                = std::min(n, options.blockSize - current->input.size());
+            current->input.append(s, todo);
+            s += todo;
+            n -= todo;
+
+            if (current->input.size() == options.blockSize)
+                submit(output);
+        }
+    }
+
+    void close(const Output & output)
+    {
+        // An empty gzip, zstd or lz4 file still needs a member or frame
+        if (!current->input.empty()
+            || (options.format != XZ && !started && pending.empty()))
+            submit(output);
+
+        while (!pending.empty())
+            finishOldest(output);
+
+        if (options.format == XZ) {
+            startXz(output);
+            finishXz(output);
+        }
+        else if (options.format == ZSTD)
+            finishZstd(output);
+
+        started = false;
+    }
+
+    /** Send the current block off to be compressed. */
+    void submit(const Output & output)
+    {
+        while (pending.size() >= size_t(options.maxBlocks))
+            finishOldest(output);
+
+        std::shared_ptr<Block> block = std::move(current);
+        current.reset(new Block());
+        current->input.reserve(options.blockSize);
+
+        Worker_Task & worker = *options.worker;
+        Worker_Task::Id group
+            = worker.get_group(NO_JOB, "parallel_compressor block");
+        pending.push_back(make_pair(group, block));
+
+        Format format = options.format;
+        int level = options.level;
+        const lzma_options_lzma * xzOptions = &lzmaOptions;
+
+        worker.add([=] ()
+                   {
+                       switch (format) {
+                       case GZIP: compressGzip(*block, level);  break;
+                       case XZ:   compressXz(*block, *xzOptions);  break;
+                       case ZSTD: compressZstd(*block, level);  break;
+                       case LZ4:  compressLz4(*block, level);  break;
+                       }
+                       block->uncompressedSize = block->input.size();
+                       block->input = std::string();
+                   },
+                   "parallel_compressor block", group);
+    }
+
+    /** Wait for the earliest block (helping out in the meantime) and write
+        it to the output. */
+    void finishOldest(const Output & output)
+    {
+        Worker_Task::Id group = pending.front().first;
+        std::shared_ptr<Block> block = pending.front().second;
+
+        try {
+            options.worker->run_until_finished(group, true);
+        } catch (...) {
+            pending.pop_front();
+            throw;
+        }
+
+        pending.pop_front();
+
+        startXz(output);
+        output(block->output.data(), block->output.size());
+
+        if (options.format == XZ) {
+            lzma_ret res = lzma_index_append(index, 0, block->unpaddedSize,
+                                             block->uncompressedSize);
+            if (res != LZMA_OK)
+                throw Exception("parallel_compressor: lzma_index_append "
+                                "failed: %d", res);
+        }
+        else if (options.format == ZSTD)
+            seekTable.push_back(make_pair(block->output.size(),
+                                          block->uncompressedSize));
+    }
+
+    /** Write the seek table of the zstd seekable format: a skippable
+        frame with the compressed and uncompressed size of each frame, and
+        a footer that says how many there are.  All little endian.
+    */
+    void finishZstd(const Output & output)
+    {
+        std::string table;
+        auto add32 = [&] (uint32_t val)
+            {
+                for (unsigned i = 0;  i < 4;  ++i)
+                    table += char(val >> (8 * i));
+            };
+
+        add32(ZSTD_MAGIC_SKIPPABLE_START | 0xE);
+        add32(seekTable.size() * 8 + 9);
+        for (auto & entry: seekTable) {
+            add32(entry.first);
+            add32(entry.second);
+        }
+        add32(seekTable.size());
+        table += char(0);  // descriptor: no checksums
+        add32(0x8F92EAB1);
+
+        output(table.data(), table.size());
+        seekTable.clear();
+    }
+
+    /** Write the xz stream header, if it hasn't been yet. */
+    void startXz(const Output & output)
+    {
+        if (started) return;
+        started = true;
+        if (options.format != XZ) return;
+
+        if (index) lzma_index_end(index, 0);
+        index = lzma_index_init(0);
+        if (!index)
+            throw Exception("parallel_compressor: lzma_index_init failed");
+
+        uint8_t header[LZMA_STREAM_HEADER_SIZE];
+        lzma_stream_flags flags = streamFlags();
+        if (lzma_stream_header_encode(&flags, header) != LZMA_OK)
+            throw Exception("parallel_compressor: couldn't encode xz header");
+        output((const char *)header, LZMA_STREAM_HEADER_SIZE);
+    }
+
+    /** Write the xz index and stream footer. */
+    void finishXz(const Output & output)
+    {
+        std::string buf(lzma_index_size(index), 0);
+        size_t pos = 0;
+        if (lzma_index_buffer_encode(index, (uint8_t *)&buf[0], &pos,
+                                     buf.size()) != LZMA_OK)
+            throw Exception("parallel_compressor: couldn't encode xz index");
+        output(buf.data(), pos);
+
+        uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+        lzma_stream_flags flags = streamFlags();
+        flags.backward_size = lzma_index_size(index);
+        if (lzma_stream_footer_encode(&flags, footer) != LZMA_OK)
+            throw Exception("parallel_compressor: couldn't encode xz footer");
+        output((const char *)footer, LZMA_STREAM_HEADER_SIZE);
+
+        lzma_index_end(index, 0);
+        index = 0;
+    }
+
+    static lzma_stream_flags streamFlags()
+    {
+        lzma_stream_flags result;
+        memset(&result, 0, sizeof(result));
+        result.version = 0;
+        result.check = LZMA_CHECK_CRC64;
+        return result;
+    }
+
+    Options options;
+    lzma_options_lzma lzmaOptions;
+    lzma_index * index;
+    bool started;               ///< Has anything been written yet?
+    std::shared_ptr<Block> current;
+    std::vector<std::pair<uint32_t, uint32_t> > seekTable;   ///< For ZSTD
+    std::deque<std::pair<Worker_Task::Id, std::shared_ptr<Block> > > pending;
+};
+
+parallel_compressor::
+parallel_compressor(const Options & options)
+    : itl(new Itl(options))
+{
+}
+
+void
+parallel_compressor::
+add_input(const char * s, size_t n, const Output & output)
+{
+    itl->write(s, n, output);
+}
+
+void
+parallel_compressor::
+finish(const Output & output)
+{
+    itl->close(output);
+}
+
+} // namespace ML
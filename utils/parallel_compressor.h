@@ -0,0 +1,120 @@
+/* parallel_compressor.h                                           -*- C++ -*-
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Boost iostreams filter that compresses blocks of its input in parallel.
+*/
+
+#ifndef __jml__utils__parallel_compressor_h__
+#define __jml__utils__parallel_compressor_h__
+
+#include <memory>
+#include <functional>
+#include <boost/iostreams/categories.hpp>
+#include <boost/iostreams/operations.hpp>
+
+
+namespace ML {
+
+class Worker_Task;
+
+
+/*****************************************************************************/
+/* PARALLEL COMPRESSOR                                                       */
+/*****************************************************************************/
+
+/** Output filter that cuts what's written into blocks and compresses the
+    blocks independently of each other as jobs on a Worker_Task, writing
+    them out in order as they finish.  The thread that writes helps with
+    the compression while it's waiting for the earliest block.
+
+    The output is a normal compressed file that any decompressor can read:
+    - for GZIP, each block is a gzip member of its own (as with pigz -i),
+      and a gzip file is allowed to be several members one after the other;
+    - for XZ, each block is an xz block within a single xz stream, with the
+      index at the end recording where each block is (as with xz -T);
+    - for ZSTD and LZ4, each block is a frame of its own, and files of
+      several frames are read back as their concatenation (zstd_decompressor
+      can also decompress such frames in parallel).  ZSTD output ends with
+      a seek table in a skippable frame, as in zstd's seekable format,
+      which decompressors that don't know about it skip over.
+
+    With the index (XZ) or the seek table (ZSTD), the file can be read from
+    any block without decompressing the ones before it: see
+    Compressed_Block_Index and filter_istream::openRange().
+
+    The cost of the blocks being independent is a slightly bigger file, as
+    nothing that comes before a block can be used to compress it.
+
+    Like the filters that it replaces, flushing does nothing: the last
+    block is only written when the filter is closed.
+*/
+
+struct parallel_compressor {
+
+    enum Format {
+        GZIP,
+        XZ,
+        ZSTD,
+        LZ4
+    };
+
+    struct Options {
+        Options(Format format = GZIP, int level = -1)
+            : format(format), level(level), blockSize(0), maxBlocks(0),
+              worker(0)
+        {
+        }
+
+        Format format;
+        int level;          ///< As for the format; -1 for its default
+        size_t blockSize;   ///< 0 means 1MB for gzip, 3 dictionaries for xz,
+                            ///< 4MB for zstd and lz4.  It's also how finely
+                            ///< xz and zstd files can be seeked in.
+        int maxBlocks;      ///< Max compressing at once; 0 = threads + 1
+        Worker_Task * worker;   ///< 0 means the default one
+    };
+
+    typedef char char_type;
+    struct category
+        : boost::iostreams::multichar_output_filter_tag,
+          boost::iostreams::closable_tag {
+    };
+
+    parallel_compressor(const Options & options = Options());
+
+    /** Function to which compressed data is written. */
+    typedef std::function<void (const char *, size_t)> Output;
+
+    template<typename Sink>
+    std::streamsize write(Sink & sink, const char * s, std::streamsize n)
+    {
+        add_input(s, n, [&] (const char * data, size_t len)
+                  {
+                      boost::iostreams::write(sink, data, len);
+                  });
+        return n;
+    }
+
+    template<typename Sink>
+    void close(Sink & sink)
+    {
+        finish([&] (const char * data, size_t len)
+               {
+                   boost::iostreams::write(sink, data, len);
+               });
+    }
+
+    /** Add to the input, writing out any blocks that are finished. */
+    void add_input(const char * s, size_t n, const Output & output);
+
+    /** Compress whatever is left of the input and write it all out. */
+    void finish(const Output & output);
+
+    /** The filter is copied around by boost, so the state is shared. */
+    struct Itl;
+    std::shared_ptr<Itl> itl;
+};
+
+} // namespace ML
+
+#endif /* __jml__utils__parallel_compressor_h__ */
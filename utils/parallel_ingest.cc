@@ -0,0 +1,115 @@
+/* parallel_ingest.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Splitting of text into chunks of whole records.
+*/
+
+#include "parallel_ingest.h"
+#include "jml/arch/simd_scan.h"
+#include "jml/arch/cpu_info.h"
+#include <sched.h>
+#include <string.h>
+
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* RECORD SPLITTER                                                           */
+/*****************************************************************************/
+
+size_t
+Record_Splitter::
+defaultBlockSize(size_t length)
+{
+    size_t result = length / (8 * num_cpus());
+    return std::min<size_t>(std::max<size_t>(result, 65536), 4 << 20);
+}
+
+Record_Splitter::
+Record_Splitter(const char * start, const char * end,
+                char quote, size_t blockSize)
+    : start(start), end(end), quote(quote),
+      blockSize_(blockSize ? blockSize : defaultBlockSize(end - start)),
+      numBlocks_((end - start + blockSize_ - 1) / blockSize_),
+      blocks(new Block[numBlocks_])
+{
+    for (size_t i = 0;  i < numBlocks_;  ++i)
+        blocks[i].state = NOTHING;
+}
+
+void
+Record_Splitter::
+block(size_t i, const char * & first, const char * & last, size_t & line)
+{
+    if (i >= numBlocks_)
+        throw Exception("Record_Splitter: block out of range");
+
+    Block & b = blocks[i];
+    const char * p = start + i * blockSize_;
+    const char * e = std::min(p + blockSize_, end);
+
+    b.lines = count_char(p, e, '\n');
+    b.quotes = quote ? count_char(p, e, quote) : 0;
+    __atomic_store_n(&b.state, (int)COUNTED, __ATOMIC_RELEASE);
+
+    // Look back until we find a block that knows its total
+    size_t linesBefore = 0, quotesBefore = 0;
+    for (size_t j = i;  j > 0;  /* no inc */) {
+        const Block & prev = blocks[--j];
+        int state;
+        while ((state = __atomic_load_n(&prev.state, __ATOMIC_ACQUIRE))
+               == NOTHING)
+            sched_yield();
+
+        linesBefore += prev.lines;
+        quotesBefore += prev.quotes;
+        if (state == TOTALLED) {
+            linesBefore += prev.linesBefore;
+            quotesBefore += prev.quotesBefore;
+            break;
+        }
+    }
+
+    b.linesBefore = linesBefore;
+    b.quotesBefore = quotesBefore;
+    __atomic_store_n(&b.state, (int)TOTALLED, __ATOMIC_RELEASE);
+
+    size_t ignored = 0;
+    first = recordStart(i, quotesBefore, linesBefore);
+    last = recordStart(i + 1, quotesBefore + b.quotes, ignored);
+    line = linesBefore + 1;
+}
+
+const char *
+Record_Splitter::
+recordStart(size_t i, size_t quotesBefore, size_t & lines) const
+{
+    if (i == 0) return start;
+    if (i >= numBlocks_) return end;
+
+    const char * p = start + i * blockSize_;
+    bool quoted = quotesBefore % 2;
+
+    // Common case: the block boundary is a record boundary
+    if (p[-1] == '\n' && !quoted) return p;
+
+    if (!quote) {
+        p = (const char *)memchr(p, '\n', end - p);
+        if (!p) return end;
+        ++lines;
+        return p + 1;
+    }
+
+    for (;;) {
+        p = scan_for_any(p, end, '\n', quote, '\n', quote);
+        if (p == end) return end;
+        if (*p++ == quote) quoted = !quoted;
+        else {
+            ++lines;
+            if (!quoted) return p;
+        }
+    }
+}
+
+} // namespace ML
@@ -0,0 +1,199 @@
+/* parallel_ingest.h                                               -*- C++ -*-
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Parse a line oriented file (JSON lines, CSV) in memory on several
+   threads at once.
+*/
+
+#ifndef __jml__utils__parallel_ingest_h__
+#define __jml__utils__parallel_ingest_h__
+
+#include "parse_context.h"
+#include "file_functions.h"
+#include "map_reduce.h"
+#include <memory>
+#include <utility>
+
+
+namespace ML {
+
+
+/*****************************************************************************/
+/* RECORD SPLITTER                                                           */
+/*****************************************************************************/
+
+/** Splits a block of text into chunks that each hold a whole number of
+    records, so that the chunks can be parsed independently.
+
+    A record ends with an end of line that isn't within a quoted field.
+    The text is cut into fixed size blocks, and the records of a block are
+    those that start within it.  To find them, each block needs the number
+    of lines and (for CSV) the parity of the number of quotes before it.
+    These are found in a single pass: when a block is asked for, its own
+    lines and quotes are counted and published, and then it looks back
+    over the earlier blocks, adding up their counts until it reaches one
+    that has already published the total of everything before it.  It
+    then publishes its own total, so that the look back is short.
+
+    Because of the look back, a block can only be asked for when all of
+    the earlier blocks have been or are being asked for by other threads.
+    Claiming the blocks in order, as parallelMapInOrderReduce does, is
+    sufficient.
+
+    Quotes are doubled to escape them, as in CSV, so only their parity
+    matters.  A quote of zero means that there is no quoting and that an
+    end of line always ends a record, as for JSON lines.
+*/
+
+struct Record_Splitter {
+
+    /** Default block size: enough blocks for eight per cpu, but no
+        smaller than 64kb or larger than 4mb. */
+    static size_t defaultBlockSize(size_t length);
+
+    Record_Splitter(const char * start, const char * end,
+                    char quote = 0, size_t blockSize = 0);
+
+    size_t numBlocks() const { return numBlocks_; }
+
+    size_t blockSize() const { return blockSize_; }
+
+    /** Return the records that start in block i as [first, last), and the
+        line number (counted from 1) that first is on.  The range is empty
+        if no record starts within the block.
+    */
+    void block(size_t i, const char * & first, const char * & last,
+               size_t & line);
+
+private:
+    const char * start;
+    const char * end;
+    char quote;
+    size_t blockSize_;
+    size_t numBlocks_;
+
+    enum {
+        NOTHING = 0,    ///< Block hasn't been counted yet
+        COUNTED = 1,    ///< lines and quotes are set
+        TOTALLED = 2    ///< linesBefore and quotesBefore are set too
+    };
+
+    struct Block {
+        size_t lines;          ///< Ends of line within the block
+        size_t quotes;         ///< Quotes within the block
+        size_t linesBefore;    ///< Ends of line before the block
+        size_t quotesBefore;   ///< Quotes before the block
+        int state;
+    };
+
+    std::unique_ptr<Block[]> blocks;
+
+    /** Return the first record boundary at or after the start of block i,
+        given the number of quotes before the block.  lines is incremented
+        for each end of line that is skipped over.
+    */
+    const char * recordStart(size_t i, size_t quotesBefore,
+                             size_t & lines) const;
+};
+
+
+/*****************************************************************************/
+/* PARALLEL INGEST                                                           */
+/*****************************************************************************/
+
+/** Parse the file in parallel, calling onChunk(context, chunkNum) for each
+    chunk of records with a context that covers just that chunk.  The
+    context starts at the real line number of the chunk, so that the errors
+    it throws point to the right place in the file.  The chunks are handed
+    out in order, but are finished in any order; chunks with no records in
+    them are skipped.
+
+    quote is the quote character for CSV, or zero for JSON lines or other
+    formats where an end of line always ends a record.  blockSize is the
+    size of the text to find chunks in (the default depends on the size of
+    the file and the number of cpus).
+
+    If onChunk throws, no more chunks are started and the exception is
+    rethrown once the running ones have finished.
+*/
+template<typename ChunkFn>
+void
+parallelIngest(const File_Read_Buffer & file, ChunkFn onChunk,
+               char quote = 0, size_t blockSize = 0,
+               Worker_Task & worker = Worker_Task::instance(num_threads() - 1))
+{
+    Record_Splitter splitter(file.start(), file.end(), quote, blockSize);
+    std::string filename = file.filename();
+
+    size_t n = splitter.numBlocks();
+    if (n == 0) return;
+
+    size_t numRunners = std::min<size_t>(worker.threads() + 1, n);
+    size_t nextToClaim = 0;
+    volatile bool stop = false;
+
+    auto doRunner = [&] (size_t)
+        {
+            for (;;) {
+                size_t i = nextToClaim;
+                do {
+                    if (stop || i >= n) return;
+                } while (!cmp_xchg(nextToClaim, i, i + 1));
+
+                try {
+                    const char * first, * last;
+                    size_t line;
+                    splitter.block(i, first, last, line);
+                    if (first == last) continue;
+
+                    Parse_Context context(filename, first, last, line);
+                    onChunk(context, i);
+                } catch (...) {
+                    stop = true;
+                    throw;
+                }
+            }
+        };
+
+    worker.do_group<size_t>(0, numRunners, doRunner);
+}
+
+/** Parse the file in parallel, and reduce the results strictly in order.
+    map(context, chunkNum) is called in parallel for each chunk as in
+    parallelIngest (including for empty chunks), and reduce(chunkNum,
+    result) is called in order of chunkNum with what it returned.  At most
+    maxOutstanding results (by default 64 per thread) are waiting to be
+    reduced at any time.
+*/
+template<typename MapFn, typename ReduceFn>
+void
+parallelIngestInOrder(const File_Read_Buffer & file,
+                      MapFn map, ReduceFn reduce,
+                      char quote = 0, size_t blockSize = 0,
+                      size_t maxOutstanding = 0,
+                      Worker_Task & worker
+                          = Worker_Task::instance(num_threads() - 1))
+{
+    typedef decltype(map(std::declval<Parse_Context &>(), size_t(0)))
+        MapResult;
+
+    Record_Splitter splitter(file.start(), file.end(), quote, blockSize);
+    std::string filename = file.filename();
+
+    auto mapChunk = [&] (size_t i) -> MapResult
+        {
+            const char * first, * last;
+            size_t line;
+            splitter.block(i, first, last, line);
+
+            Parse_Context context(filename, first, last, line);
+            return map(context, i);
+        };
+
+    parallelMapInOrderReduce(size_t(0), splitter.numBlocks(),
+                             mapChunk, reduce, maxOutstanding, worker);
+}
+
+} // namespace ML
+
+#endif /* __jml__utils__parallel_ingest_h__ */
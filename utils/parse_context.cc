@@ -16,6 +16,7 @@
 #include "fast_float_parsing.h"
 #include "jml/utils/file_functions.h"
 #include <cassert>
+#include <unistd.h>
 #include <boost/scoped_array.hpp>
 
 
@@ -64,12 +65,13 @@ Parse_Context(const std::string & filename, const char * start,
 }
 
 Parse_Context::
-Parse_Context(const std::string & filename)
+Parse_Context(const std::string & filename,
+              const File_Read_Buffer::Options & options)
     : stream_(0), chunk_size_(0), first_token_(0), last_token_(0),
       filename_(filename),
       line_(1), col_(1), ofs_(0)
 {
-    buf.reset(new File_Read_Buffer(filename));
+    buf.reset(new File_Read_Buffer(filename, options));
     cur_ = buf->start();
     ebuf_ = buf->end();
     current_ = buffers_.insert(buffers_.end(),
@@ -86,6 +88,22 @@ Parse_Context(const File_Read_Buffer & buf)
                                Buffer(0, cur_, ebuf_ - cur_, false));
 }
 
+Parse_Context::
+Parse_Context(const std::string & filename,
+              const std::shared_ptr<Async_File_Reader> & reader,
+              unsigned line, unsigned col)
+    : stream_(0), reader_(reader), chunk_size_(0),
+      first_token_(0), last_token_(0), filename_(filename), cur_(0), ebuf_(0),
+      line_(line), col_(col), ofs_(0)
+{
+    current_ = read_new_buffer();
+
+    if (current_ != buffers_.end()) {
+        cur_ = current_->pos;
+        ebuf_ = cur_ + current_->size;
+    }
+}
+
 Parse_Context::
 Parse_Context(const std::string & filename, std::istream & stream,
               unsigned line, unsigned col, size_t chunk_size)
@@ -108,9 +126,11 @@ Parse_Context::
 
 void
 Parse_Context::
-init(const std::string & filename)
+init(const std::string & filename,
+     const File_Read_Buffer::Options & options)
 {
     stream_ = 0;
+    reader_.reset();
     chunk_size_ = 0;
     first_token_ = 0;
     last_token_ = 0;
@@ -118,8 +138,9 @@ init(const std::string & filename)
     line_ = 1;
     col_ = 1;
     ofs_ = 0;
+    dropped_ = 0;
 
-    buf.reset(new File_Read_Buffer(filename));
+    buf.reset(new File_Read_Buffer(filename, options));
     cur_ = buf->start();
     ebuf_ = buf->end();
     current_ = buffers_.insert(buffers_.end(),
@@ -128,25 +149,6 @@ init(const std::string & filename)
 
 namespace {
 
-struct MatchAnyChar {
-    MatchAnyChar(const char * delimiters, int nd)
-    {
-        assert(nd > 0 && nd <= 4);
-        for (unsigned i = 0;  i < nd;  ++i)
-            chars[i] = delimiters[i];
-        for (unsigned i = nd;  i < 4;  ++i)
-            chars[i] = delimiters[0];
-    }
-    
-    char chars[4];
-
-    bool operator () (char c) const
-    {
-        return (c == chars[0] || c == chars[1]
-                || c == chars[2] || c == chars[3]);
-    }
-};
-
 struct MatchAnyCharLots {
     MatchAnyCharLots(const char * delimiters, int nd)
     {
@@ -180,7 +182,12 @@ match_text(std::string & text, const char * delimiters)
     if (nd == 0)
         throw Exception("Parse_Context::match_text(): no characters");
 
-    if (nd <= 4) return match_text(text, MatchAnyChar(delimiters, nd));
+    if (nd <= 4)
+        return match_text(text,
+                          Matches_Any_Char(delimiters[0],
+                                           nd > 1 ? delimiters[1] : delimiters[0],
+                                           nd > 2 ? delimiters[2] : delimiters[0],
+                                           nd > 3 ? delimiters[3] : delimiters[0]));
     else return match_text(text, MatchAnyCharLots(delimiters, nd));
 }
 
@@ -382,6 +389,22 @@ expect_double(double min, double max, const char * error)
     return val;
 }
 
+void
+Parse_Context::
+drop_consumed()
+{
+    if (!buf) return;
+
+    size_t pos = cur_ - buf->start();
+    if (pos <= dropped_) return;
+
+    // Everything before dropped_ was consumed too, so its page can go
+    size_t page = getpagesize();
+    size_t first = dropped_ / page * page;
+    buf->done_with(first, pos - first);
+    dropped_ = pos;
+}
+
 std::string
 Parse_Context::
 where() const
@@ -547,6 +570,7 @@ free_buffers()
         std::list<Buffer>::iterator to_erase = it;
         ++it;
         if (to_erase->del) delete[] (const_cast<char *>(to_erase->pos));
+        if (to_erase->block != -1) reader_->release(to_erase->block);
         buffers_.erase(to_erase);
     }
 }
@@ -555,6 +579,43 @@ std::list<Parse_Context::Buffer>::iterator
 Parse_Context::
 read_new_buffer()
 {
+    if (reader_) {
+        /* Tokens can keep every one of the reader's blocks alive (for
+           example a Revert_Token over a record longer than them all), in
+           which case the oldest is copied so that its block can be read
+           into again. */
+        int held = 0;
+        for (auto it = buffers_.begin();  it != buffers_.end();  ++it)
+            held += (it->block != -1);
+
+        if (held >= reader_->numBlocks()) {
+            for (auto it = buffers_.begin();  it != buffers_.end();  ++it) {
+                if (it->block == -1) continue;
+                char * copy = new char[it->size];
+                memcpy(copy, it->pos, it->size);
+                if (it == current_) {
+                    cur_ = copy + (cur_ - it->pos);
+                    ebuf_ = copy + it->size;
+                }
+                reader_->release(it->block);
+                it->pos = copy;
+                it->del = true;
+                it->block = -1;
+                break;
+            }
+        }
+
+        Async_File_Reader::Block block;
+        if (!reader_->next(block)) return buffers_.end();
+
+        uint64_t last_ofs = (buffers_.empty() ? ofs_
+                             : buffers_.back().ofs + buffers_.back().size);
+
+        return buffers_.insert(buffers_.end(),
+                               Buffer(last_ofs, block.data, block.size,
+                                      false, block.index));
+    }
+
     if (!stream_) return buffers_.end();
 
     if (stream_->eof()) return buffers_.end();
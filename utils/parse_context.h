@@ -26,6 +26,9 @@
 #include "jml/utils/unnamed_bool.h"
 #include "jml/arch/exception.h"
 #include "jml/compiler/compiler.h"
+#include "jml/arch/simd_scan.h"
+#include "jml/utils/file_functions.h"
+#include "jml/utils/async_file_reader.h"
 #include <cmath>
 #include <string>
 #include <iostream>
@@ -40,9 +43,6 @@
 namespace ML {
 
 
-class File_Read_Buffer;
-
-
 /*****************************************************************************/
 /* PARSE_CONTEXT                                                             */
 /*****************************************************************************/
@@ -53,8 +53,10 @@ struct Parse_Context {
     Parse_Context();
 
     /** Initialize from a filename, loading the file and uncompressing if
-        necessary. */
-    explicit Parse_Context(const std::string & filename);
+        necessary.  The options say how the file is to be mapped. */
+    explicit Parse_Context(const std::string & filename,
+                           const File_Read_Buffer::Options & options
+                               = File_Read_Buffer::Options());
     
     /** Initialize from a memory region. */
     Parse_Context(const std::string & filename, const char * start,
@@ -66,6 +68,12 @@ struct Parse_Context {
     /** Initialize from a File_Read_Buffer. */
     explicit Parse_Context(const File_Read_Buffer & buf);
 
+    /** Initialize from an Async_File_Reader, parsing each block in the
+        buffer it was read into while the next ones are being read. */
+    Parse_Context(const std::string & filename,
+                  const std::shared_ptr<Async_File_Reader> & reader,
+                  unsigned line = 1, unsigned col = 1);
+
     /** Default chunk size. */
     enum { DEFAULT_CHUNK_SIZE = 65500 };
 
@@ -77,8 +85,10 @@ struct Parse_Context {
     ~Parse_Context();
 
     /** Initialize from a filename, loading the file and uncompressing if
-        necessary. */
-    void init(const std::string & filename);
+        necessary.  The options say how the file is to be mapped. */
+    void init(const std::string & filename,
+              const File_Read_Buffer::Options & options
+                  = File_Read_Buffer::Options());
 
     /** Initialize from a memory region. */
     void init(const std::string & filename, const char * start,
@@ -196,54 +206,35 @@ struct Parse_Context {
         if (!match_literal(str)) exception_fmt(error, str);
     }
 
+    /** Match text up to (but not including) the first character for
+        which found(c) returns true, or EOF.  The text is returned in text
+        and the position will be at the delimiter.  Always returns true,
+        as the empty string counts as being matched.
+
+        The buffer is scanned in blocks rather than a character at a time
+        (with SIMD for the delimiter types below), and the position and
+        line numbers are updated once per block.
+    */
     template<class FoundEnd>
     bool match_text(std::string & text, const FoundEnd & found)
     {
-#if 0 // buggy        
-        /* We do each buffer separately, to avoid overhead. */
-        while (!eof()) {
-            const char * text_start = cur_;
+        text.clear();
+        return append_text(text, found);
+    }
 
-            /* Go to an EOF or the end of the buffer, whatever first. */
-            while (cur_ < ebuf_ && !found(*cur_)) ++cur_;
-            
-            /* Copy the text. */
-            text.append(text_start, cur_);
-            
-            /* Did we find the end of line? */
-            if (cur_ < ebuf_) break;
-            
-            /* We need a new buffer. */
-            --cur_;  // make sure the operator ++ will return a new buffer
-            operator ++ ();  // get the new buffer
-        }
-#else
-        char internalBuffer[4096];
-        
-        char * buffer = internalBuffer;
-        size_t bufferSize = 4096;
-        size_t pos = 0;
-        char c;
-        
-        while (!eof() && !found(c = operator *())) {
-            if (pos == bufferSize) {
-                size_t newBufferSize = bufferSize * 8;
-                char * newBuffer = new char[newBufferSize];
-                std::copy(buffer, buffer + bufferSize, newBuffer);
-                if (buffer != internalBuffer)
-                    delete[] buffer;
-                buffer = newBuffer;
-                bufferSize = newBufferSize;
-            }
-            buffer[pos++] = c;
-            operator ++();
+    /** As match_text, but appends the matched text to text instead of
+        replacing it. */
+    template<class FoundEnd>
+    bool append_text(std::string & text, const FoundEnd & found)
+    {
+        while (!eof()) {
+            const char * end = find_end(cur_, ebuf_, found);
+            text.append(cur_, end);
+            bool finished = end != ebuf_;
+            advance_to(end);
+            if (finished) break;
         }
 
-        text = std::string(buffer, buffer + pos);
-        if (buffer != internalBuffer)
-            delete[] buffer;
-#endif
-
         return true;
     }
     
@@ -253,6 +244,32 @@ struct Parse_Context {
         bool operator () (char c2) const { return c == c2; }
     };
 
+    /** Matches any of two, three or four characters.  Any character
+        (including NUL) may be a delimiter; unused slots repeat c1. */
+    struct Matches_Any_Char {
+        Matches_Any_Char(char c1, char c2)
+            : c1(c1), c2(c2), c3(c1), c4(c1)
+        {
+        }
+
+        Matches_Any_Char(char c1, char c2, char c3)
+            : c1(c1), c2(c2), c3(c3), c4(c1)
+        {
+        }
+
+        Matches_Any_Char(char c1, char c2, char c3, char c4)
+            : c1(c1), c2(c2), c3(c3), c4(c4)
+        {
+        }
+
+        char c1, c2, c3, c4;
+
+        bool operator () (char c) const
+        {
+            return c == c1 || c == c2 || c == c3 || c == c4;
+        }
+    };
+
     /** Match a string of any length delimited by the given character.  EOF is
         implicitly considered a delimiter.  The text may be of zero length if
         the delimiter is encountered straight away.  The text up to but not
@@ -334,15 +351,19 @@ struct Parse_Context {
     double expect_double(double min = -INFINITY, double max = INFINITY,
                          const char * error = "expected double");
     
+    /** Match spaces and tabs (in blocks, like match_text). */
     bool match_whitespace()
     {
-        bool result = false;
-        while (!eof() && isblank(*cur_)) {
-        // while (!eof() && isspace(*cur_) && *cur_ != '\n') {
-            result = true;
-            operator ++ ();
+        if (eof() || (*cur_ != ' ' && *cur_ != '\t'))
+            return false;
+
+        while (!eof()) {
+            const char * end = scan_past_blanks(cur_, ebuf_);
+            bool finished = end != ebuf_;
+            advance_to(end);
+            if (finished) break;
         }
-        return result;
+        return true;
     }
 
     void skip_whitespace()
@@ -514,7 +535,42 @@ struct Parse_Context {
 
     bool match_literal_str(const char * start, size_t len);
 
-protected: 
+    /** Direct access to the characters buffered from the current position
+        onwards, for parsers that scan in place.  They are in
+        [buffer_pos(), buffer_end()); unless last_buffer() is true, more
+        characters may follow in another buffer.  Use skip_buffered() to
+        consume them.
+    */
+    const char * buffer_pos() const { return cur_; }
+    const char * buffer_end() const { return ebuf_; }
+
+    /** Is the current buffer the last one, so that nothing comes after
+        buffer_end()? */
+    bool last_buffer() const
+    {
+        return (!stream_ || stream_->eof())
+            && (!reader_ || reader_->finished())
+            && (current_ == buffers_.end()
+                || boost::next(current_) == buffers_.end());
+    }
+
+    /** Consume the characters up to pos, which must be between
+        buffer_pos() and buffer_end(). */
+    void skip_buffered(const char * pos)
+    {
+        advance_to(pos);
+    }
+
+    /** For a context that opened a file itself, tell the file that nothing
+        before the current position will be looked at again, so that those
+        pages can be dropped (see File_Read_Buffer::done_with).  Calling it
+        every few megabytes keeps a scan of a big file from filling the
+        page cache.  No token may refer to anything before the current
+        position.  Does nothing for other contexts.
+    */
+    void drop_consumed();
+
+protected:
     /** This token class allows speculative parsing.  It saves the position
         of the parse context, and will on destruction revert back to that
         position, unless it was ignored.
@@ -695,6 +751,51 @@ private:
         necessary. */
     void next_buffer();
 
+    /** Move forward to pos, which must be within the current buffer or
+        at its end, updating the offset, line and column as if operator ++
+        had been called for each character.  The newlines are counted in
+        blocks, and the column comes from the last one. */
+    void advance_to(const char * pos)
+    {
+        size_t n = pos - cur_;
+        if (n == 0) return;
+
+        const char * last_nl = (const char *)memrchr(cur_, '\n', n);
+        if (last_nl) {
+            line_ += count_char(cur_, last_nl, '\n') + 1;
+            col_ = pos - last_nl;
+        }
+        else col_ += n;
+
+        ofs_ += n;
+        cur_ = pos;
+        if (JML_UNLIKELY(cur_ == ebuf_))
+            next_buffer();
+    }
+
+    /* Find the first delimiter in [p, e), or e if there is none. */
+
+    template<class FoundEnd>
+    static const char * find_end(const char * p, const char * e,
+                                 const FoundEnd & found)
+    {
+        while (p < e && !found(*p)) ++p;
+        return p;
+    }
+
+    static const char * find_end(const char * p, const char * e,
+                                 const Matches_Char & found)
+    {
+        const char * result = (const char *)memchr(p, found.c, e - p);
+        return result ? result : e;
+    }
+
+    static const char * find_end(const char * p, const char * e,
+                                 const Matches_Any_Char & found)
+    {
+        return scan_for_any(p, e, found.c1, found.c2, found.c3, found.c4);
+    }
+
     /** Go to a given offset.  It must be within the current set of buffers. */
     void goto_ofs(uint64_t ofs, size_t line, size_t col);
 
@@ -708,8 +809,8 @@ private:
     /** This contains a single contiguous block of text. */
     struct Buffer {
         Buffer(uint64_t ofs = 0, const char * pos = 0, size_t size = 0,
-               bool del = false)
-            : ofs(ofs), pos(pos), size(size), del(del)
+               bool del = false, int block = -1)
+            : ofs(ofs), pos(pos), size(size), del(del), block(block)
         {
         }
 
@@ -717,6 +818,7 @@ private:
         const char * pos;     ///< First character
         size_t size;          ///< Length
         bool del;             ///< Do we delete it once finished with?
+        int block;            ///< Block of reader_ to release, or -1
     };
 
     /** Read a new buffer if possible, and update everything.  Doesn't
@@ -724,6 +826,7 @@ private:
     std::list<Buffer>::iterator read_new_buffer();
 
     std::istream * stream_;   ///< Stream we read from; zero if none
+    std::shared_ptr<Async_File_Reader> reader_;  ///< Or reader to read from
     size_t chunk_size_;       ///< Size of chunks we read in
 
     Token * first_token_;     ///< The earliest token
@@ -742,6 +845,7 @@ private:
     uint64_t ofs_;            ///< Offset of current position (chars since 0)
 
     std::shared_ptr<const File_Read_Buffer> buf;
+    size_t dropped_ = 0;      ///< Offset in buf before which was dropped
 };
 
 } // namespace ML
@@ -0,0 +1,133 @@
+/* async_file_reader_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Cold cache parsing throughput of a file through Parse_Context when it's
+   read from an istream, from a memory mapping and from an
+   Async_File_Reader with each of its backends.  The size of the file in MB
+   comes from ASYNC_BENCHMARK_MB.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <fstream>
+#include <functional>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "jml/utils/async_file_reader.h"
+#include "jml/utils/parse_context.h"
+#include "jml/utils/file_functions.h"
+#include "jml/utils/environment.h"
+#include "jml/utils/guard.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace std;
+
+void write_file(const string & filename, size_t bytes)
+{
+    FILE * file = fopen(filename.c_str(), "w");
+    if (!file)
+        throw Exception("couldn't open " + filename);
+
+    string line;
+    for (size_t written = 0, i = 0;  written < bytes;  written += line.size())
+        fputs((line = format("%zd,%zd,some text\n", i++, written)).c_str(),
+              file);
+
+    fclose(file);
+}
+
+/** Drop the whole file from the page cache. */
+void drop_cache(const string & filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw Exception(errno, filename, "open");
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/** Parse the first field of every line and return their sum. */
+uint64_t parse(Parse_Context & context)
+{
+    uint64_t result = 0;
+    while (context) {
+        result += context.expect_unsigned_long_long();
+        context.skip_line();
+    }
+    return result;
+}
+
+uint64_t run(const string & filename, const char * what,
+             std::function<uint64_t ()> doParse)
+{
+    drop_cache(filename);
+
+    Timer timer;
+    uint64_t result = doParse();
+    double elapsed = timer.elapsed_wall();
+
+    cerr << format("  %-24s %8.1f MB/s  %6.2fs cpu",
+                   what, get_file_size(filename) / elapsed / 1e6,
+                   timer.elapsed_cpu())
+         << endl;
+
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_cold_cache_parse )
+{
+    Env_Option<size_t> file_mb("ASYNC_BENCHMARK_MB", 1024);
+
+    string filename = "async_file_reader_benchmark.txt";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    write_file(filename, file_mb * 1000000);
+
+    auto parseStream = [&] ()
+        {
+            ifstream stream(filename.c_str());
+            Parse_Context context(filename, stream);
+            return parse(context);
+        };
+
+    auto parseMapped = [&] ()
+        {
+            Parse_Context context(filename,
+                                  File_Read_Buffer::Options
+                                      (File_Read_Buffer::SEQUENTIAL));
+            return parse(context);
+        };
+
+    auto parseAsync = [&] (Async_File_Reader::Backend backend)
+        {
+            Async_File_Reader::Options options;
+            options.backend = backend;
+            Parse_Context context(filename,
+                                  std::make_shared<Async_File_Reader>
+                                      (filename, options));
+            return parse(context);
+        };
+
+    auto parseUring = [&] ()
+        {
+            return parseAsync(Async_File_Reader::IO_URING);
+        };
+
+    auto parseThread = [&] ()
+        {
+            return parseAsync(Async_File_Reader::THREAD);
+        };
+
+    uint64_t sum = run(filename, "istream", parseStream);
+    BOOST_CHECK_EQUAL(run(filename, "mmap sequential", parseMapped), sum);
+    BOOST_CHECK_EQUAL(run(filename, "async io_uring", parseUring), sum);
+    BOOST_CHECK_EQUAL(run(filename, "async thread", parseThread), sum);
+}
@@ -0,0 +1,256 @@
+/* async_file_reader_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Tests for the asynchronous file reader and for parsing from it.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <fstream>
+#include <thread>
+#include <unistd.h>
+
+#include "jml/utils/async_file_reader.h"
+#include "jml/utils/parse_context.h"
+#include "jml/utils/file_functions.h"
+#include "jml/utils/guard.h"
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/format.h"
+#include "jml/arch/timers.h"
+
+using namespace std;
+using namespace ML;
+
+string make_text(unsigned lines)
+{
+    string result;
+    for (unsigned i = 0;  i < lines;  ++i)
+        result += format("%d %s\n", i, string(i % 37, 'x').c_str());
+    return result;
+}
+
+void write_file(const string & filename, const string & text)
+{
+    ofstream stream(filename.c_str());
+    stream << text;
+}
+
+/** Read the whole file, holding up to held blocks at once. */
+string read_all(Async_File_Reader & reader, size_t held = 1)
+{
+    string result;
+    vector<int> holding;
+    Async_File_Reader::Block block;
+    while (reader.next(block)) {
+        result.append(block.data, block.size);
+        holding.push_back(block.index);
+        if (holding.size() == held) {
+            reader.release(holding.front());
+            holding.erase(holding.begin());
+        }
+    }
+    BOOST_CHECK(reader.finished());
+    BOOST_CHECK(!reader.next(block));
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE( test_read_whole_file )
+{
+    string filename = "async_file_reader_test_file";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    string text = make_text(50000);
+    write_file(filename, text);
+
+    typedef Async_File_Reader::Backend Backend;
+
+    for (Backend backend: { Async_File_Reader::IO_URING,
+                            Async_File_Reader::THREAD }) {
+        for (size_t blockSize: { 1, 4096, 65536, 1 << 22 }) {
+            for (int numBlocks: { 2, 3, 8 }) {
+                Async_File_Reader::Options options;
+                options.blockSize = blockSize;
+                options.numBlocks = numBlocks;
+                options.backend = backend;
+
+                std::unique_ptr<Async_File_Reader> reader;
+                try {
+                    reader.reset(new Async_File_Reader(filename, options));
+                } catch (const std::exception & exc) {
+                    // Not every kernel has io_uring
+                    BOOST_REQUIRE_EQUAL(backend, Async_File_Reader::IO_URING);
+                    cerr << "no io_uring: " << exc.what() << endl;
+                    continue;
+                }
+
+                BOOST_CHECK_EQUAL(reader->backend(), backend);
+                BOOST_CHECK(read_all(*reader, numBlocks - 1) == text);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_empty_file )
+{
+    string filename = "async_file_reader_test_empty";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    write_file(filename, "");
+
+    Async_File_Reader reader(filename);
+    BOOST_CHECK(reader.finished());
+    BOOST_CHECK_EQUAL(read_all(reader), "");
+}
+
+BOOST_AUTO_TEST_CASE( test_pipe )
+{
+    string text = make_text(20000);
+
+    int fds[2];
+    BOOST_REQUIRE_EQUAL(pipe(fds), 0);
+
+    std::thread writer([&] ()
+        {
+            for (size_t done = 0;  done < text.size();) {
+                ssize_t res = write(fds[1], text.c_str() + done,
+                                    std::min<size_t>(text.size() - done,
+                                                     1000));
+                if (res == -1) break;
+                done += res;
+            }
+            close(fds[1]);
+        });
+
+    Async_File_Reader::Options options;
+    options.blockSize = 4096;
+    options.numBlocks = 4;
+    Async_File_Reader reader(fds[0], options);
+    close(fds[0]);
+
+    BOOST_CHECK_EQUAL(reader.backend(), Async_File_Reader::THREAD);
+    BOOST_CHECK(read_all(reader, 2) == text);
+
+    writer.join();
+}
+
+/* Destroying the reader while the writer of its pipe is idle mustn't wait
+   for the writer. */
+BOOST_AUTO_TEST_CASE( test_pipe_destroyed_before_eof )
+{
+    int fds[2];
+    BOOST_REQUIRE_EQUAL(pipe(fds), 0);
+    Call_Guard guard([&] () { close(fds[1]); });
+
+    BOOST_REQUIRE_EQUAL(write(fds[1], "hello\n", 6), 6);
+
+    {
+        Async_File_Reader reader(fds[0]);
+        close(fds[0]);
+
+        Async_File_Reader::Block block;
+        BOOST_REQUIRE(reader.next(block));
+        BOOST_CHECK_EQUAL(string(block.data, block.size), "hello\n");
+        reader.release(block.index);
+
+        // Give the reader thread time to block waiting for more
+        ML::sleep(0.1);
+    }
+
+    {
+        int fds2[2];
+        BOOST_REQUIRE_EQUAL(pipe(fds2), 0);
+        Call_Guard guard2([&] () { close(fds2[1]); });
+        BOOST_REQUIRE_EQUAL(write(fds2[1], "hello ", 6), 6);
+
+        std::shared_ptr<Async_File_Reader> reader
+            (new Async_File_Reader(fds2[0]));
+        close(fds2[0]);
+
+        Parse_Context context("pipe", reader);
+        BOOST_CHECK(context.match_literal("hello"));
+        ML::sleep(0.1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_errors )
+{
+    JML_TRACE_EXCEPTIONS(false);
+
+    BOOST_CHECK_THROW(Async_File_Reader("/this/file/does/not/exist"),
+                      std::exception);
+
+    string filename = "async_file_reader_test_held";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    write_file(filename, make_text(1000));
+
+    Async_File_Reader::Options options;
+    options.blockSize = 4096;
+    options.numBlocks = 2;
+    Async_File_Reader reader(filename, options);
+
+    Async_File_Reader::Block block;
+    BOOST_CHECK(reader.next(block));
+    BOOST_CHECK(reader.next(block));
+    BOOST_CHECK_THROW(reader.next(block), std::exception);
+}
+
+// Tokens straddle the blocks, and the line numbers have to carry on across
+// them
+BOOST_AUTO_TEST_CASE( test_parse_context )
+{
+    string filename = "async_file_reader_test_parse";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    write_file(filename, make_text(20000));
+
+    for (size_t blockSize: { 1, 4096, 1 << 20 }) {
+        Async_File_Reader::Options options;
+        options.blockSize = blockSize;
+        options.numBlocks = 4;
+
+        Parse_Context context(filename,
+                              std::make_shared<Async_File_Reader>
+                                  (filename, options));
+
+        for (unsigned i = 0;  i < 20000;  ++i) {
+            BOOST_REQUIRE_EQUAL(context.get_line(), i + 1);
+            BOOST_REQUIRE_EQUAL(context.expect_unsigned(), i);
+            context.expect_whitespace();
+            string x = context.expect_text('\n', true);
+            BOOST_REQUIRE_EQUAL(x, string(i % 37, 'x'));
+            context.expect_eol();
+        }
+
+        BOOST_CHECK(context.eof());
+    }
+}
+
+// A token held over a line longer than all of the buffers together keeps
+// every block alive; they have to be copied rather than running out
+BOOST_AUTO_TEST_CASE( test_parse_context_token_holds_all_blocks )
+{
+    string filename = "async_file_reader_test_long_line";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    string line(100000, 'x');
+    write_file(filename, line + "\nend\n");
+
+    Async_File_Reader::Options options;
+    options.blockSize = 4096;
+    options.numBlocks = 4;
+
+    Parse_Context context(filename,
+                          std::make_shared<Async_File_Reader>
+                              (filename, options));
+
+    {
+        Parse_Context::Revert_Token token(context);
+        BOOST_CHECK_EQUAL(context.expect_text('\n', true).size(), 100000);
+    }
+
+    BOOST_CHECK_EQUAL(context.get_offset(), 0);
+    BOOST_CHECK(context.expect_text('\n', true) == line);
+    context.expect_eol();
+    context.expect_literal("end");
+    context.expect_eol();
+    BOOST_CHECK(context.eof());
+}
@@ -0,0 +1,109 @@
+/* codec_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Write and read throughput through filter_ostream and filter_istream for
+   each of the compression formats, with the size they compress to.  The
+   size of the input in MB comes from CODEC_BENCHMARK_MB.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+#include <sstream>
+
+#include "jml/utils/filter_streams.h"
+#include "jml/utils/worker_task.h"
+#include "jml/utils/environment.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace std;
+
+/** Something like a log file: repetitive, but not too repetitive. */
+string make_corpus(size_t bytes)
+{
+    string result;
+    result.reserve(bytes + 200);
+    for (size_t i = 0;  result.size() < bytes;  ++i)
+        result += format("2013-06-%02zd %02zd:%02zd:%02zd id=%zd user=u%zd "
+                         "url=/page/%zd status=%d bytes=%zd\n",
+                         i / 86400 % 30 + 1, i / 3600 % 24, i / 60 % 60,
+                         i % 60, i, (i * 7919) % 100003, (i * 31) % 997,
+                         i % 17 ? 200 : 404, (i * 104729) % 65536);
+    return result;
+}
+
+void run(const string & corpus, const string & compression, int level,
+         int threads = 1)
+{
+    stringbuf buf;
+    Timer timer;
+    {
+        filter_ostream stream;
+        stream.openFromStreambuf(&buf, false, "", compression, level,
+                                 threads);
+        for (size_t i = 0;  i < corpus.size();  i += 65536)
+            stream.write(corpus.c_str() + i,
+                         std::min<size_t>(65536, corpus.size() - i));
+    }
+    double writeTime = timer.elapsed_wall();
+
+    string compressed = buf.str();
+
+    // Read it back with no hint of the format, as for a file of unknown
+    // name, and with as many threads as it was written with
+    stringbuf input(compressed);
+    timer.restart();
+    size_t total = 0;
+    {
+        filter_istream stream;
+        stream.openFromStreambuf(&input, false, "", "", threads);
+        char block[65536];
+        while (stream) {
+            stream.read(block, sizeof(block));
+            total += stream.gcount();
+        }
+    }
+    double readTime = timer.elapsed_wall();
+
+    BOOST_CHECK_EQUAL(total, corpus.size());
+
+    cerr << format("  %-4s level %2d %-9s  write %8.1f MB/s  "
+                   "read %8.1f MB/s  ratio %6.3f",
+                   compression.c_str(), level,
+                   threads == 1 ? "serial" : format("%d blocks",
+                                                    threads).c_str(),
+                   corpus.size() / writeTime / 1e6,
+                   corpus.size() / readTime / 1e6,
+                   1.0 * compressed.size() / corpus.size())
+         << endl;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_codecs )
+{
+    Env_Option<size_t> corpus_mb("CODEC_BENCHMARK_MB", 32);
+
+    string corpus = make_corpus(corpus_mb * 1000000);
+    cerr << "compressing " << corpus.size() / 1e6 << "MB" << endl;
+
+    run(corpus, "none", -1);
+
+    for (int level: { 1, 6 })
+        run(corpus, "gz", level);
+    for (int level: { 1, 9 })
+        run(corpus, "bz2", level);
+    for (int level: { 0, 6 })
+        run(corpus, "xz", level);
+    for (int level: { 1, 3, 9, 19 })
+        run(corpus, "zst", level);
+    for (int level: { -1, 9 })
+        run(corpus, "lz4", level);
+
+    // Many frames, so that they can be decompressed in parallel too
+    int threads = std::max(num_threads(), 2);
+    run(corpus, "zst", 3, threads);
+    run(corpus, "lz4", -1, threads);
+}
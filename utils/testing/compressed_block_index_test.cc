@@ -0,0 +1,223 @@
+/* compressed_block_index_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Tests for reading ranges of indexed compressed files.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/bind.hpp>
+#include <fstream>
+
+#include "jml/utils/compressed_block_index.h"
+#include "jml/utils/parallel_compressor.h"
+#include "jml/utils/filter_streams.h"
+#include "jml/utils/worker_task.h"
+#include "jml/utils/file_functions.h"
+#include "jml/utils/guard.h"
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/format.h"
+
+using namespace std;
+using namespace ML;
+
+string make_text(unsigned lines)
+{
+    string result;
+    for (unsigned i = 0;  i < lines;  ++i)
+        result += format("line %d of the text, %d\n", i, i * i % 1013);
+    return result;
+}
+
+string compress(const string & text, parallel_compressor::Format format,
+                size_t blockSize)
+{
+    parallel_compressor::Options options(format, 1);
+    options.blockSize = blockSize;
+    options.maxBlocks = 2;
+
+    string result;
+    {
+        boost::iostreams::filtering_ostream stream;
+        stream.push(parallel_compressor(options));
+        stream.push(boost::iostreams::back_inserter(result));
+        stream << text;
+    }
+    return result;
+}
+
+void write_file(const string & filename, const string & contents)
+{
+    ofstream stream(filename.c_str());
+    stream << contents;
+}
+
+string read_range(const string & filename, uint64_t start,
+                  uint64_t end = -1, int threads = 1)
+{
+    filter_istream stream;
+    stream.openRange(filename, start, end, "", threads);
+    string result;
+    char buf[1000];
+    while (stream) {
+        stream.read(buf, sizeof(buf));
+        result.append(buf, stream.gcount());
+    }
+    return result;
+}
+
+/** Check a good spread of ranges, including ones on block boundaries. */
+void check_ranges(const string & filename, const string & text,
+                  const Compressed_Block_Index * index)
+{
+    vector<uint64_t> offsets = { 0, 1, 999, text.size() / 2,
+                                 text.size() - 1, text.size(),
+                                 text.size() + 10 };
+    if (index) {
+        for (unsigned i = 0;  i < index->blocks.size();  i += 3) {
+            uint64_t offset = index->blocks[i].uncompressedOffset;
+            offsets.push_back(offset);
+            if (offset) offsets.push_back(offset - 1);
+            offsets.push_back(offset + 1);
+        }
+    }
+
+    for (uint64_t start: offsets) {
+        BOOST_CHECK(read_range(filename, start)
+                    == text.substr(std::min<uint64_t>(start, text.size())));
+        for (uint64_t end: offsets) {
+            string expected;
+            if (start < end && start < text.size())
+                expected = text.substr(start, end - start);
+            string got = read_range(filename, start, end);
+            if (got != expected)
+                cerr << "range " << start << " to " << end << " got "
+                     << got.size() << " bytes" << endl;
+            BOOST_CHECK(got == expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_xz_and_zstd_ranges )
+{
+    string text = make_text(20000);
+
+    for (auto format: { parallel_compressor::XZ, parallel_compressor::ZSTD }) {
+        string filename = (format == parallel_compressor::XZ
+                           ? "compressed_block_index_test.xz"
+                           : "compressed_block_index_test.zst");
+        Call_Guard guard(boost::bind(&delete_file, filename));
+        write_file(filename, compress(text, format, 20000));
+
+        auto index = getCompressedBlockIndex(filename);
+        BOOST_REQUIRE(index);
+        BOOST_CHECK_EQUAL(index->format,
+                          format == parallel_compressor::XZ
+                          ? Compressed_Block_Index::XZ
+                          : Compressed_Block_Index::ZSTD);
+        BOOST_CHECK_EQUAL(index->uncompressedSize, text.size());
+        BOOST_CHECK_EQUAL(index->blocks.size(),
+                          (text.size() + 19999) / 20000);
+        BOOST_CHECK_EQUAL(index->findBlock(0), 0);
+        BOOST_CHECK_EQUAL(index->findBlock(20000), 1);
+        BOOST_CHECK_EQUAL(index->findBlock(text.size()),
+                          index->blocks.size());
+
+        // It's still a normal file for everything else
+        filter_istream stream(filename);
+        string all((istreambuf_iterator<char>(stream)),
+                   istreambuf_iterator<char>());
+        BOOST_CHECK(all == text);
+
+        check_ranges(filename, text, index.get());
+
+        // Split into shards on block boundaries, as a parallel reader would
+        string shards;
+        for (unsigned i = 0;  i < index->blocks.size();  i += 7) {
+            uint64_t start = index->blocks[i].uncompressedOffset;
+            uint64_t end = (i + 7 < index->blocks.size()
+                            ? index->blocks[i + 7].uncompressedOffset
+                            : index->uncompressedSize);
+            shards += read_range(filename, start, end, 2);
+        }
+        BOOST_CHECK(shards == text);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_only_needed_blocks_are_read )
+{
+    JML_TRACE_EXCEPTIONS(false);
+
+    string text = make_text(20000);
+
+    for (auto format: { parallel_compressor::XZ, parallel_compressor::ZSTD }) {
+        string compressed = compress(text, format, 20000);
+
+        string filename = "compressed_block_index_test_corrupt.dat";
+        Call_Guard guard(boost::bind(&delete_file, filename));
+        write_file(filename, compressed);
+
+        auto index = getCompressedBlockIndex(filename);
+        BOOST_REQUIRE(index);
+
+        // Break the first block
+        const auto & block = index->blocks[0];
+        for (unsigned i = 20;  i < 40;  ++i)
+            compressed[block.compressedOffset + i] ^= 0x55;
+        write_file(filename, compressed);
+
+        BOOST_CHECK_THROW(read_range(filename, 0), std::exception);
+
+        uint64_t start = index->blocks[3].uncompressedOffset + 100;
+        BOOST_CHECK(read_range(filename, start) == text.substr(start));
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_xz_several_streams )
+{
+    string text1 = make_text(10000), text2 = make_text(7000);
+
+    // Two streams, with stream padding between them
+    string filename = "compressed_block_index_test_streams.xz";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    write_file(filename,
+               compress(text1, parallel_compressor::XZ, 30000)
+               + string(8, '\0')
+               + compress(text2, parallel_compressor::XZ, 30000));
+
+    auto index = getCompressedBlockIndex(filename);
+    BOOST_REQUIRE(index);
+    BOOST_CHECK_EQUAL(index->streamChecks.size(), 2);
+    BOOST_CHECK_EQUAL(index->uncompressedSize, text1.size() + text2.size());
+
+    check_ranges(filename, text1 + text2, index.get());
+}
+
+BOOST_AUTO_TEST_CASE( test_without_index )
+{
+    string text = make_text(5000);
+
+    // Formats with no index, and a single block xz file, still work; they
+    // are just read from the start
+    for (string ext: { ".gz", ".lz4", ".zst", ".xz", ".txt" }) {
+        string filename = "compressed_block_index_test_plain" + ext;
+        Call_Guard guard(boost::bind(&delete_file, filename));
+        {
+            filter_ostream stream(filename);
+            stream << text;
+        }
+
+        auto index = getCompressedBlockIndex(filename);
+        if (ext == ".xz") {
+            BOOST_REQUIRE(index);
+            BOOST_CHECK_EQUAL(index->blocks.size(), 1);
+        }
+        else BOOST_CHECK(!index);
+
+        check_ranges(filename, text, 0);
+    }
+}
@@ -0,0 +1,138 @@
+/* concurrent_lightweight_hash_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Multi-threaded read/write mix benchmark of the concurrent lightweight
+   hash against a Lightweight_Hash protected by an RWLock.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <iostream>
+#include <vector>
+
+#include "jml/utils/concurrent_lightweight_hash.h"
+#include "jml/utils/lightweight_hash.h"
+#include "jml/arch/rwlock.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/cpu_info.h"
+
+using namespace ML;
+using namespace std;
+
+struct Locked_Hash {
+    RWLock lock;
+    Lightweight_Hash<uint64_t, uint64_t> hash;
+
+    bool find(uint64_t key, uint64_t & value)
+    {
+        lock.lock_shared();
+        auto it = hash.find(key);
+        bool found = it != hash.end();
+        if (found) value = it->second;
+        lock.unlock_shared();
+        return found;
+    }
+
+    bool insert(uint64_t key, uint64_t value)
+    {
+        lock.lock();
+        bool result = hash.insert(make_pair(key, value)).second;
+        lock.unlock();
+        return result;
+    }
+};
+
+struct Lock_Free_Hash {
+    Concurrent_Lightweight_Hash<uint64_t, uint64_t> hash;
+
+    bool find(uint64_t key, uint64_t & value)
+    {
+        return hash.find(key, value);
+    }
+
+    bool insert(uint64_t key, uint64_t value)
+    {
+        return hash.insert(key, value);
+    }
+};
+
+/** Each thread does nops operations on a map that starts with ninitial
+    keys.  A write_every of n means that every nth operation inserts a new
+    key; the others look up a random key that's there.  Returns the total
+    number of operations per second. */
+template<class Hash>
+double run_mix(int nthreads, size_t ninitial, int nops, int write_every)
+{
+    Hash h;
+    for (uint64_t i = 1;  i <= ninitial;  ++i)
+        h.insert(i, i);
+
+    boost::barrier barrier(nthreads + 1);
+    vector<size_t> num_found(nthreads);
+
+    auto runThread = [&] (int n)
+        {
+            uint64_t x = n + 1;
+            uint64_t next_key = ninitial + 1 + n;
+            size_t found = 0;
+            barrier.wait();
+            for (int i = 0;  i < nops;  ++i) {
+                x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+                if (write_every && i % write_every == 0) {
+                    h.insert(next_key, next_key);
+                    next_key += nthreads;
+                }
+                else {
+                    uint64_t value;
+                    found += h.find((x >> 33) % ninitial + 1, value);
+                }
+            }
+            num_found[n] = found;
+        };
+
+    boost::thread_group threads;
+    for (int i = 0;  i < nthreads;  ++i)
+        threads.create_thread(std::bind<void>(runThread, i));
+
+    barrier.wait();
+    Timer timer;
+    threads.join_all();
+    double elapsed = timer.elapsed_wall();
+
+    for (int i = 0;  i < nthreads;  ++i)
+        BOOST_CHECK_EQUAL(num_found[i],
+                          nops - (write_every ? (nops + write_every - 1)
+                                  / write_every : 0));
+
+    return 1.0 * nthreads * nops / elapsed;
+}
+
+BOOST_AUTO_TEST_CASE( test_read_write_mix )
+{
+    int max_threads = std::max(4, num_cpus() * 2);
+    size_t ninitial = 1000000;
+    int nops = 2000000;
+
+    for (int write_every: { 0, 1000, 100, 10 }) {
+        if (write_every)
+            cerr << "one write every " << write_every << " operations"
+                 << endl;
+        else cerr << "read only" << endl;
+
+        for (int nthreads = 1;  nthreads <= max_threads;  nthreads *= 2) {
+            double locked
+                = run_mix<Locked_Hash>(nthreads, ninitial, nops, write_every);
+            double lockFree
+                = run_mix<Lock_Free_Hash>(nthreads, ninitial, nops,
+                                          write_every);
+            cerr << format("  %3d threads rwlock %8.2fM ops/s "
+                           "lock free %8.2fM ops/s",
+                           nthreads, locked / 1e6, lockFree / 1e6)
+                 << endl;
+        }
+    }
+}
@@ -0,0 +1,126 @@
+/* concurrent_lightweight_hash_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Test program for the concurrent lightweight hash.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+#undef NDEBUG
+
+#include "jml/utils/concurrent_lightweight_hash.h"
+#include <boost/test/unit_test.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <iostream>
+#include <vector>
+#include <map>
+
+using namespace ML;
+using namespace std;
+
+BOOST_AUTO_TEST_CASE( test_single_threaded )
+{
+    Concurrent_Lightweight_Hash<uint64_t, int> h;
+
+    BOOST_CHECK_EQUAL(h.size(), 0);
+    BOOST_CHECK_EQUAL(h.capacity(), 16);
+    BOOST_CHECK_EQUAL(h.count(1), false);
+
+    std::map<uint64_t, int> reference;
+
+    // Keys that all share their low bits, and enough of them to go through
+    // lots of expansions
+    for (unsigned i = 0;  i < 100000;  ++i) {
+        uint64_t key = (random() % 200000 + 1) << 12;
+        bool inserted = h.insert(key, i);
+        BOOST_CHECK_EQUAL(inserted, !reference.count(key));
+        if (inserted) reference[key] = i;
+    }
+
+    BOOST_CHECK_EQUAL(h.size(), reference.size());
+    BOOST_CHECK_GE(h.capacity(), reference.size());
+
+    for (unsigned i = 1;  i <= 200000;  ++i) {
+        uint64_t key = uint64_t(i) << 12;
+        int value = -1;
+        bool found = h.find(key, value);
+        BOOST_CHECK_EQUAL(found, reference.count(key));
+        if (found) BOOST_CHECK_EQUAL(value, reference[key]);
+    }
+
+    BOOST_CHECK_THROW(h.insert(0, 1), ML::Exception);
+    BOOST_CHECK_THROW(h.count(0), ML::Exception);
+}
+
+/* Several threads insert overlapping ranges of keys, whose value is a
+   function of the key, while others look them up.  Everything that was
+   inserted must be found with the right value, and each key must have
+   been reported as inserted exactly once. */
+BOOST_AUTO_TEST_CASE( test_concurrent_insert_find )
+{
+    typedef Concurrent_Lightweight_Hash<uint64_t, uint64_t> Hash;
+    Hash h;
+
+    int nwriters = 4, nreaders = 4;
+    uint64_t nkeys = 200000;
+
+    vector<int> num_inserted(nwriters);
+    vector<int> num_errors(nreaders);
+    volatile bool finished = false;
+
+    boost::barrier barrier(nwriters + nreaders);
+
+    auto writer = [&] (int n)
+        {
+            barrier.wait();
+            // Each writer does half the keys, overlapping with the others
+            for (uint64_t i = 0;  i < nkeys;  ++i) {
+                uint64_t key = (i * 7919 + n * nkeys / 2) % nkeys + 1;
+                num_inserted[n] += h.insert(key, key * 3);
+                if (i == nkeys / 2) break;
+            }
+        };
+
+    auto reader = [&] (int n)
+        {
+            barrier.wait();
+            while (!finished) {
+                for (uint64_t key = 1;  key <= nkeys;  key += 97) {
+                    uint64_t value;
+                    if (h.find(key, value) && value != key * 3)
+                        ++num_errors[n];
+                }
+            }
+        };
+
+    boost::thread_group writers, readers;
+    for (int i = 0;  i < nwriters;  ++i)
+        writers.create_thread(std::bind<void>(writer, i));
+    for (int i = 0;  i < nreaders;  ++i)
+        readers.create_thread(std::bind<void>(reader, i));
+
+    writers.join_all();
+    finished = true;
+    readers.join_all();
+
+    for (int i = 0;  i < nreaders;  ++i)
+        BOOST_CHECK_EQUAL(num_errors[i], 0);
+
+    int total_inserted = 0;
+    for (int i = 0;  i < nwriters;  ++i)
+        total_inserted += num_inserted[i];
+
+    BOOST_CHECK_EQUAL(total_inserted, h.size());
+
+    size_t num_found = 0;
+    for (uint64_t key = 1;  key <= nkeys;  ++key) {
+        uint64_t value = 0;
+        if (h.find(key, value)) {
+            ++num_found;
+            BOOST_CHECK_EQUAL(value, key * 3);
+        }
+    }
+
+    BOOST_CHECK_EQUAL(num_found, h.size());
+}
@@ -0,0 +1,118 @@
+/* csv_columns_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Benchmark of Csv_Column_Reader against expect_csv_row followed by
+   converting the strings, on a 200 column numeric CSV file.  The size in
+   MB comes from CSV_BENCHMARK_MB.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+#include <stdlib.h>
+
+#include "jml/utils/csv_columns.h"
+#include "jml/utils/csv.h"
+#include "jml/utils/parse_context.h"
+#include "jml/utils/environment.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace std;
+
+enum { INT_COLUMNS = 20, STRING_COLUMNS = 10, DOUBLE_COLUMNS = 170 };
+
+Csv_Column_Reader::Schema make_schema()
+{
+    Csv_Column_Reader::Schema result;
+    for (unsigned i = 0;  i < INT_COLUMNS;  ++i)
+        result.push_back(make_pair(format("i%d", i), Csv_Column::INT64));
+    for (unsigned i = 0;  i < STRING_COLUMNS;  ++i)
+        result.push_back(make_pair(format("s%d", i), Csv_Column::STRING));
+    for (unsigned i = 0;  i < DOUBLE_COLUMNS;  ++i)
+        result.push_back(make_pair(format("d%d", i), Csv_Column::DOUBLE));
+    return result;
+}
+
+string make_corpus(size_t bytes, size_t & rows)
+{
+    string result;
+    result.reserve(bytes + 4096);
+    rows = 0;
+    while (result.size() < bytes) {
+        for (unsigned i = 0;  i < INT_COLUMNS;  ++i)
+            result += format("%zd,", (rows * 7919 + i * 104729) % 1000003);
+        for (unsigned i = 0;  i < STRING_COLUMNS;  ++i)
+            result += format("cat%zd,", (rows + i) % 50);
+        for (unsigned i = 0;  i < DOUBLE_COLUMNS;  ++i)
+            result += format("%.4f", ((rows * 31 + i * 17) % 100000) / 1000.0)
+                + (i == DOUBLE_COLUMNS - 1 ? "\n" : ",");
+        ++rows;
+    }
+    return result;
+}
+
+void report(const char * what, size_t bytes, size_t rows, double elapsed)
+{
+    cerr << format("  %-24s %8.1f MB/s %10.0f rows/s",
+                   what, bytes / elapsed / 1e6, rows / elapsed)
+         << endl;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_csv_columns )
+{
+    Env_Option<size_t> corpus_mb("CSV_BENCHMARK_MB", 256);
+
+    size_t rows;
+    string corpus = make_corpus(corpus_mb * 1000000, rows);
+    cerr << "parsing " << corpus.size() / 1e6 << "MB in " << rows
+         << " rows of " << INT_COLUMNS + STRING_COLUMNS + DOUBLE_COLUMNS
+         << " columns" << endl;
+
+    double checksum1 = 0.0, checksum2 = 0.0;
+
+    {
+        Parse_Context context("corpus", corpus.c_str(),
+                              corpus.c_str() + corpus.size());
+        Timer timer;
+        size_t n = 0;
+        while (context) {
+            vector<string> row = expect_csv_row(context);
+            for (unsigned i = 0;  i < INT_COLUMNS;  ++i)
+                checksum1 += strtoll(row[i].c_str(), 0, 10);
+            for (unsigned i = INT_COLUMNS + STRING_COLUMNS;
+                 i < row.size();  ++i)
+                checksum1 += strtod(row[i].c_str(), 0);
+            ++n;
+        }
+        BOOST_CHECK_EQUAL(n, rows);
+        report("expect_csv_row + strtod", corpus.size(), n,
+               timer.elapsed_wall());
+    }
+
+    {
+        Parse_Context context("corpus", corpus.c_str(),
+                              corpus.c_str() + corpus.size());
+        Csv_Column_Reader reader(make_schema());
+        while (reader.read_batch(context, 4096)) {
+            for (auto & c: reader.columns()) {
+                for (size_t i = 0;  i < c.ints.size();  ++i)
+                    checksum2 += c.ints[i];
+                for (size_t i = 0;  i < c.doubles.size();  ++i)
+                    checksum2 += c.doubles[i];
+            }
+        }
+
+        const Csv_Column_Reader::Stats & stats = reader.stats();
+        BOOST_CHECK_EQUAL(stats.rows, rows);
+        cerr << format("  %-24s %8.1f MB/s %10.0f rows/s",
+                       "Csv_Column_Reader", stats.bytes_per_second() / 1e6,
+                       stats.rows_per_second())
+             << endl;
+    }
+
+    BOOST_CHECK_CLOSE(checksum1, checksum2, 1e-9);
+}
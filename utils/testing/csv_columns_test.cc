@@ -0,0 +1,128 @@
+/* csv_columns_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Tests for the schema driven CSV reader.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <sstream>
+#include <cmath>
+
+#include "jml/utils/csv_columns.h"
+#include "jml/utils/csv.h"
+#include "jml/utils/parse_context.h"
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/format.h"
+
+using namespace std;
+using namespace ML;
+
+Csv_Column_Reader::Schema schema()
+{
+    return { { "id", Csv_Column::INT64 },
+             { "price", Csv_Column::DOUBLE },
+             { "name", Csv_Column::STRING } };
+}
+
+BOOST_AUTO_TEST_CASE( test_typed_columns )
+{
+    string text =
+        "id,price,name\n"
+        "1,2.5,hello\n"
+        "-9223372036854775808,,\"a, \"\"quoted\"\"\nname\"\r\n"
+        "\n"
+        "9223372036854775807,-1e-3,hello\n"
+        "+4,7,\"\"";
+
+    Parse_Context context("test", text.c_str(), text.c_str() + text.size());
+    Csv_Column_Reader reader(schema());
+    reader.expect_header(context);
+
+    BOOST_CHECK_EQUAL(reader.read_batch(context), 4);
+    BOOST_CHECK_EQUAL(reader.stats().rows, 4);
+    BOOST_CHECK_EQUAL(reader.stats().bytes, text.size() - 14);
+
+    const Csv_Column & id = reader.column(0);
+    BOOST_REQUIRE_EQUAL(id.size(), 4);
+    BOOST_CHECK_EQUAL(id.ints[0], 1);
+    BOOST_CHECK_EQUAL(id.ints[1], INT64_MIN);
+    BOOST_CHECK_EQUAL(id.ints[2], INT64_MAX);
+    BOOST_CHECK_EQUAL(id.ints[3], 4);
+
+    const Csv_Column & price = reader.column(1);
+    BOOST_CHECK_EQUAL(price.doubles[0], 2.5);
+    BOOST_CHECK(std::isnan(price.doubles[1]));
+    BOOST_CHECK_EQUAL(price.doubles[2], -1e-3);
+    BOOST_CHECK_EQUAL(price.doubles[3], 7);
+
+    const Csv_Column & name = reader.column(2);
+    BOOST_CHECK_EQUAL(name.string_at(0), "hello");
+    BOOST_CHECK_EQUAL(name.string_at(1), "a, \"quoted\"\nname");
+    BOOST_CHECK_EQUAL(name.string_at(3), "");
+    BOOST_CHECK_EQUAL(name.codes[0], name.codes[2]);
+    BOOST_CHECK_EQUAL(name.dictionary.size(), 3);
+
+    BOOST_CHECK_EQUAL(reader.read_batch(context), 0);
+    BOOST_CHECK_EQUAL(reader.column(0).size(), 0);
+}
+
+// Reading from a stream in small buffers makes fields straddle them; the
+// result has to be the same as reading from memory, in any batch size.
+BOOST_AUTO_TEST_CASE( test_stream_and_batches )
+{
+    string text;
+    for (unsigned i = 0;  i < 1000;  ++i)
+        text += format("%d,%f,%s\n", i * 1001 - 30000, i * 0.25,
+                       i % 5 ? format("s%d", i % 13).c_str() : "\"q,\"");
+
+    for (size_t batch: { 1, 7, 1000 }) {
+        istringstream stream(text);
+        Parse_Context context("stream", stream, 1, 1, 17);
+        Csv_Column_Reader reader(schema());
+
+        size_t row = 0;
+        while (size_t n = reader.read_batch(context, batch)) {
+            BOOST_REQUIRE(n <= batch);
+            const Csv_Column & name = reader.column(2);
+            for (size_t i = 0;  i < n;  ++i, ++row) {
+                BOOST_CHECK_EQUAL(reader.column(0).ints[i], row * 1001 - 30000);
+                BOOST_CHECK_EQUAL(reader.column(1).doubles[i], row * 0.25);
+                BOOST_CHECK_EQUAL(name.string_at(i),
+                                  row % 5 ? format("s%zd", row % 13) : "q,");
+            }
+        }
+
+        BOOST_CHECK_EQUAL(row, 1000);
+        BOOST_CHECK_EQUAL(reader.column(2).dictionary.size(), 14);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_errors )
+{
+    JML_TRACE_EXCEPTIONS(false);
+
+    auto read = [] (const string & text)
+        {
+            Parse_Context context("test", text.c_str(),
+                                  text.c_str() + text.size());
+            Csv_Column_Reader reader(schema());
+            reader.read_batch(context);
+        };
+
+    read("1,2,x\n");
+    BOOST_CHECK_THROW(read("1.5,2,x\n"), std::exception);
+    BOOST_CHECK_THROW(read("9223372036854775808,2,x\n"), std::exception);
+    BOOST_CHECK_THROW(read(",2,x\n"), std::exception);
+    BOOST_CHECK_THROW(read("1,2x,x\n"), std::exception);
+    BOOST_CHECK_THROW(read("1,2\n"), std::exception);
+    BOOST_CHECK_THROW(read("1,2,x,y\n"), std::exception);
+    BOOST_CHECK_THROW(read("1,2,\"x\",\n"), std::exception);
+
+    string text = "id,price,wrong\n";
+    Parse_Context context("test", text.c_str(), text.c_str() + text.size());
+    Csv_Column_Reader reader(schema());
+    BOOST_CHECK_THROW(reader.expect_header(context), std::exception);
+}
@@ -0,0 +1,156 @@
+/* file_read_buffer_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Cold cache scan throughput of a memory mapped file with each of the
+   access options of File_Read_Buffer, and how much of the file is left in
+   the page cache afterwards.  The size of the file in MB comes from
+   FILE_BENCHMARK_MB.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <vector>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "jml/utils/file_functions.h"
+#include "jml/utils/environment.h"
+#include "jml/utils/guard.h"
+#include "jml/arch/simd_scan.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace std;
+
+void write_file(const string & filename, size_t bytes)
+{
+    FILE * file = fopen(filename.c_str(), "w");
+    if (!file)
+        throw Exception("couldn't open " + filename);
+
+    string line;
+    for (size_t written = 0, i = 0;  written < bytes;  written += line.size())
+        fputs((line = format("%zd,%zd,some text\n", i++, written)).c_str(),
+              file);
+
+    fclose(file);
+}
+
+int open_file(const string & filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        throw Exception(errno, filename, "open");
+    return fd;
+}
+
+/** Drop the whole file from the page cache. */
+void drop_cache(const string & filename)
+{
+    int fd = open_file(filename);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+/** Fraction of the file that is in the page cache. */
+double cached_fraction(const string & filename)
+{
+    int fd = open_file(filename);
+    size_t size = get_file_size(fd);
+    void * mem = mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        throw Exception(errno, "mmap", "cached_fraction");
+
+    size_t page = getpagesize();
+    vector<unsigned char> resident((size + page - 1) / page);
+    if (mincore(mem, size, &resident[0]) == -1)
+        throw Exception(errno, "mincore", "cached_fraction");
+    munmap(mem, size);
+
+    size_t n = 0;
+    for (unsigned char r: resident)
+        n += r & 1;
+    return 1.0 * n / resident.size();
+}
+
+enum { STEP = 1 << 20, WINDOW = 64 << 20 };
+
+size_t run(const string & filename, const char * what,
+           File_Read_Buffer::Options options,
+           bool willNeed = false, bool doneWith = false)
+{
+    drop_cache(filename);
+    double before = cached_fraction(filename);
+
+    Timer timer;
+    File_Read_Buffer file(filename, options);
+    size_t lines = 0;
+
+    for (size_t ofs = 0;  ofs < file.size();  ofs += STEP) {
+        // Keep the next window on its way in while this one is scanned
+        if (willNeed && ofs == 0)
+            file.will_need(0, 2 * WINDOW);
+        else if (willNeed && ofs % WINDOW == 0)
+            file.will_need(ofs + WINDOW, WINDOW);
+
+        size_t n = std::min<size_t>(STEP, file.size() - ofs);
+        lines += count_char(file.start() + ofs, file.start() + ofs + n, '\n');
+
+        if (doneWith && (ofs + n) % WINDOW == 0)
+            file.done_with(ofs + n - WINDOW, WINDOW);
+    }
+
+    double elapsed = timer.elapsed_wall();
+    size_t size = file.size();
+    file.close();
+
+    cerr << format("  %-28s %8.1f MB/s  cached %5.1f%% before, %5.1f%% after",
+                   what, size / elapsed / 1e6, before * 100.0,
+                   cached_fraction(filename) * 100.0)
+         << endl;
+
+    return lines;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_cold_cache_scan )
+{
+    Env_Option<size_t> file_mb("FILE_BENCHMARK_MB", 1024);
+
+    string filename = "file_read_buffer_benchmark.txt";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    write_file(filename, file_mb * 1000000);
+
+    typedef File_Read_Buffer F;
+
+    F::Options populate;
+    populate.populate = true;
+
+    F::Options hugePages(F::SEQUENTIAL);
+    hugePages.hugePages = true;
+
+    F::Options dropBehind(F::SEQUENTIAL);
+    dropBehind.dropBehind = true;
+
+    size_t lines = run(filename, "normal", F::Options());
+    BOOST_CHECK_EQUAL(run(filename, "sequential", F::Options(F::SEQUENTIAL)),
+                      lines);
+    BOOST_CHECK_EQUAL(run(filename, "random", F::Options(F::RANDOM)), lines);
+    BOOST_CHECK_EQUAL(run(filename, "populate", populate), lines);
+    BOOST_CHECK_EQUAL(run(filename, "sequential + huge pages", hugePages),
+                      lines);
+    BOOST_CHECK_EQUAL(run(filename, "random + will_need",
+                          F::Options(F::RANDOM), true),
+                      lines);
+    BOOST_CHECK_EQUAL(run(filename, "sequential + drop behind",
+                          dropBehind, false, true),
+                      lines);
+}
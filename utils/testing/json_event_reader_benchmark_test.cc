@@ -0,0 +1,147 @@
+/* json_event_reader_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Benchmark of the JsonEventReader against the callback based
+   expectJsonObject/expectJsonArray functions, on a memory mapped JSON
+   lines file.  The size in MB comes from JSON_BENCHMARK_MB.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <stdio.h>
+
+#include "jml/utils/json_parsing.h"
+#include "jml/utils/file_functions.h"
+#include "jml/utils/environment.h"
+#include "jml/utils/guard.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace std;
+
+/* Something that looks like a bid request. */
+size_t write_corpus(const string & filename, size_t bytes)
+{
+    FILE * file = fopen(filename.c_str(), "w");
+    if (!file)
+        throw Exception("couldn't open " + filename);
+
+    size_t written = 0, lines = 0;
+    while (written < bytes) {
+        int n = fprintf(file,
+                        "{\"id\":\"%zx-%zx\",\"timestamp\":%.3f,"
+                        "\"exchange\":\"exchange%zu\","
+                        "\"user\":{\"id\":\"u%zu\",\"segments\":[%zu,%zu,%zu],"
+                        "\"tz\":-%zu,\"gdpr\":%s},"
+                        "\"imp\":[{\"id\":\"1\",\"w\":300,\"h\":250,"
+                        "\"bidfloor\":%.4f,\"formats\":[\"banner\",\"video\"]}],"
+                        "\"url\":\"http:\\/\\/example.com\\/page\\/%zu\","
+                        "\"deal\":null}\n",
+                        lines * 7919, lines, 1.3e9 + lines * 0.001,
+                        lines % 7, lines % 100000, lines % 97, lines % 89,
+                        lines % 83, lines % 12, lines % 2 ? "true" : "false",
+                        (lines % 1000) / 1000.0, lines % 5000);
+        written += n;
+        ++lines;
+    }
+
+    fclose(file);
+    return lines;
+}
+
+void walkCallbacks(Parse_Context & context, size_t & tokens)
+{
+    skipJsonWhitespace(context);
+    ++tokens;
+
+    if (*context == '{') {
+        expectJsonObject(context,
+                         [&] (string key, Parse_Context & context)
+                         {
+                             ++tokens;
+                             walkCallbacks(context, tokens);
+                         });
+    }
+    else if (*context == '[') {
+        expectJsonArray(context,
+                        [&] (int, Parse_Context & context)
+                        {
+                            walkCallbacks(context, tokens);
+                        });
+    }
+    else if (*context == '"')
+        expectJsonStringAscii(context);
+    else if (*context == 't' || *context == 'f')
+        expectJsonBool(context);
+    else if (!matchJsonNull(context))
+        expectJsonNumber(context);
+}
+
+struct CountingHandler : public JsonEventHandler {
+    CountingHandler()
+        : tokens(0), chars(0)
+    {
+    }
+
+    size_t tokens, chars;
+
+    void onBeginObject() { ++tokens; }
+    void onBeginArray() { ++tokens; }
+    void onKey(const char * key, size_t len) { ++tokens;  chars += len; }
+    void onString(const char * str, size_t len) { ++tokens;  chars += len; }
+    void onNumber(const JsonNumber & number) { ++tokens; }
+    void onBool(bool value) { ++tokens; }
+    void onNull() { ++tokens; }
+};
+
+void report(const char * what, size_t bytes, size_t tokens, double elapsed)
+{
+    cerr << format("  %-20s %8.1f MB/s %12.0f tokens/s",
+                   what, bytes / elapsed / 1e6, tokens / elapsed)
+         << endl;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_json_event_reader )
+{
+    Env_Option<size_t> corpus_mb("JSON_BENCHMARK_MB", 2048);
+
+    string filename = "json_event_reader_benchmark.json";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+
+    size_t lines = write_corpus(filename, corpus_mb * 1000000);
+
+    File_Read_Buffer buffer(filename);
+    size_t bytes = buffer.size();
+    cerr << "parsing " << bytes / 1e6 << "MB in " << lines << " lines"
+         << endl;
+
+    size_t callbackTokens = 0;
+    {
+        Parse_Context context(buffer);
+        Timer timer;
+        while (context) {
+            walkCallbacks(context, callbackTokens);
+            context.expect_eol();
+        }
+        report("callbacks", bytes, callbackTokens, timer.elapsed_wall());
+    }
+
+    CountingHandler handler;
+    {
+        Parse_Context context(buffer);
+        JsonEventReader reader;
+        Timer timer;
+        while (context) {
+            reader.expectValue(context, handler);
+            context.expect_eol();
+        }
+        report("event reader", bytes, handler.tokens, timer.elapsed_wall());
+    }
+
+    BOOST_CHECK_EQUAL(handler.tokens, callbackTokens);
+}
@@ -0,0 +1,202 @@
+/* json_index_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Benchmark of pulling two fields out of each of a set of large nested
+   records with the JsonIndex, against a full parse with the
+   JsonEventReader.  The records are read both one per line and as a
+   single document.  The size in MB comes from JSON_BENCHMARK_MB.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+#include <string.h>
+
+#include "jml/utils/json_index.h"
+#include "jml/utils/environment.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace std;
+
+/* An array of records with a user id and bid floor to be extracted, and a
+   large nested payload that isn't needed. */
+string make_document(size_t bytes, size_t & records)
+{
+    string result = "[";
+    records = 0;
+
+    while (result.size() < bytes) {
+        if (records) result += ",\n";
+        result += format("{\"id\":%zd,\"payload\":{", records);
+        for (unsigned i = 0;  i < 20;  ++i) {
+            result += format("\"field%d\":{\"values\":[%d,%d,%.3f],"
+                             "\"name\":\"some \\\"quoted\\\" text %d\","
+                             "\"flags\":[true,false,null]},",
+                             i, i, (int)records, records / 3.0, i);
+        }
+        result += format("\"end\":null},\"user\":{\"id\":\"user%zd\","
+                         "\"segments\":[1,2,3]},\"imp\":[{\"bidfloor\":%.2f,"
+                         "\"w\":300,\"h\":250}]}",
+                         records % 1000, (records % 100) / 10.0);
+        ++records;
+    }
+
+    result += "]";
+    return result;
+}
+
+/* Full parse that remembers the fields as they go past. */
+struct ExtractingHandler : public JsonEventHandler {
+    ExtractingHandler()
+        : depth(0), inUser(false), inImp(false), userIdChars(0),
+          bidfloorTotal(0.0)
+    {
+    }
+
+    int depth;
+    bool inUser, inImp;
+    const char * lastKey;
+    size_t lastKeyLen;
+    size_t userIdChars;
+    double bidfloorTotal;
+
+    bool keyIs(const char * key) const
+    {
+        return lastKeyLen == strlen(key) && !memcmp(lastKey, key, lastKeyLen);
+    }
+
+    void onBeginObject()
+    {
+        ++depth;
+        if (depth == 2)
+            inUser = keyIs("user");
+    }
+
+    void onEndObject() { --depth; }
+
+    void onBeginArray()
+    {
+        if (depth == 1) inImp = keyIs("imp");
+    }
+
+    void onEndArray()
+    {
+        if (depth == 1) inImp = false;
+    }
+
+    void onKey(const char * key, size_t len)
+    {
+        lastKey = key;
+        lastKeyLen = len;
+    }
+
+    void onString(const char * str, size_t len)
+    {
+        if (depth == 2 && inUser && keyIs("id"))
+            userIdChars += len;
+    }
+
+    void onNumber(const JsonNumber & number)
+    {
+        if (depth == 2 && inImp && keyIs("bidfloor"))
+            bidfloorTotal += number.fp;
+    }
+};
+
+void report(const char * what, size_t bytes, double elapsed)
+{
+    cerr << format("  %-28s %8.1f MB/s  %6.3fs", what, bytes / elapsed / 1e6,
+                   elapsed) << endl;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_json_index )
+{
+    Env_Option<size_t> corpus_mb("JSON_BENCHMARK_MB", 512);
+
+    size_t records;
+    string doc = make_document(corpus_mb * 1000000, records);
+    cerr << "document is " << doc.size() / 1e6 << "MB with " << records
+         << " records" << endl;
+
+    // Records one per line, skipping the [ at the start
+    const char * linesStart = doc.c_str() + 1;
+    const char * linesEnd = doc.c_str() + doc.size() - 1;
+
+    ExtractingHandler handler;
+    {
+        Parse_Context context("doc", linesStart, linesEnd);
+        JsonEventReader reader;
+        Timer timer;
+        while (context) {
+            reader.expectValue(context, handler);
+            context.match_literal(',');
+            context.match_eol();
+        }
+        report("records, full parse", doc.size(), timer.elapsed_wall());
+    }
+
+    size_t userIdChars = 0;
+    double bidfloorTotal = 0.0;
+
+    auto extract = [&] (const JsonIndexValue & record)
+        {
+            userIdChars += record["user"]["id"].getString().size();
+            bidfloorTotal += record["imp"].at(0)["bidfloor"].getNumber().fp;
+        };
+
+    {
+        // The same index is reused for each record, so its memory is only
+        // allocated once
+        JsonIndex index;
+        Timer timer;
+        for (const char * p = linesStart;  p < linesEnd;) {
+            const char * eol = (const char *)memchr(p, '\n', linesEnd - p);
+            if (!eol) eol = linesEnd;
+            index.init(p, eol[-1] == ',' ? eol - 1 : eol);
+            extract(index.root());
+            p = eol + 1;
+        }
+        report("records, index", doc.size(), timer.elapsed_wall());
+    }
+
+    BOOST_CHECK_EQUAL(userIdChars, handler.userIdChars);
+    BOOST_CHECK_EQUAL(bidfloorTotal, handler.bidfloorTotal);
+
+    {
+        Parse_Context context("doc", doc.c_str(), doc.c_str() + doc.size());
+        ExtractingHandler handler;
+        Timer timer;
+        readJsonEvents(context, handler);
+        report("whole document, full parse", doc.size(), timer.elapsed_wall());
+    }
+
+    {
+        Timer timer;
+        JsonIndex index(doc.c_str(), doc.c_str() + doc.size());
+        double indexTime = timer.elapsed_wall();
+
+        index.root().forEachElement([&] (size_t, const JsonIndexValue & record)
+                                    {
+                                        extract(record);
+                                    });
+        report("whole document, index", doc.size(), timer.elapsed_wall());
+        report("  (of which index build)", doc.size(), indexTime);
+
+        // Again, now that the index's memory has been touched
+        timer.restart();
+        index.init(doc.c_str(), doc.c_str() + doc.size());
+        indexTime = timer.elapsed_wall();
+
+        index.root().forEachElement([&] (size_t, const JsonIndexValue & record)
+                                    {
+                                        extract(record);
+                                    });
+        report("whole document, index again", doc.size(),
+               timer.elapsed_wall());
+        report("  (of which index build)", doc.size(), indexTime);
+    }
+}
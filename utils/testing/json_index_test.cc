@@ -0,0 +1,166 @@
+/* json_index_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Test of the JSON structural index.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include "jml/utils/json_index.h"
+#include "jml/arch/format.h"
+
+#include <boost/test/unit_test.hpp>
+#include <boost/lexical_cast.hpp>
+
+using namespace ML;
+using namespace std;
+
+string numberText(const JsonNumber & number)
+{
+    if (number.type == JsonNumber::FLOATING_POINT)
+        return boost::lexical_cast<string>(number.fp);
+    else if (number.type == JsonNumber::SIGNED_INT)
+        return boost::lexical_cast<string>(number.sgn);
+    return boost::lexical_cast<string>(number.uns);
+}
+
+/* Write out the value in a canonical form by walking the index. */
+string walkIndex(const JsonIndexValue & value)
+{
+    if (value.isObject()) {
+        string result = "{";
+        value.forEachMember([&] (const char * key, size_t len,
+                                 const JsonIndexValue & member)
+                            {
+                                result += "k:" + string(key, len) + " ";
+                                result += walkIndex(member);
+                            });
+        return result + "}";
+    }
+    else if (value.isArray()) {
+        string result = "[";
+        value.forEachElement([&] (size_t, const JsonIndexValue & element)
+                             {
+                                 result += walkIndex(element);
+                             });
+        return result + "]";
+    }
+    else if (value.isString())
+        return "s:" + value.getString() + " ";
+    else if (value.isNull())
+        return "null ";
+    else if (value.isBool())
+        return value.getBool() ? "true " : "false ";
+    else return "n:" + numberText(value.getNumber()) + " ";
+}
+
+/* The same canonical form from the event reader. */
+struct CanonicalHandler : public JsonEventHandler {
+    string result;
+
+    void onBeginObject() { result += "{"; }
+    void onKey(const char * key, size_t len)
+    {
+        result += "k:" + string(key, len) + " ";
+    }
+    void onEndObject() { result += "}"; }
+    void onBeginArray() { result += "["; }
+    void onEndArray() { result += "]"; }
+    void onString(const char * str, size_t len)
+    {
+        result += "s:" + string(str, len) + " ";
+    }
+    void onNumber(const JsonNumber & number)
+    {
+        result += "n:" + numberText(number) + " ";
+    }
+    void onBool(bool value) { result += value ? "true " : "false "; }
+    void onNull() { result += "null "; }
+};
+
+string walkEvents(const string & str)
+{
+    Parse_Context context(str, str.c_str(), str.c_str() + str.size());
+    CanonicalHandler handler;
+    readJsonEvents(context, handler);
+    return handler.result;
+}
+
+BOOST_AUTO_TEST_CASE( test_navigation )
+{
+    string str = "{ \"id\": 12, \"name\": \"x\\\"y\", \"tags\": [ \"a\", 1.5,"
+        " null, true, {\"deep\": [[]]} ], \"esc\\u0041ped\": false,"
+        " \"empty\": { }, \"last\" : -3 }";
+
+    JsonIndex index(str.c_str(), str.c_str() + str.size());
+    JsonIndexValue root = index.root();
+
+    BOOST_CHECK(root.isObject());
+    BOOST_CHECK_EQUAL(root.size(), 6);
+    BOOST_CHECK_EQUAL(root["id"].getNumber().uns, 12);
+    BOOST_CHECK_EQUAL(root["name"].getString(), "x\"y");
+    BOOST_CHECK_EQUAL(root["tags"].size(), 5);
+    BOOST_CHECK_EQUAL(root["tags"].at(1).getNumber().fp, 1.5);
+    BOOST_CHECK(root["tags"].at(2).isNull());
+    BOOST_CHECK(root["tags"].at(3).getBool());
+    BOOST_CHECK_EQUAL(root["tags"].at(4)["deep"].text(), "[[]]");
+    BOOST_CHECK_EQUAL(root["escAped"].getBool(), false);
+    BOOST_CHECK_EQUAL(root["empty"].size(), 0);
+    BOOST_CHECK_EQUAL(root["last"].getNumber().sgn, -3);
+    BOOST_CHECK_EQUAL(root["last"].text(), "-3");
+    BOOST_CHECK(!root.find("missing").valid());
+
+    BOOST_CHECK_EQUAL(walkIndex(root), walkEvents(str));
+
+    JML_TRACE_EXCEPTIONS(false);
+    BOOST_CHECK_THROW(root["missing"], std::exception);
+    BOOST_CHECK_THROW(root["tags"].at(5), std::exception);
+    BOOST_CHECK_THROW(root["id"].getString(), std::exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_scalar_documents )
+{
+    string str = "  42  ";
+    JsonIndex index(str.c_str(), str.c_str() + str.size());
+    BOOST_CHECK_EQUAL(index.root().getNumber().uns, 42);
+
+    string str2 = "\"hello\"";
+    JsonIndex index2(str2.c_str(), str2.c_str() + str2.size());
+    BOOST_CHECK_EQUAL(index2.root().getString(), "hello");
+}
+
+BOOST_AUTO_TEST_CASE( test_escapes_across_blocks )
+{
+    // Put runs of backslashes and escaped quotes across every position of
+    // the 64 byte blocks that the index works on
+    for (unsigned padding = 0;  padding < 70;  ++padding) {
+        for (unsigned backslashes = 1;  backslashes <= 4;  ++backslashes) {
+            string escaped(backslashes * 2, '\\');
+            string str = "[\"" + string(padding, 'x') + escaped
+                + "\\\"{]\", {\"k" + escaped + "\": [\"" + escaped
+                + "\"]}, \"" + escaped + "\"]";
+
+            JsonIndex index(str.c_str(), str.c_str() + str.size());
+            BOOST_CHECK_EQUAL(index.root().size(), 3);
+            BOOST_CHECK_EQUAL(walkIndex(index.root()), walkEvents(str));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_malformed )
+{
+    JML_TRACE_EXCEPTIONS(false);
+
+    const char * unbalanced[] = { "{", "[}", "\"abc", "[\"\\\"]", "]" };
+    for (auto doc: unbalanced) {
+        BOOST_CHECK_THROW(JsonIndex(doc, doc + strlen(doc)), std::exception);
+    }
+
+    // These are only found when the bad part is reached
+    const char * bad[] = { "{\"a\" 1}", "[1,]", "{1:2}", "[1 2]" };
+    for (auto doc: bad) {
+        JsonIndex index(doc, doc + strlen(doc));
+        BOOST_CHECK_THROW(walkIndex(index.root()), std::exception);
+    }
+}
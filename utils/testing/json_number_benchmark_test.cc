@@ -0,0 +1,88 @@
+/* json_number_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Benchmark for expectJsonNumber on a synthetic numeric-heavy JSON
+   corpus, both from memory and from a stream.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <sstream>
+#include <iostream>
+
+#include "jml/utils/json_parsing.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace std;
+
+/* Lines of the form [id,price,-delta,ratio,1.5e-3,...] like a bid request
+   log that is mostly numbers. */
+string make_corpus(size_t lines)
+{
+    ostringstream stream;
+    for (size_t i = 0;  i < lines;  ++i) {
+        stream << "[" << i * 7919
+               << "," << (i % 1000) / 100.0
+               << ",-" << i % 37
+               << "," << 1.0 / (i + 1)
+               << "," << (i % 13) << "e-" << i % 7
+               << "," << 1234567890123ULL + i
+               << "]\n";
+    }
+    return stream.str();
+}
+
+size_t parse_corpus(Parse_Context & context, double & total)
+{
+    size_t numbers = 0;
+    while (context) {
+        expectJsonArray(context, [&] (int, Parse_Context & context)
+                        {
+                            JsonNumber num = expectJsonNumber(context);
+                            total += num.type == JsonNumber::FLOATING_POINT
+                                ? num.fp : num.uns;
+                            ++numbers;
+                        });
+        context.expect_eol();
+    }
+    return numbers;
+}
+
+void report(const char * what, size_t bytes, size_t numbers, double elapsed)
+{
+    cerr << format("  %-20s %8.1f MB/s %12.0f numbers/s",
+                   what, bytes / elapsed / 1e6, numbers / elapsed)
+         << endl;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_json_numbers )
+{
+    string data = make_corpus(2000000);
+    cerr << "parsing " << data.size() / 1e6 << "MB" << endl;
+
+    double total1 = 0.0, total2 = 0.0;
+
+    {
+        Parse_Context context("memory", data.c_str(),
+                              data.c_str() + data.size());
+        Timer timer;
+        size_t numbers = parse_corpus(context, total1);
+        report("memory", data.size(), numbers, timer.elapsed_wall());
+        BOOST_CHECK_EQUAL(numbers, 12000000);
+    }
+
+    {
+        istringstream stream(data);
+        Parse_Context context("stream", stream);
+        Timer timer;
+        size_t numbers = parse_corpus(context, total2);
+        report("stream", data.size(), numbers, timer.elapsed_wall());
+        BOOST_CHECK_EQUAL(numbers, 12000000);
+    }
+
+    BOOST_CHECK_EQUAL(total1, total2);
+}
@@ -14,6 +14,8 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/test/auto_unit_test.hpp>
 #include <math.h>
+#include <sstream>
+#include <vector>
 
 using namespace ML;
 
@@ -71,3 +73,130 @@ BOOST_AUTO_TEST_CASE( test1 )
     BOOST_CHECK_THROW(testFp("3e", 0.1), std::exception);
     BOOST_CHECK_THROW(testFp("3.1aade", 0.1), std::exception);
 }
+
+BOOST_AUTO_TEST_CASE( test_number_limits )
+{
+    testUnsigned("18446744073709551615", 18446744073709551615ULL);
+    testSigned("-9223372036854775808", -9223372036854775807LL - 1);
+    testFp("1.7976931348623157e308", 1.7976931348623157e308);
+    testFp("9007199254740993.0", 9007199254740992.0);  // rounds to even
+    testFp("0.1e1", 1.0);
+    testFp("2.2250738585072014e-308", 2.2250738585072014e-308);
+    testFp("123456789012345678901234567890.0", 1.2345678901234568e29);
+    testFp("1e22", 1e22);
+    testFp("1e23", 1e23);
+    testFp("3.14159265358979323846", 3.14159265358979323846);
+
+    JML_TRACE_EXCEPTIONS(false);
+    BOOST_CHECK_THROW(testUnsigned("18446744073709551616", 0),
+                      std::exception);
+    BOOST_CHECK_THROW(testSigned("-9223372036854775809", 0),
+                      std::exception);
+    BOOST_CHECK_THROW(testFp("1e400", 0.0), std::exception);
+    BOOST_CHECK_THROW(testFp("-", 0.0), std::exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_numbers_across_buffers )
+{
+    // Numbers that straddle the end of a buffer or are followed by other
+    // characters must give the same result as when they are on their own
+    std::string str = "[12345678901234,-3.25e-7,0.1,-42,1e100,7]";
+
+    for (unsigned chunkSize = 1;  chunkSize <= str.size();  ++chunkSize) {
+        std::istringstream stream(str);
+        Parse_Context context("stream", stream, 1, 1, chunkSize);
+
+        std::vector<JsonNumber> numbers;
+        expectJsonArray(context,
+                        [&] (int, Parse_Context & context)
+                        {
+                            numbers.push_back(expectJsonNumber(context));
+                        });
+        context.expect_eof();
+
+        BOOST_REQUIRE_EQUAL(numbers.size(), 6);
+        BOOST_CHECK_EQUAL(numbers[0].type, JsonNumber::UNSIGNED_INT);
+        BOOST_CHECK_EQUAL(numbers[0].uns, 12345678901234ULL);
+        BOOST_CHECK_EQUAL(numbers[1].type, JsonNumber::FLOATING_POINT);
+        BOOST_CHECK_EQUAL(numbers[1].fp, -3.25e-7);
+        BOOST_CHECK_EQUAL(numbers[2].fp, 0.1);
+        BOOST_CHECK_EQUAL(numbers[3].type, JsonNumber::SIGNED_INT);
+        BOOST_CHECK_EQUAL(numbers[3].sgn, -42);
+        BOOST_CHECK_EQUAL(numbers[4].fp, 1e100);
+        BOOST_CHECK_EQUAL(numbers[5].uns, 7);
+        BOOST_CHECK_EQUAL(context.get_col(), str.size() + 1);
+    }
+}
+
+struct RecordingHandler : public JsonEventHandler {
+    std::string events;
+    std::vector<const char *> views;
+
+    void onBeginObject() { events += "{"; }
+    void onKey(const char * key, size_t len)
+    {
+        events += "k:" + std::string(key, len) + " ";
+        views.push_back(key);
+    }
+    void onEndObject() { events += "}"; }
+    void onBeginArray() { events += "["; }
+    void onEndArray() { events += "]"; }
+    void onString(const char * str, size_t len)
+    {
+        events += "s:" + std::string(str, len) + " ";
+        views.push_back(str);
+    }
+    void onNumber(const JsonNumber & number)
+    {
+        if (number.type == JsonNumber::FLOATING_POINT)
+            events += "f:" + boost::lexical_cast<std::string>(number.fp) + " ";
+        else if (number.type == JsonNumber::SIGNED_INT)
+            events += "i:" + boost::lexical_cast<std::string>(number.sgn) + " ";
+        else events += "u:" + boost::lexical_cast<std::string>(number.uns) + " ";
+    }
+    void onBool(bool value) { events += value ? "true " : "false "; }
+    void onNull() { events += "null "; }
+};
+
+BOOST_AUTO_TEST_CASE( test_json_event_reader )
+{
+    std::string str = "{ \"a\" : [1, -2, 0.5, true, false, null],\n"
+        "  \"b\\\"c\": { \"d\": \"e\\n\\u00e9\\ud83d\\ude00\" },\n"
+        "  \"empty\": {}, \"none\": [ ] }";
+    std::string expected = "{k:a [u:1 i:-2 f:0.5 true false null ]"
+        "k:b\"c {k:d s:e\n\xc3\xa9\xf0\x9f\x98\x80 }"
+        "k:empty {}k:none []}";
+
+    {
+        Parse_Context context(str, str.c_str(), str.c_str() + str.size());
+        RecordingHandler handler;
+        readJsonEvents(context, handler);
+        context.expect_eof();
+        BOOST_CHECK_EQUAL(handler.events, expected);
+
+        // Strings without escapes are passed straight from the input
+        BOOST_REQUIRE_EQUAL(handler.views.size(), 6);
+        BOOST_CHECK_EQUAL((const void *)handler.views[0],
+                          (const void *)(str.c_str() + 3));
+        BOOST_CHECK_EQUAL((const void *)handler.views[2],
+                          (const void *)(str.c_str() + str.find("\"d\"") + 1));
+    }
+
+    for (unsigned chunkSize = 1;  chunkSize <= str.size();  ++chunkSize) {
+        std::istringstream stream(str);
+        Parse_Context context("stream", stream, 1, 1, chunkSize);
+        RecordingHandler handler;
+        readJsonEvents(context, handler);
+        context.expect_eof();
+        BOOST_CHECK_EQUAL(handler.events, expected);
+    }
+
+    JML_TRACE_EXCEPTIONS(false);
+    const char * bad[] = { "{\"a\" 1}", "[1,]", "\"abc", "\"\\ud83d\"",
+                           "\"\\u00g0\"", "{1:2}" };
+    for (auto doc: bad) {
+        Parse_Context context(doc, doc, doc + strlen(doc));
+        RecordingHandler handler;
+        BOOST_CHECK_THROW(readJsonEvents(context, handler), std::exception);
+    }
+}
@@ -0,0 +1,243 @@
+/* lightweight_hash_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Benchmark for the lightweight hash: insert and lookup throughput of the
+   linear probe and the SIMD control byte probe against std::unordered_map,
+   a sweep over the load factor, the time taken to open a hash that was
+   saved to a mapped file compared to building it, and batched lookups
+   against one at a time across map sizes.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <unordered_map>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <unistd.h>
+
+#include "jml/utils/lightweight_hash.h"
+#include "jml/utils/mapped_lightweight_hash.h"
+#include "jml/utils/file_functions.h"
+#include "jml/utils/guard.h"
+#include "jml/arch/timers.h"
+
+using namespace ML;
+using namespace std;
+
+typedef std::pair<uint64_t, uint64_t> Bucket;
+
+typedef Lightweight_Hash<uint64_t, uint64_t> Linear_Hash;
+
+typedef Lightweight_Hash<uint64_t, uint64_t, Bucket,
+                         std::pair<const uint64_t, uint64_t>,
+                         PairOps<uint64_t, uint64_t>,
+                         SimdProbeStorage<Bucket> >
+Simd_Hash;
+
+typedef std::unordered_map<uint64_t, uint64_t> Std_Hash;
+
+/** Keys that look like the ids we map: large, sparse and not uniformly
+    distributed in their low bits. */
+vector<uint64_t> make_keys(size_t n, uint64_t seed)
+{
+    vector<uint64_t> result(n);
+    uint64_t x = seed;
+    for (size_t i = 0;  i < n;  ++i) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        result[i] = (x >> 8) << 4 | 1;
+    }
+    return result;
+}
+
+template<class Hash>
+double time_inserts(Hash & h, const vector<uint64_t> & keys)
+{
+    Timer timer;
+    for (size_t i = 0;  i < keys.size();  ++i)
+        h[keys[i]] = i;
+    return keys.size() / timer.elapsed_wall();
+}
+
+template<class Hash>
+double time_lookups(const Hash & h, const vector<uint64_t> & keys,
+                    size_t expected)
+{
+    size_t found = 0;
+    Timer timer;
+    for (size_t i = 0;  i < keys.size();  ++i)
+        found += h.find(keys[i]) != h.end();
+    double rate = keys.size() / timer.elapsed_wall();
+    BOOST_CHECK_EQUAL(found, expected);
+    return rate;
+}
+
+template<class Hash>
+void run_benchmark(const char * name, size_t n)
+{
+    vector<uint64_t> keys = make_keys(n, 1);
+    vector<uint64_t> missing = make_keys(n, 2);
+
+    // Look up in a different order to insertion, otherwise node based
+    // tables get the benefit of having allocated their nodes in order
+    vector<uint64_t> shuffled = keys;
+    std::random_shuffle(shuffled.begin(), shuffled.end());
+
+    Hash h;
+    double inserts = time_inserts(h, keys);
+    double hits = time_lookups(h, shuffled, n);
+    double misses = time_lookups(h, missing, 0);
+
+    cerr << format("  %-16s %10zd inserts %7.2fM/s hits %7.2fM/s "
+                   "misses %7.2fM/s",
+                   name, n, inserts / 1e6, hits / 1e6, misses / 1e6)
+         << endl;
+}
+
+BOOST_AUTO_TEST_CASE( test_throughput )
+{
+    for (size_t n: { 1000, 100000, 10000000 }) {
+        run_benchmark<Linear_Hash>("linear probe", n);
+        run_benchmark<Simd_Hash>("simd probe", n);
+        run_benchmark<Std_Hash>("unordered_map", n);
+    }
+}
+
+/** Fill a table of fixed capacity up to the given load factor, then time
+    lookups of present and absent keys.  The lightweight hash expands once
+    it's 3/4 full, so that's as far as the sweep can go. */
+template<class Hash>
+void run_load_factor(const char * name, size_t capacity, double load)
+{
+    size_t n = capacity * load;
+    vector<uint64_t> keys = make_keys(n, 1);
+    vector<uint64_t> missing = make_keys(n, 2);
+
+    Hash h;
+    h.reserve(capacity);
+    time_inserts(h, keys);
+    BOOST_CHECK_EQUAL(h.capacity(), capacity);
+
+    double hits = time_lookups(h, keys, n);
+    double misses = time_lookups(h, missing, 0);
+
+    cerr << format("  %-16s load %4.2f hits %7.2fM/s misses %7.2fM/s",
+                   name, load, hits / 1e6, misses / 1e6)
+         << endl;
+}
+
+BOOST_AUTO_TEST_CASE( test_load_factor_sweep )
+{
+    size_t capacity = 1 << 20;
+
+    for (double load: { 0.25, 0.5, 0.6, 0.7, 0.74 }) {
+        run_load_factor<Linear_Hash>("linear probe", capacity, load);
+        run_load_factor<Simd_Hash>("simd probe", capacity, load);
+    }
+}
+
+typedef Lightweight_Hash<uint64_t, uint64_t, Bucket,
+                         std::pair<const uint64_t, uint64_t>,
+                         PairOps<uint64_t, uint64_t>,
+                         MappedStorage<Bucket> >
+Mapped_Hash;
+
+BOOST_AUTO_TEST_CASE( test_mapped_open )
+{
+    string filename = "lightweight_hash_benchmark_mapped";
+    Call_Guard guard([&] () { delete_file(filename); });
+
+    size_t n = 10000000;
+    vector<uint64_t> keys = make_keys(n, 1);
+
+    double build, save;
+    {
+        Mapped_Hash h;
+        Timer timer;
+        time_inserts(h, keys);
+        build = timer.elapsed_wall();
+        timer.restart();
+        save_mapped(h, filename);
+        save = timer.elapsed_wall();
+    }
+
+    Mapped_Hash h;
+    Timer timer;
+    load_mapped(h, filename);
+    double load = timer.elapsed_wall();
+
+    BOOST_CHECK_EQUAL(h.size(), n);
+    timer.restart();
+    double hits = time_lookups(h, keys, n);
+    double firstPass = timer.elapsed_wall();
+
+    cerr << format("%zd entries: build %.3fs save %.3fs map %.6fs; "
+                   "first lookup pass %.3fs (%.2fM/s)",
+                   n, build, save, load, firstPass, hits / 1e6)
+         << endl;
+}
+
+/** Look up nlookups random keys that are in the hash, either one at a time
+    or in batches with find_batch(). */
+template<class Hash>
+void run_batch_lookups(const char * name, size_t n, size_t nlookups)
+{
+    vector<uint64_t> keys = make_keys(n, 1);
+    Hash h;
+    h.reserve(n * 4 / 3 + 1);
+    for (size_t i = 0;  i < n;  ++i)
+        h[keys[i]] = i;
+
+    vector<uint64_t> lookups(nlookups);
+    uint64_t x = 3;
+    for (size_t i = 0;  i < nlookups;  ++i) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+        lookups[i] = keys[(x >> 11) % n];
+    }
+
+    Timer timer;
+    double single = time_lookups(h, lookups, nlookups);
+
+    size_t batchSize = 1024, found = 0;
+    vector<typename Hash::const_iterator> out(batchSize);
+    const Hash & ch = h;
+    timer.restart();
+    for (size_t i = 0;  i < nlookups;  i += batchSize) {
+        size_t todo = std::min(batchSize, nlookups - i);
+        ch.find_batch(&lookups[i], todo, &out[0]);
+        for (size_t j = 0;  j < todo;  ++j)
+            found += out[j] != ch.end();
+    }
+    double batch = nlookups / timer.elapsed_wall();
+    BOOST_CHECK_EQUAL(found, nlookups);
+
+    cerr << format("  %-16s %11zd entries find %7.2fM/s "
+                   "find_batch %7.2fM/s (%.2fx)",
+                   name, n, single / 1e6, batch / 1e6, batch / single)
+         << endl;
+}
+
+BOOST_AUTO_TEST_CASE( test_batch_lookups )
+{
+    size_t memory = sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+
+    // Buckets are indexed with an int, so 1e8 entries (a capacity of 2^28)
+    // is as far as we can go in powers of ten
+    for (size_t n = 1000;  n <= 100000000;  n *= 10) {
+        // The table may be up to 8/3 of the entries in capacity, and we
+        // need the keys as well
+        size_t needed = n * (sizeof(Bucket) * 8 / 3 + 3 * sizeof(uint64_t));
+        if (needed > memory / 2) {
+            cerr << format("  skipping %zd entries: needs %.1fGB of memory",
+                           n, needed / 1e9)
+                 << endl;
+            continue;
+        }
+
+        size_t nlookups = std::min<size_t>(10000000, std::max<size_t>(n, 1000000));
+        run_batch_lookups<Linear_Hash>("linear probe", n, nlookups);
+        run_batch_lookups<Simd_Hash>("simd probe", n, nlookups);
+    }
+}
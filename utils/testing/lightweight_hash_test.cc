@@ -10,6 +10,9 @@
 #undef NDEBUG
 
 #include "jml/utils/lightweight_hash.h"
+#include "jml/utils/mapped_lightweight_hash.h"
+#include "jml/utils/file_functions.h"
+#include "jml/utils/guard.h"
 #include "jml/utils/string_functions.h"
 #include <boost/test/unit_test.hpp>
 #include <boost/bind.hpp>
@@ -18,6 +21,8 @@
 #include "jml/arch/exception_handler.h"
 #include "jml/arch/demangle.h"
 #include <set>
+#include <map>
+#include <fstream>
 #include "live_counting_obj.h"
 
 using namespace ML;
@@ -191,3 +196,264 @@ BOOST_AUTO_TEST_CASE(test_set)
     BOOST_CHECK_EQUAL_COLLECTIONS(objects.begin(), objects.end(),
                                   obj3.begin(), obj3.end());
 }
+
+typedef Lightweight_Hash<uint64_t, int,
+                         std::pair<uint64_t, int>,
+                         std::pair<const uint64_t, int>,
+                         PairOps<uint64_t, int>,
+                         SimdProbeStorage<std::pair<uint64_t, int> > >
+Simd_Hash;
+
+BOOST_AUTO_TEST_CASE(test_simd_probe)
+{
+    Simd_Hash h;
+    const Simd_Hash & ch = h;
+
+    BOOST_CHECK_EQUAL(h.size(), 0);
+    BOOST_CHECK_EQUAL(h.begin(), h.end());
+    BOOST_CHECK(h.find(1) == h.end());
+
+    // Capacity is rounded up to the probe width
+    h.reserve(2);
+    BOOST_CHECK_EQUAL(h.capacity(), 16);
+    BOOST_CHECK_EQUAL(ch.begin(), ch.end());
+
+    // Lots of keys whose scrambled hashes share their top 8 bits, so that
+    // they all start probing in the last 256th of the table whatever its
+    // size; the probe sequences get long and wrap around the end
+    typedef PairOps<uint64_t, int> Ops;
+    SimdProbeStorage<std::pair<uint64_t, int> > storage256(256);
+    vector<uint64_t> keys;
+    for (uint64_t key = 1;  keys.size() < 4000;  ++key)
+        if (storage256.bucketForHash(Ops::hashKeyFull(key)) == 255)
+            keys.push_back(key);
+
+    std::map<uint64_t, int> reference;
+    for (unsigned i = 0;  i < 2500;  ++i) {
+        uint64_t key = keys[random() % keys.size()];
+        h[key] = i;
+        reference[key] = i;
+        BOOST_CHECK_EQUAL(h.size(), reference.size());
+    }
+
+    size_t cap = h.capacity();
+    for (uint64_t key: keys) {
+        BOOST_CHECK_GE(h.storage().bucketForHash(Ops::hashKeyFull(key)),
+                       cap - cap / 256);
+        BOOST_CHECK_EQUAL(h.count(key), reference.count(key));
+        if (reference.count(key)) {
+            BOOST_REQUIRE(h.find(key) != h.end());
+            BOOST_CHECK_EQUAL(h.find(key)->second, reference[key]);
+        }
+        else BOOST_CHECK(h.find(key) == h.end());
+    }
+
+    std::map<uint64_t, int> contents(ch.begin(), ch.end());
+    BOOST_CHECK(contents == reference);
+
+    // Copying keeps the control bytes in step with the buckets
+    Simd_Hash h2 = h;
+    BOOST_CHECK_EQUAL(h2.size(), h.size());
+    for (auto it = reference.begin();  it != reference.end();  ++it)
+        BOOST_CHECK_EQUAL(h2[it->first], it->second);
+    BOOST_CHECK_EQUAL(h2.size(), h.size());
+
+    // As does clearing
+    h.clear();
+    BOOST_CHECK_EQUAL(h.size(), 0);
+    BOOST_CHECK_EQUAL(h.begin(), h.end());
+    BOOST_CHECK(h.find(reference.begin()->first) == h.end());
+    h[reference.begin()->first] = 3;
+    BOOST_CHECK_EQUAL(h.size(), 1);
+    BOOST_CHECK_EQUAL(h.begin()->second, 3);
+
+    BOOST_CHECK_THROW(h[0], ML::Exception);
+
+    // Storage can be handed over to a hash, as with the other storages
+    SimdProbeStorage<std::pair<uint64_t, int> > storage(32);
+    for (unsigned i = 0;  i < storage.capacity();  ++i)
+        PairOps<uint64_t, int>::initEmptyBucket(storage + i);
+    Simd_Hash h3(std::move(storage), 0);
+    BOOST_CHECK_EQUAL(storage.capacity(), 0);
+    BOOST_CHECK_EQUAL(h3.capacity(), 32);
+    BOOST_CHECK_EQUAL(h3.begin(), h3.end());
+    h3[1 << 16] = 4;
+    BOOST_CHECK_EQUAL(h3.size(), 1);
+    BOOST_CHECK_EQUAL(h3.find(1 << 16)->second, 4);
+}
+
+BOOST_AUTO_TEST_CASE(test_simd_probe_set)
+{
+    int nobj = 1000;
+
+    vector<int> objects;
+    for (unsigned j = 0;  j < nobj;  ++j)
+        objects.push_back(j * 1024);
+
+    Lightweight_Hash_Set<int, std::hash<int>, int, ScalarOps<int, std::hash<int> >,
+                         SimdProbeStorage<int> > s;
+
+    for (unsigned i = 0;  i < nobj;  ++i) {
+        BOOST_CHECK_EQUAL(s.count(objects[i]), 0);
+        BOOST_CHECK_EQUAL(s.insert(objects[i]).second, true);
+        BOOST_CHECK_EQUAL(s.insert(objects[i]).second, false);
+        BOOST_CHECK_EQUAL(s.count(objects[i]), 1);
+        BOOST_CHECK_EQUAL(s.size(), i + 1);
+    }
+
+    vector<int> obj2(s.begin(), s.end());
+    std::sort(obj2.begin(), obj2.end());
+    BOOST_CHECK_EQUAL_COLLECTIONS(objects.begin(), objects.end(),
+                                  obj2.begin(), obj2.end());
+}
+
+typedef Lightweight_Hash<uint64_t, int,
+                         std::pair<uint64_t, int>,
+                         std::pair<const uint64_t, int>,
+                         PairOps<uint64_t, int>,
+                         MappedStorage<std::pair<uint64_t, int> > >
+Mapped_Hash;
+
+BOOST_AUTO_TEST_CASE(test_mapped_storage)
+{
+    string filename = "lightweight_hash_test_mapped";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+
+    std::map<uint64_t, int> reference;
+
+    {
+        Mapped_Hash h;
+        for (unsigned i = 0;  i < 10000;  ++i) {
+            uint64_t key = random() % 100000 + 1;
+            h[key] = i;
+            reference[key] = i;
+        }
+        BOOST_CHECK_EQUAL(h.size(), reference.size());
+        save_mapped(h, filename);
+    }
+
+    Mapped_Hash h;
+    h[1] = 1;  // replaced by the load
+    load_mapped(h, filename);
+
+    BOOST_CHECK_EQUAL(h.size(), reference.size());
+    std::map<uint64_t, int> contents(h.begin(), h.end());
+    BOOST_CHECK(contents == reference);
+
+    for (auto it = reference.begin();  it != reference.end();  ++it) {
+        BOOST_REQUIRE(h.find(it->first) != h.end());
+        BOOST_CHECK_EQUAL(h.find(it->first)->second, it->second);
+    }
+    BOOST_CHECK(h.find(100001) == h.end());
+
+    // Writing to the loaded hash changes our copy but not the file
+    h[100001] = 3;
+    BOOST_CHECK_EQUAL(h[100001], 3);
+
+    Mapped_Hash h2;
+    load_mapped(h2, filename);
+    BOOST_CHECK_EQUAL(h2.size(), reference.size());
+    BOOST_CHECK(h2.find(100001) == h2.end());
+
+    // Copies don't keep the mapping
+    Mapped_Hash h3 = h2;
+    BOOST_CHECK_EQUAL(h3.size(), reference.size());
+
+    // A set can be mapped in the same way
+    {
+        Lightweight_Hash_Set<int, std::hash<int>, int,
+                             ScalarOps<int, std::hash<int> >,
+                             MappedStorage<int> > s, s2;
+        for (int i = 0;  i < 1000;  ++i)
+            s.insert(i * 3);
+        save_mapped(s, filename);
+        load_mapped(s2, filename);
+        BOOST_CHECK_EQUAL(s2.size(), 1000);
+        BOOST_CHECK(s2.count(2997));
+        BOOST_CHECK(!s2.count(2998));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_mapped_storage_validation)
+{
+    string filename = "lightweight_hash_test_mapped_invalid";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+
+    Mapped_Hash h;
+    BOOST_CHECK_THROW(load_mapped(h, filename), ML::Exception);
+
+    {
+        ofstream stream(filename.c_str());
+        stream << "hello, I'm not a hash" << endl;
+    }
+    BOOST_CHECK_THROW(load_mapped(h, filename), ML::Exception);
+
+    for (unsigned i = 1;  i <= 100;  ++i)
+        h[i] = i;
+    save_mapped(h, filename);
+
+    // Different value type
+    Lightweight_Hash<uint64_t, float,
+                     std::pair<uint64_t, float>,
+                     std::pair<const uint64_t, float>,
+                     PairOps<uint64_t, float>,
+                     MappedStorage<std::pair<uint64_t, float> > > h2;
+    BOOST_CHECK_THROW(load_mapped(h2, filename), ML::Exception);
+
+    // Truncated
+    BOOST_CHECK_EQUAL(truncate(filename.c_str(), 4096 + 16), 0);
+    Mapped_Hash h3;
+    BOOST_CHECK_THROW(load_mapped(h3, filename), ML::Exception);
+    BOOST_CHECK_EQUAL(h3.size(), 0);
+}
+
+template<class Hash>
+void test_find_batch_for()
+{
+    Hash h;
+    vector<uint64_t> keys;
+    for (unsigned i = 0;  i < 5000;  ++i) {
+        uint64_t key = random() % 10000 + 1;
+        h[key] = i;
+        keys.push_back(key);
+        keys.push_back(key + 10000);  // never there
+    }
+
+    // Empty batches and a batch on an empty hash are fine
+    h.find_batch(&keys[0], 0, (typename Hash::iterator *)0);
+    Hash empty;
+    vector<typename Hash::iterator> emptyOut(3);
+    empty.find_batch(&keys[0], 3, &emptyOut[0]);
+    for (unsigned i = 0;  i < 3;  ++i)
+        BOOST_CHECK(emptyOut[i] == empty.end());
+
+    vector<typename Hash::iterator> out(keys.size());
+    h.find_batch(&keys[0], keys.size(), &out[0]);
+
+    const Hash & ch = h;
+    vector<typename Hash::const_iterator> cout(keys.size());
+    ch.find_batch(&keys[0], keys.size(), &cout[0]);
+
+    for (unsigned i = 0;  i < keys.size();  ++i) {
+        BOOST_CHECK(out[i] == h.find(keys[i]));
+        BOOST_CHECK(cout[i] == ch.find(keys[i]));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_find_batch)
+{
+    test_find_batch_for<Lightweight_Hash<uint64_t, int> >();
+    test_find_batch_for<Simd_Hash>();
+    test_find_batch_for<Mapped_Hash>();
+
+    Lightweight_Hash_Set<int> s;
+    vector<int> keys;
+    for (int i = 1;  i <= 100;  ++i) {
+        s.insert(i * 2);
+        keys.push_back(i);
+    }
+    vector<Lightweight_Hash_Set<int>::const_iterator> out(keys.size());
+    s.find_batch(&keys[0], keys.size(), &out[0]);
+    for (unsigned i = 0;  i < keys.size();  ++i)
+        BOOST_CHECK_EQUAL(out[i] != s.end(), keys[i] % 2 == 0);
+}
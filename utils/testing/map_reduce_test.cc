@@ -0,0 +1,214 @@
+/* map_reduce_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Tests for the parallel map/reduce, reduce and scan primitives.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include "jml/utils/map_reduce.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/timers.h"
+
+using namespace ML;
+using namespace std;
+
+typedef vector<int>::const_iterator It;
+
+BOOST_AUTO_TEST_CASE( test_parallel_map_in_order_reduce )
+{
+    vector<int> values(10000);
+    for (unsigned i = 0;  i < values.size();  ++i)
+        values[i] = i;
+
+    vector<int> reduced;
+
+    auto map = [] (It it) { return *it * 2; };
+    auto reduce = [&] (It it, int mapped) { reduced.push_back(mapped); };
+
+    parallelMapInOrderReduce(It(values.begin()), It(values.end()),
+                             map, reduce);
+
+    BOOST_REQUIRE_EQUAL(reduced.size(), values.size());
+    for (unsigned i = 0;  i < values.size();  ++i)
+        BOOST_CHECK_EQUAL(reduced[i], 2 * i);
+}
+
+// One slow element at the start mustn't let the others pile up without
+// limit waiting to be reduced.
+BOOST_AUTO_TEST_CASE( test_parallel_map_in_order_reduce_bounded )
+{
+    Worker_Task worker(3);
+
+    size_t n = 100000, window = 64;
+    int outstanding = 0, max_outstanding = 0;
+    size_t next = 0;
+    bool in_order = true;
+
+    auto map = [&] (size_t i)
+        {
+            if (i == 0) ML::sleep(0.1);
+            atomic_inc(outstanding);
+            atomic_max(max_outstanding, outstanding);
+            return vector<size_t>(100, i);
+        };
+
+    auto reduce = [&] (size_t i, vector<size_t> & mapped)
+        {
+            in_order = in_order && i == next && mapped[0] == i;
+            ++next;
+            atomic_dec(outstanding);
+        };
+
+    parallelMapInOrderReduce(size_t(0), n, map, reduce, window, worker);
+
+    BOOST_CHECK(in_order);
+    BOOST_CHECK_EQUAL(next, n);
+    BOOST_CHECK_LE(max_outstanding, window);
+}
+
+BOOST_AUTO_TEST_CASE( test_parallel_map_in_order_reduce_exception )
+{
+    Worker_Task worker(3);
+
+    size_t reduced = 0;
+
+    auto map = [&] (size_t i) -> int
+        {
+            if (i == 1000)
+                throw Exception("there was an exception");
+            return i;
+        };
+
+    auto reduce = [&] (size_t i, int mapped) { ++reduced; };
+
+    JML_TRACE_EXCEPTIONS(false);
+    BOOST_CHECK_THROW(parallelMapInOrderReduce(size_t(0), size_t(1000000),
+                                               map, reduce, 0, worker),
+                      std::exception);
+    BOOST_CHECK_LE(reduced, 1000);
+}
+
+BOOST_AUTO_TEST_CASE( test_parallel_reduce_sum )
+{
+    for (int nthreads: { 1, 4 }) {
+        Worker_Task worker(nthreads - 1);
+
+        for (size_t n: { 0, 1, 5, 1023, 1024, 1025, 100000, 1000001 }) {
+            vector<int> values(n);
+            long long expected = 0;
+            for (unsigned i = 0;  i < n;  ++i)
+                expected += values[i] = (i * 7919) % 1000;
+
+            auto accum = [] (long long & total, It it) { total += *it; };
+            auto combine = [] (long long & left, long long & right)
+                {
+                    left += right;
+                };
+
+            long long total
+                = parallelReduce(It(values.begin()), It(values.end()),
+                                 0LL, accum, combine, worker);
+
+            BOOST_CHECK_EQUAL(total, expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_parallel_reduce_histogram )
+{
+    Worker_Task worker(3);
+
+    size_t n = 1000000;
+    vector<int> values(n);
+    vector<size_t> expected(256);
+    for (unsigned i = 0;  i < n;  ++i)
+        ++expected[values[i] = random() % 256];
+
+    auto accum = [] (vector<size_t> & hist, It it) { ++hist[*it]; };
+    auto combine = [] (vector<size_t> & left, vector<size_t> & right)
+        {
+            for (unsigned i = 0;  i < left.size();  ++i)
+                left[i] += right[i];
+        };
+
+    vector<size_t> hist
+        = parallelReduce(It(values.begin()), It(values.end()),
+                         vector<size_t>(256), accum, combine, worker);
+
+    BOOST_CHECK_EQUAL_COLLECTIONS(hist.begin(), hist.end(),
+                                  expected.begin(), expected.end());
+}
+
+// Concatenation is associative but not commutative, so this checks that
+// the partials are combined in order.
+BOOST_AUTO_TEST_CASE( test_parallel_reduce_ordered )
+{
+    Worker_Task worker(3);
+
+    size_t n = 50000;
+    vector<int> values(n);
+    string expected;
+    for (unsigned i = 0;  i < n;  ++i) {
+        values[i] = 'a' + i % 26;
+        expected += values[i];
+    }
+
+    auto accum = [] (string & str, It it) { str += *it; };
+    auto combine = [] (string & left, string & right) { left += right; };
+
+    string result = parallelReduce(It(values.begin()), It(values.end()),
+                                   string(), accum, combine, worker);
+
+    BOOST_CHECK(result == expected);
+}
+
+BOOST_AUTO_TEST_CASE( test_parallel_scan )
+{
+    for (int nthreads: { 1, 4 }) {
+        Worker_Task worker(nthreads - 1);
+
+        for (size_t n: { 0, 1, 5, 1025, 100000, 1000001 }) {
+            for (bool inclusive: { false, true }) {
+                vector<int> values(n);
+                for (unsigned i = 0;  i < n;  ++i)
+                    values[i] = (i * 7919) % 100;
+
+                vector<long long> offsets(n, -1);
+
+                auto accum = [] (long long & total, It it) { total += *it; };
+                auto combine = [] (long long & left, long long & right)
+                    {
+                        left += right;
+                    };
+                auto output = [&] (It it, const long long & prefix)
+                    {
+                        offsets[it - values.begin()] = prefix;
+                    };
+
+                long long total
+                    = parallelScan(It(values.begin()), It(values.end()),
+                                   0LL, accum, combine, output, inclusive,
+                                   worker);
+
+                long long expected = 0;
+                size_t wrong = 0;
+                for (unsigned i = 0;  i < n;  ++i) {
+                    if (inclusive) expected += values[i];
+                    wrong += offsets[i] != expected;
+                    if (!inclusive) expected += values[i];
+                }
+
+                BOOST_CHECK_EQUAL(wrong, 0);
+                BOOST_CHECK_EQUAL(total, expected);
+            }
+        }
+    }
+}
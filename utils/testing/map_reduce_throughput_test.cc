@@ -0,0 +1,91 @@
+/* map_reduce_throughput_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Throughput benchmark of parallelReduce and parallelScan against doing
+   the same job with parallelMapInOrderReduce.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <vector>
+#include <iostream>
+
+#include "jml/utils/map_reduce.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/cpu_info.h"
+
+using namespace ML;
+using namespace std;
+
+typedef vector<int>::const_iterator It;
+
+BOOST_AUTO_TEST_CASE( test_reduce_throughput )
+{
+    size_t n = 10000000;
+    vector<int> values(n);
+    for (unsigned i = 0;  i < n;  ++i)
+        values[i] = random() % 256;
+
+    for (int nthreads = 1;  nthreads <= num_cpus();  nthreads *= 2) {
+        Worker_Task worker(nthreads - 1);
+
+        cerr << nthreads << " threads" << endl;
+
+        // Histogram via the ordered map/reduce: everything funnels through
+        // a single reduce, one element at a time.
+        {
+            vector<size_t> hist(256);
+            auto map = [] (It it) { return *it; };
+            auto reduce = [&] (It it, int val) { ++hist[val]; };
+
+            Timer timer;
+            parallelMapInOrderReduce(It(values.begin()), It(values.end()),
+                                     map, reduce, 0, worker);
+            cerr << format("  histogram parallelMapInOrderReduce %8.2f Mrows/s",
+                           n / timer.elapsed_wall() / 1000000.0)
+                 << endl;
+        }
+
+        // Histogram via the tree reduce
+        {
+            auto accum = [] (vector<size_t> & hist, It it) { ++hist[*it]; };
+            auto combine = [] (vector<size_t> & left, vector<size_t> & right)
+                {
+                    for (unsigned i = 0;  i < left.size();  ++i)
+                        left[i] += right[i];
+                };
+
+            Timer timer;
+            vector<size_t> hist
+                = parallelReduce(It(values.begin()), It(values.end()),
+                                 vector<size_t>(256), accum, combine, worker);
+            cerr << format("  histogram parallelReduce           %8.2f Mrows/s",
+                           n / timer.elapsed_wall() / 1000000.0)
+                 << endl;
+        }
+
+        // Offsets via the scan
+        {
+            vector<long long> offsets(n);
+            auto accum = [] (long long & total, It it) { total += *it; };
+            auto combine = [] (long long & left, long long & right)
+                {
+                    left += right;
+                };
+            auto output = [&] (It it, long long prefix)
+                {
+                    offsets[it - values.begin()] = prefix;
+                };
+
+            Timer timer;
+            parallelScan(It(values.begin()), It(values.end()), 0LL,
+                         accum, combine, output, false /* inclusive */,
+                         worker);
+            cerr << format("  offsets parallelScan               %8.2f Mrows/s",
+                           n / timer.elapsed_wall() / 1000000.0)
+                 << endl;
+        }
+    }
+}
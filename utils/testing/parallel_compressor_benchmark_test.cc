@@ -0,0 +1,85 @@
+/* parallel_compressor_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Compression throughput of filter_ostream for gzip and xz at several
+   levels, with the normal filters and with the parallel compressor
+   limited to different numbers of blocks at once.  The size of the input
+   in MB comes from COMPRESS_BENCHMARK_MB.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <iostream>
+#include <sstream>
+
+#include "jml/utils/filter_streams.h"
+#include "jml/utils/worker_task.h"
+#include "jml/utils/environment.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace std;
+
+/** Something like a log file: repetitive, but not too repetitive. */
+string make_corpus(size_t bytes)
+{
+    string result;
+    result.reserve(bytes + 200);
+    for (size_t i = 0;  result.size() < bytes;  ++i)
+        result += format("2013-06-%02zd %02zd:%02zd:%02zd id=%zd user=u%zd "
+                         "url=/page/%zd status=%d bytes=%zd\n",
+                         i / 86400 % 30 + 1, i / 3600 % 24, i / 60 % 60,
+                         i % 60, i, (i * 7919) % 100003, (i * 31) % 997,
+                         i % 17 ? 200 : 404, (i * 104729) % 65536);
+    return result;
+}
+
+void run(const string & corpus, const string & compression, int level,
+         int threads)
+{
+    stringbuf buf;
+    Timer timer;
+    {
+        filter_ostream stream;
+        stream.openFromStreambuf(&buf, false, "", compression, level,
+                                 threads);
+        for (size_t i = 0;  i < corpus.size();  i += 65536)
+            stream.write(corpus.c_str() + i,
+                         std::min<size_t>(65536, corpus.size() - i));
+    }
+    double elapsed = timer.elapsed_wall();
+
+    cerr << format("  %-4s level %d %-12s %8.1f MB/s  ratio %6.3f",
+                   compression.c_str(), level,
+                   threads == 1 ? "serial"
+                   : format("%d blocks", threads).c_str(),
+                   corpus.size() / elapsed / 1e6,
+                   1.0 * buf.str().size() / corpus.size())
+         << endl;
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_parallel_compression )
+{
+    Env_Option<size_t> corpus_mb("COMPRESS_BENCHMARK_MB", 32);
+
+    string corpus = make_corpus(corpus_mb * 1000000);
+    int maxThreads = num_threads();
+    cerr << "compressing " << corpus.size() / 1e6 << "MB with "
+         << maxThreads << " threads" << endl;
+
+    vector<int> threadCounts = { 1 };
+    for (int n = 2;  n < maxThreads;  n *= 2)
+        threadCounts.push_back(n);
+    threadCounts.push_back(maxThreads == 1 ? 2 : maxThreads);
+
+    for (int level: { 1, 6, 9 })
+        for (int threads: threadCounts)
+            run(corpus, "gz", level, threads);
+
+    for (int level: { 0, 3, 6 })
+        for (int threads: threadCounts)
+            run(corpus, "xz", level, threads);
+}
@@ -0,0 +1,146 @@
+/* parallel_compressor_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Tests for the parallel block compressor.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/bind.hpp>
+#include <fstream>
+#include <sstream>
+
+#include "jml/utils/parallel_compressor.h"
+#include "jml/utils/filter_streams.h"
+#include "jml/utils/worker_task.h"
+#include "jml/utils/file_functions.h"
+#include "jml/utils/guard.h"
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/format.h"
+
+using namespace std;
+using namespace ML;
+
+string make_text(unsigned lines)
+{
+    string result;
+    for (unsigned i = 0;  i < lines;  ++i)
+        result += format("line %d of the text, %d\n", i, i * i % 1013);
+    return result;
+}
+
+string compress(const string & text,
+                const parallel_compressor::Options & options,
+                size_t writeSize)
+{
+    string result;
+    {
+        boost::iostreams::filtering_ostream stream;
+        stream.push(parallel_compressor(options));
+        stream.push(boost::iostreams::back_inserter(result));
+        for (size_t i = 0;  i < text.size();  i += writeSize)
+            stream.write(text.c_str() + i,
+                         std::min(writeSize, text.size() - i));
+    }
+    return result;
+}
+
+string decompress(const string & filename)
+{
+    filter_istream stream(filename);
+    ostringstream result;
+    result << stream.rdbuf();
+    return result.str();
+}
+
+void write_file(const string & filename, const string & contents)
+{
+    ofstream stream(filename.c_str());
+    stream << contents;
+}
+
+/** Decompress with the command line tool and check it's the same. */
+void check_with_tool(const string & compressed, const string & command,
+                     const string & expected)
+{
+    string filename = "parallel_compressor_test.out";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+    write_file(filename + ".cmp", compressed);
+    Call_Guard guard2(boost::bind(&delete_file, filename + ".cmp"));
+
+    string cmd = command + " < " + filename + ".cmp > " + filename;
+    BOOST_REQUIRE_EQUAL(system(cmd.c_str()), 0);
+
+    File_Read_Buffer buf(filename);
+    BOOST_CHECK(string(buf.start(), buf.end()) == expected);
+}
+
+BOOST_AUTO_TEST_CASE( test_formats_and_blocks )
+{
+    string text = make_text(20000);
+    Worker_Task worker(2);
+
+    for (auto type: { parallel_compressor::GZIP, parallel_compressor::XZ }) {
+        string tool = (type == parallel_compressor::GZIP
+                       ? "gzip -dc" : "xz -dc");
+        string ext = (type == parallel_compressor::GZIP ? ".gz" : ".xz");
+
+        for (size_t blockSize: { 1000, 65536, 1 << 22 }) {
+            for (int maxBlocks: { 1, 3 }) {
+                parallel_compressor::Options options(type, 1);
+                options.blockSize = blockSize;
+                options.maxBlocks = maxBlocks;
+                options.worker = &worker;
+
+                string compressed = compress(text, options, 777);
+                check_with_tool(compressed, tool, text);
+
+                // And with our own decompressor
+                string filename = "parallel_compressor_test" + ext;
+                Call_Guard guard(boost::bind(&delete_file, filename));
+                write_file(filename, compressed);
+                BOOST_CHECK(decompress(filename) == text);
+            }
+        }
+
+        // Empty input still has to be a valid file
+        parallel_compressor::Options options(type);
+        options.worker = &worker;
+        check_with_tool(compress("", options, 1), tool, "");
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_filter_ostream )
+{
+    string text = make_text(50000);
+
+    for (string ext: { ".gz", ".xz" }) {
+        for (int threads: { 0, 4 }) {
+            string filename = "parallel_compressor_test_stream" + ext;
+            Call_Guard guard(boost::bind(&delete_file, filename));
+            {
+                filter_ostream stream(filename, ios::out, "", -1, threads);
+                stream << text;
+            }
+            BOOST_CHECK(decompress(filename) == text);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_errors )
+{
+    JML_TRACE_EXCEPTIONS(false);
+
+    BOOST_CHECK_THROW(parallel_compressor
+                          (parallel_compressor::Options
+                               (parallel_compressor::GZIP, 10)),
+                      std::exception);
+    BOOST_CHECK_THROW(parallel_compressor
+                          (parallel_compressor::Options
+                               (parallel_compressor::XZ, -2)),
+                      std::exception);
+}
@@ -0,0 +1,136 @@
+/* parallel_ingest_benchmark_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Scaling of parallelIngest with the number of threads, on a memory mapped
+   JSON lines file and a CSV file with quoted fields.  The size of each in
+   MB comes from INGEST_BENCHMARK_MB.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/bind.hpp>
+#include <iostream>
+#include <stdio.h>
+
+#include "jml/utils/parallel_ingest.h"
+#include "jml/utils/json_parsing.h"
+#include "jml/utils/csv.h"
+#include "jml/utils/environment.h"
+#include "jml/utils/guard.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/cpu_info.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace std;
+
+void write_corpus(const string & filename, size_t bytes, bool csv)
+{
+    FILE * file = fopen(filename.c_str(), "w");
+    if (!file)
+        throw Exception("couldn't open " + filename);
+
+    size_t written = 0;
+    for (size_t i = 0;  written < bytes;  ++i) {
+        int n;
+        if (csv)
+            n = fprintf(file, "%zu,\"user %zu\",%.4f,\"a, \"\"quoted\"\"\n"
+                        "field\",%s\n",
+                        i, i % 100000, (i % 1000) / 1000.0,
+                        i % 2 ? "true" : "false");
+        else
+            n = fprintf(file, "{\"id\":%zu,\"user\":\"user %zu\","
+                        "\"price\":%.4f,\"segments\":[%zu,%zu],"
+                        "\"gdpr\":%s}\n",
+                        i, i % 100000, (i % 1000) / 1000.0, i % 97, i % 89,
+                        i % 2 ? "true" : "false");
+        written += n;
+    }
+
+    fclose(file);
+}
+
+struct CountingHandler : public JsonEventHandler {
+    CountingHandler() : tokens(0) {}
+    size_t tokens;
+    void onKey(const char * key, size_t len) { ++tokens; }
+    void onString(const char * str, size_t len) { ++tokens; }
+    void onNumber(const JsonNumber & number) { ++tokens; }
+    void onBool(bool value) { ++tokens; }
+};
+
+template<typename ChunkFn>
+void run(const char * what, const File_Read_Buffer & file, char quote,
+         ChunkFn onChunk)
+{
+    double base = 0.0;
+    for (int threads = 1;  threads <= num_cpus();  threads *= 2) {
+        Worker_Task worker(threads - 1);
+        size_t records = 0;
+
+        Timer timer;
+        parallelIngest(file,
+                       [&] (Parse_Context & context, size_t chunk)
+                       {
+                           atomic_add(records, onChunk(context));
+                       },
+                       quote, 0, worker);
+        double elapsed = timer.elapsed_wall();
+        if (threads == 1) base = elapsed;
+
+        cerr << format("  %-6s %3d threads %8.1f MB/s %10.0f records/s "
+                       "speedup %5.2f",
+                       what, threads, file.size() / elapsed / 1e6,
+                       records / elapsed, base / elapsed)
+             << endl;
+    }
+}
+
+BOOST_AUTO_TEST_CASE( benchmark_parallel_ingest )
+{
+    Env_Option<size_t> corpus_mb("INGEST_BENCHMARK_MB", 512);
+
+    cerr << num_cpus() << " cpus" << endl;
+
+    {
+        string filename = "parallel_ingest_benchmark.json";
+        Call_Guard guard(boost::bind(&delete_file, filename));
+        write_corpus(filename, corpus_mb * 1000000, false);
+        File_Read_Buffer file(filename);
+
+        run("json", file, 0,
+            [] (Parse_Context & context) -> size_t
+            {
+                JsonEventReader reader;
+                CountingHandler handler;
+                size_t records = 0;
+                while (context) {
+                    reader.expectValue(context, handler);
+                    context.expect_eol();
+                    ++records;
+                }
+                return records;
+            });
+    }
+
+    {
+        string filename = "parallel_ingest_benchmark.csv";
+        Call_Guard guard(boost::bind(&delete_file, filename));
+        write_corpus(filename, corpus_mb * 1000000, true);
+        File_Read_Buffer file(filename);
+
+        run("csv", file, '"',
+            [] (Parse_Context & context) -> size_t
+            {
+                size_t records = 0;
+                while (context) {
+                    expect_csv_row(context, 5);
+                    ++records;
+                }
+                return records;
+            });
+    }
+}
@@ -0,0 +1,176 @@
+/* parallel_ingest_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Tests for parallel ingestion of JSON lines and CSV.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/lexical_cast.hpp>
+#include <vector>
+#include <string>
+#include <iostream>
+
+#include "jml/utils/parallel_ingest.h"
+#include "jml/utils/csv.h"
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace std;
+
+// Row i is on line lines[i] and has fields i, "a<i>" and (every third row)
+// a quoted field with a comma, a doubled quote and two newlines in it.
+string make_csv(size_t nrows, vector<size_t> & lines)
+{
+    string result;
+    size_t line = 1;
+    for (size_t i = 0;  i < nrows;  ++i) {
+        lines.push_back(line);
+        result += format("%zd,a%zd", i, i);
+        if (i % 3 == 0) {
+            result += ",\"x,\"\"y\"\"\nz\n\"";
+            line += 2;
+        }
+        else result += ",plain";
+        result += "\n";
+        ++line;
+    }
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE( test_csv_quoted_newlines )
+{
+    vector<size_t> lines;
+    string text = make_csv(1000, lines);
+    File_Read_Buffer file(text.c_str(), text.size(), "test.csv");
+
+    Worker_Task worker(3);
+
+    for (size_t blockSize: { 1, 2, 3, 7, 16, 100, 1000, 100000 }) {
+        vector<int> seen(lines.size());
+        bool ok = true;
+
+        auto onChunk = [&] (Parse_Context & context, size_t chunk)
+            {
+                while (context) {
+                    size_t line = context.get_line();
+                    vector<string> row = expect_csv_row(context, 3);
+                    size_t i = boost::lexical_cast<size_t>(row[0]);
+                    if (i >= lines.size() || line != lines[i]
+                        || row[1] != format("a%zd", i)
+                        || row[2] != (i % 3 == 0 ? "x,\"y\"\nz\n" : "plain"))
+                        ok = false;
+                    else atomic_inc(seen[i]);
+                }
+            };
+
+        parallelIngest(file, onChunk, '"', blockSize, worker);
+
+        BOOST_CHECK(ok);
+        for (size_t i = 0;  i < seen.size();  ++i)
+            BOOST_CHECK_EQUAL(seen[i], 1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_json_lines_in_order )
+{
+    string text;
+    size_t nlines = 5000;
+    for (size_t i = 0;  i < nlines;  ++i)
+        text += format("{\"n\":%zd}\n", i);
+    File_Read_Buffer file(text.c_str(), text.size(), "test.json");
+
+    Worker_Task worker(3);
+
+    for (size_t blockSize: { 1, 5, 64, 4096 }) {
+        vector<size_t> values;
+        size_t lastChunk = 0;
+        bool inOrder = true, linesOk = true;
+
+        auto map = [&] (Parse_Context & context, size_t chunk)
+            {
+                vector<size_t> result;
+                while (context) {
+                    size_t line = context.get_line();
+                    context.expect_literal("{\"n\":");
+                    size_t n = context.expect_unsigned();
+                    context.expect_literal('}');
+                    context.expect_eol();
+                    if (line != n + 1) linesOk = false;
+                    result.push_back(n);
+                }
+                return result;
+            };
+
+        auto reduce = [&] (size_t chunk, vector<size_t> & result)
+            {
+                if (chunk && chunk != lastChunk + 1) inOrder = false;
+                lastChunk = chunk;
+                values.insert(values.end(), result.begin(), result.end());
+            };
+
+        parallelIngestInOrder(file, map, reduce, 0, blockSize, 16, worker);
+
+        BOOST_CHECK(inOrder);
+        BOOST_CHECK(linesOk);
+        BOOST_REQUIRE_EQUAL(values.size(), nlines);
+        for (size_t i = 0;  i < nlines;  ++i)
+            BOOST_CHECK_EQUAL(values[i], i);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_error_line_number )
+{
+    string text;
+    for (size_t i = 0;  i < 1000;  ++i)
+        text += (i == 700 ? "bad\n" : format("%zd\n", i));
+    File_Read_Buffer file(text.c_str(), text.size(), "test.txt");
+
+    Worker_Task worker(3);
+
+    auto onChunk = [&] (Parse_Context & context, size_t chunk)
+        {
+            while (context) {
+                context.expect_unsigned();
+                context.expect_eol();
+            }
+        };
+
+    JML_TRACE_EXCEPTIONS(false);
+    string message;
+    try {
+        parallelIngest(file, onChunk, 0, 256, worker);
+    } catch (const std::exception & exc) {
+        message = exc.what();
+    }
+
+    BOOST_CHECK(message.find("test.txt:701:1:") != string::npos);
+}
+
+BOOST_AUTO_TEST_CASE( test_empty_and_unterminated )
+{
+    Worker_Task worker(1);
+    size_t calls = 0;
+    auto count = [&] (Parse_Context & context, size_t chunk)
+        {
+            while (context) {
+                context.expect_text('\n');
+                context.match_eol();
+                atomic_inc(calls);
+            }
+        };
+
+    File_Read_Buffer empty("", 0, "empty");
+    parallelIngest(empty, count, 0, 0, worker);
+    BOOST_CHECK_EQUAL(calls, 0);
+
+    // No newline at the end, and a record longer than several blocks
+    string text = "a\n" + string(100, 'b') + "\nc";
+    File_Read_Buffer file(text.c_str(), text.size(), "text");
+    parallelIngest(file, count, 0, 10, worker);
+    BOOST_CHECK_EQUAL(calls, 3);
+}
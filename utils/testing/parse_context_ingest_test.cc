@@ -0,0 +1,107 @@
+/* parse_context_ingest_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Ingest benchmark for the parse context: reads the CSV test data (made
+   bigger by repeating it) as CSV rows, as lines and as whitespace
+   separated words, both from memory and from a stream.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <sstream>
+#include <iostream>
+
+#include "jml/utils/parse_context.h"
+#include "jml/utils/filter_streams.h"
+#include "jml/utils/environment.h"
+#include "jml/utils/csv.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/format.h"
+
+using namespace ML;
+using namespace std;
+
+string load_test_data(int copies)
+{
+    string input_file = Environment::instance()["JML_BASE_TOP"]
+        + "/utils/testing/parse_context_test_data.csv.gz";
+
+    filter_istream stream(input_file);
+    ostringstream contents;
+    contents << stream.rdbuf();
+
+    string result;
+    result.reserve(contents.str().size() * copies);
+    for (int i = 0;  i < copies;  ++i)
+        result += contents.str();
+    return result;
+}
+
+void report(const char * what, size_t bytes, size_t lines, double elapsed)
+{
+    cerr << format("  %-32s %8.1f MB/s %10.0f lines/s",
+                   what, bytes / elapsed / 1e6, lines / elapsed)
+         << endl;
+}
+
+template<class Fn>
+void run(const char * what, const string & data, Fn fn)
+{
+    {
+        Parse_Context context("memory", data.c_str(),
+                              data.c_str() + data.size());
+        Timer timer;
+        size_t lines = fn(context);
+        report(format("%s (memory)", what).c_str(), data.size(), lines,
+               timer.elapsed_wall());
+    }
+
+    {
+        istringstream stream(data);
+        Parse_Context context("stream", stream);
+        Timer timer;
+        size_t lines = fn(context);
+        report(format("%s (stream)", what).c_str(), data.size(), lines,
+               timer.elapsed_wall());
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_ingest )
+{
+    string data = load_test_data(100);
+    cerr << "ingesting " << data.size() / 1e6 << "MB" << endl;
+
+    run("csv rows", data, [] (Parse_Context & context)
+        {
+            size_t rows = 0;
+            while (context) {
+                expect_csv_row(context);
+                ++rows;
+            }
+            BOOST_CHECK_EQUAL(rows, 1000000);
+            return rows;
+        });
+
+    run("lines", data, [] (Parse_Context & context)
+        {
+            size_t rows = 0;
+            string line;
+            while (context.match_line(line))
+                ++rows;
+            BOOST_CHECK_EQUAL(rows, 1000000);
+            return rows;
+        });
+
+    run("words and whitespace", data, [] (Parse_Context & context)
+        {
+            string word;
+            while (context) {
+                context.skip_whitespace();
+                context.match_text(word, " \t\n");
+                context.match_eol();
+            }
+            return context.get_line() - 1;
+        });
+}
@@ -9,6 +9,7 @@
 #define BOOST_TEST_DYN_LINK
 
 #include "jml/utils/parse_context.h"
+#include "jml/utils/fast_float_parsing.h"
 #include "jml/utils/file_functions.h"
 #include "jml/utils/guard.h"
 #include "jml/utils/filter_streams.h"
@@ -143,6 +144,24 @@ BOOST_AUTO_TEST_CASE( test_double_parsing3 )
     BOOST_CHECK_EQUAL(s, s3);
 }
 
+BOOST_AUTO_TEST_CASE( test_double_parsing_long )
+{
+    // Too long to be copied onto the stack to go to strtod
+    for (string s: { "0." + string(200, '3'), string(300, '9') + ".5e-300",
+                     "1" + string(150, '0') + "1" }) {
+        double f = strtod(s.c_str(), 0);
+
+        Parse_Context pc(s, s.c_str(), s.c_str() + s.length());
+        BOOST_CHECK_EQUAL(pc.expect_double(), f);
+        BOOST_CHECK(pc.eof());
+
+        double f2 = -1.0;
+        BOOST_CHECK(parse_double(s.c_str(), s.c_str() + s.length(), f2)
+                    == s.c_str() + s.length());
+        BOOST_CHECK_EQUAL(f2, f);
+    }
+}
+
 void test_long_long(long long value)
 {
     string s = format("%lld", value);
@@ -252,6 +271,32 @@ BOOST_AUTO_TEST_CASE( test2 )
     run_test1(context);
 }
 
+// Dropping what's been parsed mustn't change what's still to come
+BOOST_AUTO_TEST_CASE( test_drop_consumed )
+{
+    string tmp_filename = "parse_context_test_file_drop";
+    Call_Guard guard;
+    {
+        ofstream stream(tmp_filename.c_str());
+        guard.set(boost::bind(&delete_file, tmp_filename));
+        for (unsigned i = 0;  i < 100000;  ++i)
+            stream << i << "\n";
+    }
+
+    File_Read_Buffer::Options options(File_Read_Buffer::SEQUENTIAL);
+    options.dropBehind = true;
+    Parse_Context context(tmp_filename, options);
+
+    for (unsigned i = 0;  i < 100000;  ++i) {
+        BOOST_REQUIRE_EQUAL(context.expect_unsigned(), i);
+        context.expect_eol();
+        if (i % 1000 == 999)
+            context.drop_consumed();
+    }
+    BOOST_CHECK(context.eof());
+    context.drop_consumed();
+}
+
 std::string expect_feature_name(Parse_Context & c)
 {
     std::string result;
@@ -523,6 +568,101 @@ BOOST_AUTO_TEST_CASE( test_csv_data )
     }
 }
 
+/* Scan text with match_text and match_whitespace, and check that the
+   position, line and column always agree with walking the same text a
+   character at a time. */
+void test_block_scanning_size(const string & text, int chunk_size)
+{
+    istringstream stream(text);
+    Parse_Context context("test", stream, 1, 1, chunk_size);
+    Parse_Context reference("reference", text.c_str(),
+                            text.c_str() + text.length());
+
+    auto check = [&] (const string & matched)
+        {
+            for (unsigned i = 0;  i < matched.size();  ++i) {
+                BOOST_REQUIRE(!reference.eof());
+                BOOST_REQUIRE_EQUAL(*reference, matched[i]);
+                ++reference;
+            }
+            BOOST_REQUIRE_EQUAL(context.get_offset(), reference.get_offset());
+            BOOST_REQUIRE_EQUAL(context.get_line(), reference.get_line());
+            BOOST_REQUIRE_EQUAL(context.get_col(), reference.get_col());
+        };
+
+    string word;
+    for (int i = 0;  context;  ++i) {
+        switch (i % 4) {
+        case 0:
+            context.match_text(word, ',');
+            check(word);
+            break;
+        case 1:
+            context.match_text(word, ";x\n");
+            check(word);
+            break;
+        case 2:
+            context.match_text(word, "abcdefg\n");
+            check(word);
+            break;
+        case 3: {
+            size_t ofs = context.get_offset();
+            context.match_whitespace();
+            check(text.substr(ofs, context.get_offset() - ofs));
+            if (context) check(string(1, *context++));
+            break;
+        }
+        }
+    }
+
+    BOOST_CHECK(reference.eof());
+}
+
+BOOST_AUTO_TEST_CASE( test_block_scanning )
+{
+    string text;
+    const char * pieces[] = { "hello", ",", ";", "\n", " ", "\t", "x",
+                              "a long run of text with no delimiters in it",
+                              "            ", "\n\n\n" };
+    for (unsigned i = 0;  i < 2000;  ++i)
+        text += pieces[random() % (sizeof(pieces) / sizeof(pieces[0]))];
+
+    for (int chunk_size: { 1, 3, 15, 16, 17, 31, 32, 33, 1000, 100000 })
+        test_block_scanning_size(text, chunk_size);
+}
+
+/* Embedded NULs are ordinary text unless they are given as a delimiter. */
+BOOST_AUTO_TEST_CASE( test_match_text_embedded_nul )
+{
+    string text("ab\0cd\0ex;fg\0", 12);
+
+    for (int chunk_size: { 1, 3, 16, 32, 100 }) {
+        istringstream stream(text);
+        Parse_Context context("test", stream, 1, 1, chunk_size);
+
+        string word;
+        BOOST_CHECK(context.match_text(word, "x"));
+        BOOST_CHECK_EQUAL(word, string("ab\0cd\0e", 7));
+        BOOST_CHECK(context.match_literal('x'));
+
+        BOOST_CHECK(context.match_text(word, ";"));
+        BOOST_CHECK_EQUAL(word, "");
+        BOOST_CHECK(context.match_literal(';'));
+
+        BOOST_CHECK(context.match_text
+                    (word, Parse_Context::Matches_Any_Char('q', '\0')));
+        BOOST_CHECK_EQUAL(word, "fg");
+        BOOST_CHECK(context.match_literal('\0'));
+        BOOST_CHECK(context.eof());
+    }
+
+    Parse_Context context("test", text.c_str(), text.c_str() + text.size());
+    string word;
+    BOOST_CHECK(context.match_text
+                (word, Parse_Context::Matches_Any_Char(';', 'z', 'x')));
+    BOOST_CHECK_EQUAL(word, string("ab\0cd\0e", 7));
+}
+
 BOOST_AUTO_TEST_CASE( test_token )
 {
     string s = "aaabac";
@@ -6,6 +6,30 @@ $(eval $(call test,circular_buffer_test,arch,boost))
 $(eval $(call test,lightweight_hash_test,arch utils,boost))
 $(eval $(call test,filter_streams_test,arch utils boost_filesystem boost_system,boost))
 $(eval $(call test,csv_parsing_test,arch utils,boost))
+$(eval $(call test,csv_columns_test,arch utils,boost))
+$(eval $(call test,async_file_reader_test,utils arch pthread,boost))
+$(eval $(call test,parallel_compressor_test,utils worker_task arch boost_iostreams,boost))
+$(eval $(call test,zstd_lz4_filter_test,utils worker_task arch boost_iostreams zstd,boost))
+$(eval $(call test,compressed_block_index_test,utils worker_task arch boost_iostreams,boost))
 
 $(eval $(call test,worker_task_test,worker_task ACE arch boost_thread pthread,boost manual))
 $(eval $(call test,json_parsing_test,utils arch,boost))
+$(eval $(call test,json_index_test,utils arch,boost))
+$(eval $(call test,worker_task_scaling_test,worker_task arch,boost manual))
+$(eval $(call test,worker_task_alloc_test,worker_task arch,boost manual))
+$(eval $(call test,map_reduce_test,worker_task arch boost_thread,boost))
+$(eval $(call test,map_reduce_throughput_test,worker_task arch boost_thread,boost manual))
+$(eval $(call test,parallel_ingest_test,worker_task utils arch boost_thread,boost))
+$(eval $(call test,lightweight_hash_benchmark_test,arch utils,boost manual))
+$(eval $(call test,concurrent_lightweight_hash_test,arch boost_thread,boost))
+$(eval $(call test,concurrent_lightweight_hash_benchmark_test,arch utils boost_thread,boost manual))
+$(eval $(call test,parse_context_ingest_test,utils arch,boost manual))
+$(eval $(call test,json_number_benchmark_test,utils arch,boost manual))
+$(eval $(call test,json_event_reader_benchmark_test,utils arch,boost manual))
+$(eval $(call test,json_index_benchmark_test,utils arch,boost manual))
+$(eval $(call test,parallel_ingest_benchmark_test,worker_task utils arch boost_thread,boost manual))
+$(eval $(call test,csv_columns_benchmark_test,utils arch,boost manual))
+$(eval $(call test,file_read_buffer_benchmark_test,utils arch,boost manual))
+$(eval $(call test,async_file_reader_benchmark_test,utils arch,boost manual))
+$(eval $(call test,parallel_compressor_benchmark_test,utils worker_task arch,boost manual))
+$(eval $(call test,codec_benchmark_test,utils worker_task arch,boost manual))
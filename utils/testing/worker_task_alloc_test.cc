@@ -0,0 +1,222 @@
+/* worker_task_alloc_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Microbenchmark for the job submission path of the worker task: reports
+   the number of jobs per second and the number of heap allocations per
+   job, both for a job submitted as a std::function holding a bound functor
+   plus a formatted name, and through the allocation-free path that
+   do_group uses.  Both are measured on the current Worker_Task; this is not
+   a comparison against earlier versions of it.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <vector>
+#include <iostream>
+#include <new>
+#include <stdlib.h>
+#include <sched.h>
+
+#include "jml/utils/worker_task.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/atomic_ops.h"
+
+using namespace ML;
+using namespace std;
+
+
+/* Count every allocation made by the process. */
+size_t num_allocations = 0;
+
+void * operator new (size_t size)
+{
+    __sync_fetch_and_add(&num_allocations, 1);
+    void * result = malloc(size ? size : 1);
+    if (!result) throw std::bad_alloc();
+    return result;
+}
+
+void operator delete (void * mem) noexcept
+{
+    free(mem);
+}
+
+void operator delete (void * mem, size_t) noexcept
+{
+    free(mem);
+}
+
+const char * scheduler_name(Worker_Task::Scheduler scheduler)
+{
+    return scheduler == Worker_Task::SCHED_LIST ? "list" : "work stealing";
+}
+
+struct Result {
+    double jobs_per_second;
+    double allocs_per_job;
+};
+
+/** Submits the jobs one at a time as a std::function wrapping a bound
+    functor that's too big for its inline storage, with a name formatted
+    for each job.  Both the function and the name need a heap allocation
+    per job, but nothing else should. */
+Result run_function_style(Worker_Task & worker, int njobs)
+{
+    vector<int> done(njobs);
+    auto doWork = [&] (int i) { done[i] = 1; };
+
+    string jobName = "job ";
+
+    size_t allocs_before = num_allocations;
+    Timer timer;
+
+    int group = worker.get_group(NO_JOB, "group");
+    {
+        Call_Guard guard(std::bind(&Worker_Task::unlock_group,
+                                   &worker, group));
+        for (int i = 0;  i < njobs;  ++i)
+            worker.add(Job(std::bind<void>(doWork, i)),
+                       jobName + ML::format("%d", i),
+                       group);
+    }
+    worker.run_until_finished(group);
+
+    Result result;
+    result.jobs_per_second = njobs / timer.elapsed_wall();
+    result.allocs_per_job
+        = 1.0 * (num_allocations - allocs_before) / njobs;
+    return result;
+}
+
+/** Submits the jobs through do_group, which uses inline callables and
+    lazily formatted names. */
+Result run_do_group_style(Worker_Task & worker, int njobs)
+{
+    vector<int> done(njobs);
+    auto doWork = [&] (int i) { done[i] = 1; };
+
+    size_t allocs_before = num_allocations;
+    Timer timer;
+
+    worker.do_group(0, njobs, doWork, -1, "group", "job ");
+
+    Result result;
+    result.jobs_per_second = njobs / timer.elapsed_wall();
+    result.allocs_per_job
+        = 1.0 * (num_allocations - allocs_before) / njobs;
+    return result;
+}
+
+/** Grow the node pool and queues to hold njobs at once.  The jobs wait
+    until they have all been submitted, so that the worker threads can't
+    keep the queue shorter than it will be while we are measuring. */
+void warm_up(Worker_Task & worker, int njobs)
+{
+    volatile bool submitted = false;
+    auto doWait = [&] (int) { while (!submitted) sched_yield(); };
+
+    int group = worker.get_group(NO_JOB, "warm up");
+    for (int i = 0;  i < njobs;  ++i)
+        worker.add([&doWait, i] () { doWait(i); }, "", group);
+    submitted = true;
+    worker.unlock_group(group);
+    worker.run_until_finished(group);
+}
+
+BOOST_AUTO_TEST_CASE( test_small_job_inline )
+{
+    int x = 0;
+    Small_Job job1([&] () { ++x; });
+    BOOST_CHECK(job1.is_inline());
+    job1();
+    BOOST_CHECK_EQUAL(x, 1);
+
+    Small_Job job2 = job1;
+    job2();
+    BOOST_CHECK_EQUAL(x, 2);
+
+    Small_Job job3(std::move(job2));
+    BOOST_CHECK(!job2);
+    job3();
+    BOOST_CHECK_EQUAL(x, 3);
+
+    // Too big to go inline
+    char big[Small_Job::INLINE_SIZE * 2] = { 1 };
+    Small_Job job4([=, &x] () { x += big[0]; });
+    BOOST_CHECK(!job4.is_inline());
+    Small_Job job5 = job4;
+    job4 = Small_Job();
+    job5();
+    BOOST_CHECK_EQUAL(x, 4);
+
+    BOOST_CHECK(!Small_Job(NO_JOB));
+}
+
+BOOST_AUTO_TEST_CASE( test_job_name )
+{
+    string prefix = "job ";
+    BOOST_CHECK_EQUAL(Job_Name(&prefix, 10).str(), "job 10");
+    BOOST_CHECK_EQUAL(Job_Name("hello").str(), "hello");
+}
+
+/* A callable too big to go inline is allocated once when the Small_Job is
+   made; queueing and running the job must move it rather than copy it. */
+BOOST_AUTO_TEST_CASE( test_heap_job_not_copied )
+{
+    Worker_Task::Scheduler schedulers[2]
+        = { Worker_Task::SCHED_LIST, Worker_Task::SCHED_WORK_STEALING };
+
+    int njobs = 10000;
+
+    for (auto scheduler: schedulers) {
+        Worker_Task worker(0, scheduler);
+
+        int total = 0;
+        char big[Small_Job::INLINE_SIZE * 2] = { 1 };
+
+        warm_up(worker, njobs);
+
+        int group = worker.get_group(NO_JOB, "group");
+        size_t allocs_before = num_allocations;
+        for (int i = 0;  i < njobs;  ++i)
+            worker.add(Small_Job([=, &total] () { total += big[0]; }),
+                       "", group);
+        size_t allocs = num_allocations - allocs_before;
+        worker.unlock_group(group);
+        worker.run_until_finished(group);
+
+        BOOST_CHECK_EQUAL(total, njobs);
+        BOOST_CHECK_EQUAL(allocs, njobs);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_submission_allocations )
+{
+    Worker_Task::Scheduler schedulers[2]
+        = { Worker_Task::SCHED_LIST, Worker_Task::SCHED_WORK_STEALING };
+
+    int njobs = 200000;
+
+    for (auto scheduler: schedulers) {
+        for (int nthreads: { 1, 4 }) {
+            Worker_Task worker(nthreads - 1, scheduler);
+
+            warm_up(worker, njobs);
+
+            Result function = run_function_style(worker, njobs);
+            Result do_group = run_do_group_style(worker, njobs);
+
+            cerr << format("%-14s %d threads: std::function %10.0f jobs/sec "
+                           "%5.2f allocs/job; do_group %10.0f jobs/sec "
+                           "%5.2f allocs/job",
+                           scheduler_name(scheduler), nthreads,
+                           function.jobs_per_second, function.allocs_per_job,
+                           do_group.jobs_per_second, do_group.allocs_per_job)
+                 << endl;
+
+            BOOST_CHECK_LT(do_group.allocs_per_job, 0.1);
+        }
+    }
+}
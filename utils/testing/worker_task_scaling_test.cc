@@ -0,0 +1,156 @@
+/* worker_task_scaling_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Scaling benchmark for the worker task schedulers: fans out lots of tiny
+   jobs at 1..N threads with both the list and the work stealing backends,
+   and compares fixed and guided chunking on workloads with skewed costs.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <vector>
+#include <iostream>
+
+#include "jml/utils/worker_task.h"
+#include "jml/arch/timers.h"
+#include "jml/arch/atomic_ops.h"
+#include "jml/arch/cpu_info.h"
+
+using namespace ML;
+using namespace std;
+
+const char * scheduler_name(Worker_Task::Scheduler scheduler)
+{
+    return scheduler == Worker_Task::SCHED_LIST ? "list" : "work stealing";
+}
+
+/** Runs njobs jobs that each do the given amount of busy work, and returns
+    the number of jobs per second achieved. */
+double run_fan_out(Worker_Task::Scheduler scheduler, int nthreads,
+                   int njobs, int work_per_job)
+{
+    Worker_Task worker(nthreads - 1, scheduler);
+
+    vector<double> results(njobs);
+
+    auto doJob = [&] (int i)
+        {
+            double x = i;
+            for (int j = 0;  j < work_per_job;  ++j)
+                x = x * 0.999 + 1.0;
+            results[i] = x;
+        };
+
+    Timer timer;
+    worker.do_group(0, njobs, doJob);
+    double elapsed = timer.elapsed_wall();
+
+    return njobs / elapsed;
+}
+
+/** As above, but through run_in_parallel_blocked. */
+double run_blocked(Worker_Task::Scheduler scheduler, int nthreads,
+                   int njobs)
+{
+    Worker_Task worker(nthreads - 1, scheduler);
+
+    int total = 0;
+    vector<int> items(njobs, 1);
+
+    auto doItem = [&] (vector<int>::iterator it) { atomic_add(total, *it); };
+
+    Timer timer;
+    run_in_parallel_blocked(items.begin(), items.end(), doItem,
+                            -1, "", "", worker);
+    double elapsed = timer.elapsed_wall();
+
+    BOOST_CHECK_EQUAL(total, njobs);
+
+    return njobs / elapsed;
+}
+
+BOOST_AUTO_TEST_CASE( test_scaling )
+{
+    int max_threads = num_cpus();
+
+    Worker_Task::Scheduler schedulers[2]
+        = { Worker_Task::SCHED_LIST, Worker_Task::SCHED_WORK_STEALING };
+
+    for (int work: { 0, 100, 10000 }) {
+        cerr << "fan out of tiny jobs with " << work << " work units"
+             << endl;
+        for (int nthreads = 1;  nthreads <= max_threads;  nthreads *= 2) {
+            for (auto scheduler: schedulers) {
+                double rate = run_fan_out(scheduler, nthreads, 100000, work);
+                cerr << format("  %3d threads %-14s %12.0f jobs/sec",
+                               nthreads, scheduler_name(scheduler), rate)
+                     << endl;
+            }
+        }
+    }
+
+    cerr << "run_in_parallel_blocked" << endl;
+    for (int nthreads = 1;  nthreads <= max_threads;  nthreads *= 2) {
+        for (auto scheduler: schedulers) {
+            double rate = run_blocked(scheduler, nthreads, 10000000);
+            cerr << format("  %3d threads %-14s %12.0f items/sec",
+                           nthreads, scheduler_name(scheduler), rate)
+                 << endl;
+        }
+    }
+}
+
+/** Busy work whose cost depends on the item.  Returns something so that
+    the compiler can't optimize it away. */
+double skewed_work(size_t cost)
+{
+    double x = cost;
+    for (size_t j = 0;  j < cost;  ++j)
+        x = x * 0.999 + 1.0;
+    return x;
+}
+
+BOOST_AUTO_TEST_CASE( test_skewed_chunking )
+{
+    int max_threads = num_cpus();
+    size_t n = 1000000;
+
+    // The cost per item varies by 100x: either a contiguous block of
+    // expensive items at the end of the range (worst case for a fixed
+    // split), or expensive items scattered at random.
+    vector<size_t> tail_costs(n, 10), random_costs(n, 10);
+    for (size_t i = n - n / 10;  i < n;  ++i)
+        tail_costs[i] = 1000;
+    for (size_t i = 0;  i < n;  ++i)
+        if (random() % 10 == 0) random_costs[i] = 1000;
+
+    vector<double> results(n);
+
+    for (auto costs: { &tail_costs, &random_costs }) {
+        cerr << (costs == &tail_costs ? "expensive tail" : "random expensive")
+             << endl;
+
+        for (int nthreads = 1;  nthreads <= max_threads;  nthreads *= 2) {
+            Worker_Task worker(nthreads - 1);
+
+            auto doItem = [&] (size_t i)
+                {
+                    results[i] = skewed_work((*costs)[i]);
+                };
+
+            Timer timer;
+            run_in_parallel_blocked(size_t(0), n, doItem, -1, "", "", worker);
+            double blocked = timer.elapsed_wall();
+
+            timer.restart();
+            run_in_parallel_guided(size_t(0), n, doItem, -1, "", "", worker);
+            double guided = timer.elapsed_wall();
+
+            cerr << format("  %3d threads blocked %8.3fs guided %8.3fs",
+                           nthreads, blocked, guided)
+                 << endl;
+        }
+    }
+}
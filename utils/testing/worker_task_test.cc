@@ -94,9 +94,11 @@ void null_job()
 }
 
 void test_overhead_job(int nthreads, int ntasks, bool verbose = true,
-                       void (&job) () = null_job)
+                       void (&job) () = null_job,
+                       Worker_Task::Scheduler scheduler
+                           = Worker_Task::SCHED_LIST)
 {
-    Worker_Task worker(nthreads - 1);
+    Worker_Task worker(nthreads - 1, scheduler);
     
     /* We submit 1 million do-nothing tasks, and look at how long it takes
        to do them all */
@@ -157,3 +159,266 @@ BOOST_AUTO_TEST_CASE( test_exception )
     }
 }
 
+
+BOOST_AUTO_TEST_CASE( test_work_stealing_overhead )
+{
+    int njobs = 100000;
+
+    for (int nthreads: { 1, 2, 4, 8, 16 })
+        test_overhead_job(nthreads, njobs, true /* verbose */, null_job,
+                          Worker_Task::SCHED_WORK_STEALING);
+}
+
+BOOST_AUTO_TEST_CASE( test_work_stealing_exception )
+{
+    int njobs = 1000;
+    set_trace_exceptions(false);
+    for (unsigned i = 0;  i < 100;  ++i) {
+        JML_TRACE_EXCEPTIONS(false);
+        BOOST_CHECK_THROW(test_overhead_job(4, njobs, false /* verbose */,
+                                            exception_job,
+                                            Worker_Task::SCHED_WORK_STEALING),
+                          std::exception);
+    }
+}
+
+/* Each outer job creates a subgroup of inner jobs and waits for it from
+   within the worker thread, which exercises nested groups and threads
+   lending themselves from inside a job. */
+void test_nested_groups(Worker_Task::Scheduler scheduler, int nthreads)
+{
+    Worker_Task worker(nthreads - 1, scheduler);
+
+    int nouter = 100, ninner = 100;
+    int total = 0, finished_groups = 0;
+
+    auto doOuter = [&] (int i)
+        {
+            auto onFinished = [&] () { atomic_inc(finished_groups); };
+            int group = worker.get_group(onFinished, "inner");
+            {
+                Call_Guard guard(boost::bind(&Worker_Task::unlock_group,
+                                             boost::ref(worker),
+                                             group));
+                for (int j = 0;  j < ninner;  ++j)
+                    worker.add([&] () { atomic_inc(total); }, "", group);
+            }
+            worker.run_until_finished(group);
+        };
+
+    worker.do_group(0, nouter, doOuter);
+
+    BOOST_CHECK_EQUAL(total, nouter * ninner);
+    BOOST_CHECK_EQUAL(finished_groups, nouter);
+}
+
+BOOST_AUTO_TEST_CASE( test_nested )
+{
+    for (int nthreads: { 1, 2, 8 }) {
+        test_nested_groups(Worker_Task::SCHED_LIST, nthreads);
+        test_nested_groups(Worker_Task::SCHED_WORK_STEALING, nthreads);
+    }
+}
+
+/* A thread waiting for a group under work stealing must only run jobs of
+   that group or its subgroups, never unrelated jobs that happen to be
+   queued. */
+BOOST_AUTO_TEST_CASE( test_work_stealing_waits_in_group )
+{
+    Worker_Task worker(0, Worker_Task::SCHED_WORK_STEALING);
+
+    int ran_group = 0, ran_unrelated = 0;
+
+    int unrelated = worker.get_group(NO_JOB, "unrelated");
+    worker.add([&] () { ++ran_unrelated; }, "", unrelated);
+    worker.unlock_group(unrelated);
+
+    worker.add([&] () { ++ran_unrelated; }, "");
+
+    int group = worker.get_group(NO_JOB, "group");
+    int subgroup = worker.get_group(NO_JOB, "subgroup", group);
+    worker.add([&] () { ++ran_group; }, "", group);
+    worker.add([&] () { ++ran_group; }, "", subgroup);
+    worker.unlock_group(subgroup);
+    worker.unlock_group(group);
+
+    worker.run_until_finished(group);
+
+    BOOST_CHECK_EQUAL(ran_group, 2);
+    BOOST_CHECK_EQUAL(ran_unrelated, 0);
+    BOOST_CHECK_EQUAL(worker.queued(), 2);
+
+    worker.run_until_finished(unrelated);
+    while (worker.queued() > 0)
+        worker.lend_thread(-1);
+
+    BOOST_CHECK_EQUAL(ran_unrelated, 2);
+}
+
+/* The same goes for a thread waiting for a group that had an error, while
+   it waits for the group's cancelled jobs to be skipped. */
+BOOST_AUTO_TEST_CASE( test_work_stealing_error_waits_in_group )
+{
+    Worker_Task worker(0, Worker_Task::SCHED_WORK_STEALING);
+
+    int ran_group = 0, ran_unrelated = 0;
+
+    int group = worker.get_group(NO_JOB, "group");
+    int subgroup = worker.get_group(NO_JOB, "subgroup", group);
+    auto throwJob = [&] ()
+        {
+            ++ran_group;
+            throw Exception("there was an exception");
+        };
+    for (unsigned i = 0;  i < 3;  ++i) {
+        worker.add(throwJob, "", group);
+        worker.add(throwJob, "", subgroup);
+    }
+    worker.unlock_group(subgroup);
+    worker.unlock_group(group);
+
+    // Queued after the group's jobs, so they'd be the first to be taken
+    int unrelated = worker.get_group(NO_JOB, "unrelated");
+    worker.add([&] () { ++ran_unrelated; }, "", unrelated);
+    worker.unlock_group(unrelated);
+
+    worker.add([&] () { ++ran_unrelated; }, "");
+
+    JML_TRACE_EXCEPTIONS(false);
+    BOOST_CHECK_THROW(worker.run_until_finished(group), std::exception);
+
+    // Some of the group's jobs were cancelled rather than run
+    BOOST_CHECK_LT(ran_group, 6);
+    BOOST_CHECK_EQUAL(ran_unrelated, 0);
+    BOOST_CHECK_EQUAL(worker.queued(), 2);
+
+    worker.run_until_finished(unrelated);
+    while (worker.queued() > 0)
+        worker.lend_thread(-1);
+
+    BOOST_CHECK_EQUAL(ran_unrelated, 2);
+}
+
+/** An iterator that can't be copied once it gets to throwAt, so that
+    do_group() fails partway through adding its jobs. */
+struct Throwing_Iterator {
+    Throwing_Iterator(int i, int throwAt)
+        : i(i), throwAt(throwAt)
+    {
+    }
+
+    Throwing_Iterator(const Throwing_Iterator & other)
+        : i(other.i), throwAt(other.throwAt)
+    {
+        if (i == throwAt)
+            throw Exception("couldn't copy iterator");
+    }
+
+    Throwing_Iterator & operator ++ () { ++i;  return *this; }
+
+    bool operator != (int last) const { return i != last; }
+
+    int i, throwAt;
+};
+
+/* The jobs that were added before do_group() failed refer to its arguments,
+   so they have to have been run before the exception gets out of it. */
+BOOST_AUTO_TEST_CASE( test_do_group_add_exception )
+{
+    for (auto scheduler: { Worker_Task::SCHED_LIST,
+                           Worker_Task::SCHED_WORK_STEALING }) {
+        for (int nthreads: { 1, 4 }) {
+            Worker_Task worker(nthreads - 1, scheduler);
+            int processed = 0;
+
+            auto doItem = [&] (const Throwing_Iterator & it)
+                {
+                    atomic_inc(processed);
+                };
+
+            BOOST_CHECK_THROW(worker.do_group(Throwing_Iterator(0, 10), 100,
+                                              doItem),
+                              std::exception);
+            BOOST_CHECK_EQUAL(processed, 10);
+        }
+    }
+}
+
+/* Check that each element of the range is processed exactly once, with
+   indexes above 2^32 so that any truncation to int shows up. */
+template<typename RunFn>
+void test_each_once(RunFn run, size_t n, Worker_Task & worker)
+{
+    size_t first = (1ULL << 32) + 17;
+    vector<int> counts(n);
+
+    auto doItem = [&] (size_t i) { atomic_inc(counts.at(i - first)); };
+
+    run(first, first + n, doItem, worker);
+
+    size_t wrong = 0;
+    for (size_t i = 0;  i < n;  ++i)
+        wrong += counts[i] != 1;
+
+    BOOST_CHECK_EQUAL(wrong, 0);
+}
+
+BOOST_AUTO_TEST_CASE( test_run_in_parallel_ranges )
+{
+    auto blocked = [] (size_t first, size_t last,
+                       std::function<void (size_t)> doItem,
+                       Worker_Task & worker)
+        {
+            run_in_parallel_blocked(first, last, doItem, -1, "", "", worker);
+        };
+
+    auto guided = [] (size_t first, size_t last,
+                      std::function<void (size_t)> doItem,
+                      Worker_Task & worker)
+        {
+            run_in_parallel_guided(first, last, doItem, -1, "", "", worker);
+        };
+
+    auto guided_min = [] (size_t first, size_t last,
+                          std::function<void (size_t)> doItem,
+                          Worker_Task & worker)
+        {
+            run_in_parallel_guided(first, last, doItem, -1, "", "", worker,
+                                   100 /* min chunk */);
+        };
+
+    for (int nthreads: { 1, 4 }) {
+        Worker_Task worker(nthreads - 1);
+        for (size_t n: { 0, 1, 7, 1000, 1000003 }) {
+            test_each_once(blocked, n, worker);
+            test_each_once(guided, n, worker);
+            test_each_once(guided_min, n, worker);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_run_in_parallel_guided_exception )
+{
+    Worker_Task worker(3);
+    int n = 10000;
+    int processed = 0;
+
+    // Each item is slow, so that the exception early in the first chunk
+    // happens long before the other runners get through theirs
+    auto doItem = [&] (int i)
+        {
+            if (i == 10)
+                throw Exception("there was an exception");
+            ML::sleep(0.00005);
+            atomic_inc(processed);
+        };
+
+    JML_TRACE_EXCEPTIONS(false);
+    BOOST_CHECK_THROW(run_in_parallel_guided(0, n, doItem,
+                                             -1, "", "", worker),
+                      std::exception);
+
+    // The runners finish the chunks they had already claimed, which are
+    // each an eighth of what was left, but don't claim any more
+    BOOST_CHECK_LT(processed, n / 2);
+}
@@ -0,0 +1,331 @@
+/* zstd_lz4_filter_test.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Tests for the zstd and lz4 filters, and for how filter_istream
+   recognizes compressed files.
+*/
+
+#define BOOST_TEST_MAIN
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/bind.hpp>
+#include <fstream>
+#include <zdict.h>
+
+#include "jml/utils/zstd_filter.h"
+#include "jml/utils/lz4_filter.h"
+#include "jml/utils/parallel_compressor.h"
+#include "jml/utils/filter_streams.h"
+#include "jml/utils/worker_task.h"
+#include "jml/utils/file_functions.h"
+#include "jml/utils/guard.h"
+#include "jml/arch/exception_handler.h"
+#include "jml/arch/format.h"
+
+using namespace std;
+using namespace ML;
+
+string make_text(unsigned lines)
+{
+    string result;
+    for (unsigned i = 0;  i < lines;  ++i)
+        result += format("line %d of the text, %d\n", i, i * i % 1013);
+    return result;
+}
+
+/** Read until the end.  Unlike copying the rdbuf(), errors from the
+    decompressor get through. */
+string read_all(istream & stream)
+{
+    string result;
+    char buf[1000];
+    while (stream) {
+        stream.read(buf, sizeof(buf));
+        result.append(buf, stream.gcount());
+    }
+    return result;
+}
+
+template<typename Filter>
+string compress(const string & text, const Filter & filter,
+                size_t writeSize = 777)
+{
+    string result;
+    {
+        boost::iostreams::filtering_ostream stream;
+        stream.push(filter);
+        stream.push(boost::iostreams::back_inserter(result));
+        for (size_t i = 0;  i < text.size();  i += writeSize)
+            stream.write(text.c_str() + i,
+                         std::min(writeSize, text.size() - i));
+    }
+    return result;
+}
+
+template<typename Filter>
+string decompress(const string & compressed, const Filter & filter)
+{
+    boost::iostreams::filtering_istream stream;
+    stream.push(filter);
+    stream.push(boost::iostreams::array_source(compressed.data(),
+                                               compressed.size()));
+    stream.exceptions(ios::badbit);
+    return read_all(stream);
+}
+
+string read_file(const string & filename,
+                 const string & compression = "",
+                 int threads = 1)
+{
+    filter_istream stream(filename, ios::in, compression, threads);
+    return read_all(stream);
+}
+
+void write_file(const string & filename, const string & contents)
+{
+    ofstream stream(filename.c_str());
+    stream << contents;
+}
+
+/** Streambuf over a string that can't seek, like a pipe. */
+struct Unseekable_Buf : public std::streambuf {
+    Unseekable_Buf(string contents)
+        : contents(std::move(contents))
+    {
+        char * p = &this->contents[0];
+        setg(p, p, p + this->contents.size());
+    }
+
+    string contents;
+};
+
+BOOST_AUTO_TEST_CASE( test_round_trip )
+{
+    string text = make_text(20000);
+
+    for (string ext: { ".zst", ".lz4" }) {
+        for (int level: { -1, 1, 9 }) {
+            for (string contents: { text, string(), string("x") }) {
+                string filename = "zstd_lz4_filter_test" + ext;
+                Call_Guard guard(boost::bind(&delete_file, filename));
+                {
+                    filter_ostream stream(filename, ios::out, "", level);
+                    stream << contents;
+                }
+                BOOST_CHECK(get_file_size(filename) > 0);
+                BOOST_CHECK(read_file(filename) == contents);
+            }
+        }
+    }
+
+    // Several frames one after the other read as their concatenation
+    string twice = compress(text, zstd_compressor())
+        + compress(text, zstd_compressor());
+    BOOST_CHECK(decompress(twice, zstd_decompressor()) == text + text);
+
+    twice = compress(text, lz4_compressor())
+        + compress(text, lz4_compressor());
+    BOOST_CHECK(decompress(twice, lz4_decompressor()) == text + text);
+}
+
+BOOST_AUTO_TEST_CASE( test_parallel_frames )
+{
+    string text = make_text(50000);
+    Worker_Task worker(2);
+
+    for (auto type: { parallel_compressor::ZSTD, parallel_compressor::LZ4 }) {
+        string ext = (type == parallel_compressor::ZSTD ? ".zst" : ".lz4");
+
+        for (size_t blockSize: { 1000, 65536, 1 << 22 }) {
+            parallel_compressor::Options options(type);
+            options.blockSize = blockSize;
+            options.maxBlocks = 3;
+            options.worker = &worker;
+
+            string filename = "zstd_lz4_filter_test_parallel" + ext;
+            Call_Guard guard(boost::bind(&delete_file, filename));
+            write_file(filename, compress(text, parallel_compressor(options)));
+
+            for (int threads: { 1, 0, 3 })
+                BOOST_CHECK(read_file(filename, "", threads) == text);
+        }
+    }
+
+    // And through filter_ostream
+    for (string ext: { ".zst", ".lz4" }) {
+        string filename = "zstd_lz4_filter_test_stream" + ext;
+        Call_Guard guard(boost::bind(&delete_file, filename));
+        {
+            filter_ostream stream(filename, ios::out, "", -1, 4);
+            stream << text;
+        }
+        BOOST_CHECK(read_file(filename, "", 4) == text);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_parallel_decompress_falls_back )
+{
+    string text = make_text(50000);
+    Worker_Task worker(2);
+
+    parallel_compressor::Options smallFrames(parallel_compressor::ZSTD);
+    smallFrames.blockSize = 5000;
+    smallFrames.worker = &worker;
+
+    // Small frames, then one that is too big to buffer, then small again
+    string compressed = compress(text, parallel_compressor(smallFrames))
+        + compress(text, zstd_compressor())
+        + compress(text, parallel_compressor(smallFrames));
+
+    zstd_decompressor::Options options(3);
+    options.maxBuffered = 20000;
+    options.worker = &worker;
+
+    BOOST_CHECK(decompress(compressed, zstd_decompressor(options))
+                == text + text + text);
+
+    // With room to buffer them all, every frame is done in parallel
+    options.maxBuffered = 1 << 20;
+    BOOST_CHECK(decompress(compressed, zstd_decompressor(options))
+                == text + text + text);
+}
+
+BOOST_AUTO_TEST_CASE( test_dictionary )
+{
+    JML_TRACE_EXCEPTIONS(false);
+
+    // Lots of small similar records, which is where a dictionary helps
+    string samples;
+    vector<size_t> sizes;
+    for (unsigned i = 0;  i < 2000;  ++i) {
+        string record = format("{\"id\":%d,\"user\":\"u%d\",\"status\":%d,"
+                               "\"url\":\"/page/%d\"}",
+                               i, i * 7919 % 1009, i % 7 ? 200 : 404,
+                               i * 31 % 97);
+        samples += record;
+        sizes.push_back(record.size());
+    }
+
+    string dictionary(4096, 0);
+    size_t res = ZDICT_trainFromBuffer(&dictionary[0], dictionary.size(),
+                                       samples.data(), &sizes[0],
+                                       sizes.size());
+    BOOST_REQUIRE(!ZDICT_isError(res));
+    dictionary.resize(res);
+
+    string record = "{\"id\":12345,\"user\":\"u321\",\"status\":200,"
+        "\"url\":\"/page/42\"}";
+
+    zstd_compressor::Options options;
+    options.dictionary = dictionary;
+    string withDictionary = compress(record, zstd_compressor(options));
+    string without = compress(record, zstd_compressor());
+    BOOST_CHECK_LT(withDictionary.size(), without.size());
+
+    // Can't be read until the dictionary is known
+    BOOST_CHECK_THROW(decompress(withDictionary, zstd_decompressor()),
+                      std::exception);
+
+    unsigned id = registerZstdDictionary(dictionary);
+    BOOST_CHECK_NE(id, 0);
+    BOOST_CHECK_EQUAL(registerZstdDictionary(dictionary), id);
+
+    BOOST_CHECK_EQUAL(decompress(withDictionary, zstd_decompressor()),
+                      record);
+    BOOST_CHECK_EQUAL(decompress(without + withDictionary + without,
+                                 zstd_decompressor()),
+                      record + record + record);
+
+    zstd_decompressor::Options parallel(0);
+    BOOST_CHECK_EQUAL(decompress(withDictionary + without,
+                                 zstd_decompressor(parallel)),
+                      record + record);
+
+    BOOST_CHECK_THROW(registerZstdDictionary("not a dictionary"),
+                      std::exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_detect_compression )
+{
+    string text = make_text(5000);
+    string filename = "zstd_lz4_filter_test.dat";
+    Call_Guard guard(boost::bind(&delete_file, filename));
+
+    for (string compression: { "gz", "bz2", "xz", "zst", "lz4" }) {
+        {
+            filter_ostream stream(filename, ios::out, compression);
+            stream << text;
+        }
+        BOOST_CHECK(read_file(filename, "auto") == text);
+
+        // Only if it's asked to
+        File_Read_Buffer buf(filename);
+        string compressed(buf.start(), buf.end());
+        BOOST_CHECK(read_file(filename) == compressed);
+        BOOST_CHECK(read_file(filename, "none") == compressed);
+
+        // Streams that can't seek get back what was looked at
+        Unseekable_Buf source(compressed);
+        filter_istream stream;
+        stream.openFromStreambuf(&source, false, "", "auto");
+        BOOST_CHECK(read_all(stream) == text);
+    }
+
+    // Anything else, however short, comes through untouched
+    for (string contents: { text, string(), string("BZ"), string("BZhx"),
+                            string("\x1f", 1), string("\x28\xb5\x2f") }) {
+        write_file(filename, contents);
+        BOOST_CHECK(read_file(filename, "auto") == contents);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( test_truncated )
+{
+    JML_TRACE_EXCEPTIONS(false);
+
+    string text = make_text(20000);
+
+    string zst = compress(text, zstd_compressor());
+    string lz4 = compress(text, lz4_compressor());
+
+    for (size_t keep: { size_t(3), zst.size() / 2, zst.size() - 1 }) {
+        BOOST_CHECK_THROW(decompress(zst.substr(0, keep),
+                                     zstd_decompressor()),
+                          std::exception);
+        BOOST_CHECK_THROW(decompress(zst.substr(0, keep),
+                                     zstd_decompressor(3)),
+                          std::exception);
+    }
+
+    for (size_t keep: { size_t(3), lz4.size() / 2, lz4.size() - 1 })
+        BOOST_CHECK_THROW(decompress(lz4.substr(0, keep), lz4_decompressor()),
+                          std::exception);
+
+    BOOST_CHECK_THROW(decompress(string("not compressed at all"),
+                                 zstd_decompressor()),
+                      std::exception);
+    BOOST_CHECK_THROW(decompress(string("not compressed at all"),
+                                 lz4_decompressor()),
+                      std::exception);
+}
+
+BOOST_AUTO_TEST_CASE( test_errors )
+{
+    JML_TRACE_EXCEPTIONS(false);
+
+    BOOST_CHECK_THROW(zstd_compressor(1000), std::exception);
+    BOOST_CHECK_THROW(lz4_compressor(1000), std::exception);
+    BOOST_CHECK_THROW(lz4_compressor(-2), std::exception);
+    BOOST_CHECK_THROW(parallel_compressor
+                          (parallel_compressor::Options
+                               (parallel_compressor::ZSTD, 1000)),
+                      std::exception);
+    BOOST_CHECK_THROW(parallel_compressor
+                          (parallel_compressor::Options
+                               (parallel_compressor::LZ4, 1000)),
+                      std::exception);
+}
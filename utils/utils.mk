@@ -6,23 +6,31 @@ LIBUTILS_SOURCES := \
         parse_context.cc \
 	configuration.cc \
 	csv.cc \
+	csv_columns.cc \
 	exc_check.cc \
 	exc_assert.cc \
 	hex_dump.cc \
 	lzma.cc \
 	floating_point.cc \
 	json_parsing.cc \
+	json_index.cc \
+	parallel_ingest.cc \
+	async_file_reader.cc \
+	parallel_compressor.cc \
+	zstd_filter.cc \
+	lz4_filter.cc \
+	compressed_block_index.cc \
 	rng.cc \
 	hash.cc \
 	abort.cc
 
-LIBUTILS_LINK :=	ACE arch boost_iostreams lzma boost_thread cryptopp
-
-$(eval $(call library,utils,$(LIBUTILS_SOURCES),$(LIBUTILS_LINK)))
-
 LIBWORKER_TASK_SOURCES := worker_task.cc
 LIBWORKER_TASK_LINK    := ACE arch pthread
 
 $(eval $(call library,worker_task,$(LIBWORKER_TASK_SOURCES),$(LIBWORKER_TASK_LINK)))
 
+LIBUTILS_LINK :=	ACE arch boost_iostreams lzma z zstd lz4 boost_thread cryptopp worker_task
+
+$(eval $(call library,utils,$(LIBUTILS_SOURCES),$(LIBUTILS_LINK)))
+
 $(eval $(call include_sub_make,utils_testing,testing))
@@ -38,6 +38,20 @@ int num_threads()
 
 const Job NO_JOB;
 
+namespace {
+
+/** Work queue of the calling thread, if it is a worker thread of a work
+    stealing Worker_Task. */
+__thread const Worker_Task * current_task = 0;
+__thread int current_task_queue = -1;
+
+/** Stands in for a job that was cancelled while it was queued. */
+void skip_cancelled_job()
+{
+}
+
+} // file scope
+
 
 /*****************************************************************************/
 /* WORKER_TASK                                                               */
@@ -52,10 +66,13 @@ instance(int thr)
 }
 
 Worker_Task::
-Worker_Task(int threads)
-    : jobs_sem(0), finished_sem(1), state_change_sem(0), shutdown_sem(0),
-      next_group(0), next_job(0), num_queued(0),
-      num_running(0), force_finished(false)
+Worker_Task(int threads, Scheduler scheduler)
+    : scheduler_(scheduler),
+      jobs_sem(0), finished_sem(1), state_change_sem(0), shutdown_sem(0),
+      jobs(Pool_Allocator<Job_Info>(&job_pool)),
+      next_group(0), next_job(0), num_queued(0), num_running(0),
+      num_outstanding(0), num_sleepers(0),
+      force_finished(false)
 {
     if (threads == -1)
         threads = num_cpus();
@@ -64,9 +81,22 @@ Worker_Task(int threads)
 
     //cerr << "creating worker task with " << threads << " threads" << endl;
 
+    if (scheduler_ == SCHED_WORK_STEALING) {
+        /* One per worker thread, plus one for outside threads */
+        for (int i = 0;  i <= threads;  ++i)
+            queues.emplace_back(new Work_Queue());
+    }
+
     /* Create our threads */
-    for (unsigned i = 0;  i < threads;  ++i)
-        workerThreads_.emplace_back(new std::thread(std::bind(&Worker_Task::runWorkerThread, this)));
+    for (unsigned i = 0;  i < threads;  ++i) {
+        auto run = [=] ()
+            {
+                current_task = this;
+                current_task_queue = i;
+                this->runWorkerThread();
+            };
+        workerThreads_.emplace_back(new std::thread(run));
+    }
 }
 
 Worker_Task::~Worker_Task()
@@ -79,8 +109,9 @@ Worker_Task::~Worker_Task()
         jobs_sem.release();
 
     /* TODO: finish all tasks */
-    if (jobs.size() || groups.size())
-        cerr << "at the end, there were " << jobs.size()
+    size_t njobs = (scheduler_ == SCHED_LIST ? jobs.size() : num_queued);
+    if (njobs || groups.size())
+        cerr << "at the end, there were " << njobs
              << " jobs outstanding and "
              << groups.size() << " groups outstanding" << endl;
 
@@ -111,9 +142,22 @@ get_group(const Job & group_finish, const std::string & info_str,
     groups[id].locked = locked;
     groups[id].info = info_str;
 
+    if (scheduler_ == SCHED_WORK_STEALING) {
+        /* No marker job is needed; the deques don't keep a global order. */
+        if (parent_group != -1) {
+            groups[id].parent = &groups[parent_group];
+            groups[parent_group].groups_outstanding += 1;
+        }
+        groups[id].group_job = jobs.end();
+
+        notify_state_changed();
+
+        return id;
+    }
+
     /* Add a job for the group.  This allows us to keep track of where the child
        jobs get inserted. */
-    Job_Info info(group_finish, Job(),
+    Job_Info info(group_finish, Small_Job(),
                   format("job for group %lld: ", id) + info_str, -1, id);
     
     Jobs::iterator where = jobs.end();
@@ -124,7 +168,7 @@ get_group(const Job & group_finish, const std::string & info_str,
         where = groups[parent_group].group_job;
     }
     
-    Jobs::iterator it = jobs.insert(where, info);
+    Jobs::iterator it = jobs.insert(where, std::move(info));
     groups[id].group_job = it;
     
     notify_state_changed();
@@ -146,11 +190,16 @@ void Worker_Task::unlock_group(int group)
 
 Worker_Task::Id
 Worker_Task::
-add(const Job & job, const Job & error, const std::string & job_info, Id group)
+add(Small_Job job, Small_Job error, const Job_Name & job_info, Id group)
 {
+    if (scheduler_ == SCHED_WORK_STEALING)
+        return add_ws(std::move(job), std::move(error), job_info, group);
+
     /* Wait to manupulate */
     Guard guard(lock);
-    Job_Info info(job, error, job_info, next_job++, group);
+    Job_Info info(std::move(job), std::move(error), job_info,
+                  next_job++, group);
+    Id id = info.id;
 
     /* Find where to put it. */
 
@@ -161,9 +210,10 @@ add(const Job & job, const Job & error, const std::string & job_info, Id group)
         Group_Info & group_info = groups[group];
         ++group_info.jobs_outstanding;
         
-        /* Jobs::iterator it = */ jobs.insert(group_info.group_job, info);
+        /* Jobs::iterator it = */
+        jobs.insert(group_info.group_job, std::move(info));
     }
-    else jobs.push_back(info);
+    else jobs.push_back(std::move(info));
     
     ++num_queued;
     
@@ -176,14 +226,14 @@ add(const Job & job, const Job & error, const std::string & job_info, Id group)
 
     notify_state_changed();
     
-    return info.id;
+    return id;
 }
 
 Worker_Task::Id
 Worker_Task::
-add(const Job & job, const std::string & job_info, Id group)
+add(Small_Job job, const Job_Name & job_info, Id group)
 {
-    return add(job, Job(), job_info, group);
+    return add(std::move(job), Small_Job(), job_info, group);
 }
 
 void Worker_Task::finish_all()
@@ -319,7 +369,13 @@ void Worker_Task::run_until_released(Semaphore & sem, int group)
         }
 
         /* Wait for a state change. */
-        state_semaphore.acquire();
+        auto released = [&] ()
+            {
+                if (sem.tryacquire() == -1) return false;
+                sem.release();
+                return true;
+            };
+        wait_state_change(state_semaphore, released);
     }
     
     sem.release();
@@ -339,6 +395,11 @@ cancel_group_ul(Group_Info & group_info, int group)
 {
     //cerr << "thread " << ACE_OS::thr_self() << " cancel_group() "
     //     << group_info.info << endl;
+
+    /* The work stealing scheduler skips the queued jobs of a group with an
+       error as they are dequeued. */
+    if (scheduler_ == SCHED_WORK_STEALING)
+        return;
     
     /* We clean up the group by scanning through its list of tasks, removing
        those that haven't run yet, and calling all of the handlers. */
@@ -382,6 +443,38 @@ force_finish_group(Group_Info & group_info, int group)
     Call_Guard guard(boost::bind(&Worker_Task::remove_state_semaphore,
                                  this, boost::ref(state_semaphore)));
     
+    if (scheduler_ == SCHED_WORK_STEALING) {
+        /* The cancelled jobs are still sitting in the deques.  Help to
+           skip them, so that the group finishes even if there are no
+           worker threads.  Like any other wait for a group, only jobs of
+           the group or its subgroups are run here; they are all cancelled,
+           so running them just skips them. */
+        auto stopped = [&] ()
+            {
+                return group_info.jobs_outstanding
+                    + group_info.groups_outstanding <= 0;
+            };
+
+        while (!stopped()) {
+            Id jobs_added = __sync_fetch_and_add(&next_job, 0);
+
+            Job_Info info;
+            if (try_get_job(info, group)) {
+                info.job();
+                finish_job(info);
+                continue;
+            }
+
+            auto changed = [&] ()
+                {
+                    return stopped()
+                        || __sync_fetch_and_add(&next_job, 0) != jobs_added;
+                };
+            wait_state_change(state_semaphore, changed);
+        }
+        return;
+    }
+
     while (group_info.jobs_running > 0)
         state_semaphore.acquire();
 
@@ -474,7 +567,11 @@ run_until_finished(int group, bool unlock)
             }
         }
 
-        /* Run a job if we can */
+        /* Run a job if we can.  Under work stealing there may be queued
+           jobs that we aren't allowed to run, so we wait for a new job to
+           be added rather than for there to be queued jobs. */
+        Id jobs_added = __sync_fetch_and_add(&next_job, 0);
+
         Job_Info info;
         if (try_get_job(info, group)) {
 
@@ -516,7 +613,15 @@ run_until_finished(int group, bool unlock)
         }
         
         /* Wait for a state change. */
-        state_semaphore.acquire();
+        auto changed = [&] ()
+            {
+                return group_info.error
+                    || __sync_fetch_and_add(&next_job, 0) != jobs_added
+                    || (group_info.jobs_outstanding
+                        + group_info.jobs_running
+                        + group_info.groups_outstanding == 0);
+            };
+        wait_state_change(state_semaphore, changed);
     }
 }
 
@@ -563,6 +668,220 @@ lend_thread(int group)
     }
 }
 
+Worker_Task::Id
+Worker_Task::
+add_ws(Small_Job job, Small_Job error, const Job_Name & job_info,
+       Id group)
+{
+    Job_Info info(std::move(job), std::move(error), job_info,
+                  __sync_fetch_and_add(&next_job, 1), group);
+
+    if (group != -1) {
+        /* The lock is only needed to find the group; once it has an
+           outstanding job it can't be removed, so the pointer is stable
+           until the job is finished. */
+        Guard guard(lock);
+        auto it = groups.find(group);
+        if (it == groups.end())
+            throw Exception("Worker_Task::add(): group info has none");
+        info.group_info = &it->second;
+        __sync_fetch_and_add(&info.group_info->jobs_outstanding, 1);
+    }
+
+    /* If this is the first job running, then we are no longer finished so we
+       acquire the finished semaphore. */
+    if (__sync_fetch_and_add(&num_outstanding, 1) == 0)
+        finished_sem.acquire();
+
+    Id id = info.id;
+
+    Work_Queue & queue = *queues[current_queue()];
+    {
+        std::lock_guard<Spinlock> guard(queue.lock);
+        queue.jobs.push_back(std::move(info));
+    }
+
+    __sync_fetch_and_add(&num_queued, 1);
+
+    jobs_sem.release();  // release one to allow something to run the job
+
+    wake_sleepers_ws();
+
+    return id;
+}
+
+bool
+Worker_Task::
+try_pop_job_ws(Job_Info & info, int group)
+{
+    int nqueues = queues.size();
+    int own = current_queue();
+
+    /* Our own queue first, newest job first */
+    {
+        Work_Queue & queue = *queues[own];
+        std::lock_guard<Spinlock> guard(queue.lock);
+        for (int j = (int)queue.jobs.size() - 1;  j >= 0;  --j) {
+            if (!in_group_ws(queue.jobs[j], group)) continue;
+            info = std::move(queue.jobs[j]);
+            queue.jobs.erase_element(j);
+            return true;
+        }
+    }
+
+    /* Then steal the oldest job from somebody else */
+    for (int i = 1;  i < nqueues;  ++i) {
+        Work_Queue & queue = *queues[(own + i) % nqueues];
+        std::lock_guard<Spinlock> guard(queue.lock);
+        for (int j = 0;  j < (int)queue.jobs.size();  ++j) {
+            if (!in_group_ws(queue.jobs[j], group)) continue;
+            info = std::move(queue.jobs[j]);
+            queue.jobs.erase_element(j);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+Worker_Task::Job_Info
+Worker_Task::
+get_job_ws()
+{
+    /* We hold one of the jobs_sem tokens, so there is a job for us
+       somewhere; it may just take a couple of passes to find it. */
+    Job_Info result;
+    for (unsigned i = 0;  !try_pop_job_ws(result);  ++i) {
+        if (force_finished) return Job_Info();
+        if (i % 16 == 15) sched_yield();
+    }
+
+    start_job_ws(result);
+    return result;
+}
+
+bool
+Worker_Task::
+try_get_job_ws(Job_Info & info, int group)
+{
+    /* We hold a jobs_sem token, but the job it stands for may not be in
+       our group.  If there is none in the group, we give the token back
+       for somebody else to use. */
+    if (!try_pop_job_ws(info, group)) {
+        jobs_sem.release();
+        return false;
+    }
+
+    start_job_ws(info);
+    return true;
+}
+
+void
+Worker_Task::
+start_job_ws(Job_Info & info)
+{
+    __sync_fetch_and_add(&num_queued, -1);
+    __sync_fetch_and_add(&num_running, 1);
+    if (info.group_info)
+        __sync_fetch_and_add(&info.group_info->jobs_running, 1);
+
+    if (is_cancelled(info))
+        info.job = skip_cancelled_job;
+}
+
+void
+Worker_Task::
+finish_job_ws(const Job_Info & info)
+{
+    __sync_fetch_and_add(&num_running, -1);
+
+    Group_Info * group_info = info.group_info;
+    if (group_info) {
+        __sync_fetch_and_add(&group_info->jobs_running, -1);
+
+        /* Once the outstanding count gets to zero, the group info may be
+           removed at any time, so it must be the last thing we touch. */
+        int outstanding
+            = __sync_add_and_fetch(&group_info->jobs_outstanding, -1);
+
+        if (outstanding < 0)
+            throw Exception("Worker_Task::finish_job(): "
+                            "group has negative outstanding count");
+
+        if (outstanding == 0) {
+            Guard guard(lock);
+            /* Somebody waiting in run_until_finished may have seen the
+               zero count and already removed the group. */
+            if (groups.count(info.group))
+                check_finished_ul(info.group);
+        }
+    }
+
+    if (__sync_add_and_fetch(&num_outstanding, -1) == 0)
+        finished_sem.release();
+
+    wake_sleepers_ws();
+}
+
+int
+Worker_Task::
+current_queue() const
+{
+    if (current_task == this)
+        return current_task_queue;
+    return threads_;  // shared queue for outside threads
+}
+
+bool
+Worker_Task::
+is_cancelled(const Job_Info & info)
+{
+    for (const Group_Info * g = info.group_info;  g;  g = g->parent)
+        if (g->error) return true;
+    return false;
+}
+
+bool
+Worker_Task::
+in_group_ws(const Job_Info & info, int group)
+{
+    if (group == -1 || info.group == group) return true;
+    for (const Group_Info * g = info.group_info;  g;  g = g->parent)
+        if (g->parent_group == group) return true;
+    return false;
+}
+
+void
+Worker_Task::
+wake_sleepers_ws()
+{
+    /* The __sync operations that changed the state are full barriers, so
+       either we see the sleeper here or it sees our state change when it
+       re-checks after registering itself. */
+    if (__sync_fetch_and_add(&num_sleepers, 0) == 0)
+        return;
+
+    Guard guard(lock);
+    notify_state_changed();
+}
+
+template<typename Ready>
+void
+Worker_Task::
+wait_state_change(Semaphore & state_semaphore, const Ready & ready)
+{
+    if (scheduler_ == SCHED_LIST) {
+        state_semaphore.acquire();
+        return;
+    }
+
+    __sync_fetch_and_add(&num_sleepers, 1);
+    Call_Guard guard([&] () { __sync_fetch_and_add(&num_sleepers, -1); });
+
+    if (!ready())
+        state_semaphore.acquire();
+}
+
 bool Worker_Task::in_group(const Job_Info & info, int group)
 {
     if (group == -1) return true;
@@ -606,7 +925,10 @@ Worker_Task::Job_Info Worker_Task::get_job(int group)
 bool Worker_Task::try_get_job(Worker_Task::Job_Info & job, int group)
 {
     if (jobs_sem.tryacquire() == -1) return false;
-    
+
+    if (scheduler_ == SCHED_WORK_STEALING && group != -1 && !force_finished)
+        return try_get_job_ws(job, group);
+
     job = get_job_impl(group);
     return true;
 }
@@ -618,6 +940,9 @@ Worker_Task::Job_Info Worker_Task::get_job_impl(int group)
     //     << endl;
     if (force_finished) return Job_Info();
 
+    if (scheduler_ == SCHED_WORK_STEALING)
+        return get_job_ws();
+
     for (unsigned i = 0;  i < 100;  ++i) {
         Guard guard(lock, std::try_to_lock);
         if (guard)
@@ -679,7 +1004,7 @@ Worker_Task::Job_Info Worker_Task::get_job_impl_ul(int group)
             return get_job_impl_ul(-1);
     }
     
-    Job_Info result = *it;
+    Job_Info result = std::move(*it);
     ++num_running;
 
     if (result.group != -1) ++groups[result.group].jobs_running;
@@ -694,6 +1019,11 @@ Worker_Task::Job_Info Worker_Task::get_job_impl_ul(int group)
 
 void Worker_Task::finish_job(const Job_Info & info)
 {
+    if (scheduler_ == SCHED_WORK_STEALING) {
+        finish_job_ws(info);
+        return;
+    }
+
     Guard guard(lock, std::defer_lock);
 
     for (unsigned i = 0;  i < 100;  ++i) {
@@ -807,7 +1137,8 @@ bool Worker_Task::check_finished_ul(Id group)
         }
         
         /* Get rid of the job for the group. */
-        jobs.erase(group_info->group_job);
+        if (scheduler_ == SCHED_LIST)
+            jobs.erase(group_info->group_job);
 
         Id parent = group_info->parent_group;
 
@@ -850,6 +1181,43 @@ int Worker_Task::finished() const
     return next_job - num_running - num_queued;
 }
 
+Worker_Task::Node_Pool::
+~Node_Pool()
+{
+    while (free_nodes) {
+        Free_Node * next = free_nodes->next;
+        ::operator delete(free_nodes);
+        free_nodes = next;
+    }
+}
+
+void *
+Worker_Task::Node_Pool::
+allocate(size_t bytes)
+{
+    if (node_size == 0) node_size = bytes;
+    if (bytes != node_size || !free_nodes)
+        return ::operator new(std::max(bytes, sizeof(Free_Node)));
+
+    Free_Node * result = free_nodes;
+    free_nodes = result->next;
+    return result;
+}
+
+void
+Worker_Task::Node_Pool::
+deallocate(void * mem, size_t bytes)
+{
+    if (bytes != node_size) {
+        ::operator delete(mem);
+        return;
+    }
+
+    Free_Node * node = reinterpret_cast<Free_Node *>(mem);
+    node->next = free_nodes;
+    free_nodes = node;
+}
+
 void
 Worker_Task::Job_Info::
 dump(std::ostream & stream, int indent) const
@@ -858,14 +1226,14 @@ dump(std::ostream & stream, int indent) const
     stream << i << "Job_Info @ " << this << endl;
     stream << i << "  id         = " << id << endl;
     stream << i << "  group      = " << group << endl;
-    stream << i << "  info       = " << info << endl;
+    stream << i << "  info       = " << info.str() << endl;
     stream << i << "  job set    = " << (bool)job << endl;
     stream << i << "  error set  = " << (bool)error << endl;
 }
 
 void
 Worker_Task::Group_Info::
-dump(std::ostream & stream, int indent) const
+dump(std::ostream & stream, int indent, bool with_group_job) const
 {
     string i(indent, ' ');
     stream << i << "Group_Info @ " << this << endl;
@@ -874,7 +1242,9 @@ dump(std::ostream & stream, int indent) const
     stream << i << "  jobs running       = " << jobs_running << endl;
     stream << i << "  groups outstanding = " << groups_outstanding << endl;
     stream << i << "  parent group       = " << parent_group << endl;
-    stream << i << "  group job          = " << &(*group_job) << endl;
+    if (with_group_job)
+        stream << i << "  group job          = " << &(*group_job) << endl;
+    stream << i << "  parent             = " << parent << endl;
     stream << i << "  locked             = " << locked << endl;
     stream << i << "  error              = " << error << endl;
     stream << i << "  error message      = " << error_message << endl;
@@ -896,7 +1266,12 @@ dump() const
     stream << "  number of groups = " << groups.size() << endl;
     stream << "  state semaphores = " << state_semaphores.size() << endl;
     stream << "  force finishned  = " << force_finished << endl;
+    stream << "  scheduler        = "
+           << (scheduler_ == SCHED_LIST ? "list" : "work stealing") << endl;
     stream << endl;
+    for (unsigned i = 0;  i < queues.size();  ++i)
+        stream << "  queue " << i << " has " << queues[i]->jobs.size()
+               << " jobs" << endl;
     stream << "  jobs:" << endl;
     int i = 0;
     for (Jobs::const_iterator it = jobs.begin();  it != jobs.end();  ++it, ++i) {
@@ -907,7 +1282,7 @@ dump() const
     for (map<Id, Group_Info>::const_iterator it = groups.begin();
          it != groups.end();  ++it) {
         stream << "   group with ID " << it->first << ":" << endl;
-        it->second.dump(cerr, 4);
+        it->second.dump(cerr, 4, scheduler_ == SCHED_LIST);
     }
     stream << endl;
 }
@@ -9,15 +9,23 @@
 #pragma once
 
 #include "jml/utils/guard.h"
+#include "jml/utils/circular_buffer.h"
 #include "jml/arch/format.h"
 #include "jml/arch/spinlock.h"
 #include "jml/arch/semaphore.h"
+#include "jml/arch/cmp_xchg.h"
+#include <algorithm>
+#include <exception>
 #include <functional>
 #include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <new>
 #include <set>
 #include <thread>
+#include <type_traits>
+#include <vector>
 
 
 namespace ML {
@@ -38,6 +46,224 @@ extern const Job NO_JOB;
 int num_threads();
 
 
+/*****************************************************************************/
+/* SMALL_JOB                                                                 */
+/*****************************************************************************/
+
+/** A job that stores its callable inline when it is no bigger than
+    INLINE_SIZE bytes, so that submitting the usual small lambda or bound
+    function to the Worker_Task doesn't need a heap allocation (which a
+    std::function would do for anything bigger than two pointers).  Larger
+    callables are put on the heap.
+*/
+
+struct Small_Job {
+    enum { INLINE_SIZE = 48 };
+
+    Small_Job()
+        : ops(0)
+    {
+    }
+
+    /** An empty Job gives an empty Small_Job. */
+    Small_Job(const Job & job)
+        : ops(0)
+    {
+        if (job) init(job);
+    }
+
+    template<typename Fn,
+             typename Decayed = typename std::decay<Fn>::type,
+             typename = typename std::enable_if
+                 <!std::is_same<Decayed, Small_Job>::value
+                  && !std::is_same<Decayed, Job>::value>::type>
+    Small_Job(Fn && fn)
+        : ops(0)
+    {
+        init(std::forward<Fn>(fn));
+    }
+
+    Small_Job(const Small_Job & other)
+        : ops(other.ops)
+    {
+        if (ops) ops->copy(storage, other.storage);
+    }
+
+    /* Moves are noexcept so that containers (such as the Circular_Buffer
+       of the work stealing deques) move jobs rather than copying them. */
+    Small_Job(Small_Job && other) noexcept
+        : ops(other.ops)
+    {
+        if (ops) ops->move(storage, other.storage);
+        other.ops = 0;
+    }
+
+    Small_Job & operator = (const Small_Job & other)
+    {
+        if (&other == this) return *this;
+        Small_Job new_me(other);
+        return *this = std::move(new_me);
+    }
+
+    Small_Job & operator = (Small_Job && other) noexcept
+    {
+        if (&other == this) return *this;
+        clear();
+        ops = other.ops;
+        if (ops) ops->move(storage, other.storage);
+        other.ops = 0;
+        return *this;
+    }
+
+    ~Small_Job()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        if (ops) ops->destroy(storage);
+        ops = 0;
+    }
+
+    void operator () () const
+    {
+        ops->call(const_cast<char *>(storage));
+    }
+
+    explicit operator bool () const { return ops; }
+
+    /** Is the callable stored inline?  For testing. */
+    bool is_inline() const { return ops && ops->is_inline; }
+
+private:
+    struct Ops {
+        void (*call) (void * obj);
+        void (*copy) (void * to, const void * from);
+        void (*move) (void * to, void * from);  // leaves from destroyed
+        void (*destroy) (void * obj);
+        bool is_inline;
+    };
+
+    template<typename Fn>
+    struct Inline_Ops {
+        static Fn * get(void * obj) { return reinterpret_cast<Fn *>(obj); }
+        static const Fn * get(const void * obj)
+        {
+            return reinterpret_cast<const Fn *>(obj);
+        }
+        static void call(void * obj) { (*get(obj))(); }
+        static void copy(void * to, const void * from)
+        {
+            new (to) Fn(*get(from));
+        }
+        static void move(void * to, void * from)
+        {
+            new (to) Fn(std::move(*get(from)));
+            get(from)->~Fn();
+        }
+        static void destroy(void * obj) { get(obj)->~Fn(); }
+        static const Ops ops;
+    };
+
+    template<typename Fn>
+    struct Heap_Ops {
+        static Fn * & get(void * obj) { return *reinterpret_cast<Fn **>(obj); }
+        static Fn * get(const void * obj)
+        {
+            return *reinterpret_cast<Fn * const *>(obj);
+        }
+        static void call(void * obj) { (*get(obj))(); }
+        static void copy(void * to, const void * from)
+        {
+            new (to) Fn * (new Fn(*get(from)));
+        }
+        static void move(void * to, void * from)
+        {
+            new (to) Fn * (get(from));
+        }
+        static void destroy(void * obj) { delete get(obj); }
+        static const Ops ops;
+    };
+
+    template<typename Fn>
+    void init(Fn && fn)
+    {
+        typedef typename std::decay<Fn>::type Stored;
+        typedef std::integral_constant
+            <bool,
+             sizeof(Stored) <= INLINE_SIZE
+             && alignof(Stored) <= alignof(std::max_align_t)> Fits;
+        init(std::forward<Fn>(fn), Fits());
+    }
+
+    template<typename Fn>
+    void init(Fn && fn, std::true_type /* fits inline */)
+    {
+        typedef typename std::decay<Fn>::type Stored;
+        new (storage) Stored(std::forward<Fn>(fn));
+        ops = &Inline_Ops<Stored>::ops;
+    }
+
+    template<typename Fn>
+    void init(Fn && fn, std::false_type /* fits inline */)
+    {
+        typedef typename std::decay<Fn>::type Stored;
+        new (storage) Stored * (new Stored(std::forward<Fn>(fn)));
+        ops = &Heap_Ops<Stored>::ops;
+    }
+
+    const Ops * ops;
+    alignas(std::max_align_t) char storage[INLINE_SIZE];
+};
+
+template<typename Fn>
+const Small_Job::Ops Small_Job::Inline_Ops<Fn>::ops
+    = { &call, &copy, &move, &destroy, true };
+
+template<typename Fn>
+const Small_Job::Ops Small_Job::Heap_Ops<Fn>::ops
+    = { &call, &copy, &move, &destroy, false };
+
+
+/*****************************************************************************/
+/* JOB_NAME                                                                  */
+/*****************************************************************************/
+
+/** Name of a job, used for debugging.  A name can be given as a prefix
+    and an index, in which case the string is only formatted when it's
+    actually needed by str().  That way do_group doesn't need to allocate
+    a name for every job.  The prefix must outlive the job.
+*/
+
+struct Job_Name {
+    Job_Name(const std::string & name = "")
+        : prefix(0), index(-1), name(name)
+    {
+    }
+
+    Job_Name(const char * name)
+        : prefix(0), index(-1), name(name)
+    {
+    }
+
+    Job_Name(const std::string * prefix, long long index)
+        : prefix(prefix), index(index)
+    {
+    }
+
+    std::string str() const
+    {
+        if (prefix) return *prefix + ML::format("%lld", index);
+        return name;
+    }
+
+    const std::string * prefix;
+    long long index;
+    std::string name;
+};
+
+
 /*****************************************************************************/
 /* WORKER_TASK                                                               */
 /*****************************************************************************/
@@ -54,23 +280,51 @@ int num_threads();
    as small as possible.
 
    It works multithreaded, and deals with all locking and unlocking.
+
+   Two scheduling backends are available, selected at construction:
+
+   SCHED_LIST keeps every job in a single list behind one lock, and scans
+   it in order to find the next job to run.  It gives a strict depth first
+   ordering over all jobs.
+
+   SCHED_WORK_STEALING gives each worker thread its own deque of jobs.  A
+   thread pushes the jobs that it creates onto its own deque and runs them
+   newest first, so that a job that creates a subgroup and waits for it
+   will run that subgroup's jobs before anything older (the same depth
+   first effect, maintained per thread).  Idle threads steal the oldest job
+   from another thread's deque.  Threads that don't belong to the worker
+   task share a single extra deque.  The group lock is only taken to look
+   up a group on add() and when a group's count reaches zero, and queued
+   jobs of a group with an error are skipped when they are dequeued rather
+   than being removed eagerly.  A thread waiting for a group (in
+   run_until_finished(), run_until_released() or lend_thread()) only ever
+   runs jobs of that group or its subgroups, so unrelated jobs can't
+   block or recurse on the waiter's stack.
 */
 
 class Worker_Task {
 public:
     typedef long long Id;  // 64 bits so no wraparound
 
+    /** Which backend is used to schedule jobs onto threads. */
+    enum Scheduler {
+        SCHED_LIST,           ///< Single locked list of jobs
+        SCHED_WORK_STEALING   ///< Per-thread deques with work stealing
+    };
+
     /** Return the instance.  Creates it with the number of threads given,
         or num_threads() if thr == -1.  If thr == 0, then only local work
         is done (no work is transferred to other threads). */
     static Worker_Task & instance(int thr = -1);
 
-    Worker_Task(int threads);
+    Worker_Task(int threads, Scheduler scheduler = SCHED_LIST);
 
     virtual ~Worker_Task();
     
     int threads() const { return threads_; }
 
+    Scheduler scheduler() const { return scheduler_; }
+
     /** Allocate a new job group.  The given job will be called once the group
         is finished.  Note that if nothing is ever added to the group, it won't
         be finished automatically unless check_finished() is called.
@@ -91,12 +345,16 @@ public:
     /** Unlock the group so that it can be removed. */
     void unlock_group(int group);
 
-    /** Run a set of jobs in multiple threads. */
+    /** Run a set of jobs in multiple threads.  doWork isn't copied for
+        each job: all of them call the same one, through a const reference,
+        from several threads at once, so it must be safe to call
+        concurrently. */
     template<typename It, typename It2, typename Fn>
     void do_group(It first, It2 last, Fn doWork, int parent = -1,
                  std::string groupName = "", std::string jobName = "")
     {
         int group;
+        std::exception_ptr addError;
         {
             int parent = -1;  // no parent group
             group = get_group(NO_JOB, groupName, parent);
@@ -104,10 +362,27 @@ public:
                                          this,
                                          group));
             
-            for (int i = 0; first != last;  ++first, ++i)
-                add(std::bind<void>(doWork, first),
-                    jobName + ML::format("%d", i),
-                    group);
+            /* doWork and jobName live until the group is finished, so
+               the jobs can refer to them instead of copying them. */
+            const Fn & work = doWork;
+            try {
+                for (long long i = 0; first != last;  ++first, ++i)
+                    add([&work, first] () { work(first); },
+                        Job_Name(&jobName, i),
+                        group);
+            } catch (...) {
+                addError = std::current_exception();
+            }
+        }
+
+        if (addError) {
+            /* The jobs that were added still refer to doWork and jobName,
+               so they need to be finished before we can leave. */
+            try {
+                run_until_finished(group);
+            } catch (...) {
+            }
+            std::rethrow_exception(addError);
         }
 
         run_until_finished(group);
@@ -118,13 +393,17 @@ private:
         the same group will be scheduled together.  If there is an exception or
         an error, the error job will be called.
     */
-    Id add(const Job & job, const Job & error,
-           const std::string & info, Id group = -1);
+    Id add(Small_Job job, Small_Job error, const Job_Name & info,
+           Id group = -1);
 public:
 
     /** Add a job that belongs to the given group.  Jobs which are scheduled into
-        the same group will be scheduled together. */
-    Id add(const Job & job, const std::string & info, Id group = -1);
+        the same group will be scheduled together.
+
+        Callables of up to Small_Job::INLINE_SIZE bytes are stored without
+        any heap allocation.
+    */
+    Id add(Small_Job job, const Job_Name & info, Id group = -1);
 
     /** Check if a group is finished, and if so call its finish job. */
     bool check_finished(Id group);
@@ -174,30 +453,84 @@ public:
 
 private:
     int threads_;
+    Scheduler scheduler_;
 
     std::vector<std::unique_ptr<std::thread> > workerThreads_;
     
     struct Job_Info;
+    struct Group_Info;
+
+    /** Free list of the list scheduler's nodes, so that it doesn't need to
+        go to the heap for each job.  Only used with the lock held. */
+    struct Node_Pool {
+        Node_Pool() : free_nodes(0), node_size(0) {}
+        ~Node_Pool();
+
+        void * allocate(size_t bytes);
+        void deallocate(void * mem, size_t bytes);
+
+        struct Free_Node { Free_Node * next; };
+        Free_Node * free_nodes;
+        size_t node_size;
+    };
+
+    template<typename T>
+    struct Pool_Allocator {
+        typedef T value_type;
 
-    typedef std::list<Job_Info> Jobs;
+        Pool_Allocator(Node_Pool * pool = 0) : pool(pool) {}
+
+        template<typename U>
+        Pool_Allocator(const Pool_Allocator<U> & other) : pool(other.pool) {}
+
+        T * allocate(size_t n)
+        {
+            if (n != 1 || !pool) return std::allocator<T>().allocate(n);
+            return reinterpret_cast<T *>(pool->allocate(sizeof(T)));
+        }
+
+        void deallocate(T * p, size_t n)
+        {
+            if (n != 1 || !pool) std::allocator<T>().deallocate(p, n);
+            else pool->deallocate(p, sizeof(T));
+        }
+
+        template<typename U>
+        bool operator == (const Pool_Allocator<U> & other) const
+        {
+            return pool == other.pool;
+        }
+
+        template<typename U>
+        bool operator != (const Pool_Allocator<U> & other) const
+        {
+            return pool != other.pool;
+        }
+
+        Node_Pool * pool;
+    };
+
+    typedef std::list<Job_Info, Pool_Allocator<Job_Info> > Jobs;
     
     struct Job_Info {
-        Job_Info() : id(-1), group(-1) {}
-        Job_Info(const Job & job, const Job & error,
-                 const std::string & info, Id id, Id group = -1)
-            : job(job), error(error), id(id), group(group), info(info) {}
-        Job job;
-        Job error;
+        Job_Info() : id(-1), group(-1), group_info(0) {}
+        Job_Info(Small_Job job, Small_Job error,
+                 const Job_Name & info, Id id, Id group = -1)
+            : job(std::move(job)), error(std::move(error)),
+              id(id), group(group), group_info(0), info(info) {}
+        Small_Job job;
+        Small_Job error;
         Id id;    // if -1, this is a group end marker
         Id group;
-        std::string info;
+        Group_Info * group_info;  ///< Work stealing only; stable while queued
+        Job_Name info;            ///< Only formatted by dump()
         void dump(std::ostream & stream, int indent = 0) const;
     };
 
     struct Group_Info {
         Group_Info()
             : jobs_outstanding(0), jobs_running(0),
-              groups_outstanding(0), parent_group(0),
+              groups_outstanding(0), parent_group(0), parent(0),
               locked(false), error(false)
         {
         }
@@ -207,13 +540,26 @@ private:
         int jobs_running;          ///< Number of jobs that are running
         int groups_outstanding;    ///< Number of groups waiting for
         Id parent_group;           ///< Group to notify when finished
+        Group_Info * parent;       ///< Parent's info (work stealing only)
         Jobs::iterator group_job;  ///< Job for the group; always last
         bool locked;
         bool error;                ///< No further jobs can be run
         std::string error_message; ///< Error message to throw
         std::string info;
 
-        void dump(std::ostream & stream, int indent = 0) const;
+        /** The group job only exists under the list scheduler; pass
+            with_group_job = false for work stealing. */
+        void dump(std::ostream & stream, int indent = 0,
+                  bool with_group_job = true) const;
+    };
+
+    /** Deque of jobs owned by one thread under the work stealing
+        scheduler.  The owner pushes and pops at the back; thieves take
+        from the front.
+    */
+    struct Work_Queue {
+        Spinlock lock;
+        Circular_Buffer<Job_Info> jobs;
     };
 
     /** Get a job. */
@@ -243,6 +589,39 @@ private:
     // Check_finished, bit without the lock held
     bool check_finished_ul(Id group);
 
+    /** Work stealing implementations of add, get_job and finish_job. */
+    Id add_ws(Small_Job job, Small_Job error,
+              const Job_Name & info, Id group);
+    Job_Info get_job_ws();
+    bool try_get_job_ws(Job_Info & info, int group);
+    bool try_pop_job_ws(Job_Info & info, int group = -1);
+    void start_job_ws(Job_Info & info);
+    void finish_job_ws(const Job_Info & info);
+
+    /** Index of the work queue that belongs to the calling thread. */
+    int current_queue() const;
+
+    /** Is the job's group, or any of its parents, in an error state?  Used
+        by the work stealing scheduler to skip cancelled jobs. */
+    static bool is_cancelled(const Job_Info & info);
+
+    /** Is the job in the group or one of its subgroups?  Lock free version
+        of in_group() for the work stealing scheduler. */
+    static bool in_group_ws(const Job_Info & info, int group);
+
+    /** Wake up any threads sleeping on a state semaphore.  Used by the
+        work stealing scheduler, which only takes the lock to notify when
+        somebody is actually waiting. */
+    void wake_sleepers_ws();
+
+    /** Wait for a state change on the given semaphore.  Under the work
+        stealing scheduler, the ready predicate is re-checked once we have
+        been registered as a sleeper so that no wakeup is lost.  Defined
+        in worker_task.cc; it's a template so that passing the predicate
+        doesn't allocate. */
+    template<typename Ready>
+    void wait_state_change(Semaphore & state_semaphore, const Ready & ready);
+
     /** Is the given job in the group?  Searches up the parent hierarchy. */
     bool in_group(const Job_Info & info, int group);
 
@@ -265,6 +644,7 @@ private:
     Semaphore jobs_sem, finished_sem, state_change_sem, shutdown_sem;
 
     /** Jobs we are running. */
+    Node_Pool job_pool;
     Jobs jobs;
     Id next_group;
     Id next_job;
@@ -272,6 +652,18 @@ private:
     int num_running;
     Lock lock;
 
+    /** Per-thread deques for the work stealing scheduler.  There is one
+        for each worker thread, plus a shared one at the end for threads
+        that don't belong to us. */
+    std::vector<std::unique_ptr<Work_Queue> > queues;
+
+    /** Jobs queued or running under the work stealing scheduler. */
+    int num_outstanding;
+
+    /** Number of threads waiting on a state semaphore under the work
+        stealing scheduler. */
+    int num_sleepers;
+
     /** Groups that are currently running. */
     std::map<Id, Group_Info> groups;
 
@@ -286,7 +678,9 @@ private:
 
 /** Run a set of jobs in multiple threads.  The iterator will be iterated
     through the range and the doWork function will be called with each
-    value of the iterator in a different thread.
+    value of the iterator in a different thread.  The same doWork is called
+    from all of the threads at once, so it must be safe to call
+    concurrently (see do_group).
 */
 template<typename It, typename It2, typename Fn>
 void run_in_parallel(It first, It2 last, Fn doWork, int parent = -1,
@@ -306,29 +700,93 @@ void run_in_parallel_blocked(RAIt first, RAIt2 last,
                              Worker_Task & worker
                                  = Worker_Task::instance(num_threads() - 1))
 {
-    int numJobs = last - first;
-    if (numJobs < 16 * num_threads()) {
+    size_t numJobs = last - first;
+    size_t nthreads = num_threads();
+    if (numJobs < 16 * nthreads) {
         // less than 16 jobs per thread... do it directly
         worker.do_group(first, last, doWork, parent, groupName, jobName);
     }
     else {
         // Split into sub-groups such that we have roughly 16 jobs per
         // thread
-        int numPerGroup = numJobs / num_threads() / 16;
-        int numGroups
+        size_t numPerGroup = numJobs / nthreads / 16;
+        size_t numGroups
             = (numJobs / numPerGroup)
             + (numJobs % numPerGroup != 0); // extra if there is a remainder
 
-        auto doGroup = [&] (int groupNum)
+        const Fn & work = doWork;
+        auto doGroup = [&] (size_t groupNum)
             {
                 RAIt it = first + groupNum * numPerGroup;
-                for (int i = 0;  i < numPerGroup && it != last;  ++i, ++it)
-                    doWork(it);
+                for (size_t i = 0;  i < numPerGroup && it != last;  ++i, ++it)
+                    work(it);
             };
         
-        worker.do_group<int>(0, numGroups, doGroup, parent, groupName, jobName);
+        worker.do_group<size_t>(0, numGroups, doGroup, parent, groupName,
+                                jobName);
     }
 }
 
+/** Run doWork over a range of random access iterators using guided
+    self-scheduling.  Rather than splitting the range up front into equal
+    blocks, one runner per thread repeatedly claims the next chunk of the
+    range, with the chunk size shrinking geometrically as the range is used
+    up (each chunk is 1 / (2 * nthreads) of what remains, but no smaller than
+    minChunk).  The big early chunks keep the scheduling overhead low, and
+    the small late ones let threads that got cheap items pick up the slack
+    of those that got expensive ones, which is what makes this the better
+    choice when the cost per item varies a lot.
+
+    If doWork throws, the other runners stop claiming chunks and the
+    exception is rethrown (as with do_group) once they have finished.  As
+    with do_group, doWork must be safe to call concurrently.
+*/
+template<typename RAIt, typename RAIt2, typename Fn>
+void run_in_parallel_guided(RAIt first, RAIt2 last,
+                            Fn doWork,
+                            int parent = -1,
+                            std::string groupName = "",
+                            std::string jobName = "",
+                            Worker_Task & worker
+                                = Worker_Task::instance(num_threads() - 1),
+                            size_t minChunk = 1)
+{
+    size_t numJobs = last - first;
+    if (numJobs == 0) return;
+
+    size_t numRunners = std::min<size_t>(worker.threads() + 1, numJobs);
+    size_t divisor = 2 * numRunners;
+    minChunk = std::max<size_t>(minChunk, 1);
+
+    size_t next = 0;           // first unclaimed element
+    volatile bool stop = false;
+    const Fn & work = doWork;
+
+    auto doRunner = [&] (size_t)
+        {
+            for (;;) {
+                size_t start = next, chunk;
+                do {
+                    if (stop || start >= numJobs) return;
+                    size_t remaining = numJobs - start;
+                    chunk = std::min(remaining,
+                                     std::max(minChunk, remaining / divisor));
+                } while (!cmp_xchg(next, start, start + chunk));
+
+                try {
+                    RAIt it = first + start;
+                    for (size_t i = 0;  i < chunk;  ++i, ++it)
+                        work(it);
+                } catch (...) {
+                    stop = true;
+                    throw;
+                }
+            }
+        };
+
+    worker.do_group<size_t>(0, numRunners, doRunner, parent, groupName,
+                            jobName);
+}
+
 
 } // namespace ML
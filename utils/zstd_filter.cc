@@ -0,0 +1,430 @@
+/* zstd_filter.cc
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Implementation of the zstd filters.
+*/
+
+#include "zstd_filter.h"
+#include "worker_task.h"
+#include "jml/arch/exception.h"
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <zstd.h>
+
+
+using namespace std;
+
+
+namespace ML {
+
+namespace {
+
+/** Maximum size of a frame header, which is enough to find the dictionary
+    ID.  (ZSTD_FRAMEHEADERSIZE_MAX is only in the experimental API.) */
+enum { FRAME_HEADER_SIZE_MAX = 18 };
+
+size_t check(size_t res, const char * what)
+{
+    if (ZSTD_isError(res))
+        throw Exception("zstd: %s: %s", what, ZSTD_getErrorName(res));
+    return res;
+}
+
+std::mutex dictionariesLock;
+std::unordered_map<unsigned, ZSTD_DDict *> dictionaries;
+
+/** The dictionary for the frame at the start of the given data. */
+const ZSTD_DDict * frameDictionary(const char * data, size_t len)
+{
+    unsigned id = ZSTD_getDictID_fromFrame(data, len);
+    if (id == 0) return 0;
+
+    std::unique_lock<std::mutex> guard(dictionariesLock);
+    auto it = dictionaries.find(id);
+    if (it == dictionaries.end())
+        throw Exception("zstd: frame needs dictionary %u, which hasn't "
+                        "been registered", id);
+    return it->second;
+}
+
+} // file scope
+
+unsigned registerZstdDictionary(const std::string & dictionary)
+{
+    unsigned id = ZSTD_getDictID_fromDict(dictionary.data(),
+                                          dictionary.size());
+    if (id == 0)
+        throw Exception("registerZstdDictionary: not a zstd dictionary");
+
+    std::unique_lock<std::mutex> guard(dictionariesLock);
+    if (dictionaries.count(id)) return id;
+
+    ZSTD_DDict * ddict = ZSTD_createDDict(dictionary.data(),
+                                          dictionary.size());
+    if (!ddict)
+        throw Exception("registerZstdDictionary: couldn't load dictionary");
+    dictionaries[id] = ddict;
+    return id;
+}
+
+
+/*****************************************************************************/
+/* ZSTD COMPRESSOR                                                           */
+/*****************************************************************************/
+
+struct zstd_compressor::Itl {
+    Itl(const Options & options)
+        : options(options), cctx(ZSTD_createCCtx()),
+          buffer(ZSTD_CStreamOutSize(), 0)
+    {
+        if (!cctx)
+            throw Exception("zstd_compressor: couldn't create context");
+
+        try {
+            int level = (options.level == -1 ? ZSTD_CLEVEL_DEFAULT
+                         : options.level);
+            if (level < ZSTD_minCLevel() || level > ZSTD_maxCLevel())
+                throw Exception("zstd_compressor: level %d out of range",
+                                options.level);
+            check(ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+                                         level),
+                  "setting level");
+            check(ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag,
+                                         options.checksum),
+                  "setting checksum");
+            if (!options.dictionary.empty())
+                check(ZSTD_CCtx_loadDictionary(cctx,
+                                               options.dictionary.data(),
+                                               options.dictionary.size()),
+                      "loading dictionary");
+        } catch (...) {
+            ZSTD_freeCCtx(cctx);
+            throw;
+        }
+    }
+
+    ~Itl()
+    {
+        ZSTD_freeCCtx(cctx);
+    }
+
+    /** Run the compressor over the input and write what comes out. */
+    void process(const char * s, size_t n, ZSTD_EndDirective mode,
+                 const Output & output)
+    {
+        ZSTD_inBuffer in = { s, n, 0 };
+        for (;;) {
+            ZSTD_outBuffer out = { &buffer[0], buffer.size(), 0 };
+            size_t remaining
+                = check(ZSTD_compressStream2(cctx, &out, &in, mode),
+                        "compressing");
+            if (out.pos)
+                output(buffer.data(), out.pos);
+            if (mode == ZSTD_e_continue ? in.pos == in.size
+                : remaining == 0)
+                break;
+        }
+    }
+
+    void close(const Output & output)
+    {
+        // Even an empty stream gets a frame
+        process(0, 0, ZSTD_e_end, output);
+    }
+
+    Options options;
+    ZSTD_CCtx * cctx;
+    std::string buffer;
+};
+
+zstd_compressor::
+zstd_compressor(const Options & options)
+    : itl(new Itl(options))
+{
+}
+
+void
+zstd_compressor::
+add_input(const char * s, size_t n, const Output & output)
+{
+    itl->process(s, n, ZSTD_e_continue, output);
+}
+
+void
+zstd_compressor::
+finish(const Output & output)
+{
+    itl->close(output);
+}
+
+
+/*****************************************************************************/
+/* ZSTD DECOMPRESSOR                                                         */
+/*****************************************************************************/
+
+namespace {
+
+/** A frame decompressed by a job. */
+struct Frame {
+    Frame() : pos(0) {}
+    std::string compressed;
+    std::string output;
+    size_t pos;   ///< How much of the output has been read
+};
+
+void decompressFrame(Frame & frame)
+{
+    ZSTD_DCtx * dctx = ZSTD_createDCtx();
+    if (!dctx)
+        throw Exception("zstd_decompressor: couldn't create context");
+
+    try {
+        const char * data = frame.compressed.data();
+        size_t len = frame.compressed.size();
+
+        check(ZSTD_DCtx_refDDict(dctx, frameDictionary(data, len)),
+              "setting dictionary");
+
+        unsigned long long size = ZSTD_getFrameContentSize(data, len);
+        if (size != ZSTD_CONTENTSIZE_UNKNOWN
+            && size != ZSTD_CONTENTSIZE_ERROR)
+            frame.output.reserve(size);
+
+        // The content size is optional, so grow as we go if needed
+        ZSTD_inBuffer in = { data, len, 0 };
+        size_t chunk = ZSTD_DStreamOutSize();
+        for (;;) {
+            size_t done = frame.output.size();
+            frame.output.resize(std::max(frame.output.capacity(),
+                                         done + chunk));
+            ZSTD_outBuffer out = { &frame.output[done],
+                                   frame.output.size() - done, 0 };
+            size_t res = check(ZSTD_decompressStream(dctx, &out, &in),
+                               "decompressing");
+            frame.output.resize(done + out.pos);
+            if (res == 0) break;
+            if (in.pos == in.size && out.pos == 0)
+                throw Exception("zstd_decompressor: truncated frame");
+        }
+    } catch (...) {
+        ZSTD_freeDCtx(dctx);
+        throw;
+    }
+
+    ZSTD_freeDCtx(dctx);
+    frame.compressed = std::string();
+}
+
+} // file scope
+
+struct zstd_decompressor::Itl {
+    Itl(const Options & options)
+        : options(options), dctx(ZSTD_createDCtx())
+    {
+        if (!dctx)
+            throw Exception("zstd_decompressor: couldn't create context");
+
+        if (options.maxFrames != 1) {
+            if (!this->options.worker)
+                this->options.worker
+                    = &Worker_Task::instance(num_threads() - 1);
+            if (this->options.maxFrames <= 0)
+                this->options.maxFrames
+                    = this->options.worker->threads() + 1;
+        }
+
+        init();
+    }
+
+    ~Itl()
+    {
+        drain();
+        ZSTD_freeDCtx(dctx);
+    }
+
+    void init()
+    {
+        inBuf.clear();
+        inPos = 0;
+        inputEnded = false;
+        atFrameStart = true;
+        serial = (options.maxFrames == 1);
+        delivering.reset();
+        ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+    }
+
+    /** Wait for the jobs in flight, which refer to their frames. */
+    void drain()
+    {
+        for (auto & p: pending) {
+            try {
+                options.worker->run_until_finished(p.first, true);
+            } catch (...) {
+            }
+        }
+        pending.clear();
+    }
+
+    void reset()
+    {
+        drain();
+        init();
+    }
+
+    /** Read input until there are at least the given number of bytes
+        buffered or it's finished.  Returns the number buffered. */
+    size_t fill(size_t wanted, const Input & input)
+    {
+        if (inPos == inBuf.size()) {
+            inBuf.clear();
+            inPos = 0;
+        }
+        else if (inPos > inBuf.size() / 2) {
+            inBuf.erase(0, inPos);
+            inPos = 0;
+        }
+
+        size_t chunk = ZSTD_DStreamInSize();
+        while (!inputEnded && inBuf.size() - inPos < wanted) {
+            size_t done = inBuf.size();
+            inBuf.resize(done + std::max(chunk, wanted));
+            std::streamsize res = input(&inBuf[done], inBuf.size() - done);
+            inBuf.resize(done + std::max<std::streamsize>(res, 0));
+            if (res <= 0) inputEnded = true;
+        }
+
+        return inBuf.size() - inPos;
+    }
+
+    std::streamsize read(char * s, size_t n, const Input & input)
+    {
+        for (;;) {
+            if (delivering && delivering->pos < delivering->output.size()) {
+                size_t todo = std::min(n, delivering->output.size()
+                                          - delivering->pos);
+                std::copy(delivering->output.data() + delivering->pos,
+                          delivering->output.data() + delivering->pos + todo,
+                          s);
+                delivering->pos += todo;
+                return todo;
+            }
+            delivering.reset();
+
+            if (!serial) queueFrames(input);
+
+            if (pending.empty())
+                return readSerial(s, n, input);
+
+            Worker_Task::Id group = pending.front().first;
+            std::shared_ptr<Frame> frame = pending.front().second;
+            pending.pop_front();
+            options.worker->run_until_finished(group, true);
+            delivering = frame;
+        }
+    }
+
+    /** Start decompressing as many whole frames as we can. */
+    void queueFrames(const Input & input)
+    {
+        while (pending.size() < size_t(options.maxFrames)) {
+            size_t avail = fill(1, input);
+            if (avail == 0) return;
+
+            size_t frameSize;
+            for (;;) {
+                frameSize = ZSTD_findFrameCompressedSize(&inBuf[inPos],
+                                                         avail);
+                if (!ZSTD_isError(frameSize)) break;
+
+                // Incomplete, or not valid at all.  Either way, it's up to
+                // the normal decompression from here.
+                if (inputEnded || avail >= options.maxBuffered) {
+                    serial = true;
+                    return;
+                }
+                avail = fill(2 * avail, input);
+            }
+
+            std::shared_ptr<Frame> frame(new Frame());
+            frame->compressed.assign(inBuf, inPos, frameSize);
+            inPos += frameSize;
+
+            Worker_Task & worker = *options.worker;
+            Worker_Task::Id group
+                = worker.get_group(NO_JOB, "zstd_decompressor frame");
+            pending.push_back(make_pair(group, frame));
+            worker.add([=] () { decompressFrame(*frame); },
+                       "zstd_decompressor frame", group);
+        }
+    }
+
+    /** Decompress straight from the input in this thread. */
+    std::streamsize readSerial(char * s, size_t n, const Input & input)
+    {
+        ZSTD_outBuffer out = { s, n, 0 };
+
+        while (out.pos == 0) {
+            if (atFrameStart) {
+                size_t avail = fill(FRAME_HEADER_SIZE_MAX, input);
+                if (avail == 0) return -1;  // clean end between frames
+                check(ZSTD_DCtx_refDDict(dctx,
+                                         frameDictionary(&inBuf[inPos],
+                                                         avail)),
+                      "setting dictionary");
+                atFrameStart = false;
+            }
+
+            if (inPos == inBuf.size())
+                fill(1, input);
+
+            ZSTD_inBuffer in = { inBuf.data() + inPos,
+                                 inBuf.size() - inPos, 0 };
+            size_t res = check(ZSTD_decompressStream(dctx, &out, &in),
+                               "decompressing");
+            inPos += in.pos;
+
+            if (res == 0)
+                atFrameStart = true;
+            else if (in.pos == 0 && out.pos == 0 && inputEnded
+                     && inPos == inBuf.size())
+                throw Exception("zstd_decompressor: truncated input");
+        }
+
+        return out.pos;
+    }
+
+    Options options;
+    ZSTD_DCtx * dctx;
+
+    std::string inBuf;       ///< Input that has been read
+    size_t inPos;            ///< How much of inBuf has been used
+    bool inputEnded;
+    bool atFrameStart;       ///< Is the serial decompressor between frames?
+    bool serial;             ///< No more parallel decompression
+
+    std::deque<std::pair<Worker_Task::Id, std::shared_ptr<Frame> > > pending;
+    std::shared_ptr<Frame> delivering;   ///< Frame being read out
+};
+
+zstd_decompressor::
+zstd_decompressor(const Options & options)
+    : itl(new Itl(options))
+{
+}
+
+std::streamsize
+zstd_decompressor::
+get_output(char * s, std::streamsize n, const Input & input)
+{
+    return itl->read(s, n, input);
+}
+
+void
+zstd_decompressor::
+reset()
+{
+    itl->reset();
+}
+
+} // namespace ML
@@ -0,0 +1,151 @@
+/* zstd_filter.h                                                   -*- C++ -*-
+   Copyright (c) 2013 Datacratic Inc.  All rights reserved.
+
+   Boost iostreams filters for zstd compression.
+*/
+
+#ifndef __jml__utils__zstd_filter_h__
+#define __jml__utils__zstd_filter_h__
+
+#include <string>
+#include <memory>
+#include <functional>
+#include <boost/iostreams/categories.hpp>
+#include <boost/iostreams/operations.hpp>
+
+
+namespace ML {
+
+class Worker_Task;
+
+
+/** Make a zstd dictionary (as made by zstd --train) known, so that frames
+    that were compressed with it can be decompressed by zstd_decompressor
+    and so by filter_istream.  Frames record the ID of their dictionary,
+    which is what is returned.
+*/
+unsigned registerZstdDictionary(const std::string & dictionary);
+
+
+/*****************************************************************************/
+/* ZSTD COMPRESSOR                                                           */
+/*****************************************************************************/
+
+/** Output filter that compresses into a single zstd frame. */
+
+struct zstd_compressor {
+
+    struct Options {
+        Options(int level = -1)
+            : level(level), checksum(true)
+        {
+        }
+
+        int level;                ///< -1 for zstd's default; others as zstd
+        std::string dictionary;   ///< Dictionary to compress with, if any
+        bool checksum;            ///< Add a checksum of the content
+    };
+
+    typedef char char_type;
+    struct category
+        : boost::iostreams::multichar_output_filter_tag,
+          boost::iostreams::closable_tag {
+    };
+
+    zstd_compressor(const Options & options = Options());
+
+    typedef std::function<void (const char *, size_t)> Output;
+
+    template<typename Sink>
+    std::streamsize write(Sink & sink, const char * s, std::streamsize n)
+    {
+        add_input(s, n, [&] (const char * data, size_t len)
+                  {
+                      boost::iostreams::write(sink, data, len);
+                  });
+        return n;
+    }
+
+    template<typename Sink>
+    void close(Sink & sink)
+    {
+        finish([&] (const char * data, size_t len)
+               {
+                   boost::iostreams::write(sink, data, len);
+               });
+    }
+
+    void add_input(const char * s, size_t n, const Output & output);
+    void finish(const Output & output);
+
+    struct Itl;
+    std::shared_ptr<Itl> itl;
+};
+
+
+/*****************************************************************************/
+/* ZSTD DECOMPRESSOR                                                         */
+/*****************************************************************************/
+
+/** Input filter that decompresses any number of zstd frames, one after the
+    other.  Frames that were compressed with a dictionary need it to have
+    been registered with registerZstdDictionary().
+
+    With maxFrames other than 1, the input is read ahead and each complete
+    frame is decompressed as a job on a Worker_Task, with up to maxFrames of
+    them at once.  That only helps for files made of many frames (such as
+    those written by parallel_compressor); as soon as a frame doesn't fit
+    in maxBuffered bytes (the zstd tool writes a whole file as one frame),
+    the rest of the input is decompressed in the reading thread as usual.
+*/
+
+struct zstd_decompressor {
+
+    struct Options {
+        Options(int maxFrames = 1)
+            : maxFrames(maxFrames), maxBuffered(64 << 20), worker(0)
+        {
+        }
+
+        int maxFrames;        ///< 1 = in this thread; 0 = worker threads + 1
+        size_t maxBuffered;   ///< Most input to read looking for a frame end
+        Worker_Task * worker; ///< 0 means the default one
+    };
+
+    typedef char char_type;
+    struct category
+        : boost::iostreams::multichar_input_filter_tag,
+          boost::iostreams::closable_tag {
+    };
+
+    zstd_decompressor(const Options & options = Options());
+
+    /** Reads up to the given number of bytes, returning -1 at the end. */
+    typedef std::function<std::streamsize (char *, std::streamsize)> Input;
+
+    template<typename Source>
+    std::streamsize read(Source & src, char * s, std::streamsize n)
+    {
+        return get_output(s, n, [&] (char * data, std::streamsize len)
+                          {
+                              return boost::iostreams::read(src, data, len);
+                          });
+    }
+
+    template<typename Source>
+    void close(Source & src)
+    {
+        reset();
+    }
+
+    std::streamsize get_output(char * s, std::streamsize n,
+                               const Input & input);
+    void reset();
+
+    struct Itl;
+    std::shared_ptr<Itl> itl;
+};
+
+} // namespace ML
+
+#endif /* __jml__utils__zstd_filter_h__ */